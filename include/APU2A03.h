@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "BusDevice.h"
+#include "SaveState.h"
+
+using namespace std;
+
+class AudioRing;
+class Bus;
+
+// The 2A03's audio unit: two pulse channels, triangle, noise and the delta
+// modulation channel (DMC), with the frame counter that clocks their
+// envelopes, sweeps and length counters. Its registers are $4000-$4013,
+// $4015 and $4017, which the Bus's I/O ports pass on while a cartridge is
+// plugged in. The frame counter's interrupt and the DMC's end-of-sample
+// interrupt hold irq() until acknowledged.
+//
+// run() advances a whole stretch of CPU cycles at once, jumping from one
+// event to the next: a frame counter step or, while samples are wanted, a
+// step of a channel that can be heard. Between events nothing changes, so
+// the channels' timers move on arithmetically. Every change in the mixed
+// output is drawn into the 48 kHz output as a band-limited step, a
+// windowed sinc kernel placed at the fractional sample where the change
+// falls, which resamples from the CPU clock without aliasing and without
+// per-cycle work. Channels that step more often than that, such as the
+// noise at its shorter periods, are averaged over each sample's window
+// instead, which is as much filtering as a change that fast can use, and
+// go into the output without a kernel. No channel draws more steps than
+// there are samples. A DMC step that leaves its level where it is changes
+// nothing heard, and is taken without stopping. Samples go to the
+// AudioRing set with setOutput() a batch at a time, unfinished: summing
+// them up and converting them to 16 bits is left to the ring's consumer
+// (see Finisher).
+//
+// Simplifications: the DMC's sample fetches do not steal CPU cycles, and a
+// $4017 write restarts the frame counter at once rather than 3-4 cycles
+// later. A triangle period below 2 is ultrasonic and holds the triangle
+// where it is, as on a TV it might as well be.
+class APU2A03 : public BusDevice {
+   public:
+    static constexpr uint32_t SAMPLE_RATE = 48000;
+    static constexpr uint32_t NEVER = 0xFFFFFFFF;
+
+    // Turns the samples the APU pushes, the changes in the output that
+    // fell in each, into 16-bit PCM, on the thread that consumes them. The
+    // PCM does not depend on how the samples are split between calls as
+    // long as every call but the last is given whole blocks of eight.
+    class Finisher {
+       public:
+        void run(const float *in, size_t n, int16_t *pcm);
+
+       private:
+        float out = 0.0f;  // The last sample finished
+    };
+
+    APU2A03();
+
+    // DMC samples are read from bus. They are always at $8000-$FFFF, in
+    // cartridge ROM, and are read through the page table, so reading has
+    // no side effects.
+    void connect(Bus *bus);
+
+    // Power-on state: silent, frame counter in 4-step mode.
+    void reset();
+
+    uint8_t cpuRead(uint16_t addr, bool bReadOnly) override;
+    void cpuWrite(uint16_t addr, uint8_t data) override;
+
+    // Advances n CPU cycles.
+    void run(uint64_t n);
+
+    // The interrupt line: the frame or DMC interrupt flag is set.
+    bool irq() const {
+        return irqFlags != 0;
+    }
+
+    // The cycles run() can go before irq() next goes up, or NEVER. Exact
+    // until the next register write.
+    uint32_t untilIrq() const;
+
+    // Sends samples to ring from now on, or stops making them with null.
+    void setOutput(AudioRing *ring);
+
+    // Pushes every finished sample to the output, however few. Ends a
+    // recording, as the last push may be a part block.
+    void flush();
+
+    void saveState(APUState &s) const;
+    void loadState(const APUState &s);
+
+   private:
+    Bus *bus = nullptr;
+
+    APUState::Pulse pulse[2];
+    APUState::Triangle triangle;
+    APUState::Noise noise;
+    APUState::Dmc dmc;
+    uint16_t frameCycle = 0;
+    uint8_t frameControl = 0x00;
+    uint8_t enabled = 0x00;
+    uint8_t irqFlags = 0x00;
+
+    // Output. Deltas are accumulated by the sample they fall in; time is
+    // the current cycle's position in samples from acc[0], 32.32 fixed
+    // point, and moves on by step a cycle. Samples before time's integer
+    // part can get no more deltas and are pushed.
+    AudioRing *output = nullptr;
+    vector<float> acc;
+    uint64_t time = 0;
+    uint64_t step = 0;
+    float level = 0.0f;  // Mixed output as of time
+
+    // A channel that steps more often than the output samples has its
+    // changes added up by sample instead, and each sample's sum is added to
+    // acc where the kernel puts the middle of a step, when it is pushed. A
+    // change a fraction f into sample s puts 1 - f of itself on s and f on
+    // s + 1, so the sample comes out as the average over its window.
+    vector<float> sums;
+
+    // While the rest of the mix holds, the noise only moves the output by
+    // plus or minus unit, so its changes in sample unitAt are counted in
+    // whole units, with unitsLate the sum of their fractions into the
+    // sample in 32.32 fixed point. Counting is exact, so the noise adds the
+    // same to sums however its steps are split between calls.
+    size_t unitAt = 0;
+    float unit = 0.0f;
+    int32_t units = 0;
+    int64_t unitsLate = 0;
+
+    uint16_t frameStep() const;  // The frameCycle of the next step
+    void quarterFrame();
+    void halfFrame();
+
+    // Move the channels on by n cycles, with no frame counter step or
+    // register write in between: advance() without drawing the output,
+    // synthesize() drawing every change in it.
+    void advance(uint32_t n);
+    void synthesize(uint32_t n);
+    void advancePulse(int i, uint32_t n);
+    void advanceTriangle(uint32_t n);
+    void advanceNoise(uint32_t n);
+    void advanceDmc(uint32_t n);
+
+    float mix() const;
+    void settle();  // Draws the step to mix(), if it has moved
+    void addDelta(float delta);
+    void addFast(float delta);
+    void addUnit(float size, int32_t sign);  // sign is 1 for the noise on
+    void useUnit(float size);  // Spends the units first if size is new
+    void spendUnits();         // Adds the units counted to sums
+    void finish(size_t n);  // Pushes the first n samples to the output
+
+    void pulseWrite(int i, int reg, uint8_t data);
+    uint16_t sweepTarget(int i) const;
+    bool pulseMuted(int i) const;
+    uint8_t pulseOut(int i) const;
+    uint8_t noiseOut() const;
+    bool triangleRunning() const;
+
+    bool dmcMoves() const;  // The next step changes the level
+    void dmcClock();
+    void dmcByte();
+    void dmcFetch();
+    void dmcStart();
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "APU2A03.h"
+#include "Drain.h"
+
+using namespace std;
+
+// Single-producer, single-consumer ring of mono samples, from the APU to
+// whatever plays or records them. The APU pushes them unfinished, and pop()
+// finishes them into 16-bit PCM on the consumer's thread. Neither side
+// locks or waits: a push() that does not fit is dropped and counted, so a
+// slow consumer never holds up emulation.
+//
+// A ring carries one recording. Every push() but the last must be of whole
+// blocks of eight, and pop() takes whole blocks up to the last, so the
+// PCM comes out the same however the two threads interleave.
+class AudioRing {
+   public:
+    explicit AudioRing(size_t capacity = 1 << 18);
+
+    AudioRing(const AudioRing &) = delete;
+    AudioRing &operator=(const AudioRing &) = delete;
+
+    // Producer: appends n samples, or none if they do not all fit. Returns
+    // how many.
+    size_t push(const float *samples, size_t n);
+
+    // Consumer: finishes up to n samples into out, a multiple of eight
+    // unless the recording ends there, and returns how many.
+    size_t pop(int16_t *out, size_t n);
+
+    uint64_t pushed() const {
+        return head.load(memory_order_relaxed);
+    }
+    uint64_t dropped() const {
+        return lost;
+    }
+
+   private:
+    vector<float> ring;
+    uint64_t mask = 0;
+    uint64_t lost = 0;  // Producer side
+    APU2A03::Finisher finisher;  // Consumer side
+
+    alignas(64) atomic<uint64_t> head{0};  // Samples pushed
+    alignas(64) atomic<uint64_t> tail{0};  // Samples popped
+};
+
+// Records an AudioRing to a 16-bit mono PCM WAV file. A Drain thread
+// finishes the samples and writes them in large writes, as Trace does for
+// instructions, and close() fills in the sizes the header left open.
+class WavWriter {
+   public:
+    WavWriter(AudioRing &ring, uint32_t sampleRate);
+    ~WavWriter();
+
+    WavWriter(const WavWriter &) = delete;
+    WavWriter &operator=(const WavWriter &) = delete;
+
+    // Creates path, writes the header and starts the writer. Returns false
+    // if the file cannot be created.
+    bool open(const string &path);
+
+    // Writes whatever is left in the ring and closes the file. Returns
+    // false if a write failed.
+    bool close();
+
+    uint64_t samples() const {
+        return writer.taken();
+    }
+
+   private:
+    AudioRing &ring;
+    uint32_t sampleRate;
+
+    int fd = -1;
+    vector<int16_t> chunk;
+    Drain writer;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+// Headless batch mode: runs every program listed in a manifest on its own
+// Bus/CPU6502 instance, spread over a thread pool, and prints the final
+// state of each.
+//
+//     nes --batch <manifest> [--threads N] [--no-jit | --jit-check]
+//                            [--profile <file>]
+//                            [--trace <file> [--trace-lossless]]
+//                            [--rewind <instructions>] [--lockstep]
+//                            [--wav <file>]
+//                            [--video <file> | --png <file> | --ppm <file>]
+//                            [--frames-lossless]
+//                            [--load-state <file>] [--save-state <file>]
+//
+// Each manifest line is
+//
+//     <binary> <load address> <cycles> [<entry point>]
+//
+// with addresses in hex ($8000, 0x8000 or 8000). Without an entry point the
+// reset vector is taken from the image if it covers $FFFC-$FFFD, and points
+// at the load address otherwise. Blank lines and lines starting with '#'
+// are ignored. iNES images (*.nes) are plugged in as cartridges instead, with
+// the load address written as "-"; an entry point then overrides the reset
+// vector. Each file is mapped once however many jobs name it. Cartridge
+// jobs run the PPU alongside the CPU (see Bus::run()) and also report how
+// many frames it drew and a checksum of the frame buffer when it ends.
+// --lockstep clocks the PPU along with every CPU cycle instead of letting
+// it catch up, which must not change any result; it is there to check
+// that (see Bus::lockstep). --wav records what the APU of cartridge job n
+// plays to <file>.n.wav, 16-bit mono at 48 kHz, through an AudioRing that
+// drops samples rather than hold up the CPU if the disk falls behind.
+//
+// --video, --png and --ppm hand every frame the PPU of a cartridge job
+// finishes to a FrameSink (see FrameSink.h) on a thread of its own: raw
+// RGB24 to <file>.n.rgb, or to <file> itself when it is "-" (stdout, with
+// the report going to stderr) or a FIFO, which takes exactly one cartridge
+// job; or one image per frame, <file>.n.<frame>.png or .ppm. The frame
+// checksum still hashes the picture as it would be with no sink, so it
+// does not depend on these options. Frames the sink has not caught up with
+// are dropped and counted; --frames-lossless instead waits for room between
+// run slices of a few thousand cycles, outside the CPU.
+//
+// In a JIT=1 build --no-jit runs the interpreter only, and --jit-check
+// replays every translated block on the interpreter and fails if any came
+// out differently. In a PROFILE=1 build --profile prints the opcode counts
+// of all jobs and writes them to the file as JSON. In a TRACE=1 build
+// --trace records every instruction of job n (in manifest order) to
+// <file>.n; see Trace.h. Records that find the trace ring full, because the
+// disk fell behind, are dropped and counted in the report, so the CPU never
+// waits on I/O; --trace-lossless waits for the writer instead.
+//
+// --rewind keeps a Rewind history for each job while it runs, snapshotting
+// every N instructions (checked every few thousand cycles), and reports its
+// size at the end.
+//
+// --save-state writes the whole machine of job n to <file>.n.state when it
+// ends, and --load-state restores job n from <file>.n.state after its reset,
+// so it runs its cycles on from the saved point. A job whose state is
+// missing, from another layout version or from another board runs nothing
+// and fails the batch.
+int runBatch(int argc, char **argv);
@@ -0,0 +1,17 @@
+#pragma once
+
+// Microbenchmarks for the CPU and the bus:
+//
+//     nes --bench [--quick] [--json <file>]
+//
+// Measures every official opcode on its own (control flow that leaves the
+// kernel excepted), each addressing mode over the opcodes that use it,
+// Bus::read()/write() latency, Bus::fork(), disassemble() over the whole
+// address space, and emulated MHz on small 6502 kernels: a memcpy loop, a
+// multiply loop, branch-heavy code and JSR/RTS with pushes and pulls.
+//
+// Each benchmark is timed over a number of samples and reported as the
+// median and 99th percentile per operation, with instructions per second
+// and emulated MHz where they apply. --json also writes the results to a
+// file; --quick takes fewer, shorter samples.
+int runBench(int argc, char **argv);
@@ -2,11 +2,21 @@
 
 #include <array>
 #include <cstdint>
+#include <memory>
+#include <vector>
 
+#include "APU2A03.h"
+#include "BusDevice.h"
+#include "BusWatcher.h"
 #include "CPU6502.h"
+#include "Cartridge.h"
+#include "PPU2C02.h"
+#include "SaveState.h"
 
 using namespace std;
 
+class Mapper;
+
 class Bus {
    public:
     Bus();
@@ -14,8 +24,304 @@ class Bus {
 
    public:
     CPU6502 cpu;
+    PPU2C02 ppu;
+    APU2A03 apu;
     array<uint8_t, 64 * 1024> ram;
 
-    void write(uint16_t addr, uint8_t data);
-    uint8_t read(uint16_t addr, bool bReadOnly = false);
+    // Clocks every CPU cycle with clock() instead of letting the PPU and APU
+    // catch up (see run()). Much slower and cycle for cycle the same, so it
+    // is there to check that against.
+    bool lockstep = false;
+
+    // The CPU address space as 256 pages of 256 bytes. A page backed by host
+    // memory has read (and write, if writable) pointing at its first byte,
+    // so an access is a single indexed load or store. Accesses with no
+    // pointer go to device, or are dropped (writes) and read as 0x00.
+    //
+    // Pages mapped onto ram also record which ram page backs them, so
+    // mirrors of one ram page can be remapped together; pages mapped onto
+    // other memory keep it in mem. Watched pages have no write pointer, so
+    // writes to them reach writeSlow() and the watchers.
+    struct Page {
+        const uint8_t *read = nullptr;
+        uint8_t *write = nullptr;
+        BusDevice *device = nullptr;
+        uint8_t *mem = nullptr;
+        uint16_t ramPage = NOT_RAM;
+        bool writable = false;
+        bool watched = false;
+    };
+
+    static constexpr uint16_t NOT_RAM = 0xFFFF;
+
+    array<Page, 256> pages;
+
+    // Snapshot the whole machine into s, or restore it from s. loadState
+    // returns false, leaving the machine untouched, if s is from another
+    // layout version or was saved with another board plugged in.
+    void saveState(SaveState &s);
+    bool loadState(const SaveState &s);
+
+    // Returns a copy of this machine that shares ram with it copy-on-write.
+    // Every ram page starts out shared between parent and child as an
+    // immutable block; the first write to a page by either side copies just
+    // that page back into its own ram. Forking again only has to copy the
+    // pages written since the last fork.
+    //
+    // Pages mapped onto other memory or onto devices are shared as they are.
+    // A forked Bus must only be accessed through read()/write(), not ram.
+    // Neither side may be running while fork() is in progress; afterwards
+    // they can run on different threads.
+    unique_ptr<Bus> fork();
+
+    // An immutable image of ram, one shared block per page. Images taken
+    // in turn share the blocks of every page that did not change.
+    using PageBlock = array<uint8_t, 256>;
+    using RamImage = array<shared_ptr<const PageBlock>, 256>;
+
+    // Shares every ram page, as fork() does, and returns the blocks. Only
+    // pages written since they were last shared are copied.
+    RamImage shareRam();
+
+    // Puts ram back to image, sharing every page with it. Watchers hear
+    // about every page that changes.
+    void restoreRam(const RamImage &image);
+
+    // The block ram page n currently reads from, or null if the page has
+    // been written since it was last shared.
+    const PageBlock *sharedPage(uint8_t n) const {
+        return shared[n].get();
+    }
+
+    // The current contents of ram page n, shared or not.
+    const uint8_t *ramPage(uint8_t n) const {
+        return shared[n] ? shared[n]->data() : &ram[n * 256];
+    }
+
+    // Overwrites ram page n with 256 bytes from data.
+    void loadRamPage(uint8_t n, const uint8_t *data);
+
+    // Zeroes all of ram. Unlike ram.fill(), watchers hear about it, so
+    // nothing decoded from the old contents survives.
+    void clearRam();
+
+    // Maps nPages pages starting at firstPage onto mem, which must hold
+    // nPages * 256 bytes. Read-only mappings send writes to the page's
+    // device, if any. Watchers of a remapped page hear that all of it
+    // changed, as they do for mapRom() and mapDevice().
+    void mapMemory(uint8_t firstPage, uint16_t nPages, uint8_t *mem,
+                   bool writable = true);
+
+    // Maps nPages pages starting at firstPage read-only onto rom, which
+    // must hold nPages * 256 bytes and outlive the mapping.
+    void mapRom(uint8_t firstPage, uint16_t nPages, const uint8_t *rom);
+
+    // Maps nPages pages starting at firstPage onto device for both reads
+    // and writes.
+    void mapDevice(uint8_t firstPage, uint16_t nPages, BusDevice *device);
+
+    // Plugs cart in behind the Mapper for its board, which maps the PRG
+    // ROM straight into $8000-$FFFF; nothing is copied. The bus becomes a
+    // NES: $0800-$1FFF mirror the 2 KiB of ram at $0000-$07FF, the PPU,
+    // powered on afresh, takes $2000-$3FFF and the I/O registers
+    // $4000-$40FF, of which the APU's and OAM DMA ($4014) are implemented,
+    // and $4100-$5FFF read as 0 and ignore writes. Returns false, leaving
+    // the bus as it was, if the board is not supported (see Mapper.h).
+    bool insertCartridge(shared_ptr<const Cartridge> inserted);
+    static bool canInsert(const Cartridge &cart);
+
+    // Unplugs the cartridge, if any, and maps ram back over $0800-$1FFF,
+    // $2000-$3FFF, $4000-$5FFF and $8000-$FFFF. The APU is reset and its
+    // IRQ line let go.
+    void ejectCartridge();
+
+    // Runs whole instructions until at least cycleBudget CPU cycles have
+    // elapsed and returns the cycles run. Without a cartridge there is
+    // only the CPU and this is cpu.run(), overrun carried over and all.
+    //
+    // With one, the CPU runs uninterrupted for as long as nothing needs
+    // it, and the PPU and APU are each brought up to the CPU's time in one
+    // go when something could notice: before an access to the device (or
+    // to a mapper, which can switch the banks they read from), at an
+    // instruction boundary where an interrupt could be due, and on return.
+    // NMI comes at the start of vertical blank, whose time the PPU
+    // predicts, or from a write; the APU predicts when its IRQ line goes
+    // up in the same way. The CPU stops at the first boundary past either
+    // time, after any write that brings one forward, raises NMI or starts
+    // OAM DMA, and after an instruction that unmasks a held IRQ.
+    // Sprite-0 hit is not predicted: the CPU can only see it by reading
+    // PPUSTATUS, which catches up first. Every access therefore finds the
+    // devices as lockstep would have left them, and the two agree cycle
+    // for cycle.
+    uint32_t run(uint32_t cycleBudget);
+
+    // Runs until the CPU has finished one more instruction and returns the
+    // cycles run, including any that reset(), irq() or nmi() still owe, as
+    // cpu.step() does. With a cartridge in the devices keep up, as in run().
+    uint32_t step();
+
+    // One CPU cycle followed by three PPU dots and an APU cycle, as
+    // lockstep runs. NMI and IRQ are delivered between instructions, NMI
+    // first, and OAM DMA takes the CPU's place for 513 cycles, or 514 when
+    // it starts on an odd one.
+    void clock();
+
+    // The master clock: CPU cycles since power-on (or since the cartridge
+    // went in), counting those of the run() in progress up to the access
+    // being made. Devices keep their time against it.
+    uint64_t now() const {
+        return cycles + cpu.runCycles();
+    }
+
+    // Sets the master clock between runs, with every device counted as
+    // caught up to it, as restoring a state does.
+    void setCycles(uint64_t t) {
+        cycles = ppuCycles = apuCycles = t;
+    }
+
+    // The board plugged in, or null.
+    Mapper *mapper() const {
+        return board.get();
+    }
+
+    // Watchers hear about writes to every watched page. watchPage(n) also
+    // watches the mirrors of page n, and reports a write through any of them
+    // once per watched mirror, at that mirror's address. Pages stay watched
+    // until the last watcher is removed.
+    void addWatcher(BusWatcher *watcher);
+    void removeWatcher(BusWatcher *watcher);
+    void watchPage(uint8_t n);
+
+    void write(uint16_t addr, uint8_t data) {
+        const Page &page = pages[addr >> 8];
+        if (page.write) {
+            page.write[addr & 0x00FF] = data;
+        } else {
+            writeSlow(addr, data);
+        }
+    }
+
+    uint8_t read(uint16_t addr, bool bReadOnly = false) {
+        const Page &page = pages[addr >> 8];
+        if (page.read) {
+            return page.read[addr & 0x00FF];
+        }
+        return readSlow(addr, bReadOnly);
+    }
+
+    // Little-endian word at addr, for operands and vectors. Wraps at $FFFF.
+    uint16_t read16(uint16_t addr) {
+        const Page &page = pages[addr >> 8];
+        if (page.read && (addr & 0x00FF) != 0x00FF) {
+            const uint8_t *p = page.read + (addr & 0x00FF);
+            return p[0] | (p[1] << 8);
+        }
+        uint16_t lo = read(addr);
+        uint16_t hi = read(addr + 1);
+        return (hi << 8) | lo;
+    }
+
+   private:
+    // The registers at $4000-$40FF.
+    class IoPorts : public BusDevice {
+       public:
+        explicit IoPorts(Bus &bus) : bus(bus) {
+        }
+
+        uint8_t cpuRead(uint16_t addr, bool bReadOnly) override;
+        void cpuWrite(uint16_t addr, uint8_t data) override;
+
+       private:
+        Bus &bus;
+    };
+
+    IoPorts io{*this};
+
+    // The master clock as of the start of the run() in progress, and the
+    // cycles the PPU and APU have been run up to.
+    uint64_t cycles = 0;
+    uint64_t ppuCycles = 0;
+    uint64_t apuCycles = 0;
+
+    // Where the stretch of CPU time run() is in must end: the first
+    // boundary at or past it is the next one that needs looking at. 0
+    // outside run().
+    uint64_t runUntil = 0;
+
+    // OAM DMA asked for by a write to $4014, which starts once the
+    // instruction has finished, and, in lockstep, the cycles it has left.
+    bool dmaPending = false;
+    uint8_t dmaPage = 0x00;
+    uint16_t dmaCycles = 0;
+
+    // Runs the PPU, the APU or both up to CPU cycle t.
+    void catchUpPpu(uint64_t t);
+    void catchUpApu(uint64_t t);
+    void catchUp(uint64_t t) {
+        catchUpPpu(t);
+        catchUpApu(t);
+    }
+
+    // The first cycle at which an interrupt could be due, with the devices
+    // caught up.
+    uint64_t nextEvent() const;
+
+    // True at an instruction boundary where the held IRQ line gets in.
+    bool irqDue() const {
+        return apu.irq() && !(cpu.status & CPU6502::I);
+    }
+
+    // After a device access: passes the IRQ line on to the CPU, and stops
+    // the CPU if the access needs seeing to before the next instruction.
+    void reschedule();
+
+    // Copies the page to OAM and returns the cycles the DMA takes.
+    uint32_t oamDma();
+
+    // ram pages currently shared with forks. While set, the pages mapped
+    // onto that ram page read from the block and have no write pointer.
+    array<shared_ptr<const PageBlock>, 256> shared;
+
+    vector<BusWatcher *> watchers;
+
+    // The watched pages mapped onto each ram page, in ascending order, so a
+    // write reaches its mirrors without a scan of the whole page table.
+    array<vector<uint8_t>, 256> watchedMirrors;
+
+    // The cartridge's board, which keeps the PRG pages it maps valid.
+    unique_ptr<Mapper> board;
+
+    struct ForkTag {};
+    Bus(const Bus &parent, ForkTag);
+
+    // Points every page mapped onto ram page n back at the block or at ram,
+    // whichever currently holds its contents.
+    void remapRamPage(uint8_t n);
+
+    // Points page n at ram page ramPage (or NOT_RAM), keeping
+    // watchedMirrors up to date.
+    void setRamPage(uint8_t n, uint16_t ramPage);
+
+    // Marks page n watched and adds it to the mirrors of its ram page.
+    void setWatched(uint8_t n);
+
+    // Sets page's read and write pointers from its backing memory.
+    void updatePage(Page &page);
+
+    void notifyWatchers(uint16_t addr);
+
+    // Tells the watchers of page n, if it is watched, that it was remapped.
+    void pageChanged(uint8_t n);
+
+    // Tells the watchers of ram page n that all of it may have changed.
+    void ramPageChanged(uint8_t n);
+
+    // Overwrites all of ram with 64 KiB from data and tells the watchers.
+    void loadRam(const uint8_t *data);
+
+    // Gives ram page n its own copy of the shared contents.
+    void unshare(uint8_t n);
+
+    uint8_t readSlow(uint16_t addr, bool bReadOnly);
+    void writeSlow(uint16_t addr, uint8_t data);
 };
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+// Anything on the bus that is not plain memory: memory-mapped registers,
+// mapper ports and so on. Attached to pages with Bus::mapDevice().
+class BusDevice {
+   public:
+    virtual ~BusDevice() {
+    }
+
+    virtual uint8_t cpuRead(uint16_t addr, bool bReadOnly) = 0;
+    virtual void cpuWrite(uint16_t addr, uint8_t data) = 0;
+};
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+
+// Anything that caches what it has read from memory, such as decoded
+// instructions. Told about every write to a page it watches, after the
+// write has happened. See Bus::watchPage().
+class BusWatcher {
+   public:
+    virtual ~BusWatcher() {
+    }
+
+    virtual void busWritten(uint16_t addr) = 0;
+
+    // Page n has been mapped onto different memory or had all of its
+    // contents replaced, so all of it may have changed. By default every
+    // address on it is reported to busWritten().
+    virtual void busPageChanged(uint8_t n) {
+        for (int i = 0; i < 256; i++) {
+            busWritten((n << 8) | i);
+        }
+    }
+};
@@ -1,15 +1,24 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "BusWatcher.h"
+#include "CPU6502Opcodes.h"
+
 using namespace std;
 
 class Bus;
+class CPU6502Jit;
+class Trace;
+struct CPU6502Fused;
+struct CPUState;
 
-class CPU6502 {
+class CPU6502 : public BusWatcher {
    public:
     enum FLAGS6502 {
         C = (1 << 0),  // Carry
@@ -29,36 +38,216 @@ class CPU6502 {
     uint16_t pc = 0x0000;   // Program Counter
     uint8_t status = 0x00;  // Status Register
 
+    // Addressing mode identifiers, named after the addressing mode functions.
+    enum class AddrMode : uint8_t {
+        IMP, IMM, ZP0, ZPX, ZPY, REL, ABS, ABX, ABY, IND, IZX, IZY
+    };
+
+#if defined(NES_JIT)
+    // run() executes translated code where it can (see CPU6502Jit.h).
+    // jitCrossCheck replays every translated block on the interpreter and
+    // counts the blocks that came out differently in jitMismatches.
+    bool jitEnabled = true;
+    bool jitCrossCheck = false;
+    uint64_t jitMismatches = 0;
+#endif
+
+#if defined(NES_TRACE)
+    // While set, every instruction is recorded here before it runs (see
+    // Trace.h).
+    Trace *trace = nullptr;
+#endif
+
    private:
+    friend struct CPU6502Fused;
+    friend class CPU6502Jit;
+
     Bus *bus = nullptr;
     void write(uint16_t a, uint8_t d);
     uint8_t read(uint16_t a);
+    uint16_t read16(uint16_t a);
 
     // Access Status Register
     uint8_t GetFlag(FLAGS6502 f);
     void SetFlag(FLAGS6502 f, bool v);
+    void SetZN(uint8_t v);  // Z and N from one result
+
+    // The whole status register. Operations that push or pull it go
+    // through these so lazily tracked flags are folded in.
+    uint8_t GetStatus();
+    void SetStatus(uint8_t v);
+
+#if defined(NES_LAZY_FLAGS)
+    // Lazy flags: Z and N are kept as the last result that set them and only
+    // folded into status when something observes it. Z is set when zResult
+    // is zero, N is bit 7 of nResult.
+    uint8_t zResult = 0x01;
+    uint8_t nResult = 0x00;
+#endif
+
+    // With lazy flags, status is exact whenever control is outside the CPU.
+    // Public entry points reload the lazy state from status on the way in
+    // and fold it back on the way out. No-ops otherwise.
+    void loadFlags();
+    void storeFlags();
+
+    // Operation identifiers, named after the operation functions.
+    enum class Operation : uint8_t {
+        ADC, AND, ASL, BCC, BCS, BEQ, BIT, BMI, BNE, BPL, BRK, BVC, BVS, CLC,
+        CLD, CLI, CLV, CMP, CPX, CPY, DEC, DEX, DEY, EOR, INC, INX, INY, JMP,
+        JSR, LDA, LDX, LDY, LSR, NOP, ORA, PHA, PHP, PLA, PLP, ROL, ROR, RTI,
+        RTS, SBC, SEC, SED, SEI, STA, STX, STY, TAX, TAY, TSX, TXA, TXS, TYA,
+        XXX
+    };
 
+    // The execution side of one opcode, four bytes so the whole table
+    // spans 16 cache lines. Mnemonics live apart in the cold names table.
     struct INSTRUCTION {
-        string name;
-        uint8_t (CPU6502::*operate)(void) = nullptr;
-        uint8_t (CPU6502::*addrmode)(void) = nullptr;
+        Operation operate;
+        AddrMode addrmode;
+        uint8_t cycles;
+        uint8_t length;  // Including the opcode byte
+    };
+
+    // Defined here rather than in CPU6502.cpp so every user of the table
+    // (the fused handlers, the JIT, the benchmarks) sees it as a constant.
+    static constexpr array<INSTRUCTION, 256> lookup = {{
+// Lengths: one byte for implied, three for ABS through IND, two otherwise.
+#define CPU6502_LOOKUP_ENTRY(code, name, op, mode, cyc)                    \
+    {Operation::op, AddrMode::mode, cyc,                                  \
+     uint8_t(AddrMode::mode == AddrMode::IMP ? 1                          \
+             : AddrMode::mode >= AddrMode::ABS                            \
+                     && AddrMode::mode <= AddrMode::IND                   \
+                 ? 3                                                      \
+                 : 2)},
+        CPU6502_OPCODES(CPU6502_LOOKUP_ENTRY)
+#undef CPU6502_LOOKUP_ENTRY
+    }};
+    static const array<uint8_t (CPU6502::*)(void), 57> operations;
+    static const array<uint8_t (CPU6502::*)(void), 12> addrmodes;
+    static const char names[256][4];
+
+    // Set per instruction by the lookup core; true when the operand is the
+    // accumulator rather than memory.
+    bool implied = false;
+
+    // Cycles the last run() spent past its budget, owed by the next call.
+    uint32_t overshoot = 0;
+
+    // While run() is going: the cycles it has run so far, and whether
+    // yield() has cut it short.
+    uint32_t ran = 0;
+    bool yielded = false;
+
+    // After an instruction that may have cleared I: yields if that lets
+    // the held IRQ line in.
+    void checkIrq() {
+        if (irqLine && !(status & I)) {
+            yield();
+        }
+    }
+
+#if defined(NES_PREDECODE) || defined(NES_JIT)
+    // The fused handler for each opcode, taking the operand already fetched.
+    static const array<uint8_t (*)(CPU6502 &, uint16_t), 256> handlers;
+#endif
+
+#if defined(NES_JIT)
+    // Created by the first run(); dropped when the bus changes.
+    shared_ptr<CPU6502Jit> jit;
+#endif
+
+#if defined(NES_PREDECODE)
+    // One predecoded instruction: its fused handler with the operand already
+    // fetched. run is null until the instruction at that address has been
+    // executed, and again once one of its bytes is written.
+    struct Decoded {
+        uint8_t (*run)(CPU6502 &, uint16_t operand) = nullptr;
+        uint16_t operand = 0x0000;
+        uint8_t opcode = 0x00;
+        uint8_t length = 0;
         uint8_t cycles = 0;
     };
 
-    vector<INSTRUCTION> lookup;
+    // Indexed by address. Until the first predecode() it points at
+    // noneDecoded, which never has anything in it, so a new or forked CPU
+    // does not clear 1 MiB it may never use. decodedTable owns the CPU's
+    // own table after that; ConnectBus() drops it.
+    Decoded *decoded = noneDecoded;
+    shared_ptr<Decoded> decodedTable;
+    static Decoded noneDecoded[64 * 1024];
+
+    // Fills in decoded[addr] if all of its bytes are in memory pages, and
+    // watches those pages. Returns false for instructions read from devices.
+    bool predecode(uint16_t addr);
+#endif
+
+#if defined(NES_CYCLE_CORE)
+    // Cycle core: every opcode is a short program of bus cycles built from
+    // lookup, and clock() runs one cycle of it per call (see
+    // CPU6502Cycle.cpp). Entries are the Cycle values defined there.
+    static const array<array<uint8_t, 8>, 256> microcode;
+    const uint8_t *micro = nullptr;  // Next cycle of the instruction in flight
+    uint16_t microBase = 0x0000;     // Unindexed address or pointer
+    bool crossed = false;            // Indexing crossed a page
+    bool prefetched = false;         // Read-modify-write operand already read
+    uint8_t branchExtra = 0;         // Cycles the last branch added
+#if defined(NES_PROFILE) || defined(NES_TRACE)
+    uint8_t microCycles = 0;  // Cycles of the instruction in flight so far
+#endif
+
+    // Runs one program entry. False if it was skipped without a bus cycle.
+    bool cycle(uint8_t entry);
+    bool due(uint8_t entry);
+    void operate();
+#endif
+
+    // Fetches the opcode at pc and runs the whole instruction, leaving its
+    // cycle count in cycles.
+    void execute();
+
+    // Decodes and runs the instruction in opcode. Built either as the
+    // lookup table core or, with NES_SWITCH_CORE, as the switch core over
+    // the fused handlers in CPU6502Fused.h.
+    void dispatch();
+
+#if defined(NES_TRACE)
+    // Pushes the state before the instruction at pc to trace.
+    void traceInstruction();
+#endif
 
    public:
     CPU6502();
     ~CPU6502();
 
-    void ConnectBus(Bus *n) {
-        bus = n;
-    }
+    // Also starts watching the bus for writes when the predecode cache or
+    // the JIT is built in, dropping anything decoded from the previous bus.
+    void ConnectBus(Bus *n);
+
+    // Drops predecoded instructions and translated blocks that include addr.
+    void busWritten(uint16_t addr) override;
+
+    // Drops everything decoded or translated from page n at once.
+    void busPageChanged(uint8_t n) override;
+
+    // Copy the CPU registers and internal state to and from a snapshot.
+    void saveState(CPUState &s);
+    void loadState(const CPUState &s);
 
     // Helper functions
     bool complete();
+    static const char *mnemonic(uint8_t opcode);
     map<uint16_t, string> disassemble(uint16_t nStart, uint16_t nStop);
 
+    // Length in bytes of the instruction with this opcode, its addressing
+    // mode and that mode's name, and the disassembly line for it at addr
+    // given its operand bytes.
+    static uint8_t length(uint8_t opcode);
+    static AddrMode addrMode(uint8_t opcode);
+    static const char *modeName(AddrMode mode);
+    static string formatInstruction(uint16_t addr, uint8_t opcode, uint8_t lo,
+                                    uint8_t hi);
+
     // Addressing Modes
     uint8_t IMP();
     uint8_t IMM();
@@ -134,11 +323,50 @@ class CPU6502 {
     // Unofficial Opcode
     uint8_t XXX();
 
+    // One clock cycle. The default core runs a whole instruction on its
+    // first cycle and idles for the rest; with ACCURACY=cycle each cycle
+    // makes the bus access the 6502 makes on it, dummy accesses included.
     void clock();
     void reset();
+
+    // Executes exactly one instruction and returns the cycles it took,
+    // including any still owed by clock(), reset(), irq() or nmi().
+    uint8_t step();
+
+    // Executes whole instructions until cycleBudget cycles have elapsed and
+    // returns the cycles executed. The last instruction may overrun the
+    // budget; the overrun is taken off the budget of the next call.
+    uint32_t run(uint32_t cycleBudget);
+
+    // As run(), but nothing is owed from or to other calls: it stops on the
+    // first instruction boundary at least cycles away. For callers that
+    // keep their own clock, as Bus::run() does.
+    uint32_t runFor(uint32_t cycles) {
+        overshoot = 0;
+        uint32_t elapsed = run(cycles);
+        overshoot = 0;
+        return elapsed;
+    }
+
+    // For devices reached from inside run(): the cycles it has run before
+    // the instruction in flight (before the current cycle, with
+    // ACCURACY=cycle, which makes one access per cycle). 0 outside run().
+    uint32_t runCycles() const;
+
+    // Makes the run() in progress return as soon as the current
+    // instruction has finished, whatever budget it has left. For writes
+    // that need the caller's attention before the next instruction.
+    void yield();
+
     void irq();
     void nmi();
 
+    // The IRQ line, held by devices until they are acknowledged. Whoever
+    // runs the CPU calls irq() at an instruction boundary where it is held
+    // and I is clear. CLI, PLP and RTI yield when they clear I while it is
+    // held, so run() stops where the interrupt is due.
+    bool irqLine = false;
+
     uint8_t fetch();
     uint8_t fetched = 0x00;
 
@@ -146,4 +374,6 @@ class CPU6502 {
     uint16_t addr_rel = 0x00;
     uint8_t opcode = 0x00;
     uint8_t cycles = 0;
+
+    uint64_t instructions = 0;  // Instructions executed since construction
 };
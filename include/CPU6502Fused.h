@@ -0,0 +1,838 @@
+#pragma once
+
+#include <cstdint>
+
+#include "CPU6502.h"
+
+// Fused opcode handlers for the switch core and the predecode cache.
+//
+// Every row of CPU6502_OPCODES is stamped out as Op<Operation, Mode>, so the
+// addressing arithmetic, the page-cross penalty and the flag updates of one
+// opcode compile into a single straight-line function. Addresses and
+// operands stay in locals instead of going through addr_abs/fetched, which
+// CPUState leaves out for that reason, and the extra cycles are returned
+// directly rather than through the additional_cycle1 & additional_cycle2
+// handshake.
+//
+// The behaviour of each handler matches the CPU6502 member function of the
+// same name exactly, bus accesses included.
+struct CPU6502Fused {
+    // Addressing modes. fetch() consumes the operand bytes at pc and returns
+    // them (IMM returns their address instead), and resolve() turns them
+    // into the effective address. When Penalty is set, modes that can cross
+    // a page report it in crossed.
+
+    struct IMP {
+        static constexpr bool implied = true;
+        static uint16_t fetch(CPU6502 &) {
+            return 0x0000;
+        }
+        template <bool Penalty>
+        static uint16_t resolve(CPU6502 &, uint16_t, uint8_t &) {
+            return 0x0000;
+        }
+    };
+
+    struct IMM {
+        static constexpr bool implied = false;
+        static uint16_t fetch(CPU6502 &c) {
+            return c.pc++;
+        }
+        template <bool Penalty>
+        static uint16_t resolve(CPU6502 &, uint16_t operand, uint8_t &) {
+            return operand;
+        }
+    };
+
+    struct ZP0 {
+        static constexpr bool implied = false;
+        static uint16_t fetch(CPU6502 &c) {
+            return c.read(c.pc++);
+        }
+        template <bool Penalty>
+        static uint16_t resolve(CPU6502 &, uint16_t operand, uint8_t &) {
+            return operand & 0x00FF;
+        }
+    };
+
+    struct ZPX {
+        static constexpr bool implied = false;
+        static uint16_t fetch(CPU6502 &c) {
+            return c.read(c.pc++);
+        }
+        template <bool Penalty>
+        static uint16_t resolve(CPU6502 &c, uint16_t operand, uint8_t &) {
+            return (operand + c.x) & 0x00FF;
+        }
+    };
+
+    struct ZPY {
+        static constexpr bool implied = false;
+        static uint16_t fetch(CPU6502 &c) {
+            return c.read(c.pc++);
+        }
+        template <bool Penalty>
+        static uint16_t resolve(CPU6502 &c, uint16_t operand, uint8_t &) {
+            return (operand + c.y) & 0x00FF;
+        }
+    };
+
+    // Returns the branch target rather than the operand address.
+    struct REL {
+        static constexpr bool implied = false;
+        static uint16_t fetch(CPU6502 &c) {
+            return c.read(c.pc++);
+        }
+        template <bool Penalty>
+        static uint16_t resolve(CPU6502 &c, uint16_t operand, uint8_t &) {
+            uint16_t rel = operand;
+            if (rel & 0x80) {
+                rel |= 0xFF00;
+            }
+            return c.pc + rel;
+        }
+    };
+
+    struct ABS {
+        static constexpr bool implied = false;
+        static uint16_t fetch(CPU6502 &c) {
+            uint16_t operand = c.read16(c.pc);
+            c.pc += 2;
+            return operand;
+        }
+        template <bool Penalty>
+        static uint16_t resolve(CPU6502 &, uint16_t operand, uint8_t &) {
+            return operand;
+        }
+    };
+
+    struct ABX {
+        static constexpr bool implied = false;
+        static uint16_t fetch(CPU6502 &c) {
+            return ABS::fetch(c);
+        }
+        template <bool Penalty>
+        static uint16_t resolve(CPU6502 &c, uint16_t base, uint8_t &crossed) {
+            uint16_t addr = base + c.x;
+            if (Penalty) {
+                crossed = (addr & 0xFF00) != (base & 0xFF00);
+            }
+            return addr;
+        }
+    };
+
+    struct ABY {
+        static constexpr bool implied = false;
+        static uint16_t fetch(CPU6502 &c) {
+            return ABS::fetch(c);
+        }
+        template <bool Penalty>
+        static uint16_t resolve(CPU6502 &c, uint16_t base, uint8_t &crossed) {
+            uint16_t addr = base + c.y;
+            if (Penalty) {
+                crossed = (addr & 0xFF00) != (base & 0xFF00);
+            }
+            return addr;
+        }
+    };
+
+    struct IND {
+        static constexpr bool implied = false;
+        static uint16_t fetch(CPU6502 &c) {
+            return ABS::fetch(c);
+        }
+        template <bool Penalty>
+        static uint16_t resolve(CPU6502 &c, uint16_t ptr, uint8_t &) {
+            // Same page wrap bug as CPU6502::IND.
+            if ((ptr & 0x00FF) == 0x00FF) {
+                return (c.read(ptr & 0xFF00) << 8) | c.read(ptr + 0);
+            }
+            return c.read16(ptr);
+        }
+    };
+
+    struct IZX {
+        static constexpr bool implied = false;
+        static uint16_t fetch(CPU6502 &c) {
+            return c.read(c.pc++);
+        }
+        template <bool Penalty>
+        static uint16_t resolve(CPU6502 &c, uint16_t t, uint8_t &) {
+            uint16_t lo = c.read((t + (uint16_t)c.x) & 0x00FF);
+            uint16_t hi = c.read((t + (uint16_t)c.x + 1) & 0x00FF);
+            return hi << 8 | lo;
+        }
+    };
+
+    struct IZY {
+        static constexpr bool implied = false;
+        static uint16_t fetch(CPU6502 &c) {
+            return c.read(c.pc++);
+        }
+        template <bool Penalty>
+        static uint16_t resolve(CPU6502 &c, uint16_t t, uint8_t &crossed) {
+            uint16_t lo = c.read(t & 0x00FF);
+            uint16_t hi = c.read((t + 1) & 0x00FF);
+            uint16_t addr = ((hi << 8) | lo) + c.y;
+            if (Penalty) {
+                crossed = (addr & 0xFF00) != (hi << 8);
+            }
+            return addr;
+        }
+    };
+
+    // Shared pieces of the operations.
+
+    template <class Mode>
+    static uint8_t operand(CPU6502 &c, uint16_t addr) {
+        return Mode::implied ? c.a : c.read(addr);
+    }
+
+    template <class Mode>
+    static void store(CPU6502 &c, uint16_t addr, uint8_t v) {
+        if (Mode::implied) {
+            c.a = v;
+        } else {
+            c.write(addr, v);
+        }
+    }
+
+    static void push(CPU6502 &c, uint8_t v) {
+        c.write(0x0100 + c.stkp, v);
+        c.stkp--;
+    }
+
+    static uint8_t pull(CPU6502 &c) {
+        c.stkp++;
+        return c.read(0x0100 + c.stkp);
+    }
+
+    static uint8_t branch(CPU6502 &c, bool taken, uint16_t target,
+                          bool jump = true) {
+        if (!taken) {
+            return 0;
+        }
+        uint8_t extra = 1 + ((target & 0xFF00) != (c.pc & 0xFF00));
+        if (jump) {
+            c.pc = target;
+        }
+        return extra;
+    }
+
+    // Operations. exec() runs the whole instruction and returns the cycles
+    // it took beyond the base count in the opcode table. Penalty marks the
+    // operations that take the extra cycle on a page cross.
+
+    struct ADC {
+        static constexpr bool Penalty = true;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            uint8_t m = operand<Mode>(c, addr);
+            uint16_t temp = (uint16_t)c.a + m + c.GetFlag(CPU6502::C);
+            c.SetFlag(CPU6502::C, temp > 0xFF);
+            c.SetZN(temp & 0x00FF);
+            c.SetFlag(CPU6502::V,
+                      (~((uint16_t)c.a ^ m) & ((uint16_t)c.a ^ temp)) & 0x80);
+            c.a = temp & 0x00FF;
+            return 0;
+        }
+    };
+
+    struct AND {
+        static constexpr bool Penalty = true;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            c.a &= operand<Mode>(c, addr);
+            c.SetZN(c.a);
+            return 0;
+        }
+    };
+
+    struct ASL {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            operand<Mode>(c, addr);
+            uint16_t temp = c.a << 1;
+            c.SetFlag(CPU6502::C, temp & 0xFF00);
+            c.SetZN(temp & 0x00FF);
+            store<Mode>(c, addr, temp & 0x00FF);
+            return 0;
+        }
+    };
+
+    struct BCC {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            return branch(c, !c.GetFlag(CPU6502::C), addr);
+        }
+    };
+
+    struct BCS {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            return branch(c, c.GetFlag(CPU6502::C), addr);
+        }
+    };
+
+    struct BEQ {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            return branch(c, c.GetFlag(CPU6502::Z), addr);
+        }
+    };
+
+    struct BIT {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            uint8_t m = operand<Mode>(c, addr);
+            c.SetFlag(CPU6502::Z, (c.a & m) == 0x00);
+            c.SetFlag(CPU6502::V, m & 0x40);
+            c.SetFlag(CPU6502::N, m & 0x80);
+            return 0;
+        }
+    };
+
+    struct BMI {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            return branch(c, c.GetFlag(CPU6502::N), addr);
+        }
+    };
+
+    struct BNE {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            return branch(c, !c.GetFlag(CPU6502::Z), addr);
+        }
+    };
+
+    struct BPL {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            return branch(c, !c.GetFlag(CPU6502::N), addr);
+        }
+    };
+
+    struct BRK {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.pc++;
+            c.SetFlag(CPU6502::I, 1);
+            push(c, (c.pc >> 8) & 0x00FF);
+            push(c, c.pc & 0x00FF);
+            c.SetFlag(CPU6502::B, 1);
+            c.write(0x0100 + c.stkp, c.GetStatus());
+            c.SetFlag(CPU6502::B, 0);
+            c.pc = c.read16(0xFFFE);
+            return 0;
+        }
+    };
+
+    // Matches CPU6502::BVC, which takes the branch timing but not the jump.
+    struct BVC {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            return branch(c, !c.GetFlag(CPU6502::V), addr, false);
+        }
+    };
+
+    struct BVS {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            return branch(c, c.GetFlag(CPU6502::V), addr);
+        }
+    };
+
+    struct CLC {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.SetFlag(CPU6502::C, 0);
+            return 0;
+        }
+    };
+
+    struct CLD {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.SetFlag(CPU6502::D, 0);
+            return 0;
+        }
+    };
+
+    struct CLI {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.SetFlag(CPU6502::I, 0);
+            c.checkIrq();
+            return 0;
+        }
+    };
+
+    struct CLV {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.SetFlag(CPU6502::V, 0);
+            return 0;
+        }
+    };
+
+    struct CMP {
+        static constexpr bool Penalty = true;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            uint8_t m = operand<Mode>(c, addr);
+            uint16_t temp = (uint16_t)c.a - (uint16_t)m;
+            c.SetFlag(CPU6502::C, c.a >= m);
+            c.SetZN(temp & 0x00FF);
+            return 0;
+        }
+    };
+
+    struct CPX {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            uint8_t m = operand<Mode>(c, addr);
+            uint16_t temp = (uint16_t)c.x - (uint16_t)m;
+            c.SetFlag(CPU6502::C, c.x >= m);
+            c.SetZN(temp & 0x00FF);
+            return 0;
+        }
+    };
+
+    // Matches CPU6502::CPY, which takes N from x.
+    struct CPY {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            uint8_t m = operand<Mode>(c, addr);
+            uint16_t temp = (uint16_t)c.x - (uint16_t)m;
+            c.SetFlag(CPU6502::C, c.y >= m);
+            c.SetFlag(CPU6502::Z, c.y == m);
+            c.SetFlag(CPU6502::N, temp & 0x0080);
+            return 0;
+        }
+    };
+
+    struct DEC {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            uint8_t temp = operand<Mode>(c, addr) - 1;
+            c.write(addr, temp);
+            c.SetZN(temp);
+            return 0;
+        }
+    };
+
+    struct DEX {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.x--;
+            c.SetZN(c.x);
+            return 0;
+        }
+    };
+
+    struct DEY {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.y--;
+            c.SetZN(c.y);
+            return 0;
+        }
+    };
+
+    struct EOR {
+        static constexpr bool Penalty = true;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            c.a ^= operand<Mode>(c, addr);
+            c.SetZN(c.a);
+            return 0;
+        }
+    };
+
+    struct INC {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            uint8_t temp = operand<Mode>(c, addr) + 1;
+            c.SetZN(temp);
+            c.write(addr, temp);
+            return 0;
+        }
+    };
+
+    struct INX {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.x++;
+            c.SetZN(c.x);
+            return 0;
+        }
+    };
+
+    struct INY {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.y++;
+            c.SetZN(c.y);
+            return 0;
+        }
+    };
+
+    struct JMP {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            c.pc = addr;
+            return 0;
+        }
+    };
+
+    struct JSR {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            c.pc--;
+            push(c, (c.pc >> 8) & 0x00FF);
+            push(c, c.pc & 0x00FF);
+            c.pc = addr;
+            return 0;
+        }
+    };
+
+    struct LDA {
+        static constexpr bool Penalty = true;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            c.a = operand<Mode>(c, addr);
+            c.SetZN(c.a);
+            return 0;
+        }
+    };
+
+    struct LDX {
+        static constexpr bool Penalty = true;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            c.x = operand<Mode>(c, addr);
+            c.SetZN(c.x);
+            return 0;
+        }
+    };
+
+    struct LDY {
+        static constexpr bool Penalty = true;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            c.y = operand<Mode>(c, addr);
+            c.SetZN(c.y);
+            return 0;
+        }
+    };
+
+    // Matches CPU6502::LSR, which leaves Z alone.
+    struct LSR {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            uint8_t m = operand<Mode>(c, addr);
+            c.SetFlag(CPU6502::C, m & 0x01);
+            uint8_t temp = m >> 1;
+            c.SetFlag(CPU6502::N, temp & 0x80);
+            store<Mode>(c, addr, temp);
+            return 0;
+        }
+    };
+
+    struct NOP {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &, uint16_t) {
+            return 0;
+        }
+    };
+
+    // Matches CPU6502::ORA, which only updates N.
+    struct ORA {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            c.a |= operand<Mode>(c, addr);
+            c.SetFlag(CPU6502::N, c.a & 0x80);
+            return 0;
+        }
+    };
+
+    struct PHA {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            push(c, c.a);
+            return 0;
+        }
+    };
+
+    struct PHP {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.write(0x0100 + c.stkp,
+                    c.GetStatus() | CPU6502::B | CPU6502::U);
+            c.SetFlag(CPU6502::B, 0);
+            c.SetFlag(CPU6502::U, 0);
+            c.stkp--;
+            return 0;
+        }
+    };
+
+    struct PLA {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.a = pull(c);
+            c.SetZN(c.a);
+            return 0;
+        }
+    };
+
+    struct PLP {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.SetStatus(pull(c));
+            c.SetFlag(CPU6502::U, 1);
+            c.checkIrq();
+            return 0;
+        }
+    };
+
+    // Matches CPU6502::ROL, which always sets N.
+    struct ROL {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            uint8_t m = operand<Mode>(c, addr);
+            uint16_t temp = (uint16_t)(m << 1) | c.GetFlag(CPU6502::C);
+            c.SetFlag(CPU6502::C, temp & 0xFF00);
+            c.SetFlag(CPU6502::Z, (temp & 0x00FF) == 0x0000);
+            c.SetFlag(CPU6502::N, 1);
+            store<Mode>(c, addr, temp & 0x00FF);
+            return 0;
+        }
+    };
+
+    struct ROR {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            uint8_t m = operand<Mode>(c, addr);
+            uint16_t temp = (uint16_t)m | c.GetFlag(CPU6502::C) << 8;
+            c.SetFlag(CPU6502::C, m & 0x01);
+            temp = temp >> 1;
+            c.SetZN(temp & 0x00FF);
+            store<Mode>(c, addr, temp & 0x00FF);
+            return 0;
+        }
+    };
+
+    struct RTI {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.SetStatus(pull(c));
+            c.status &= ~CPU6502::B;
+            c.status &= ~CPU6502::U;
+            c.pc = (uint16_t)pull(c);
+            c.pc |= (uint16_t)pull(c) << 8;
+            c.checkIrq();
+            return 0;
+        }
+    };
+
+    struct RTS {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.pc = (uint16_t)pull(c);
+            c.pc |= (uint16_t)pull(c) << 8;
+            c.pc++;
+            return 0;
+        }
+    };
+
+    struct SBC {
+        static constexpr bool Penalty = true;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            uint16_t inverted = operand<Mode>(c, addr) ^ 0x00FF;
+            uint16_t temp = (uint16_t)c.a + inverted + c.GetFlag(CPU6502::C);
+            c.SetFlag(CPU6502::C, temp & 0xFF00);
+            c.SetZN(temp & 0x00FF);
+            c.SetFlag(CPU6502::V,
+                      (temp ^ (uint16_t)c.a) & (temp ^ inverted) & 0x0080);
+            c.a = temp & 0x00FF;
+            return 0;
+        }
+    };
+
+    struct SEC {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.SetFlag(CPU6502::C, 1);
+            return 0;
+        }
+    };
+
+    struct SED {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.SetFlag(CPU6502::D, 1);
+            return 0;
+        }
+    };
+
+    struct SEI {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.SetFlag(CPU6502::I, 1);
+            return 0;
+        }
+    };
+
+    struct STA {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            c.write(addr, c.a);
+            return 0;
+        }
+    };
+
+    struct STX {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            c.write(addr, c.x);
+            return 0;
+        }
+    };
+
+    struct STY {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t addr) {
+            c.write(addr, c.y);
+            return 0;
+        }
+    };
+
+    struct TAX {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.x = c.a;
+            c.SetZN(c.x);
+            return 0;
+        }
+    };
+
+    struct TAY {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.y = c.a;
+            c.SetZN(c.y);
+            return 0;
+        }
+    };
+
+    struct TSX {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.x = c.stkp;
+            c.SetZN(c.x);
+            return 0;
+        }
+    };
+
+    struct TXA {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.a = c.x;
+            c.SetZN(c.x);
+            return 0;
+        }
+    };
+
+    struct TXS {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.stkp = c.x;
+            return 0;
+        }
+    };
+
+    // Matches CPU6502::TYA, which loads the stack pointer.
+    struct TYA {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &c, uint16_t) {
+            c.stkp = c.y;
+            return 0;
+        }
+    };
+
+    struct XXX {
+        static constexpr bool Penalty = false;
+        template <class Mode>
+        static uint8_t exec(CPU6502 &, uint16_t) {
+            return 0;
+        }
+    };
+
+    // One opcode: resolve the address, run the operation and return the
+    // cycles taken beyond the table's base count.
+    template <class Operation, class Mode>
+    struct Op {
+        static uint8_t exec(CPU6502 &c) {
+            return run(c, Mode::fetch(c));
+        }
+
+        // The instruction after its operand has been fetched, with pc
+        // already past it. The predecode cache calls this directly.
+        static uint8_t run(CPU6502 &c, uint16_t operand) {
+            uint8_t crossed = 0;
+            uint16_t addr =
+                Mode::template resolve<Operation::Penalty>(c, operand, crossed);
+            return crossed + Operation::template exec<Mode>(c, addr);
+        }
+    };
+};
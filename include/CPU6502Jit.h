@@ -0,0 +1,152 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "Bus.h"
+#include "CPU6502.h"
+
+using namespace std;
+
+// Dynamic recompiler from 6502 basic blocks to x86-64, built with JIT=1.
+//
+// A block is straight-line code from one address up to and including a
+// branch, JMP, JSR, RTS, RTI or BRK. Once the interpreter has reached an
+// address often enough, the block starting there is translated into native
+// code in an mmap'd buffer. Loads, stores, arithmetic, transfers,
+// flag operations, branches and JMP are emitted inline; every other
+// instruction calls its fused handler (see CPU6502Fused.h). Blocks that end
+// on a known address jump straight into the next block once it has been
+// translated, and returns, interrupts and indirect jumps look their target
+// up in a table.
+//
+// The budget is checked after every instruction, so run() stops on exactly
+// the same instruction, with the same cycle count, registers and flags as
+// the interpreter. Code on device pages is never translated, and the CPU
+// falls back to the interpreter wherever no block is available. The pages a
+// block came from are watched; a write into translated code drops the
+// blocks covering it, and the block that wrote it stops right after the
+// store.
+//
+// With CPU6502::jitCrossCheck set, every block runs on its own and is
+// replayed by the interpreter on a fork of the machine. Differences are
+// reported on stderr and counted in CPU6502::jitMismatches, and the
+// interpreter's result is kept. Devices on the bus see the replay's
+// accesses too. Forking per block makes this orders of magnitude slower.
+//
+// The buffer is never writable and executable at once: it is made writable
+// to translate or link a block and executable again before any block runs.
+// Blocks are killed from inside translated code, by the store that
+// overwrote them, so unlinking their callers waits until the code returns.
+class CPU6502Jit {
+   public:
+    explicit CPU6502Jit(CPU6502 &cpu);
+    ~CPU6502Jit();
+
+    CPU6502Jit(const CPU6502Jit &) = delete;
+    CPU6502Jit &operator=(const CPU6502Jit &) = delete;
+
+    // Runs translated code from cpu.pc until remaining runs out or control
+    // reaches code with no block, counting the cycles down from remaining
+    // and up into elapsed. Returns false, having run nothing, when there is
+    // no block for pc yet; the caller then interprets one instruction.
+    bool run(int64_t &remaining, uint32_t &elapsed);
+
+    // While translated code is running and has called out: the cycles it
+    // had taken before the instruction making the call. 0 otherwise.
+    uint32_t inFlight() const {
+        return (uint32_t)context.elapsed;
+    }
+
+    // Makes the running code return after the current instruction. It
+    // checks after inline loads and stores from memory and after handler
+    // calls, which is where CPU6502::yield() is called from.
+    void yield() {
+        context.dirty = 1;
+    }
+
+    // Drops every block that includes addr.
+    void invalidate(uint16_t addr);
+
+    // Drops every block that includes any of page n.
+    void invalidatePage(uint8_t n);
+
+   private:
+    // Everything translated code needs besides the CPU. r12 points here.
+    struct Context {
+        int64_t remaining = 0;
+        uint64_t elapsed = 0;
+        const Bus::Page *pages = nullptr;
+        uint8_t *link = nullptr;  // Chain slot the code left through
+        uint8_t dirty = 0;        // Set when a block is invalidated, or
+                                  // on yield()
+    };
+
+    struct Block {
+        uint16_t start = 0x0000;
+        uint16_t size = 0;  // Bytes of 6502 code covered
+        uint8_t *code = nullptr;
+        bool live = true;
+
+        // Chain slots in other blocks that jump here, each with the stub
+        // it jumped to before it was linked.
+        vector<pair<uint8_t *, uint8_t *>> incoming;
+    };
+
+    CPU6502 &cpu;
+    Context context;
+
+    uint8_t *buffer = nullptr;
+    size_t bufferSize = 0;
+    bool bufferWritable = false;     // Otherwise it is executable
+    uint8_t *cursor = nullptr;       // Next byte to emit into
+    uint8_t *blocksStart = nullptr;  // First byte after the entry/exit code
+
+    using Enter = void (*)(CPU6502 *cpu, Context *context, uint8_t *code);
+    Enter enter = nullptr;
+    uint8_t *exitNoLink = nullptr;
+    uint8_t *exitLink = nullptr;
+
+    vector<unique_ptr<Block>> blocks;
+    vector<Block *> blockAt;   // By start address
+    vector<uint8_t *> entries; // Native entry by start address, read by code
+    array<vector<Block *>, 256> byPage;
+    vector<uint8_t> heat;
+    uint32_t generation = 0;  // Bumped by every flush()
+    // Chain slots kill() has to point back at their stubs, with the stub.
+    vector<pair<uint8_t *, uint8_t *>> unlinks;
+    bool crossChecking = false;
+
+    // Offsets of the CPU fields translated code touches.
+    int32_t offA, offX, offY, offStkp, offStatus, offPc, offOpcode;
+    int32_t offInstructions;
+#if defined(NES_LAZY_FLAGS)
+    int32_t offZResult, offNResult;
+#endif
+
+    // The block for pc, translating it if it has become hot. Null if there
+    // is none (yet).
+    Block *find(uint16_t pc);
+    Block *translate(uint16_t pc);
+    void link(uint8_t *slot, Block *target);
+    void kill(Block *block);
+    void flush();
+
+    // Make the buffer writable, or executable with the pending unlinks
+    // applied. False if mprotect() failed.
+    bool unseal();
+    bool seal();
+
+    bool crossCheck(Block *block, int64_t &remaining, uint32_t &elapsed);
+
+    // Called from translated code for accesses off the fast path.
+    static uint8_t readByte(CPU6502 *cpu, uint16_t addr);
+    static void writeByte(CPU6502 *cpu, uint16_t addr, uint8_t data);
+
+    // Emits the code for one block; see CPU6502Jit.cpp.
+    struct Translator;
+};
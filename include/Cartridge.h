@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+using namespace std;
+
+// An iNES or NES 2.0 ROM image. The file is mmap'd read-only and PRG/CHR
+// point straight into the mapping, so nothing is copied and every Bus that
+// plugs in the same Cartridge (and every process that maps the same file)
+// shares the same physical pages. Only the header is parsed and the sizes
+// checked against the file; the data is not touched until it is read.
+class Cartridge {
+   public:
+    // Nametable layout. Boards like MMC1 can also switch to one screen,
+    // either the first or the second nametable.
+    enum class Mirroring : uint8_t {
+        HORIZONTAL, VERTICAL, FOUR_SCREEN, ONE_SCREEN_LO, ONE_SCREEN_HI
+    };
+
+    // Maps path. Returns null, with the reason in error, if it cannot be
+    // read or is not a valid iNES or NES 2.0 image.
+    static shared_ptr<const Cartridge> load(const string &path,
+                                            string &error);
+
+    ~Cartridge();
+
+    Cartridge(const Cartridge &) = delete;
+    Cartridge &operator=(const Cartridge &) = delete;
+
+    const uint8_t *prg() const {
+        return prgData;
+    }
+    size_t prgSize() const {
+        return prgBytes;
+    }
+
+    // Null with chrSize() 0 when the board has CHR RAM instead.
+    const uint8_t *chr() const {
+        return chrBytes ? chrData : nullptr;
+    }
+    size_t chrSize() const {
+        return chrBytes;
+    }
+
+    uint16_t mapper = 0;
+    uint8_t submapper = 0;  // NES 2.0 only
+    Mirroring mirroring = Mirroring::HORIZONTAL;
+    bool battery = false;  // PRG RAM is battery-backed
+    bool nes2 = false;
+
+    // Work and CHR RAM the board needs, from the header or the iNES
+    // defaults (8 KiB of each where the header says nothing).
+    size_t prgRamSize = 0;
+    size_t chrRamSize = 0;
+
+   private:
+    Cartridge() = default;
+
+    void *mapping = nullptr;
+    size_t mappingSize = 0;
+    const uint8_t *prgData = nullptr;
+    const uint8_t *chrData = nullptr;
+    size_t prgBytes = 0;
+    size_t chrBytes = 0;
+};
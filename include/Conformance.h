@@ -0,0 +1,26 @@
+#pragma once
+
+// Headless conformance runner for 6502 test ROMs such as Klaus Dormann's
+// functional tests:
+//
+//     nes --test <manifest> [--threads N] [--min-mhz MHZ]
+//
+// Each manifest line is a batch line (see Batch.h) followed by the
+// conditions for passing:
+//
+//     <binary> <load address> <max cycles> [<entry point>]
+//              [pass=<addr>] [status=<addr>:<value>]
+//
+// Every ROM runs on its own Bus/CPU6502 instance at full speed until it
+// traps, that is until an instruction leaves pc where it was (JMP *, or a
+// branch to itself), or until it has used max cycles. It passes if it
+// traps at the pass address and, with status=, the byte at addr holds
+// value when it does. A ROM with neither condition only reports where it
+// trapped.
+//
+// The report gives the verdict, trap address, instructions, cycles and
+// emulated MHz of every ROM; the counts include the few thousand cycles a
+// ROM spends in its trap before the runner looks. The exit status is 1 if
+// any ROM failed or ran out of cycles, or with --min-mhz ran slower than
+// MHZ, so the runner can gate both correctness and speed.
+int runConformance(int argc, char **argv);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Bus.h"
+
+using namespace std;
+
+// Disassembly decoded on demand. Each address that has been shown gets a
+// compact record (opcode, operand bytes, length) in a flat array indexed by
+// address; text is only formatted when a line is asked for. The pages a
+// record was read from are watched, and a write to an address drops just the
+// records that cover it, so self-modifying code is shown as it now is.
+//
+// Bytes read from device pages are never cached.
+class Disassembly : public BusWatcher {
+   public:
+    explicit Disassembly(Bus &bus);
+    ~Disassembly();
+
+    Disassembly(const Disassembly &) = delete;
+    Disassembly &operator=(const Disassembly &) = delete;
+
+    // The disassembly line for the instruction at addr.
+    string line(uint16_t addr);
+
+    // The address of the instruction after the one at addr.
+    uint16_t next(uint16_t addr) {
+        return addr + decode(addr).length;
+    }
+
+    // The address n instructions before addr, or as many as there are.
+    // addr is remembered as a known instruction start. Of the alignments
+    // within reach that decode into addr, the one through the most known
+    // starts wins, and of those the earliest.
+    uint16_t back(uint16_t addr, int n);
+
+    void busWritten(uint16_t addr) override;
+
+   private:
+    struct Record {
+        uint8_t opcode;
+        uint8_t lo;
+        uint8_t hi;
+        uint8_t length : 7;  // 0 until decoded
+        uint8_t known : 1;   // Passed to back() since the last write
+    };
+
+    Bus &bus;
+    vector<Record> records;
+
+    Record decode(uint16_t addr);
+};
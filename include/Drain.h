@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+using namespace std;
+
+// The consumer thread of a single-producer ring, for Trace, WavWriter and
+// FrameSink. It calls take() until stop(), and idle() whenever take() found
+// nothing ready. After a failed write take() keeps draining without
+// writing, so the producer never finds a dead consumer full.
+class Drain {
+   public:
+    // Writes out the ready items unless failed is set, sets it if a write
+    // fails, and returns how many items it took either way.
+    using Take = function<size_t(bool &failed)>;
+
+    Drain() = default;
+    ~Drain();
+
+    Drain(const Drain &) = delete;
+    Drain &operator=(const Drain &) = delete;
+
+    void start(Take take, function<void()> idle);
+
+    // Takes everything pushed before the call and joins the thread.
+    // Returns false if a write failed since the last start(), however many
+    // times it is called.
+    bool stop();
+
+    bool running() const {
+        return worker.joinable();
+    }
+
+    // Items taken since start(), written or not.
+    uint64_t taken() const {
+        return count;
+    }
+
+   private:
+    Take take;
+    function<void()> idle;
+
+    bool failed = false;
+    uint64_t count = 0;
+    atomic<bool> stopping{false};
+    thread worker;
+
+    void loop();
+};
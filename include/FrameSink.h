@@ -0,0 +1,211 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Drain.h"
+
+using namespace std;
+
+class ThreadPool;
+
+// Single-producer, single-consumer hand-off of finished frames, from the
+// PPU to a FrameSink. Frames are never copied: push() swaps the buffer the
+// PPU has just finished with a free one, and the sink reads it in place
+// and releases it when done, which frees the buffer for a later push().
+// The PPU draws into one buffer while up to capacity frames wait for or
+// are being written by the sink, so a capacity of 2 is triple buffering.
+//
+// push() never waits: one that finds every buffer still with the sink
+// drops the frame and counts it, leaving the PPU to draw the next one over
+// it, so a slow sink never holds up emulation. Callers that would rather
+// wait apply backpressure between runs instead, with waitForRoom().
+class FrameRing {
+   public:
+    FrameRing(size_t frameBytes, size_t capacity = 2);
+
+    FrameRing(const FrameRing &) = delete;
+    FrameRing &operator=(const FrameRing &) = delete;
+
+    // Producer: hands pixels over as frame number and swaps a free buffer
+    // of the same size into it. False if none is free, in which case the
+    // frame is dropped and pixels left as it is.
+    bool push(vector<uint8_t> &pixels, uint64_t number);
+
+    // Producer: true while a push() would drop the frame.
+    bool full() const {
+        return head.load(memory_order_relaxed) -
+                   tail.load(memory_order_acquire) >=
+               slots.size();
+    }
+
+    // Producer: the pixels of frame number if it was the last one pushed,
+    // or null. They stay put until a later push() swaps the buffer out.
+    const uint8_t *last(uint64_t number) const;
+
+    // Producer: sleeps until a push() would succeed.
+    void waitForRoom();
+
+    // Consumer: sleeps until a frame is ready, or for at most timeout.
+    void waitForFrames(chrono::microseconds timeout);
+
+    // Consumer: the frames pushed and not yet released, oldest first, and
+    // the pixels and number of the i-th of them.
+    size_t ready() const {
+        return head.load(memory_order_acquire) -
+               tail.load(memory_order_relaxed);
+    }
+    const uint8_t *pixels(size_t i) const {
+        return slot(i).pixels.data();
+    }
+    uint64_t number(size_t i) const {
+        return slot(i).number;
+    }
+
+    // Consumer: gives the oldest n ready frames' buffers back.
+    void release(size_t n);
+
+    size_t frameBytes() const {
+        return bytes;
+    }
+    uint64_t pushed() const {
+        return head.load(memory_order_relaxed);
+    }
+    uint64_t dropped() const {
+        return lost;
+    }
+
+   private:
+    struct Slot {
+        vector<uint8_t> pixels;
+        uint64_t number = 0;
+    };
+
+    size_t bytes;
+    vector<Slot> slots;
+    uint64_t lost = 0;  // Producer side
+
+    alignas(64) atomic<uint64_t> head{0};  // Frames pushed
+    alignas(64) atomic<uint64_t> tail{0};  // Frames released
+
+    // Wakeups for whichever side is waiting. Notifying does not take the
+    // lock, so a push() never waits on the sink; a wakeup lost to the race
+    // with a waiter going to sleep only costs that waiter its timeout.
+    mutex m;
+    condition_variable pushes;
+    condition_variable releases;
+
+    const Slot &slot(size_t i) const {
+        return slots[(tail.load(memory_order_relaxed) + i) % slots.size()];
+    }
+};
+
+// Writes the frames from a FrameRing somewhere on a thread of its own,
+// 256x240 NES colour indices as PPU2C02::frame() has them. Subclasses
+// open their output, call start(), and call close() from their destructor.
+class FrameSink {
+   public:
+    virtual ~FrameSink();
+
+    FrameSink(const FrameSink &) = delete;
+    FrameSink &operator=(const FrameSink &) = delete;
+
+    // Writes the frames still in the ring and stops the thread. Returns
+    // false if a write failed.
+    bool close();
+
+    // Frames taken from the ring, written or not.
+    uint64_t frames() const {
+        return sink.taken();
+    }
+
+    // The host colour of each NES colour index, as RGB.
+    static const uint8_t PALETTE[64][3];
+
+   protected:
+    explicit FrameSink(FrameRing &ring);
+
+    FrameRing &ring;
+
+    void start();
+
+    // On the sink thread: writes the oldest n ready frames, n > 0. Returns
+    // false if that failed; the sink then only drains the ring.
+    virtual bool write(size_t n) = 0;
+
+    // From close(), after the last write(), or after a failure.
+    virtual bool finish() {
+        return true;
+    }
+
+   private:
+    Drain sink;
+};
+
+// A raw stream of 24-bit RGB frames, one after another with nothing in
+// between, as encoders take it from a pipe. Into a pipe, each frame is
+// converted into page-aligned memory and vmsplice()d, so the pipe takes
+// the pages themselves rather than a copy; enough buffers are kept for a
+// pipe-full of frames, and a buffer is only converted into again once the
+// reader has taken everything spliced before the frames after it. Into
+// anything else the frames are written.
+class RawVideoWriter : public FrameSink {
+   public:
+    explicit RawVideoWriter(FrameRing &ring);
+    ~RawVideoWriter() override;
+
+    // Writes to path, "-" for stdout, and starts the sink. Opening a FIFO
+    // waits for its reader. Returns false if path cannot be opened.
+    bool open(const string &path);
+
+   private:
+    int fd = -1;
+    bool ownFd = false;
+    bool zeroCopy = false;  // vmsplice() into a pipe
+
+    // Page-aligned RGB buffers, used in turn.
+    unique_ptr<uint8_t, void (*)(void *)> buffers{nullptr, free};
+    size_t bufferBytes = 0;
+    size_t nBuffers = 0;
+    size_t next = 0;
+
+    bool write(size_t n) override;
+    bool finish() override;
+};
+
+// One image file per frame, encoded on a small pool of workers so a
+// picture takes a worker's time rather than the sink's. PNGs are kept in
+// NES colour indices, as 8-bit paletted images compressed with zlib; PPMs
+// are 24-bit RGB and uncompressed. Frame f is written to
+// <prefix>.<f>.png or .ppm.
+class ImageWriter : public FrameSink {
+   public:
+    enum class Format { PNG, PPM };
+
+    ImageWriter(FrameRing &ring, Format format, size_t workers = 2);
+    ~ImageWriter() override;
+
+    // Starts the sink. Files are created as frames come in; close()
+    // returns false if any of them could not be written.
+    void open(const string &prefix);
+
+   private:
+    Format format;
+    string prefix;
+    unique_ptr<ThreadPool> pool;
+
+    // Per worker: PNG rows before compression, and the file being built.
+    vector<vector<uint8_t>> rows;
+    vector<vector<uint8_t>> files;
+
+    bool write(size_t n) override;
+    bool writeImage(const uint8_t *pixels, uint64_t number, size_t worker);
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string>
+
+using namespace std;
+
+// n as d upper-case hex digits, for reports and diffs.
+inline string hex(uint32_t n, uint8_t d) {
+    string s(d, '0');
+    for (int i = d - 1; i >= 0; i--, n >>= 4)
+        s[i] = "0123456789ABCDEF"[n & 0xF];
+    return s;
+}
+
+// A 16-bit address or value written $8000, 0x8000 or 8000. False if s is
+// not hex or does not fit.
+inline bool parseHex(string s, uint16_t &v) {
+    if (!s.empty() && s[0] == '$') {
+        s = s.substr(1);
+    } else if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        s = s.substr(2);
+    }
+    try {
+        size_t used = 0;
+        unsigned long n = stoul(s, &used, 16);
+        if (used != s.size() || n > 0xFFFF) {
+            return false;
+        }
+        v = (uint16_t)n;
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+// A count written in decimal, for options like --threads. False if s is
+// not a whole number or does not fit in n.
+template <typename T>
+inline bool parseCount(const string &s, T &n) {
+    if (s.empty() || s[0] < '0' || s[0] > '9') {
+        return false;
+    }
+    try {
+        size_t used = 0;
+        unsigned long long v = stoull(s, &used, 10);
+        if (used != s.size() || v > numeric_limits<T>::max()) {
+            return false;
+        }
+        n = (T)v;
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
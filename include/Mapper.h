@@ -0,0 +1,101 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Bus.h"
+#include "Cartridge.h"
+#include "SaveState.h"
+
+using namespace std;
+
+// A cartridge board: which PRG and CHR banks are visible and the registers
+// that switch them. Supported boards are NROM (mapper 0), MMC1 (1), UxROM
+// (2) and CNROM (3).
+//
+// PRG banks are mapped by pointing the bus page table at the cartridge's
+// mmap'd PRG data, so switching a bank costs one pointer per 256-byte page
+// and never copies. The mapper is the device behind every page of
+// $8000-$FFFF: reads go straight through the page pointers and only writes,
+// which the ROM cannot take, reach cpuWrite(). $6000-$7FFF stays mapped to
+// bus ram and serves as work RAM. Nothing on these boards decodes
+// $4020-$5FFF, so the bus leaves $4100-$5FFF unmapped while a cartridge is
+// in: reads give 0 and writes are dropped, as for $4018-$40FF.
+//
+// CHR banks are kept the same way for the PPU, as eight 1 KiB pointers into
+// the CHR ROM, or into the mapper's own CHR RAM on boards without one.
+class Mapper : public BusDevice {
+   public:
+    // The mapper for cart's board, mapping into bus, with its power-on
+    // banks in place. Null if the board is not supported.
+    static unique_ptr<Mapper> create(Bus &bus,
+                                     shared_ptr<const Cartridge> cart);
+    static bool supports(const Cartridge &cart);
+
+    ~Mapper() override;
+
+    // A copy with the same registers and CHR RAM, mapping into bus instead.
+    virtual unique_ptr<Mapper> clone(Bus &bus) const = 0;
+
+    // Puts the registers back to power-on and remaps.
+    virtual void reset() = 0;
+
+    // The board's number and bank registers, for save states. loadState
+    // returns false, leaving the board as it was, if s is from another
+    // board.
+    void saveState(MapperState &s) const;
+    bool loadState(const MapperState &s);
+
+    // CHR RAM, CHR_RAM_SIZE bytes, or null on boards with CHR ROM.
+    const uint8_t *chrRamData() const {
+        return chrRam.empty() ? nullptr : chrRam.data();
+    }
+    void loadChrRam(const uint8_t *data);
+
+    // Nothing is mapped under the PRG pages, so reads only come here for
+    // open bus.
+    uint8_t cpuRead(uint16_t addr, bool bReadOnly) override;
+
+    const Cartridge &cartridge() const {
+        return *cart;
+    }
+    const shared_ptr<const Cartridge> &sharedCartridge() const {
+        return cart;
+    }
+
+    // $0000-$1FFF of the PPU address space in 1 KiB banks. chrWrite is null
+    // for CHR ROM.
+    array<const uint8_t *, 8> chrRead{};
+    array<uint8_t *, 8> chrWrite{};
+
+    Cartridge::Mirroring mirroring = Cartridge::Mirroring::HORIZONTAL;
+
+   protected:
+    Mapper(Bus &bus, shared_ptr<const Cartridge> cart);
+    Mapper(Bus &bus, const Mapper &other);
+
+    Bus &bus;
+    shared_ptr<const Cartridge> cart;
+    vector<uint8_t> chrRam;
+
+    // Maps 16 KiB PRG bank n at $8000 (slot 0) or $C000 (slot 1), and 4 KiB
+    // CHR bank n at $0000 (slot 0) or $1000 (slot 1). Bank numbers wrap
+    // around the size of the ROM. Slots already showing bank n are left
+    // alone, so rewriting a register costs nothing.
+    void mapPrg16(int slot, size_t n);
+    void mapChr4(int slot, size_t n);
+
+    // Makes the next mapPrg16()/mapChr4() of every slot remap.
+    void forgetBanks();
+
+    // The registers as saved in MapperState::regs. loadRegs() remaps.
+    virtual void saveRegs(uint8_t *regs) const = 0;
+    virtual void loadRegs(const uint8_t *regs) = 0;
+
+   private:
+    array<size_t, 2> prgBank;
+    array<size_t, 2> chrBank;
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "BusDevice.h"
+#include "SaveState.h"
+
+using namespace std;
+
+class FrameRing;
+class Mapper;
+
+// The 2C02 picture processing unit. Its eight registers sit at $2000-$2007
+// and repeat every 8 bytes up to $3FFF; the Bus maps them while a
+// cartridge is plugged in. Pattern tables come from the cartridge's CHR
+// banks and the nametable layout from its mirroring (see Mapper.h).
+//
+// The PPU keeps NTSC timing, 341 dots by 262 lines with the odd-frame dot
+// skipped, but draws a whole scanline at once on the line's first dot from
+// the scroll, registers and sprites in effect then. Writes made part way
+// through a line show from the next one. Each background tile row is
+// decoded eight pixels at a time by interleaving the two CHR bitplanes in
+// vector lanes (SSE2, or AVX2 when the host has it), sprites are merged in
+// the same way and, with AVX2, the palette is looked up with byte
+// shuffles. Sprite-0 hit is found while the line is drawn and raised on the
+// dot it happens on; sprite overflow follows the hardware's evaluation,
+// false positives and misses included.
+//
+// frame() is 256x240 NES colour indices ($00-$3F), one byte per pixel,
+// with the greyscale bit applied. Colour emphasis is not.
+class PPU2C02 : public BusDevice {
+   public:
+    static constexpr int WIDTH = 256;
+    static constexpr int HEIGHT = 240;
+    static constexpr int DOTS = 341;   // Per line
+    static constexpr int LINES = 262;  // Per frame
+
+    PPU2C02();
+
+    // Takes CHR and mirroring from mapper from now on; null leaves the
+    // pattern tables reading as zero.
+    void connect(Mapper *mapper);
+
+    // Power-on state: registers, memories and the frame cleared, at the
+    // first dot of scanline 0, the top of the picture.
+    void reset();
+
+    uint8_t cpuRead(uint16_t addr, bool bReadOnly) override;
+    void cpuWrite(uint16_t addr, uint8_t data) override;
+
+    // Advances one dot, or n. Only the dots that do something cost
+    // anything, so a long run() is much cheaper than as many clock()s.
+    void clock() {
+        run(1);
+    }
+    void run(uint64_t n);
+
+    // One byte of OAM DMA, stored at OAMADDR, which moves on.
+    void writeOam(uint8_t data) {
+        oam[oamAddr++] = data;
+    }
+
+    // Set when vertical blank starts with NMI enabled, or NMI is enabled
+    // during vertical blank. Whoever delivers it to the CPU clears it.
+    bool nmi = false;
+
+    // The dots run() can go before the next vertical blank starts, which
+    // is when nmi can next be set other than by a write. Exact unless
+    // rendering is switched on or off first, which moves it by the dot the
+    // pre-render line of odd frames skips.
+    uint32_t untilVblank() const;
+
+    // Frames completed: counted as vertical blank starts, when frame()
+    // holds the whole picture.
+    uint64_t frames = 0;
+
+    const uint8_t *frame() const {
+        return screen->data();
+    }
+
+    // The lines of frame() drawn since the last frame was completed: those
+    // above the current line, or all of them between the end of the last
+    // visible line and the start of vertical blank.
+    int linesDrawn() const {
+        if (scanline < HEIGHT) {
+            return scanline + (dot > 1 ? 1 : 0);
+        }
+        return scanline == HEIGHT || (scanline == 241 && dot <= 1) ? HEIGHT
+                                                                   : 0;
+    }
+
+    // Hands every frame to ring as vertical blank starts from now on, or
+    // stops with null. The frame's buffer goes with it and the PPU goes on
+    // in one the sink is done with, so below linesDrawn() frame() then
+    // holds an older picture. Frames the ring has no room for stay put and
+    // are drawn over instead.
+    void setOutput(FrameRing *ring) {
+        output = ring;
+    }
+
+    void saveState(PPUState &s) const;
+    void loadState(const PPUState &s);
+
+   private:
+    Mapper *mapper = nullptr;
+    FrameRing *output = nullptr;
+
+    uint8_t ctrl = 0x00;    // $2000
+    uint8_t mask = 0x00;    // $2001
+    uint8_t status = 0x00;  // $2002, top three bits
+    uint8_t oamAddr = 0x00;
+
+    // Scroll: v is the current VRAM address, t the one being written,
+    // fineX the pixel within the first tile and latch picks which half of
+    // $2005/$2006 the next write goes to.
+    uint16_t v = 0x0000;
+    uint16_t t = 0x0000;
+    uint8_t fineX = 0;
+    bool latch = false;
+
+    uint8_t readBuffer = 0x00;  // $2007 reads lag by one
+    uint8_t openBus = 0x00;     // Last value written to any register
+
+    uint16_t scanline = 0;
+    uint16_t dot = 0;  // Next dot to run on scanline
+    bool oddFrame = false;
+    uint16_t hitDot = 0;  // Sprite-0 hit still to come on this line, or 0
+
+    // Sprites for the next line, fetched at the end of this one: pattern
+    // low and high (already flipped), attributes in pixel form (see
+    // PPU2C02.cpp) and x.
+    struct Sprite {
+        uint8_t lo, hi, attr, x;
+    };
+    array<Sprite, 8> sprites{};
+    uint8_t spriteCount = 0;
+
+    array<uint8_t, 32> palette{};
+    array<uint8_t, 256> oam{};
+
+    // The four nametables and the frame. A copy of the PPU, as Bus::fork()
+    // makes, shares them with the original until one of the two writes to
+    // them, which then takes its own (see own()). A PPU that is copied and
+    // thrown away without drawing copies neither.
+    using Nametables = array<uint8_t, 4096>;
+    shared_ptr<Nametables> vram;
+    shared_ptr<vector<uint8_t>> screen;
+
+    bool rendering() const {
+        return mask & 0x18;
+    }
+    uint16_t lineLength() const {
+        return scanline == 261 && oddFrame && rendering() ? DOTS - 1 : DOTS;
+    }
+    uint16_t nextEvent() const;
+    void event();
+
+    // PPU address space, $0000-$3FFF.
+    uint8_t ppuRead(uint16_t addr) const;
+    void ppuWrite(uint16_t addr, uint8_t data);
+    uint8_t chr(uint16_t addr) const;
+    uint16_t nametable(uint16_t addr) const;  // Index into vram
+
+    void incrementY();
+    void evaluateSprites();
+    void renderLine();
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+
+#include "CPU6502.h"
+
+using namespace std;
+
+// Execution counters, built in with PROFILE=1 (NES_PROFILE). Without it
+// nothing here is referenced and the CPU compiles exactly as before.
+//
+// Every instruction the CPU finishes is counted against its opcode: how
+// often it ran, the cycles it took, whether an ABX, ABY or IZY operand
+// crossed a page and cost the extra cycle, and whether a branch was taken.
+// Counts are kept per thread, in a cache-aligned block each thread gets on
+// first use, so CPUs on different threads never share a line. The totals
+// are summed over every thread that has counted anything.
+struct alignas(64) ProfileCounters {
+    array<uint64_t, 256> executed{};
+    array<uint64_t, 256> cycles{};
+    array<uint64_t, 256> pageCrossed{};
+    array<uint64_t, 256> branchTaken{};
+
+    void add(const ProfileCounters &other);
+};
+
+class Profile {
+   public:
+    // Counts one finished instruction on this thread.
+    static void record(uint8_t opcode, uint8_t cycles) {
+        ProfileCounters &c = local();
+        c.executed[opcode]++;
+        c.cycles[opcode] += cycles;
+        if (cycles > base[opcode]) {
+            // The only extra cycles are page crossings and taken branches.
+            if (branch[opcode]) {
+                c.branchTaken[opcode]++;
+            } else {
+                c.pageCrossed[opcode]++;
+            }
+        }
+    }
+
+    // This thread's counters.
+    static ProfileCounters &local() {
+        if (!current) {
+            current = attach();
+        }
+        return *current;
+    }
+
+    // The sum over all threads, and zeroing every thread's counters. Neither
+    // may run while another thread is counting.
+    static ProfileCounters total();
+    static void reset();
+
+    // A table of the opcodes executed, most frequent first, with totals by
+    // addressing mode; and the same as JSON.
+    static void dump(ostream &out);
+    static void dumpJson(ostream &out);
+
+   private:
+    static thread_local ProfileCounters *current;
+    static const array<uint8_t, 256> base;    // Cycles from the opcode table
+    static const array<bool, 256> branch;     // REL addressing
+
+    static ProfileCounters *attach();
+};
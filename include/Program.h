@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Bus.h"
+
+using namespace std;
+
+// Raw binary programs for the headless runners (batch and test), as their
+// manifests list them: an image, the address it loads at and an optional
+// entry point.
+
+// Reads each image once, however many manifest lines name it. The images
+// stay put for as long as the cache lives.
+class ImageCache {
+   public:
+    // The contents of path, or null with the reason in error.
+    const vector<uint8_t> *load(const string &path, string &error);
+
+   private:
+    map<string, vector<uint8_t>> images;
+};
+
+// Writes image into bus at load, cut off at $FFFF, through bus.write() so
+// watchers see it. The reset vector is pointed at entry if there is one,
+// and at load if the image does not cover $FFFC-$FFFD itself.
+void loadProgram(Bus &bus, const vector<uint8_t> &image, uint16_t load,
+                 bool hasEntry, uint16_t entry);
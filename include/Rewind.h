@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "Bus.h"
+#include "SaveState.h"
+
+using namespace std;
+
+// A bounded history of machine states to step back through.
+//
+// Every keyframeEvery-th snapshot is a keyframe: the CPU state plus a
+// Bus::RamImage, which shares the blocks of every page that has not changed
+// since the keyframe before it, so it costs only the pages written since.
+// The snapshots in between store the CPU state and, for each ram page that
+// differs from their keyframe, the page XORed against the keyframe's block
+// and run-length encoded. A few bytes changed on a page cost a few bytes.
+// Every snapshot also keeps the mapper's registers, the PPU's registers,
+// palette and OAM and the APU's state, while CHR RAM and the PPU's
+// nametables are shared with the snapshot before for as long as they do
+// not change.
+//
+// Once the history holds more than maxBytes, the oldest keyframe is dropped
+// together with the snapshots that depend on it.
+//
+// Snapshots share ram with the bus as fork() does, so once capture() has
+// run the bus must only be accessed through read()/write(), not ram.
+class Rewind {
+   public:
+    Rewind(Bus &bus, uint32_t interval = 1, size_t maxBytes = 4 << 20,
+           uint32_t keyframeEvery = 64);
+
+    // Snapshots the machine now.
+    void capture();
+
+    // Snapshots the machine if at least interval instructions have run
+    // since the last snapshot. Cheap enough to call after every run().
+    void update() {
+        if (bus.cpu.instructions - lastCapture >= interval) {
+            capture();
+        }
+    }
+
+    // Drops the newest snapshot and puts the machine back to the one taken
+    // before it. Returns false, leaving the machine untouched, if there is
+    // nothing older to go back to.
+    bool stepBack();
+
+    size_t size() const {
+        return snapshots.size();
+    }
+
+    size_t bytes() const {
+        return totalBytes;
+    }
+
+    void clear();
+
+   private:
+    struct Snapshot {
+        CPUState cpu;
+        uint64_t cycles;  // Bus::now()
+        MapperState mapper;
+        shared_ptr<const vector<uint8_t>> chrRam;  // Boards with CHR RAM
+        // Cartridge boards: the PPU's state up to the nametables, which
+        // are kept apart so they can be shared.
+        vector<uint8_t> ppu;
+        shared_ptr<const vector<uint8_t>> vram;
+        APUState apu;
+        unique_ptr<Bus::RamImage> image;           // Keyframes only
+        vector<uint8_t> delta;  // [page, length (2), data]...
+        size_t bytes = 0;
+    };
+
+    Bus &bus;
+    uint32_t interval;
+    size_t maxBytes;
+    uint32_t keyframeEvery;
+
+    deque<Snapshot> snapshots;
+    size_t totalBytes = 0;
+    uint32_t sinceKeyframe = 0;
+    uint64_t lastCapture = 0;
+
+    // The keyframe snapshot i was taken against.
+    const Bus::RamImage &keyframeOf(size_t i) const;
+
+    void encodeDelta(const Bus::RamImage &key, vector<uint8_t> &out);
+    void restore(size_t i);
+    void trim();
+};
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// A complete emulator snapshot in one fixed-layout block, so it can be
+// written out as it is and mapped straight back in. Fields are in
+// host byte order; the header rejects files from another layout version.
+//
+// Bump SAVE_STATE_VERSION whenever the layout changes.
+constexpr uint32_t SAVE_STATE_VERSION = 7;
+
+// The CPU6502 registers and internal state. fetched, addr_abs, addr_rel
+// and the micro fields belong to an instruction in flight, which only the
+// cycle core leaves; otherwise they are zero, so a state saved between
+// instructions is the same whichever core ran.
+struct CPUState {
+    uint8_t a = 0x00;
+    uint8_t x = 0x00;
+    uint8_t y = 0x00;
+    uint8_t stkp = 0x00;
+    uint8_t status = 0x00;
+    uint8_t opcode = 0x00;
+    uint8_t cycles = 0;
+    uint8_t fetched = 0x00;
+    uint16_t pc = 0x0000;
+    uint16_t addr_abs = 0x0000;
+    uint16_t addr_rel = 0x0000;
+    uint16_t microBase = 0x0000;
+    uint32_t overshoot = 0;
+    // An instruction saved part way through by the cycle core: how far
+    // into its program it is (0 for none in flight, else 1 + the entries
+    // already run), and the state that goes with it.
+    uint8_t microStep = 0;
+    uint8_t microFlags = 0;  // MICRO_CROSSED | MICRO_PREFETCHED | MICRO_IMPLIED
+    uint8_t branchExtra = 0;
+    uint8_t microCycles = 0;
+    uint64_t instructions = 0;
+
+    static constexpr uint8_t MICRO_CROSSED = 0x01;
+    static constexpr uint8_t MICRO_PREFETCHED = 0x02;
+    static constexpr uint8_t MICRO_IMPLIED = 0x04;
+};
+
+static_assert(sizeof(CPUState) == 32,
+              "CPUState layout must not contain padding");
+
+// The cartridge's board: its iNES mapper number, so a state only loads
+// back onto the same board, and its bank registers. What each register
+// byte means is up to the mapper.
+struct MapperState {
+    static constexpr uint16_t NONE = 0xFFFF;  // No cartridge
+
+    uint16_t id = NONE;
+    uint8_t padding[14] = {};
+    uint8_t regs[16] = {};
+};
+
+static_assert(sizeof(MapperState) == 32,
+              "MapperState layout must not contain padding");
+
+// CHR RAM on boards that have it instead of CHR ROM.
+constexpr size_t CHR_RAM_SIZE = 8 * 1024;
+
+// What the bus keeps outside its devices: the CPU cycles it has clocked,
+// whose parity times OAM DMA, and a DMA asked for or under way.
+struct BusState {
+    uint64_t cycles = 0;
+    uint16_t dmaCycles = 0;  // Left of a lockstep DMA
+    uint8_t dmaPending = 0;
+    uint8_t dmaPage = 0x00;
+    uint8_t padding[4] = {};
+};
+
+static_assert(sizeof(BusState) == 16,
+              "BusState layout must not contain padding");
+
+// The PPU2C02 registers, its position in the frame, the sprites fetched
+// for the next line and its memories. vram holds four nametables, of
+// which most boards use two.
+struct PPUState {
+    uint8_t ctrl = 0x00;
+    uint8_t mask = 0x00;
+    uint8_t status = 0x00;
+    uint8_t oamAddr = 0x00;
+    uint8_t fineX = 0;
+    uint8_t latch = 0;       // Second write of $2005/$2006
+    uint8_t readBuffer = 0x00;
+    uint8_t openBus = 0x00;
+    uint16_t v = 0x0000;
+    uint16_t t = 0x0000;
+    uint16_t scanline = 0;
+    uint16_t dot = 0;
+    uint16_t hitDot = 0;     // Sprite-0 hit still to come on this line, or 0
+    uint8_t oddFrame = 0;
+    uint8_t nmi = 0;
+    uint8_t spriteCount = 0;
+    uint8_t padding[11] = {};
+    uint64_t frames = 0;
+    uint8_t sprites[32] = {};  // Pattern low, high, attributes and x of each
+    uint8_t palette[32] = {};
+    uint8_t oam[256] = {};
+    uint8_t vram[4096] = {};
+};
+
+static_assert(sizeof(PPUState) == 40 + 32 + 32 + 256 + 4096,
+              "PPUState layout must not contain padding");
+
+// The APU2A03 channels, frame counter and interrupt flags, in the form the
+// APU keeps them. Timers count CPU cycles to the channel's next step.
+struct APUState {
+    // Envelope and sweep flags.
+    static constexpr uint8_t START = 0x01;   // Envelope restarts
+    static constexpr uint8_t RELOAD = 0x02;  // Sweep or linear counter
+    // DMC flags.
+    static constexpr uint8_t BUFFERED = 0x01;  // Sample buffer full
+    static constexpr uint8_t SILENT = 0x02;    // Output unit has no byte
+    // Interrupt flags, where $4015 reads them.
+    static constexpr uint8_t FRAME_IRQ = 0x40;
+    static constexpr uint8_t DMC_IRQ = 0x80;
+
+    struct Pulse {
+        uint16_t period = 0;     // $4002/$4003
+        uint16_t timer = 2;
+        uint8_t control = 0x00;  // $4000: duty, halt, constant, volume
+        uint8_t sweep = 0x00;    // $4001
+        uint8_t step = 0;        // Position in the duty cycle, 0-7
+        uint8_t length = 0;
+        uint8_t decay = 0;       // Envelope volume
+        uint8_t divider = 0;     // Envelope divider
+        uint8_t sweepDivider = 0;
+        uint8_t flags = 0;
+    };
+
+    struct Triangle {
+        uint16_t period = 0;     // $400A/$400B
+        uint16_t timer = 1;
+        uint8_t control = 0x00;  // $4008
+        uint8_t step = 0;        // 0-31
+        uint8_t length = 0;
+        uint8_t linear = 0;
+        uint8_t flags = 0;
+        uint8_t padding[3] = {};
+    };
+
+    struct Noise {
+        uint16_t shift = 0x0001;  // 15-bit LFSR
+        uint16_t timer = 4;
+        uint8_t control = 0x00;  // $400C
+        uint8_t mode = 0x00;     // $400E
+        uint8_t length = 0;
+        uint8_t decay = 0;
+        uint8_t divider = 0;
+        uint8_t flags = 0;
+        uint8_t padding[2] = {};
+    };
+
+    struct Dmc {
+        uint16_t timer = 428;
+        uint16_t address = 0xC000;  // Sample start, $4012
+        uint16_t length = 1;        // Sample bytes, $4013
+        uint16_t current = 0xC000;  // Next byte to fetch
+        uint16_t remaining = 0;     // Bytes left to fetch
+        uint8_t control = 0x00;     // $4010
+        uint8_t level = 0;          // Output, $4011
+        uint8_t buffer = 0x00;
+        uint8_t shift = 0x00;
+        uint8_t bits = 8;  // Left in the output unit's byte
+        uint8_t flags = SILENT;
+    };
+
+    Pulse pulse[2];
+    Triangle triangle;
+    Noise noise;
+    Dmc dmc;
+    uint16_t frameCycle = 0;      // CPU cycles into the frame sequence
+    uint8_t frameControl = 0x00;  // $4017
+    uint8_t enabled = 0x00;       // $4015 writes
+    uint8_t irqFlags = 0x00;
+    uint8_t padding[3] = {};
+};
+
+static_assert(sizeof(APUState) == 2 * 12 + 12 + 12 + 16 + 8,
+              "APUState layout must not contain padding");
+
+struct SaveState {
+    // Header
+    char magic[4] = {'N', 'E', 'S', 'S'};
+    uint32_t version = SAVE_STATE_VERSION;
+    uint32_t size = sizeof(SaveState);  // As a layout check
+    uint32_t reserved = 0;
+
+    CPUState cpu;
+    MapperState mapper;
+    BusState bus;
+    PPUState ppu;
+    APUState apu;
+
+    // Bus
+    uint8_t ram[64 * 1024];
+
+    // Cartridge; all zero without CHR RAM
+    uint8_t chrRam[CHR_RAM_SIZE];
+
+    // True when the header matches this build's layout.
+    bool valid() const;
+};
+
+static_assert(sizeof(SaveState) == 16 + 32 + 32 + sizeof(BusState) +
+                                       sizeof(PPUState) + sizeof(APUState) +
+                                       64 * 1024 + CHR_RAM_SIZE,
+              "SaveState layout must not contain padding");
+
+// Writes s to path as one block, through writeAll(), which keeps calling
+// write() after a short one. False if any of it could not be written.
+bool writeSaveState(const string &path, const SaveState &s);
+
+// A save state file mapped read-only. state() points into the mapping, so
+// inspection tools can read it without copying, and Bus::loadState()
+// restores from it with a memcpy. state() is null if the file could not be
+// mapped or its header does not match.
+class MappedSaveState {
+   public:
+    explicit MappedSaveState(const string &path);
+    ~MappedSaveState();
+
+    MappedSaveState(const MappedSaveState &) = delete;
+    MappedSaveState &operator=(const MappedSaveState &) = delete;
+
+    const SaveState *state() const {
+        return mapped;
+    }
+
+   private:
+    const SaveState *mapped = nullptr;
+    size_t length = 0;
+};
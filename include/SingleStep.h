@@ -0,0 +1,21 @@
+#pragma once
+
+// Differential tester against the single-step test vectors published for
+// the NES 6502 (SingleStepTests/65x02, nes6502/v1: one JSON file per
+// opcode, 10,000 cases each):
+//
+//     nes --single-step <file or directory>... [--threads N] [--diffs N]
+//
+// Every case gives the registers and the ram bytes an instruction touches
+// before and after it runs, and the bus access it makes on each cycle.
+// Each one is run for exactly one step() on a Bus whose whole address space
+// is a recording device, and the registers, ram and cycle count are
+// compared with the final state. With ACCURACY=cycle the accesses are
+// compared cycle by cycle too; the other cores only promise the count.
+//
+// Files are parsed as they are read, one case at a time, never loaded
+// whole, and spread over a thread pool with one Bus per worker. The first
+// N mismatches of every file (3 by default) are printed with the fields
+// that differ, followed by a pass count per failing file and a total. The
+// exit status is 1 if any case failed.
+int runSingleStep(int argc, char **argv);
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// A fixed set of worker threads with one work queue each. run() deals the
+// items out in contiguous blocks; a worker takes from the back of its own
+// queue and, once that is empty, steals from the front of the others.
+//
+// Items are indices, and every task also receives the index of the worker
+// running it, so callers can keep one preallocated instance of their state
+// per worker and never share mutable state between threads.
+class ThreadPool {
+   public:
+    // nThreads == 0 sizes the pool to the machine.
+    explicit ThreadPool(size_t nThreads = 0);
+    ~ThreadPool();
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    // Runs task(item, worker) for every item in [0, count) and returns once
+    // all of them have finished.
+    void run(size_t count, const function<void(size_t, size_t)> &task);
+
+   private:
+    struct alignas(64) Queue {
+        mutex lock;
+        deque<size_t> items;
+    };
+
+    vector<thread> workers;
+    vector<unique_ptr<Queue>> queues;
+
+    mutex m;
+    condition_variable wake;
+    condition_variable done;
+    const function<void(size_t, size_t)> *task = nullptr;
+    atomic<size_t> pending{0};
+    uint64_t generation = 0;
+    bool stop = false;
+
+    void workerLoop(size_t id);
+    bool next(size_t id, size_t &item);
+};
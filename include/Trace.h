@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Drain.h"
+
+using namespace std;
+
+// One executed instruction as the CPU found it: the state before it ran and
+// the cycles elapsed since tracing started. Written to trace files as is,
+// in host byte order.
+struct TraceRecord {
+    uint64_t cycle : 48;
+    uint64_t pc : 16;
+    uint8_t opcode, lo, hi;  // Instruction bytes; lo/hi as found past pc
+    uint8_t a, x, y, p, sp;
+};
+static_assert(sizeof(TraceRecord) == 16, "trace records are 16 bytes");
+
+// Execution trace, recorded with TRACE=1 (NES_TRACE) by a CPU whose trace
+// points here. Without it the CPU has no trace member and nothing is
+// recorded.
+//
+// The CPU pushes a record for every instruction into a single-producer,
+// single-consumer ring. A Drain thread drains the ring into the file in
+// large sequential writes, so the emulation thread makes no system calls.
+// Records are published to the writer in batches to keep the two threads
+// off each other's cache lines. When the disk falls behind and the ring
+// fills up, push() either waits for space or, with dropWhenFull, drops the
+// record and counts it.
+//
+// Translated code is not traced; turn CPU6502::jitEnabled off while tracing
+// in a JIT=1 build.
+//
+// A trace file is a 16-byte header ("NES6502T", format version and record
+// size, both uint32) followed by the records. traceToText() turns one into
+// nestest-style text.
+class Trace {
+   public:
+    explicit Trace(size_t capacity = 1 << 20, bool dropWhenFull = false);
+    ~Trace();
+
+    Trace(const Trace &) = delete;
+    Trace &operator=(const Trace &) = delete;
+
+    // Creates path, writes the header and starts the writer. Returns false
+    // if the file cannot be created.
+    bool open(const string &path);
+
+    // Hands every record pushed so far to the writer, waits for it to
+    // write them all and closes the file. Returns false if a write failed.
+    bool close();
+
+    void push(const TraceRecord &r) {
+        if (head - tailCache == ring.size() && !makeRoom()) {
+            return;
+        }
+        ring[head & mask] = r;
+        head++;
+        if ((head & (BATCH - 1)) == 0) {
+            published.store(head, memory_order_release);
+        }
+    }
+
+    // Cycles since tracing started. The CPU adds every instruction's and
+    // interrupt's cycles; push() does not.
+    uint64_t cycle = 0;
+
+    uint64_t recorded() const {
+        return head;
+    }
+    uint64_t dropped() const {
+        return lost;
+    }
+
+   private:
+    static constexpr uint64_t BATCH = 4096;  // Records published at once
+
+    vector<TraceRecord> ring;
+    uint64_t mask = 0;
+    bool dropWhenFull = false;
+
+    // Producer side.
+    uint64_t head = 0;       // Records pushed
+    uint64_t tailCache = 0;  // Last tail seen
+    uint64_t lost = 0;
+
+    // Shared, each on its own line.
+    alignas(64) atomic<uint64_t> published{0};
+    alignas(64) atomic<uint64_t> tail{0};  // Records written to the file
+
+    int fd = -1;
+    uint64_t done = 0;  // Writer side: records taken from the ring
+    Drain writer;
+
+    // Slow path of push() on a full ring. False if the record is dropped.
+    bool makeRoom();
+};
+
+// The file's records as text, one line per instruction in the layout of
+// nestest.log, e.g.
+//
+//     C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD CYC:7
+//
+// Returns false if in is not a trace file or cannot be read.
+bool traceToText(const string &in, const string &out);
+
+// nes --trace-text <trace> [<output>]: traceToText() to the output file, or
+// to stdout.
+int runTraceText(int argc, char **argv);
@@ -0,0 +1,1109 @@
+#include "APU2A03.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "Audio.h"
+#include "Bus.h"
+
+using namespace std;
+
+namespace {
+
+const double CPU_HZ = 21477272.0 / 12;  // NTSC
+
+// Samples per CPU cycle, 32.32 fixed point.
+const uint64_t STEP =
+    (uint64_t)llround(APU2A03::SAMPLE_RATE / CPU_HZ * 4294967296.0);
+
+const uint8_t LENGTHS[32] = {10, 254, 20,  2,  40, 4,  80, 6,  160, 8,  60,
+                             10, 14,  12,  26, 14, 12, 16, 24, 18,  48, 20,
+                             96, 22,  192, 24, 72, 26, 16, 28, 32,  30};
+
+// The four duty cycles, bit n the output on step n.
+const uint8_t DUTY[4] = {0x02, 0x06, 0x1E, 0xF9};
+
+const uint8_t TRIANGLE[32] = {15, 14, 13, 12, 11, 10, 9,  8,  7,  6,  5,
+                              4,  3,  2,  1,  0,  0,  1,  2,  3,  4,  5,
+                              6,  7,  8,  9,  10, 11, 12, 13, 14, 15};
+
+const uint16_t NOISE_PERIODS[16] = {4,   8,   16,  32,  64,  96,   128,  160,
+                                    202, 254, 380, 508, 762, 1016, 2034, 4068};
+
+const uint16_t DMC_RATES[16] = {428, 380, 340, 320, 286, 254, 226, 214,
+                                190, 160, 142, 128, 106, 84,  72,  54};
+
+// How the noise's steps fall against the samples at each period faster
+// than the output, worked out once rather than on every catch-up: the
+// stride between steps in samples, 32.32; 2^56 over it, for dividing by it
+// (the strides are over 2^28, so this times a fraction still fits); and the
+// most whole strides in a sample, and how far they reach.
+struct NoiseRate {
+    uint64_t stride;
+    uint64_t per;
+    uint32_t fit;
+    uint64_t reach;
+};
+
+const struct NoiseRates {
+    NoiseRate r[16];
+    const NoiseRate &operator[](uint32_t i) const {
+        return r[i];
+    }
+} NOISE_RATES = [] {
+    NoiseRates rates = {};
+    for (int i = 0; i < 16; i++) {
+        uint64_t stride = NOISE_PERIODS[i] * STEP;
+        if (stride < (uint64_t)1 << 32) {
+            NoiseRate &r = rates.r[i];
+            r.stride = stride;
+            r.per = ((uint64_t)1 << 56) / stride;
+            r.fit = 0xFFFFFFFF / stride;
+            r.reach = r.fit * stride;
+        }
+    }
+    return rates;
+}();
+
+// Frame counter steps in CPU cycles from the start of the sequence. The
+// last is where the sequence starts over.
+const uint16_t FOUR_STEP[] = {7457, 14913, 22371, 29829, 29830};
+const uint16_t FIVE_STEP[] = {7457, 14913, 22371, 29829, 37281, 37282};
+
+// Output: the buffer holds BUFFER samples past the ones being finished,
+// which are handed on once BATCH of them are. LEAK is the high-pass in
+// Finisher::run().
+const size_t BUFFER = 4096;
+const size_t BATCH = 1024;
+const float GAIN = 30000.0f;
+const float LEAK = 0.996f;
+
+// The band-limited step, differentiated: for each phase, a windowed sinc
+// impulse shifted by phase / PHASES of a sample. Each phase sums to 1, so
+// once the deltas are added up the output steps by exactly the delta.
+const int TAPS = 16;
+const int PHASE_BITS = 5;
+const int PHASES = 1 << PHASE_BITS;
+const int CENTER = TAPS / 2 - 1;  // The tap a step at phase 0 is centred on
+
+struct Kernel {
+    alignas(16) float taps[PHASES][TAPS];
+};
+
+const Kernel KERNEL = [] {
+    Kernel k;
+    // Cut off at 90% of the output's Nyquist frequency, and a Blackman
+    // window over the taps.
+    const double cutoff = 0.9;
+    for (int p = 0; p < PHASES; p++) {
+        double taps[TAPS], sum = 0.0;
+        for (int j = 0; j < TAPS; j++) {
+            double x = j - CENTER - (double)p / PHASES;
+            double sinc =
+                x == 0.0 ? cutoff : sin(M_PI * cutoff * x) / (M_PI * x);
+            double w = 0.42 + 0.5 * cos(M_PI * x / (TAPS / 2)) +
+                       0.08 * cos(2 * M_PI * x / (TAPS / 2));
+            taps[j] = sinc * w;
+            sum += taps[j];
+        }
+        for (int j = 0; j < TAPS; j++) {
+            k.taps[p][j] = (float)(taps[j] / sum);
+        }
+    }
+    return k;
+}();
+
+// The nonlinear mixer, looked up by the sum of the pulse outputs and by
+// 3 * triangle + 2 * noise + DMC.
+struct Mixer {
+    float pulse[31];
+    float tnd[203];
+};
+
+const Mixer MIXER = [] {
+    Mixer m;
+    m.pulse[0] = m.tnd[0] = 0.0f;
+    for (int i = 1; i < 31; i++) {
+        m.pulse[i] = (float)(95.52 / (8128.0 / i + 100.0));
+    }
+    for (int i = 1; i < 203; i++) {
+        m.tnd[i] = (float)(163.67 / (24329.0 / i + 100.0));
+    }
+    return m;
+}();
+
+// Runs a timer that reloads with period for n cycles and returns how many
+// times it ran out. timer is the cycles left until it next does.
+uint32_t tick(uint16_t &timer, uint32_t period, uint32_t n) {
+    if (n < timer) {
+        timer -= n;
+        return 0;
+    }
+    n -= timer;
+    if (n < period) {
+        // synthesize() stops on every timer that can be heard, so this is
+        // the usual case, and it needs no division.
+        timer = period - n;
+        return 1;
+    }
+    timer = period - n % period;
+    return 1 + n / period;
+}
+
+// tick() for a timer with at least n cycles left, so it runs out once at
+// most. synthesize() stops on each heard channel's timer, and which one
+// runs out next is too irregular for branches to predict, so this picks
+// with selects.
+uint32_t tickOnce(uint16_t &timer, uint16_t period, uint32_t n) {
+    uint32_t out = timer == n;
+    timer = out ? period : timer - n;
+    return out;
+}
+
+// The noise channel's shift register moved on a step, tapping bit 6 rather
+// than bit 1 in short mode.
+uint16_t noiseStep(uint16_t shift, bool short_) {
+    uint16_t feedback = (shift ^ (shift >> (short_ ? 6 : 1))) & 1;
+    return (shift >> 1) | (feedback << 14);
+}
+
+// A step is linear over GF(2), so any number of them is a 15x15 bit
+// matrix. Jumps holds those for powers of two, each as the images of the
+// 16 values of each nibble, so a silent noise channel with a short period
+// does not have to be stepped thousands of times a frame.
+struct Jumps {
+    uint16_t nibbles[2][15][4][16];  // [short mode][log2 of the steps]
+};
+
+uint16_t applyJump(const uint16_t (&t)[4][16], uint16_t shift) {
+    return t[0][shift & 0x0F] ^ t[1][(shift >> 4) & 0x0F] ^
+           t[2][(shift >> 8) & 0x0F] ^ t[3][shift >> 12];
+}
+
+const Jumps JUMPS = [] {
+    Jumps j;
+    for (int m = 0; m < 2; m++) {
+        for (int k = 0; k < 4; k++) {
+            for (int v = 0; v < 16; v++) {
+                j.nibbles[m][0][k][v] = noiseStep(v << (4 * k), m);
+            }
+        }
+        for (int p = 1; p < 15; p++) {
+            const uint16_t(&half)[4][16] = j.nibbles[m][p - 1];
+            for (int k = 0; k < 4; k++) {
+                for (int v = 0; v < 16; v++) {
+                    j.nibbles[m][p][k][v] =
+                        applyJump(half, applyJump(half, v << (4 * k)));
+                }
+            }
+        }
+    }
+    return j;
+}();
+
+// The shift register moved on by any number of steps.
+uint16_t noiseSteps(uint16_t shift, bool short_, uint32_t steps) {
+    if (steps < 16) {
+        for (; steps > 0; steps--) {
+            shift = noiseStep(shift, short_);
+        }
+        return shift;
+    }
+    // Every state comes back to itself after 32767 steps, or after 93 in
+    // short mode.
+    steps %= short_ ? 93 : 32767;
+    for (int p = 0; steps > 0; p++, steps >>= 1) {
+        if (steps & 1) {
+            shift = applyJump(JUMPS.nibbles[short_][p], shift);
+        }
+    }
+    return shift;
+}
+
+// The bits set in each 9-bit value.
+const struct Ones {
+    uint8_t n[512];
+    uint8_t operator[](uint32_t i) const {
+        return n[i];
+    }
+} ONES = [] {
+    Ones o;
+    o.n[0] = 0;
+    for (int i = 1; i < 512; i++) {
+        o.n[i] = o.n[i >> 1] + (i & 1);
+    }
+    return o;
+}();
+
+// Envelope generator of the pulse and noise channels.
+void clockEnvelope(uint8_t control, uint8_t &decay, uint8_t &divider,
+                   uint8_t &flags) {
+    if (flags & APUState::START) {
+        flags &= ~APUState::START;
+        decay = 15;
+        divider = control & 0x0F;
+    } else if (divider == 0) {
+        divider = control & 0x0F;
+        if (decay > 0) {
+            decay--;
+        } else if (control & 0x20) {
+            decay = 15;
+        }
+    } else {
+        divider--;
+    }
+}
+
+uint8_t volume(uint8_t control, uint8_t decay) {
+    return (control & 0x10) ? control & 0x0F : decay;
+}
+
+int16_t toPcm(float v) {
+    return (int16_t)max(-32768.0f, min(32767.0f, nearbyintf(v * GAIN)));
+}
+
+}  // namespace
+
+APU2A03::APU2A03() {
+    step = STEP;
+    reset();
+}
+
+void APU2A03::connect(Bus *b) {
+    bus = b;
+}
+
+void APU2A03::reset() {
+    pulse[0] = pulse[1] = APUState::Pulse();
+    triangle = APUState::Triangle();
+    noise = APUState::Noise();
+    dmc = APUState::Dmc();
+    frameCycle = 0;
+    frameControl = enabled = irqFlags = 0x00;
+}
+
+uint8_t APU2A03::cpuRead(uint16_t addr, bool bReadOnly) {
+    if (addr != 0x4015) {
+        return 0x00;
+    }
+    // Channel length counters and DMC bytes left, and the interrupts.
+    uint8_t data = (pulse[0].length ? 0x01 : 0) | (pulse[1].length ? 0x02 : 0) |
+                   (triangle.length ? 0x04 : 0) | (noise.length ? 0x08 : 0) |
+                   (dmc.remaining ? 0x10 : 0) | irqFlags;
+    if (!bReadOnly) {
+        irqFlags &= ~APUState::FRAME_IRQ;
+    }
+    return data;
+}
+
+void APU2A03::cpuWrite(uint16_t addr, uint8_t data) {
+    switch (addr) {
+        case 0x4000: case 0x4001: case 0x4002: case 0x4003:
+        case 0x4004: case 0x4005: case 0x4006: case 0x4007:
+            pulseWrite((addr >> 2) & 1, addr & 0x03, data);
+            break;
+        case 0x4008:
+            triangle.control = data;
+            break;
+        case 0x400A:
+            triangle.period = (triangle.period & 0x0700) | data;
+            break;
+        case 0x400B:
+            triangle.period = (triangle.period & 0x00FF) | ((data & 0x07) << 8);
+            if (enabled & 0x04) {
+                triangle.length = LENGTHS[data >> 3];
+            }
+            triangle.flags |= APUState::RELOAD;
+            break;
+        case 0x400C:
+            noise.control = data & 0x3F;
+            break;
+        case 0x400E:
+            noise.mode = data & 0x8F;
+            break;
+        case 0x400F:
+            if (enabled & 0x08) {
+                noise.length = LENGTHS[data >> 3];
+            }
+            noise.flags |= APUState::START;
+            break;
+        case 0x4010:
+            dmc.control = data & 0xCF;
+            if (!(data & 0x80)) {
+                irqFlags &= ~APUState::DMC_IRQ;
+            }
+            break;
+        case 0x4011:
+            dmc.level = data & 0x7F;
+            break;
+        case 0x4012:
+            dmc.address = 0xC000 | (data << 6);
+            break;
+        case 0x4013:
+            dmc.length = (data << 4) + 1;
+            break;
+        case 0x4015:
+            enabled = data & 0x1F;
+            if (!(data & 0x01)) pulse[0].length = 0;
+            if (!(data & 0x02)) pulse[1].length = 0;
+            if (!(data & 0x04)) triangle.length = 0;
+            if (!(data & 0x08)) noise.length = 0;
+            irqFlags &= ~APUState::DMC_IRQ;
+            if (!(data & 0x10)) {
+                dmc.remaining = 0;
+            } else if (dmc.remaining == 0) {
+                dmcStart();
+                dmcFetch();
+            }
+            break;
+        case 0x4017:
+            frameControl = data & 0xC0;
+            frameCycle = 0;
+            if (data & 0x40) {
+                irqFlags &= ~APUState::FRAME_IRQ;
+            }
+            if (data & 0x80) {
+                quarterFrame();
+                halfFrame();
+            }
+            break;
+    }
+
+    // Volume, length and level writes are heard at once.
+    settle();
+}
+
+void APU2A03::pulseWrite(int i, int reg, uint8_t data) {
+    APUState::Pulse &p = pulse[i];
+    switch (reg) {
+        case 0:
+            p.control = data;
+            break;
+        case 1:
+            p.sweep = data;
+            p.flags |= APUState::RELOAD;
+            break;
+        case 2:
+            p.period = (p.period & 0x0700) | data;
+            break;
+        case 3:
+            p.period = (p.period & 0x00FF) | ((data & 0x07) << 8);
+            if (enabled & (1 << i)) {
+                p.length = LENGTHS[data >> 3];
+            }
+            p.step = 0;
+            p.flags |= APUState::START;
+            break;
+    }
+}
+
+void APU2A03::run(uint64_t n) {
+    while (n > 0) {
+        if (output && (time >> 32) >= BATCH) {
+            // Whole blocks only, so how finish() splits the samples up
+            // does not depend on how run() is called.
+            finish((time >> 32) & ~(size_t)7);
+        }
+        uint16_t next = frameStep();
+        uint32_t k = (uint32_t)min<uint64_t>(n, next - frameCycle);
+        if (output) {
+            synthesize(k);
+        } else {
+            advance(k);
+        }
+        frameCycle += k;
+        n -= k;
+
+        if (frameCycle == next) {
+            bool five = frameControl & 0x80;
+            switch (frameCycle) {
+                case 7457: case 22371:
+                    quarterFrame();
+                    break;
+                case 14913: case 37281:
+                    quarterFrame();
+                    halfFrame();
+                    break;
+                case 29829:
+                    if (!five) {
+                        quarterFrame();
+                        halfFrame();
+                        if (!(frameControl & 0x40)) {
+                            irqFlags |= APUState::FRAME_IRQ;
+                        }
+                    }
+                    break;
+            }
+            if (frameCycle == (five ? 37282 : 29830)) {
+                frameCycle = 0;
+            }
+            settle();
+        }
+    }
+}
+
+uint16_t APU2A03::frameStep() const {
+    const uint16_t *steps = (frameControl & 0x80) ? FIVE_STEP : FOUR_STEP;
+    while (*steps <= frameCycle) {
+        steps++;
+    }
+    return *steps;
+}
+
+uint32_t APU2A03::untilIrq() const {
+    if (irqFlags) {
+        return 0;
+    }
+    uint32_t next = NEVER;
+    if (!(frameControl & 0xC0)) {
+        next = frameCycle < 29829 ? 29829 - frameCycle
+                                  : 29830 - frameCycle + 29829;
+    }
+    // The last byte is fetched when the output unit starts on the one
+    // before it, and one starts every 8 timer periods.
+    if ((dmc.control & 0xC0) == 0x80 && dmc.remaining > 0) {
+        uint32_t rate = DMC_RATES[dmc.control & 0x0F];
+        uint32_t last = dmc.timer + (dmc.bits - 1) * rate +
+                        (dmc.remaining - 1) * 8 * rate;
+        next = min(next, last);
+    }
+    return next;
+}
+
+void APU2A03::quarterFrame() {
+    for (APUState::Pulse &p : pulse) {
+        clockEnvelope(p.control, p.decay, p.divider, p.flags);
+    }
+    clockEnvelope(noise.control, noise.decay, noise.divider, noise.flags);
+
+    if (triangle.flags & APUState::RELOAD) {
+        triangle.linear = triangle.control & 0x7F;
+    } else if (triangle.linear > 0) {
+        triangle.linear--;
+    }
+    if (!(triangle.control & 0x80)) {
+        triangle.flags &= ~APUState::RELOAD;
+    }
+}
+
+void APU2A03::halfFrame() {
+    for (int i = 0; i < 2; i++) {
+        APUState::Pulse &p = pulse[i];
+        if (p.length > 0 && !(p.control & 0x20)) {
+            p.length--;
+        }
+        if (p.sweepDivider == 0 && (p.sweep & 0x80) && (p.sweep & 0x07) &&
+            !pulseMuted(i)) {
+            p.period = sweepTarget(i);
+        }
+        if (p.sweepDivider == 0 || (p.flags & APUState::RELOAD)) {
+            p.sweepDivider = (p.sweep >> 4) & 0x07;
+            p.flags &= ~APUState::RELOAD;
+        } else {
+            p.sweepDivider--;
+        }
+    }
+    if (triangle.length > 0 && !(triangle.control & 0x80)) {
+        triangle.length--;
+    }
+    if (noise.length > 0 && !(noise.control & 0x20)) {
+        noise.length--;
+    }
+}
+
+// Pulse 1 negates in ones' complement, pulse 2 in two's.
+uint16_t APU2A03::sweepTarget(int i) const {
+    const APUState::Pulse &p = pulse[i];
+    int change = p.period >> (p.sweep & 0x07);
+    if (p.sweep & 0x08) {
+        return (uint16_t)max(0, p.period - change - (i == 0 ? 1 : 0));
+    }
+    return p.period + change;
+}
+
+// The sweep unit silences periods that are too short or would overflow,
+// whether or not it is sweeping.
+bool APU2A03::pulseMuted(int i) const {
+    return pulse[i].period < 8 ||
+           (!(pulse[i].sweep & 0x08) && sweepTarget(i) > 0x07FF);
+}
+
+uint8_t APU2A03::pulseOut(int i) const {
+    const APUState::Pulse &p = pulse[i];
+    if (p.length == 0 || pulseMuted(i) ||
+        !((DUTY[p.control >> 6] >> p.step) & 1)) {
+        return 0;
+    }
+    return volume(p.control, p.decay);
+}
+
+uint8_t APU2A03::noiseOut() const {
+    if (noise.length == 0 || (noise.shift & 1)) {
+        return 0;
+    }
+    return volume(noise.control, noise.decay);
+}
+
+bool APU2A03::triangleRunning() const {
+    return triangle.length > 0 && triangle.linear > 0 && triangle.period >= 2;
+}
+
+void APU2A03::advancePulse(int i, uint32_t n) {
+    APUState::Pulse &p = pulse[i];
+    p.step = (p.step + tick(p.timer, (p.period + 1) * 2, n)) & 0x07;
+}
+
+void APU2A03::advanceTriangle(uint32_t n) {
+    uint32_t steps = tick(triangle.timer, triangle.period + 1, n);
+    if (triangleRunning()) {
+        triangle.step = (triangle.step + steps) & 0x1F;
+    }
+}
+
+void APU2A03::advanceNoise(uint32_t n) {
+    uint32_t steps = tick(noise.timer, NOISE_PERIODS[noise.mode & 0x0F], n);
+    noise.shift = noiseSteps(noise.shift, noise.mode & 0x80, steps);
+}
+
+void APU2A03::advanceDmc(uint32_t n) {
+    uint32_t steps = tick(dmc.timer, DMC_RATES[dmc.control & 0x0F], n);
+    for (; steps > 0; steps--) {
+        dmcClock();
+    }
+}
+
+void APU2A03::advance(uint32_t n) {
+    time += n * step;
+    advancePulse(0, n);
+    advancePulse(1, n);
+    advanceTriangle(n);
+    advanceNoise(n);
+    advanceDmc(n);
+}
+
+// Between frame counter steps and register writes only the timers move, so
+// which channels can be heard, and how loud, holds for all of n. Those are
+// stepped from one change in their output to the next, with their volumes
+// looked up once; the others are moved on in one go at the end. A DMC that
+// is silent but has a byte coming counts as heard, since it starts to play
+// it on its own. A change only channels faster than the output moved is
+// added to sums rather than drawn, and the noise's are counted in units.
+// The DMC's top rate is below the output's, so it is always drawn, but
+// only its steps that move the level are stopped on.
+void APU2A03::synthesize(uint32_t n) {
+    const Mixer &m = MIXER;
+    uint8_t volumes[2], duties[2];
+    bool pulseOn[2];
+    for (int i = 0; i < 2; i++) {
+        const APUState::Pulse &p = pulse[i];
+        volumes[i] = volume(p.control, p.decay);
+        pulseOn[i] = p.length > 0 && volumes[i] > 0 && !pulseMuted(i);
+        duties[i] = pulseOn[i] ? DUTY[p.control >> 6] : 0x00;
+    }
+    bool triangleOn = triangleRunning();
+    uint8_t noiseVolume =
+        noise.length > 0 ? volume(noise.control, noise.decay) : 0;
+    bool dmcOn = (dmc.flags & (APUState::SILENT | APUState::BUFFERED)) !=
+                 APUState::SILENT;
+    uint16_t pulsePeriods[2] = {(uint16_t)((pulse[0].period + 1) * 2),
+                                (uint16_t)((pulse[1].period + 1) * 2)};
+    uint16_t trianglePeriod = triangle.period + 1;
+    uint16_t noisePeriod = NOISE_PERIODS[noise.mode & 0x0F];
+    bool noiseShort = noise.mode & 0x80;
+    uint16_t dmcRate = DMC_RATES[dmc.control & 0x0F];
+
+    // Channels by bit: pulses 0 and 1, triangle, noise, DMC.
+    auto faster = [&](uint32_t period) {
+        return period * step < (uint64_t)1 << 32;
+    };
+    uint32_t fast = faster(pulsePeriods[0]) | faster(pulsePeriods[1]) << 1 |
+                    faster(trianglePeriod) << 2 | faster(noisePeriod) << 3 |
+                    faster(dmcRate) << 4;
+
+    // The heard channels' timers and steps are kept here as they run, and
+    // put back before the others are moved on.
+    uint16_t pulseTimers[2] = {pulse[0].timer, pulse[1].timer};
+    uint8_t pulseSteps[2] = {pulse[0].step, pulse[1].step};
+    uint16_t triangleTimer = triangle.timer;
+    uint8_t triangleStep = triangle.step;
+    uint16_t noiseTimer = noise.timer;
+    uint16_t shift = noise.shift;
+    uint16_t dmcTimer = dmc.timer;
+
+    auto pulses = [&] {
+        return ((duties[0] >> pulseSteps[0]) & 1) * volumes[0] +
+               ((duties[1] >> pulseSteps[1]) & 1) * volumes[1];
+    };
+    // What the noise turning on adds to the mix while the rest holds.
+    auto noiseUnit = [&](float held, uint8_t tnd) {
+        return held + m.tnd[tnd + 2 * noiseVolume] - (held + m.tnd[tnd]);
+    };
+    const NoiseRate &rate = NOISE_RATES[noise.mode & 0x0F];
+    uint32_t noiseBits = __builtin_ctz(noisePeriod);
+    uint64_t noiseStride = rate.stride;
+    uint32_t noiseFit = rate.fit;
+
+    for (uint32_t left = n; left > 0;) {
+        uint32_t k = left;
+        for (int i = 0; i < 2; i++) {
+            if (pulseOn[i]) {
+                k = min<uint32_t>(k, pulseTimers[i]);
+            }
+        }
+        if (triangleOn) {
+            k = min<uint32_t>(k, triangleTimer);
+        }
+        if (dmcOn) {
+            // Steps up to k that leave the level alone are taken now,
+            // rather than stopping on each, as nothing else hears them.
+            while (dmcTimer <= k && !dmcMoves()) {
+                dmcClock();
+                dmcTimer += dmcRate;
+            }
+            k = min<uint32_t>(k, dmcTimer);
+        }
+
+        if (noiseVolume && noiseTimer < k) {
+            // Until another channel's timer runs out only the noise moves,
+            // often many times, so its steps are drawn here with the rest
+            // of the mix held.
+            float held = m.pulse[pulses()];
+            uint8_t tnd = 3 * TRIANGLE[triangleStep] + dmc.level;
+            float off = held + m.tnd[tnd];
+            float on = held + m.tnd[tnd + 2 * noiseVolume];
+            // The steps fall at noiseTimer and then every noisePeriod short
+            // of k.
+            uint32_t ran;
+            if (fast & 0x08) {
+                // Bit 0 of the shift register after a step is the next bit
+                // up before it, so the steps within a sample are counted
+                // from the register at once. The periods faster than the
+                // output are powers of two, and put at most ten steps in a
+                // sample.
+                useUnit(noiseUnit(held, tnd));
+                uint32_t steps = ((k - 1 - noiseTimer) >> noiseBits) + 1;
+                ran = noiseTimer + ((steps - 1) << noiseBits);
+                uint64_t t = time + noiseTimer * step;
+                if ((t >> 32) != unitAt) {
+                    spendUnits();
+                    unitAt = t >> 32;
+                }
+                // The steps in the sample, from an estimate that can be one
+                // short.
+                uint32_t frac = (uint32_t)t;
+                uint32_t fit = (uint32_t)((~frac * rate.per) >> 56) + 1;
+                if (frac + fit * noiseStride <= 0xFFFFFFFF) {
+                    fit++;
+                }
+                // Each sample the steps end in is spent here as spendUnits()
+                // would, with the counts kept in locals; the last one's are
+                // left in units for whatever comes next in it.
+                int32_t u = units;
+                int64_t late = unitsLate;
+                uint32_t bits = shift;
+                // Counts the next c steps, from frac.
+                auto count = [&](uint32_t c) {
+                    // Bits 15 up of x are the bits the next steps feed in.
+                    uint32_t x;
+                    if (noiseShort) {
+                        x = bits | ((bits ^ bits >> 6) & 0x1FF) << 15;
+                        x |= ((x ^ x >> 6) >> 9 & 0xFF) << 24;
+                    } else {
+                        x = bits | ((bits ^ bits >> 1) & 0x3FFF) << 15;
+                    }
+                    bits = (x >> c) & 0x7FFF;
+                    // Bit 0 going from 1 to 0 turns the noise on. Summed
+                    // over the c steps, that leaves the first bit less the
+                    // last, and their fractions past frac, in strides, come
+                    // to the bits between less c - 1 times the last.
+                    int32_t first = x & 1;
+                    int32_t last = bits & 1;
+                    int32_t between = ONES[(x & ((1u << c) - 1)) >> 1];
+                    u += first - last;
+                    late += (int64_t)frac * (first - last) +
+                            (int64_t)noiseStride *
+                                (between - (int32_t)(c - 1) * last);
+                };
+                float *sum = &sums[CENTER + unitAt];
+                // sum[0] as it will be once the sample before has been
+                // spent, kept out of memory so that one sample's store
+                // does not hold up the next.
+                float now = sum[0];
+                const float scale = unit * 0x1p-32f;
+                while (steps > fit) {
+                    count(fit);
+                    steps -= fit;
+                    float l = scale * late;
+                    sum[0] = now + (unit * u - l);
+                    now = sum[1] + l;
+                    sum++;
+                    u = 0;
+                    late = 0;
+                    // The next sample starts less than a stride before its
+                    // first step, so it has noiseFit steps or one more.
+                    frac = (uint32_t)(frac + fit * noiseStride);
+                    fit = noiseFit + (frac + rate.reach <= 0xFFFFFFFF);
+                }
+                count(steps);
+                sum[0] = now;
+                shift = bits;
+                unitAt = sum - &sums[CENTER];
+                time = ((uint64_t)unitAt << 32) + frac +
+                       (steps - 1) * noiseStride;
+                units = u;
+                unitsLate = late;
+            } else {
+                ran = 0;
+                for (;;) {
+                    ran += noiseTimer;
+                    time += noiseTimer * step;
+                    noiseTimer = noisePeriod;
+                    shift = noiseStep(shift, noiseShort);
+                    // A zero delta changes nothing, and drawing it costs
+                    // less than guessing wrong whether the noise moved.
+                    float now = shift & 1 ? off : on;
+                    addDelta(now - level);
+                    level = now;
+                    if (ran + noisePeriod >= k) {
+                        break;
+                    }
+                }
+            }
+            noiseTimer = noisePeriod;
+            level = shift & 1 ? off : on;
+            left -= ran;
+            k -= ran;
+            for (int i = 0; i < 2; i++) {
+                if (pulseOn[i]) {
+                    pulseTimers[i] -= ran;
+                }
+            }
+            if (triangleOn) {
+                triangleTimer -= ran;
+            }
+            if (dmcOn) {
+                dmcTimer -= ran;
+            }
+        }
+        if (noiseVolume) {
+            k = min<uint32_t>(k, noiseTimer);
+        }
+
+        time += k * step;
+        left -= k;
+        uint32_t ticked = 0;
+        for (int i = 0; i < 2; i++) {
+            if (pulseOn[i]) {
+                uint32_t out = tickOnce(pulseTimers[i], pulsePeriods[i], k);
+                pulseSteps[i] = (pulseSteps[i] + out) & 0x07;
+                ticked |= out << i;
+            }
+        }
+        if (triangleOn) {
+            uint32_t out = tickOnce(triangleTimer, trianglePeriod, k);
+            triangleStep = (triangleStep + out) & 0x1F;
+            ticked |= out << 2;
+        }
+        uint32_t noiseWas = shift & 1;
+        if (noiseVolume) {
+            uint16_t next = noiseStep(shift, noiseShort);
+            uint32_t out = tickOnce(noiseTimer, noisePeriod, k);
+            shift = out ? next : shift;
+            ticked |= out << 3;
+        }
+        if (dmcOn) {
+            uint32_t out = tickOnce(dmcTimer, dmcRate, k);
+            if (out) {
+                dmcClock();
+            }
+            ticked |= out << 4;
+        }
+
+        uint8_t tnd = 3 * TRIANGLE[triangleStep] + dmc.level;
+        float held = m.pulse[pulses()];
+        float now = held + m.tnd[tnd + 2 * noiseVolume * (~shift & 1)];
+        if (ticked & ~fast) {
+            addDelta(now - level);
+            level = now;
+        } else if (now != level) {
+            if (ticked == 0x08 && (fast & 0x08)) {
+                addUnit(noiseUnit(held, tnd), noiseWas ? 1 : -1);
+            } else {
+                addFast(now - level);
+            }
+            level = now;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        pulse[i].timer = pulseTimers[i];
+        pulse[i].step = pulseSteps[i];
+        if (!pulseOn[i]) {
+            advancePulse(i, n);
+        }
+    }
+    triangle.timer = triangleTimer;
+    triangle.step = triangleStep;
+    if (!triangleOn) {
+        advanceTriangle(n);
+    }
+    noise.timer = noiseTimer;
+    noise.shift = shift;
+    if (!noiseVolume) {
+        advanceNoise(n);
+    }
+    dmc.timer = dmcTimer;
+    if (!dmcOn) {
+        advanceDmc(n);
+    }
+}
+
+bool APU2A03::dmcMoves() const {
+    if (dmc.flags & APUState::SILENT) {
+        return false;
+    }
+    return dmc.shift & 1 ? dmc.level <= 125 : dmc.level >= 2;
+}
+
+float APU2A03::mix() const {
+    const Mixer &m = MIXER;
+    return m.pulse[pulseOut(0) + pulseOut(1)] +
+           m.tnd[3 * TRIANGLE[triangle.step] + 2 * noiseOut() + dmc.level];
+}
+
+void APU2A03::dmcClock() {
+    if (!(dmc.flags & APUState::SILENT)) {
+        // Up or down by 2, unless that would leave 0-127.
+        uint8_t next = dmc.shift & 1 ? dmc.level + 2 : dmc.level - 2;
+        dmc.level = next <= 127 ? next : dmc.level;
+    }
+    dmc.shift >>= 1;
+    if (--dmc.bits == 0) {
+        dmcByte();
+    }
+}
+
+void APU2A03::dmcByte() {
+    dmc.bits = 8;
+    if (dmc.flags & APUState::BUFFERED) {
+        dmc.shift = dmc.buffer;
+        dmc.flags &= ~(APUState::BUFFERED | APUState::SILENT);
+        dmcFetch();
+    } else {
+        dmc.flags |= APUState::SILENT;
+    }
+}
+
+void APU2A03::dmcFetch() {
+    if ((dmc.flags & APUState::BUFFERED) || dmc.remaining == 0) {
+        return;
+    }
+    const Bus::Page &page = bus->pages[dmc.current >> 8];
+    dmc.buffer = page.read ? page.read[dmc.current & 0x00FF] : 0x00;
+    dmc.flags |= APUState::BUFFERED;
+    dmc.current = dmc.current == 0xFFFF ? 0x8000 : dmc.current + 1;
+    if (--dmc.remaining == 0) {
+        if (dmc.control & 0x40) {
+            dmcStart();
+        } else if (dmc.control & 0x80) {
+            irqFlags |= APUState::DMC_IRQ;
+        }
+    }
+}
+
+void APU2A03::dmcStart() {
+    dmc.current = dmc.address;
+    dmc.remaining = dmc.length;
+}
+
+void APU2A03::setOutput(AudioRing *ring) {
+    output = ring;
+    if (!ring) {
+        acc = vector<float>();
+        sums = vector<float>();
+        return;
+    }
+    acc.assign(BUFFER + TAPS, 0.0f);
+    time = 0;
+    // Start from where the output is, so there is no step at the start.
+    level = mix();
+    sums.assign(BUFFER + TAPS, 0.0f);
+    unitAt = 0;
+    units = 0;
+    unitsLate = 0;
+}
+
+void APU2A03::settle() {
+    if (output) {
+        float now = mix();
+        if (now != level) {
+            addDelta(now - level);
+            level = now;
+        }
+    }
+}
+
+// Deltas land on the TAPS samples from the one time is in.
+void APU2A03::addDelta(float delta) {
+    const float *k = KERNEL.taps[(time >> (32 - PHASE_BITS)) & (PHASES - 1)];
+    float *out = &acc[time >> 32];
+#if defined(__x86_64__)
+    const __m128 d = _mm_set1_ps(delta);
+    for (int j = 0; j < TAPS; j += 4) {
+        __m128 v = _mm_add_ps(_mm_loadu_ps(out + j),
+                              _mm_mul_ps(d, _mm_load_ps(k + j)));
+        _mm_storeu_ps(out + j, v);
+    }
+#else
+    for (int j = 0; j < TAPS; j++) {
+        out[j] += delta * k[j];
+    }
+#endif
+}
+
+void APU2A03::addFast(float delta) {
+    // Units first, so what they add does not depend on when they are
+    // spent.
+    spendUnits();
+    size_t at = CENTER + (time >> 32);
+    float late = delta * ((uint32_t)time * 0x1p-32f);
+    sums[at] += delta - late;
+    sums[at + 1] += late;
+}
+
+void APU2A03::addUnit(float size, int32_t sign) {
+    size_t sample = time >> 32;
+    if (sample != unitAt) {
+        spendUnits();
+        unitAt = sample;
+    }
+    useUnit(size);
+    units += sign;
+    unitsLate += sign * (int64_t)(uint32_t)time;
+}
+
+void APU2A03::useUnit(float size) {
+    if (size != unit) {
+        spendUnits();
+        unit = size;
+    }
+}
+
+void APU2A03::spendUnits() {
+    if (units != 0 || unitsLate != 0) {
+        float late = unit * 0x1p-32f * unitsLate;
+        sums[CENTER + unitAt] += unit * units - late;
+        sums[CENTER + unitAt + 1] += late;
+        units = 0;
+        unitsLate = 0;
+    }
+}
+
+void APU2A03::flush() {
+    if (output) {
+        finish(time >> 32);
+    }
+}
+
+void APU2A03::finish(size_t n) {
+    if (n == 0) {
+        return;
+    }
+    if (unitAt < n) {
+        spendUnits();
+    }
+    for (size_t j = 0; j < n; j++) {
+        acc[j] += sums[j];
+    }
+    output->push(acc.data(), n);
+
+    // What is left: the samples after n up to the last that time's deltas
+    // and sums reach.
+    size_t left = (time >> 32) + TAPS - n;
+    memmove(acc.data(), acc.data() + n, left * sizeof(float));
+    fill(acc.begin() + left, acc.begin() + left + n, 0.0f);
+    memmove(sums.data(), sums.data() + n, left * sizeof(float));
+    fill(sums.begin() + left, sums.begin() + left + n, 0.0f);
+    time -= (uint64_t)n << 32;
+    unitAt = max(unitAt, n) - n;
+}
+
+// Adding up the deltas gives the band-limited output, and a high-pass at
+// about 30 Hz would then take out its DC offset, as the console's output
+// stage does. The high-pass subtracts each input from the next, which
+// undoes the adding up, so the two come down to a leaky sum.
+//
+// In silence out decays toward 0 for good, and would end up in denormals,
+// which are many times slower to compute with, so it is cut to 0 below
+// 1e-20, after every block of eight.
+void APU2A03::Finisher::run(const float *in, size_t n, int16_t *pcm) {
+    size_t j = 0;
+#if defined(__x86_64__)
+    // Eight samples at a time: the sum within each four by two shifted
+    // adds, then what carries in from the sample before them.
+    const __m128 leak = _mm_set1_ps(LEAK);
+    const __m128 leak2 = _mm_set1_ps(LEAK * LEAK);
+    const __m128 carry =
+        _mm_setr_ps(LEAK, LEAK * LEAK, LEAK * LEAK * LEAK,
+                    LEAK * LEAK * LEAK * LEAK);
+    const __m128 gain = _mm_set1_ps(GAIN);
+    __m128 last = _mm_set1_ps(out);
+    auto sum4 = [&](const float *in) {
+        __m128 x = _mm_loadu_ps(in);
+        x = _mm_add_ps(x, _mm_mul_ps(leak, _mm_castsi128_ps(_mm_slli_si128(
+                                               _mm_castps_si128(x), 4))));
+        x = _mm_add_ps(x, _mm_mul_ps(leak2, _mm_castsi128_ps(_mm_slli_si128(
+                                                _mm_castps_si128(x), 8))));
+        x = _mm_add_ps(x, _mm_mul_ps(carry, last));
+        last = _mm_shuffle_ps(x, x, 0xFF);
+        return _mm_cvtps_epi32(_mm_mul_ps(x, gain));
+    };
+    for (; j + 8 <= n; j += 8) {
+        __m128i a = sum4(&in[j]);
+        __m128i b = sum4(&in[j + 4]);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(&pcm[j]),
+                         _mm_packs_epi32(a, b));
+        if (fabsf(_mm_cvtss_f32(last)) < 1e-20f) {
+            last = _mm_setzero_ps();
+        }
+    }
+    out = _mm_cvtss_f32(last);
+#endif
+    for (; j < n; j++) {
+        out = in[j] + LEAK * out;
+        pcm[j] = toPcm(out);
+        if ((j & 7) == 7 && fabsf(out) < 1e-20f) {
+            out = 0.0f;
+        }
+    }
+}
+
+void APU2A03::saveState(APUState &s) const {
+    s = APUState();
+    s.pulse[0] = pulse[0];
+    s.pulse[1] = pulse[1];
+    s.triangle = triangle;
+    s.noise = noise;
+    s.dmc = dmc;
+    s.frameCycle = frameCycle;
+    s.frameControl = frameControl;
+    s.enabled = enabled;
+    s.irqFlags = irqFlags;
+}
+
+void APU2A03::loadState(const APUState &s) {
+    pulse[0] = s.pulse[0];
+    pulse[1] = s.pulse[1];
+    triangle = s.triangle;
+    noise = s.noise;
+    dmc = s.dmc;
+    frameCycle = s.frameCycle;
+    frameControl = s.frameControl;
+    enabled = s.enabled;
+    irqFlags = s.irqFlags;
+}
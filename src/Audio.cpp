@@ -0,0 +1,135 @@
+#include "Audio.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include "WriteAll.h"
+
+using namespace std;
+
+namespace {
+
+const size_t HEADER = 44;
+
+void le16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+void le32(uint8_t *p, uint32_t v) {
+    le16(p, v & 0xFFFF);
+    le16(p + 2, v >> 16);
+}
+
+// RIFF header for 16-bit mono PCM with dataBytes of samples.
+void wavHeader(uint8_t *h, uint32_t sampleRate, uint32_t dataBytes) {
+    memcpy(h, "RIFF", 4);
+    le32(h + 4, 36 + dataBytes);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    le32(h + 16, 16);              // fmt chunk size
+    le16(h + 20, 1);               // PCM
+    le16(h + 22, 1);               // Channels
+    le32(h + 24, sampleRate);
+    le32(h + 28, sampleRate * 2);  // Bytes per second
+    le16(h + 32, 2);               // Bytes per frame
+    le16(h + 34, 16);              // Bits per sample
+    memcpy(h + 36, "data", 4);
+    le32(h + 40, dataBytes);
+}
+
+}  // namespace
+
+AudioRing::AudioRing(size_t capacity) {
+    size_t size = 1024;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    ring.resize(size);
+    mask = size - 1;
+}
+
+size_t AudioRing::push(const float *samples, size_t n) {
+    uint64_t h = head.load(memory_order_relaxed);
+    if (n > ring.size() - (h - tail.load(memory_order_acquire))) {
+        lost += n;
+        return 0;
+    }
+    size_t start = h & mask;
+    size_t first = min(n, ring.size() - start);
+    memcpy(&ring[start], samples, first * sizeof(float));
+    memcpy(&ring[0], samples + first, (n - first) * sizeof(float));
+    head.store(h + n, memory_order_release);
+    return n;
+}
+
+size_t AudioRing::pop(int16_t *out, size_t n) {
+    uint64_t t = tail.load(memory_order_relaxed);
+    uint64_t ready = head.load(memory_order_acquire) - t;
+    size_t take = (size_t)min<uint64_t>(n & ~(size_t)7, ready);
+    // The ring's size is a multiple of eight, so both parts are whole
+    // blocks unless the recording ends in the second.
+    size_t start = t & mask;
+    size_t first = min(take, ring.size() - start);
+    finisher.run(&ring[start], first, out);
+    finisher.run(&ring[0], take - first, out + first);
+    tail.store(t + take, memory_order_release);
+    return take;
+}
+
+WavWriter::WavWriter(AudioRing &ring, uint32_t sampleRate)
+    : ring(ring), sampleRate(sampleRate) {
+}
+
+WavWriter::~WavWriter() {
+    close();
+}
+
+bool WavWriter::open(const string &path) {
+    close();
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    // Sizes are filled in by close().
+    uint8_t h[HEADER];
+    wavHeader(h, sampleRate, 0);
+    if (!writeAll(fd, h, sizeof(h))) {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    chunk.resize(64 * 1024);
+    writer.start(
+        [this](bool &failed) {
+            size_t n = ring.pop(chunk.data(), chunk.size());
+            if (n > 0 && !failed &&
+                !writeAll(fd, chunk.data(), n * sizeof(int16_t))) {
+                failed = true;
+            }
+            return n;
+        },
+        [] { this_thread::sleep_for(chrono::microseconds(500)); });
+    return true;
+}
+
+bool WavWriter::close() {
+    if (fd < 0) {
+        return writer.stop();
+    }
+    bool ok = writer.stop();
+
+    // RIFF sizes are 32-bit; a longer recording keeps the largest.
+    uint32_t bytes = (uint32_t)min<uint64_t>(samples() * 2, 0xFFFFFFFFu - 36);
+    uint8_t h[HEADER];
+    wavHeader(h, sampleRate, bytes);
+    ok = ok && pwrite(fd, h, sizeof(h), 0) == (ssize_t)sizeof(h);
+    ok = ::close(fd) == 0 && ok;
+    fd = -1;
+    return ok;
+}
@@ -0,0 +1,579 @@
+#include "Batch.h"
+
+#include <sys/stat.h>
+
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Audio.h"
+#include "Bus.h"
+#include "FrameSink.h"
+#include "Hex.h"
+#include "Profile.h"
+#include "Program.h"
+#include "Rewind.h"
+#include "SaveState.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+
+using namespace std;
+
+namespace {
+
+// Cycles run between rewind updates, so snapshots come close to every N
+// instructions without the loop checking after each one.
+const uint32_t REWIND_SLICE = 4096;
+
+// Cycles run between checks for room in the frame ring with
+// --frames-lossless; well under a frame, so a slice finishes at most one.
+const uint32_t FRAME_SLICE = 4096;
+
+// Frames a job's sink can have in hand: triple buffering for the raw
+// stream, and enough for every image worker to have one and the next
+// waiting.
+const size_t VIDEO_FRAMES = 2;
+const size_t IMAGE_WORKERS = 2;
+const size_t IMAGE_FRAMES = 2 * IMAGE_WORKERS;
+
+// Command-line settings every job runs with.
+struct Options {
+    string trace;  // Path prefix, or empty
+    bool traceLossless = false;
+    string wav;  // Path prefix, or empty
+    string video;   // Path prefix, or "-" or a FIFO for the one job
+    string images;  // Path prefix, or empty
+    ImageWriter::Format imageFormat = ImageWriter::Format::PNG;
+    bool framesLossless = false;
+    uint32_t rewindEvery = 0;  // Instructions between snapshots, or 0
+    string loadState;  // Path prefix, or empty
+    string saveState;  // Path prefix, or empty
+};
+
+struct Job {
+    string name;
+    const vector<uint8_t> *image = nullptr;
+    shared_ptr<const Cartridge> cart;  // Instead of image for .nes files
+    uint16_t load = 0x0000;
+    uint64_t cycles = 0;
+    bool hasEntry = false;
+    uint16_t entry = 0x0000;
+};
+
+// Written by exactly one worker; aligned so neighbours don't share a line.
+struct alignas(64) Result {
+    uint8_t a, x, y, stkp, status;
+    uint16_t pc;
+    uint64_t cycles;
+    uint64_t instructions;
+    uint32_t checksum;
+    uint64_t frames;  // Cartridge jobs only
+    uint32_t frame;   // Checksum of the frame buffer
+    double seconds;
+    bool traceFailed;
+    uint64_t traceRecords;
+    uint64_t traceDropped;
+    size_t snapshots;  // Held in the rewind history at the end
+    size_t rewindBytes;
+    bool wavFailed;
+    uint64_t samples;  // Written to the WAV file
+    uint64_t samplesDropped;
+    bool framesFailed;
+    uint64_t framesWritten;  // Taken by the frame sink
+    uint64_t framesDropped;
+    bool loadFailed;  // Nothing was run
+    bool saveFailed;
+};
+
+// FNV-1a over the whole address space as the CPU sees it.
+uint32_t checksum(Bus &bus) {
+    uint32_t h = 2166136261u;
+    for (uint32_t addr = 0; addr <= 0xFFFF; addr++) {
+        h ^= bus.read(addr, true);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// True if --video names a stream all of the one job's frames go to as they
+// are, rather than a prefix.
+bool videoStream(const string &path) {
+    struct stat st;
+    return path == "-" ||
+           (stat(path.c_str(), &st) == 0 && S_ISFIFO(st.st_mode));
+}
+
+string statePath(const string &prefix, size_t index) {
+    return prefix + "." + to_string(index) + ".state";
+}
+
+string videoPath(const Options &opt, size_t index) {
+    if (videoStream(opt.video)) {
+        return opt.video;
+    }
+    return opt.video + "." + to_string(index) + ".rgb";
+}
+
+// Where the frames of job index go, for the report; empty if nowhere.
+string framesPath(const Options &opt, size_t index) {
+    if (!opt.video.empty()) {
+        return videoPath(opt, index);
+    }
+    if (opt.images.empty()) {
+        return "";
+    }
+    bool png = opt.imageFormat == ImageWriter::Format::PNG;
+    return opt.images + "." + to_string(index) + ".<frame>" +
+           (png ? ".png" : ".ppm");
+}
+
+// FNV-1a over the PPU's picture as it would be with no frames handed to
+// ring: the last frame handed over is where the PPU has not yet drawn over
+// it, so the checksum does not depend on where frames go.
+uint32_t frameChecksum(const PPU2C02 &ppu, const FrameRing *ring) {
+    const uint8_t *last = ring ? ring->last(ppu.frames) : nullptr;
+    int drawn = ppu.linesDrawn() * PPU2C02::WIDTH;
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < PPU2C02::WIDTH * PPU2C02::HEIGHT; i++) {
+        h ^= i >= drawn && last ? last[i] : ppu.frame()[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void runJob(Bus &bus, const Job &job, size_t index, const Options &opt,
+            Result &r) {
+    bus.clearRam();
+
+    if (job.cart) {
+        bus.insertCartridge(job.cart);
+    } else {
+        bus.ejectCartridge();
+
+        loadProgram(bus, *job.image, job.load, job.hasEntry, job.entry);
+    }
+
+    r.traceFailed = false;
+    r.traceRecords = r.traceDropped = 0;
+#if defined(NES_TRACE)
+    // Attached before reset() so its cycles are counted. Unless asked to
+    // keep every record, a full ring drops records rather than stall the
+    // CPU on the disk. The ring is only allocated when asked for.
+    unique_ptr<Trace> trace;
+    if (!opt.trace.empty()) {
+        trace = make_unique<Trace>(1 << 20, !opt.traceLossless);
+        r.traceFailed = !trace->open(opt.trace + "." + to_string(index));
+        bus.cpu.trace = r.traceFailed ? nullptr : trace.get();
+    }
+#if defined(NES_JIT)
+    bool jit = bus.cpu.jitEnabled;
+    bus.cpu.jitEnabled = jit && !bus.cpu.trace;
+#endif
+#endif
+
+    bus.cpu.reset();
+    if (job.cart && job.hasEntry) {
+        // The vector is in ROM.
+        bus.cpu.pc = job.entry;
+    }
+
+    // A saved machine takes over from the freshly reset one. The file is
+    // mapped, not read, and must come from the same board.
+    r.loadFailed = false;
+    if (!opt.loadState.empty()) {
+        MappedSaveState saved(statePath(opt.loadState, index));
+        r.loadFailed = !saved.state() || !bus.loadState(*saved.state());
+    }
+    uint64_t startInstructions = bus.cpu.instructions;
+
+    // Cartridge jobs can record what the APU plays. Samples the disk
+    // cannot keep up with are dropped rather than stall the CPU.
+    unique_ptr<AudioRing> audio;
+    unique_ptr<WavWriter> wav;
+    r.wavFailed = false;
+    r.samples = r.samplesDropped = 0;
+    if (job.cart && !opt.wav.empty()) {
+        audio = make_unique<AudioRing>();
+        wav = make_unique<WavWriter>(*audio, APU2A03::SAMPLE_RATE);
+        r.wavFailed = !wav->open(opt.wav + "." + to_string(index) + ".wav");
+        bus.apu.setOutput(r.wavFailed ? nullptr : audio.get());
+    }
+
+    // Cartridge jobs can also record every frame. The PPU hands each one
+    // over as it finishes without copying it; a frame the sink has no room
+    // for is dropped, or with --frames-lossless the job waits for the sink
+    // between slices, never inside one.
+    unique_ptr<FrameRing> frameRing;
+    unique_ptr<FrameSink> frameSink;
+    r.framesFailed = false;
+    r.framesWritten = r.framesDropped = 0;
+    const size_t frameBytes = PPU2C02::WIDTH * PPU2C02::HEIGHT;
+    if (job.cart && !opt.video.empty()) {
+        frameRing = make_unique<FrameRing>(frameBytes, VIDEO_FRAMES);
+        auto video = make_unique<RawVideoWriter>(*frameRing);
+        r.framesFailed = !video->open(videoPath(opt, index));
+        frameSink = move(video);
+    } else if (job.cart && !opt.images.empty()) {
+        frameRing = make_unique<FrameRing>(frameBytes, IMAGE_FRAMES);
+        auto images = make_unique<ImageWriter>(*frameRing, opt.imageFormat,
+                                               IMAGE_WORKERS);
+        images->open(opt.images + "." + to_string(index));
+        frameSink = move(images);
+    }
+    bus.ppu.setOutput(frameSink && !r.framesFailed ? frameRing.get()
+                                                   : nullptr);
+    bool framesWait = frameSink && !r.framesFailed && opt.framesLossless;
+
+    // A history for this job only, as a game would keep for rewinding.
+    unique_ptr<Rewind> rewind;
+    if (opt.rewindEvery) {
+        rewind = make_unique<Rewind>(bus, opt.rewindEvery);
+    }
+    uint32_t maxSlice = rewind ? REWIND_SLICE : 1u << 30;
+    if (framesWait) {
+        maxSlice = min(maxSlice, FRAME_SLICE);
+    }
+
+    auto start = chrono::steady_clock::now();
+    uint64_t remaining = r.loadFailed ? 0 : job.cycles;
+    r.cycles = 0;
+    while (remaining > 0) {
+        uint32_t slice = (uint32_t)min<uint64_t>(remaining, maxSlice);
+        if (framesWait) {
+            frameRing->waitForRoom();
+        }
+        uint32_t ran = bus.run(slice);
+        r.cycles += ran;
+        remaining -= min<uint64_t>(remaining, ran);
+        if (rewind) {
+            rewind->update();
+        }
+    }
+    r.seconds = chrono::duration<double>(chrono::steady_clock::now() - start)
+                    .count();
+
+    r.instructions = bus.cpu.instructions - startInstructions;
+    r.a = bus.cpu.a;
+    r.x = bus.cpu.x;
+    r.y = bus.cpu.y;
+    r.stkp = bus.cpu.stkp;
+    r.status = bus.cpu.status;
+    r.pc = bus.cpu.pc;
+    r.checksum = checksum(bus);
+    r.frames = job.cart ? bus.ppu.frames : 0;
+    r.frame = job.cart ? frameChecksum(bus.ppu, frameRing.get()) : 0;
+    r.snapshots = rewind ? rewind->size() : 0;
+    r.rewindBytes = rewind ? rewind->bytes() : 0;
+
+    r.saveFailed = false;
+    if (!opt.saveState.empty() && !r.loadFailed) {
+        auto state = make_unique<SaveState>();
+        bus.saveState(*state);
+        r.saveFailed =
+            !writeSaveState(statePath(opt.saveState, index), *state);
+    }
+
+    if (wav && !r.wavFailed) {
+        bus.apu.flush();
+        bus.apu.setOutput(nullptr);
+        r.wavFailed = !wav->close();
+        r.samples = wav->samples();
+        r.samplesDropped = audio->dropped();
+    }
+
+    if (frameSink && !r.framesFailed) {
+        bus.ppu.setOutput(nullptr);
+        r.framesFailed = !frameSink->close();
+        r.framesWritten = frameSink->frames();
+        r.framesDropped = frameRing->dropped();
+    }
+
+#if defined(NES_TRACE)
+    if (bus.cpu.trace) {
+        r.traceFailed = !trace->close();
+        r.traceRecords = trace->recorded();
+        r.traceDropped = trace->dropped();
+        bus.cpu.trace = nullptr;
+    }
+#if defined(NES_JIT)
+    bus.cpu.jitEnabled = jit;
+#endif
+#endif
+}
+
+bool loadManifest(const string &path, vector<Job> &jobs, ImageCache &images,
+                  map<string, shared_ptr<const Cartridge>> &carts) {
+    ifstream manifest(path);
+    if (!manifest) {
+        cerr << "batch: cannot open manifest " << path << "\n";
+        return false;
+    }
+
+    string line;
+    int lineNo = 0;
+    while (getline(manifest, line)) {
+        lineNo++;
+        stringstream ss(line);
+        string file, load, cycles, entry;
+        if (!(ss >> file) || file[0] == '#') {
+            continue;
+        }
+        ss >> load >> cycles >> entry;
+
+        Job job;
+        job.name = file;
+        bool isCart = file.size() > 4 && file.substr(file.size() - 4) == ".nes";
+        bool ok = (isCart && load == "-") || parseHex(load, job.load);
+        try {
+            job.cycles = stoull(cycles);
+        } catch (...) {
+            ok = false;
+        }
+        if (!entry.empty()) {
+            job.hasEntry = true;
+            ok = ok && parseHex(entry, job.entry);
+        }
+        if (!ok) {
+            cerr << "batch: " << path << ":" << lineNo
+                 << ": expected <binary> <load> <cycles> [<entry>]\n";
+            return false;
+        }
+
+        // Cartridges are mapped once and shared by every job that names them.
+        if (isCart) {
+            auto it = carts.find(file);
+            if (it == carts.end()) {
+                string error;
+                shared_ptr<const Cartridge> cart = Cartridge::load(file, error);
+                if (!cart) {
+                    cerr << "batch: " << error << "\n";
+                    return false;
+                }
+                if (!Bus::canInsert(*cart)) {
+                    cerr << "batch: " << file << ": mapper " << cart->mapper
+                         << " is not supported\n";
+                    return false;
+                }
+                it = carts.emplace(file, cart).first;
+            }
+            job.cart = it->second;
+            jobs.push_back(job);
+            continue;
+        }
+
+        string error;
+        job.image = images.load(file, error);
+        if (!job.image) {
+            cerr << "batch: " << error << "\n";
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+}  // namespace
+
+int runBatch(int argc, char **argv) {
+    string manifest;
+    size_t nThreads = 0;
+    bool jit = true, jitCheck = false;
+    bool lockstep = false;
+    string profile;
+    Options opt;
+    bool badArg = false;
+    for (int i = 0; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            badArg |= !parseCount(argv[++i], nThreads);
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profile = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            opt.trace = argv[++i];
+        } else if (arg == "--trace-lossless") {
+            opt.traceLossless = true;
+        } else if (arg == "--wav" && i + 1 < argc) {
+            opt.wav = argv[++i];
+        } else if (arg == "--video" && i + 1 < argc) {
+            opt.video = argv[++i];
+        } else if (arg == "--png" && i + 1 < argc) {
+            opt.images = argv[++i];
+            opt.imageFormat = ImageWriter::Format::PNG;
+        } else if (arg == "--ppm" && i + 1 < argc) {
+            opt.images = argv[++i];
+            opt.imageFormat = ImageWriter::Format::PPM;
+        } else if (arg == "--frames-lossless") {
+            opt.framesLossless = true;
+        } else if (arg == "--rewind" && i + 1 < argc) {
+            badArg |= !parseCount(argv[++i], opt.rewindEvery);
+        } else if (arg == "--load-state" && i + 1 < argc) {
+            opt.loadState = argv[++i];
+        } else if (arg == "--save-state" && i + 1 < argc) {
+            opt.saveState = argv[++i];
+        } else if (arg == "--no-jit") {
+            jit = false;
+        } else if (arg == "--jit-check") {
+            jitCheck = true;
+        } else if (arg == "--lockstep") {
+            lockstep = true;
+        } else {
+            manifest = arg;
+        }
+    }
+    if (badArg || manifest.empty() ||
+        (!opt.video.empty() && !opt.images.empty())) {
+        cerr << "usage: nes --batch <manifest> [--threads N] "
+                "[--no-jit | --jit-check] [--profile <file>] "
+                "[--trace <file> [--trace-lossless]] "
+                "[--rewind <instructions>] [--lockstep] [--wav <file>] "
+                "[--video <file> | --png <file> | --ppm <file>] "
+                "[--frames-lossless] "
+                "[--load-state <file>] [--save-state <file>]\n";
+        return 2;
+    }
+
+    vector<Job> jobs;
+    ImageCache images;
+    map<string, shared_ptr<const Cartridge>> carts;
+    if (!loadManifest(manifest, jobs, images, carts)) {
+        return 1;
+    }
+
+    if (!opt.video.empty()) {
+        size_t nCarts = 0;
+        for (const Job &job : jobs) nCarts += job.cart ? 1 : 0;
+        if (videoStream(opt.video) && nCarts != 1) {
+            cerr << "batch: --video " << opt.video
+                 << " takes exactly one cartridge job\n";
+            return 2;
+        }
+        // A reader that goes away fails the stream rather than the batch.
+        signal(SIGPIPE, SIG_IGN);
+    }
+    // With the frames on stdout the report goes to stderr.
+    ostream &out = opt.video == "-" ? cerr : cout;
+
+    ThreadPool pool(nThreads);
+
+    // One instance per worker, built up front and reused for every job the
+    // worker runs.
+    vector<unique_ptr<Bus>> buses;
+    for (size_t i = 0; i < pool.size(); i++) {
+        buses.push_back(make_unique<Bus>());
+        buses.back()->lockstep = lockstep;
+#if defined(NES_JIT)
+        buses.back()->cpu.jitEnabled = jit;
+        buses.back()->cpu.jitCrossCheck = jitCheck;
+#endif
+    }
+    vector<Result> results(jobs.size());
+
+#if !defined(NES_TRACE)
+    if (!opt.trace.empty()) {
+        cerr << "batch: built without TRACE=1, nothing traced\n";
+        opt.trace.clear();
+    }
+#endif
+
+    auto start = chrono::steady_clock::now();
+    pool.run(jobs.size(), [&](size_t job, size_t worker) {
+        runJob(*buses[worker], jobs[job], job, opt, results[job]);
+    });
+    double wall =
+        chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    uint64_t totalInstructions = 0;
+    bool failed = false;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const Result &r = results[i];
+        totalInstructions += r.instructions;
+        double ips = r.seconds > 0 ? r.instructions / r.seconds : 0;
+        out << jobs[i].name << "  PC: $" << hex(r.pc, 4) << "  A: $"
+            << hex(r.a, 2) << "  X: $" << hex(r.x, 2) << "  Y: $"
+            << hex(r.y, 2) << "  SP: $" << hex(r.stkp, 2) << "  P: $"
+            << hex(r.status, 2) << "  RAM: " << hex(r.checksum, 8)
+            << "  cycles: " << r.cycles << "  instructions: "
+            << r.instructions << "  instr/s: " << (uint64_t)ips << "\n";
+        if (jobs[i].cart) {
+            out << "  frames: " << r.frames << "  frame: " << hex(r.frame, 8)
+                << "\n";
+        }
+        if (r.traceFailed) {
+            cerr << "batch: cannot write " << opt.trace << "." << i << "\n";
+            failed = true;
+        } else if (!opt.trace.empty()) {
+            out << "  trace: " << opt.trace << "." << i << "  records: "
+                << r.traceRecords << "  dropped: " << r.traceDropped << "\n";
+        }
+        if (opt.rewindEvery) {
+            out << "  rewind: " << r.snapshots << " snapshots in "
+                << r.rewindBytes << " bytes\n";
+        }
+        if (r.wavFailed) {
+            cerr << "batch: cannot write " << opt.wav << "." << i << ".wav\n";
+            failed = true;
+        } else if (jobs[i].cart && !opt.wav.empty()) {
+            out << "  audio: " << opt.wav << "." << i << ".wav  samples: "
+                << r.samples << "  dropped: " << r.samplesDropped << "\n";
+        }
+        if (r.loadFailed) {
+            cerr << "batch: cannot load " << statePath(opt.loadState, i)
+                 << "\n";
+            failed = true;
+        }
+        if (r.saveFailed) {
+            cerr << "batch: cannot write " << statePath(opt.saveState, i)
+                 << "\n";
+            failed = true;
+        }
+        string frames = framesPath(opt, i);
+        if (r.framesFailed) {
+            cerr << "batch: cannot write " << frames << "\n";
+            failed = true;
+        } else if (jobs[i].cart && !frames.empty()) {
+            out << (opt.video.empty() ? "  images: " : "  video: ") << frames
+                << "  frames: " << r.framesWritten
+                << "  dropped: " << r.framesDropped << "\n";
+        }
+    }
+    out << jobs.size() << " instances on " << pool.size() << " threads, "
+        << totalInstructions << " instructions in " << wall << " s ("
+        << (uint64_t)(wall > 0 ? totalInstructions / wall : 0)
+        << " instr/s)\n";
+
+    if (!profile.empty()) {
+#if defined(NES_PROFILE)
+        ofstream json(profile);
+        if (!json) {
+            cerr << "batch: cannot write " << profile << "\n";
+            return 1;
+        }
+        Profile::dumpJson(json);
+        Profile::dump(out);
+#else
+        cerr << "batch: built without PROFILE=1, no profile written\n";
+#endif
+    }
+
+#if defined(NES_JIT)
+    if (jit && jitCheck) {
+        uint64_t mismatches = 0;
+        for (auto &bus : buses) mismatches += bus->cpu.jitMismatches;
+        out << mismatches << " translated blocks differed from the "
+            << "interpreter\n";
+        return mismatches || failed ? 1 : 0;
+    }
+#else
+    if (!jit || jitCheck) {
+        cerr << "batch: built without JIT=1, running the interpreter\n";
+    }
+#endif
+    return failed ? 1 : 0;
+}
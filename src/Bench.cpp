@@ -0,0 +1,394 @@
+#include "Bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Bus.h"
+
+using namespace std;
+
+namespace {
+
+using Clock = chrono::steady_clock;
+using Mode = CPU6502::AddrMode;
+
+// Where measured reads end up, so they cannot be optimized away.
+volatile uint32_t sink;
+
+struct Settings {
+    int samples = 21;
+    uint32_t sliceCycles = 400000;  // Per CPU sample
+    uint32_t accesses = 1 << 20;    // Per bus sample
+    int disassembleSamples = 7;
+    uint32_t forks = 4096;  // Per fork sample
+};
+
+struct Result {
+    string group;
+    string name;
+    double median = 0;  // Nanoseconds per operation
+    double p99 = 0;
+    double perSecond = 0;  // Operations per second at the median
+    double mhz = 0;        // Emulated MHz at the median, CPU runs only
+};
+
+// Median and 99th percentile (nearest rank) of the samples.
+void summarize(vector<double> samples, Result &r) {
+    sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    r.median = n % 2 ? samples[n / 2]
+                     : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    size_t rank = (size_t)ceil(0.99 * n);
+    r.p99 = samples[max<size_t>(rank, 1) - 1];
+    r.perSecond = r.median > 0 ? 1e9 / r.median : 0;
+}
+
+double seconds(Clock::time_point start) {
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+// A fresh machine with prog at $0400 and the operand area set up: the
+// pointer at $10 points at $0300.
+unique_ptr<Bus> machine(const vector<uint8_t> &prog) {
+    auto bus = make_unique<Bus>();
+    bus->ram.fill(0x00);
+    for (size_t i = 0; i < prog.size(); i++) bus->write(0x0400 + i, prog[i]);
+    bus->write(0x0010, 0x00);
+    bus->write(0x0011, 0x03);
+    bus->cpu.reset();
+    bus->cpu.pc = 0x0400;
+    bus->cpu.stkp = 0xFF;
+    return bus;
+}
+
+// Runs prog in slices of the settings' cycles, one sample per slice.
+Result runKernel(const string &group, const string &name,
+                 const vector<uint8_t> &prog, const Settings &s) {
+    unique_ptr<Bus> bus = machine(prog);
+    CPU6502 &cpu = bus->cpu;
+    cpu.run(s.sliceCycles);  // Warm up
+
+    vector<double> samples;
+    uint64_t cycles = 0, instructions = 0;
+    for (int i = 0; i < s.samples; i++) {
+        uint64_t before = cpu.instructions;
+        auto start = Clock::now();
+        uint32_t ran = cpu.run(s.sliceCycles);
+        double t = seconds(start);
+        uint64_t n = cpu.instructions - before;
+        samples.push_back(t * 1e9 / max<uint64_t>(n, 1));
+        cycles += ran;
+        instructions += n;
+    }
+
+    Result r;
+    r.group = group;
+    r.name = name;
+    summarize(samples, r);
+    if (instructions && r.median > 0) {
+        r.mhz = (double)cycles / instructions / r.median * 1e3;
+    }
+    return r;
+}
+
+// Control flow that would leave a straight run of copies of itself.
+bool leavesKernel(uint8_t op) {
+    string name = CPU6502::mnemonic(op);
+    return name == "???" || name == "BRK" || name == "JSR" || name == "RTS" ||
+           name == "RTI" ||
+           (name == "JMP" && CPU6502::addrMode(op) == Mode::IND);
+}
+
+// Appends op with operands aimed at the operand area. Branches and
+// JMP go to the next instruction.
+void emit(vector<uint8_t> &prog, uint8_t op) {
+    uint16_t addr = 0x0400 + prog.size();
+    uint16_t next = addr + CPU6502::length(op);
+    prog.push_back(op);
+    switch (CPU6502::addrMode(op)) {
+        case Mode::IMP:
+            break;
+        case Mode::IMM:
+            prog.push_back(0x01);
+            break;
+        case Mode::REL:
+            prog.push_back(0x00);
+            break;
+        case Mode::ZP0: case Mode::ZPX: case Mode::ZPY:
+        case Mode::IZX: case Mode::IZY:
+            prog.push_back(0x10);
+            break;
+        default:  // ABS, ABX, ABY
+            if (string(CPU6502::mnemonic(op)) == "JMP") {
+                prog.push_back(next & 0x00FF);
+                prog.push_back(next >> 8);
+            } else {
+                prog.push_back(0x00);
+                prog.push_back(0x03);
+            }
+            break;
+    }
+}
+
+// Copies of the opcodes in turn up to $0F00, then back to the start.
+vector<uint8_t> repeat(const vector<uint8_t> &ops) {
+    vector<uint8_t> prog;
+    for (size_t i = 0;; i++) {
+        uint8_t op = ops[i % ops.size()];
+        if (0x0400 + prog.size() + CPU6502::length(op) > 0x0F00) {
+            break;
+        }
+        emit(prog, op);
+    }
+    prog.insert(prog.end(), {0x4C, 0x00, 0x04});  // JMP $0400
+    return prog;
+}
+
+void benchOpcodes(const Settings &s, vector<Result> &results) {
+    vector<uint8_t> byMode[12];
+    for (int op = 0; op < 256; op++) {
+        if (leavesKernel(op)) {
+            continue;
+        }
+        Mode mode = CPU6502::addrMode(op);
+        byMode[(int)mode].push_back(op);
+
+        ostringstream name;
+        name << CPU6502::mnemonic(op) << " " << CPU6502::modeName(mode)
+             << " ($" << hex << uppercase << setw(2) << setfill('0') << op
+             << ")";
+        results.push_back(runKernel("opcode", name.str(), repeat({(uint8_t)op}),
+                                    s));
+    }
+    for (int mode = 0; mode < 12; mode++) {
+        if (!byMode[mode].empty()) {
+            results.push_back(runKernel("mode", CPU6502::modeName((Mode)mode),
+                                        repeat(byMode[mode]), s));
+        }
+    }
+}
+
+void benchKernels(const Settings &s, vector<Result> &results) {
+    const vector<pair<string, vector<uint8_t>>> kernels = {
+        // LDX #0; loop: LDA $1000,X; STA $2000,X; INX; BNE loop; JMP $0400
+        {"memcpy",
+         {0xA2, 0x00, 0xBD, 0x00, 0x10, 0x9D, 0x00, 0x20, 0xE8, 0xD0, 0xF7,
+          0x4C, 0x00, 0x04}},
+        // $10 * $11 by shift and add, into A and $12
+        {"multiply",
+         {0xA9, 0x5B, 0x85, 0x10, 0xA9, 0xA7, 0x85, 0x11, 0xA9, 0x00, 0xA2,
+          0x08, 0x46, 0x10, 0x90, 0x03, 0x18, 0x65, 0x11, 0x6A, 0x66, 0x12,
+          0xCA, 0xD0, 0xF3, 0x4C, 0x00, 0x04}},
+        // Taken and untaken branches on the low bits of a counter
+        {"branches",
+         {0xA2, 0x00, 0xE8, 0x8A, 0x29, 0x01, 0xF0, 0x01, 0xEA, 0x8A, 0x29,
+          0x02, 0xD0, 0x01, 0xEA, 0xE0, 0xC8, 0x90, 0xEF, 0x4C, 0x00, 0x04}},
+        // Two JSRs to a routine that pushes and pulls A and X
+        {"stack",
+         {0x20, 0x09, 0x04, 0x20, 0x09, 0x04, 0x4C, 0x00, 0x04, 0x48, 0x8A,
+          0x48, 0x68, 0xAA, 0x68, 0x60}},
+    };
+    for (const auto &k : kernels) {
+        results.push_back(runKernel("kernel", k.first, k.second, s));
+    }
+}
+
+void benchBus(const Settings &s, vector<Result> &results) {
+    Bus bus;
+    mt19937 rng(1);
+    vector<uint16_t> addrs(4096);
+    for (auto &a : addrs) a = rng();
+
+    vector<double> reads, writes;
+    uint32_t sum = 0;
+    for (int i = 0; i < s.samples; i++) {
+        auto start = Clock::now();
+        for (uint32_t n = 0; n < s.accesses; n += addrs.size()) {
+            for (uint16_t a : addrs) sum += bus.read(a, false);
+        }
+        reads.push_back(seconds(start) * 1e9 / s.accesses);
+
+        start = Clock::now();
+        for (uint32_t n = 0; n < s.accesses; n += addrs.size()) {
+            for (uint16_t a : addrs) bus.write(a, a & 0x00FF);
+        }
+        writes.push_back(seconds(start) * 1e9 / s.accesses);
+    }
+    sink = sum;
+
+    Result r;
+    r.group = "bus";
+    r.name = "read";
+    summarize(reads, r);
+    results.push_back(r);
+    r.name = "write";
+    summarize(writes, r);
+    results.push_back(r);
+}
+
+// Bus::fork() with the writes that follow it: the parent dirties one ram
+// page before each fork and the child one after, so each fork shares one
+// page again and the child copies one. A fork that copies more than the
+// pages written shows up here.
+void benchFork(const Settings &s, vector<Result> &results) {
+    Bus bus;
+    vector<double> samples;
+    for (int i = 0; i < s.samples; i++) {
+        auto start = Clock::now();
+        for (uint32_t n = 0; n < s.forks; n++) {
+            bus.write(0x0300, n & 0x00FF);
+            unique_ptr<Bus> child = bus.fork();
+            child->write(0x0200, n & 0x00FF);
+        }
+        samples.push_back(seconds(start) * 1e9 / s.forks);
+    }
+
+    Result r;
+    r.group = "bus";
+    r.name = "fork + write";
+    summarize(samples, r);
+    results.push_back(r);
+}
+
+void benchDisassemble(const Settings &s, vector<Result> &results) {
+    Bus bus;
+    mt19937 rng(2);
+    for (uint32_t a = 0; a <= 0xFFFF; a++) bus.write(a, rng());
+
+    vector<double> samples;
+    size_t lines = 0;
+    for (int i = 0; i < s.disassembleSamples; i++) {
+        auto start = Clock::now();
+        lines = bus.cpu.disassemble(0x0000, 0xFFFF).size();
+        samples.push_back(seconds(start) * 1e9);
+    }
+
+    Result r;
+    r.group = "disassemble";
+    r.name = "64 KiB (" + to_string(lines) + " lines)";
+    summarize(samples, r);
+    results.push_back(r);
+}
+
+string config() {
+    string core = "lookup";
+#if defined(NES_CYCLE_CORE)
+    core = "cycle";
+#elif defined(NES_SWITCH_CORE)
+    core = "switch";
+#endif
+    string flags;
+#if defined(NES_LAZY_FLAGS)
+    flags += " LAZY_FLAGS";
+#endif
+#if defined(NES_PREDECODE)
+    flags += " PREDECODE";
+#endif
+#if defined(NES_JIT)
+    flags += " JIT";
+#endif
+#if defined(NES_PROFILE)
+    flags += " PROFILE";
+#endif
+#if defined(NES_TRACE)
+    flags += " TRACE";
+#endif
+    return core + flags;
+}
+
+// A duration in ns, scaled to a readable unit.
+string duration(double ns) {
+    ostringstream out;
+    out << fixed << setprecision(2);
+    if (ns >= 1e6) {
+        out << ns / 1e6 << " ms";
+    } else if (ns >= 1e3) {
+        out << ns / 1e3 << " us";
+    } else {
+        out << ns << " ns";
+    }
+    return out.str();
+}
+
+void print(const vector<Result> &results) {
+    cout << left << setw(12) << "group" << setw(24) << "name" << right
+         << setw(12) << "median" << setw(12) << "p99" << setw(16) << "ops/s"
+         << setw(10) << "MHz" << "\n";
+    for (const Result &r : results) {
+        cout << left << setw(12) << r.group << setw(24) << r.name << right
+             << setw(12) << duration(r.median) << setw(12) << duration(r.p99)
+             << setw(16) << (uint64_t)r.perSecond;
+        if (r.mhz > 0) {
+            cout << setw(10) << fixed << setprecision(1) << r.mhz;
+        }
+        cout << "\n";
+    }
+}
+
+bool writeJson(const string &path, const vector<Result> &results) {
+    ofstream out(path);
+    if (!out) {
+        cerr << "bench: cannot write " << path << "\n";
+        return false;
+    }
+    out << setprecision(6) << "{\n  \"config\": \"" << config()
+        << "\",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        out << "    {\"group\": \"" << r.group << "\", \"name\": \"" << r.name
+            << "\", \"median_ns\": " << r.median << ", \"p99_ns\": " << r.p99
+            << ", \"per_second\": " << r.perSecond;
+        if (r.mhz > 0) {
+            out << ", \"mhz\": " << r.mhz;
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return true;
+}
+
+}  // namespace
+
+int runBench(int argc, char **argv) {
+    Settings s;
+    string json;
+    for (int i = 0; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--json" && i + 1 < argc) {
+            json = argv[++i];
+        } else if (arg == "--quick") {
+            s.samples = 7;
+            s.sliceCycles = 50000;
+            s.accesses = 1 << 16;
+            s.disassembleSamples = 3;
+            s.forks = 512;
+        } else {
+            cerr << "usage: nes --bench [--quick] [--json <file>]\n";
+            return 2;
+        }
+    }
+
+    vector<Result> results;
+    benchOpcodes(s, results);
+    benchKernels(s, results);
+    benchBus(s, results);
+    benchFork(s, results);
+    benchDisassemble(s, results);
+
+    cout << "config: " << config() << "\n";
+    print(results);
+    if (!json.empty() && !writeJson(json, results)) {
+        return 1;
+    }
+    return 0;
+}
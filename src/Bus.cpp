@@ -1,26 +1,564 @@
 #include "Bus.h"
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+
+#include "Mapper.h"
 
 Bus::Bus() {
     for (auto &i : ram) i = 0x00;
 
+    mapMemory(0x00, 256, ram.data());
+
+    cpu.ConnectBus(this);
+    apu.connect(this);
+}
+
+// The child copies the devices whole, so their memories have to stay
+// behind pointers for a fork to copy only the ram pages written.
+static_assert(sizeof(PPU2C02) <= 1024 && sizeof(APU2A03) <= 1024,
+              "fork() would copy a device's memories");
+
+// A fork starts with ram left uninitialised: every ram page is shared, so
+// nothing reads it before unshare() has filled it. It has no watchers.
+Bus::Bus(const Bus &parent, ForkTag)
+    : cpu(parent.cpu),
+      ppu(parent.ppu),
+      apu(parent.apu),
+      lockstep(parent.lockstep),
+      pages(parent.pages),
+      cycles(parent.cycles),
+      ppuCycles(parent.ppuCycles),
+      apuCycles(parent.apuCycles),
+      runUntil(parent.runUntil),
+      dmaPending(parent.dmaPending),
+      dmaPage(parent.dmaPage),
+      dmaCycles(parent.dmaCycles),
+      shared(parent.shared) {
+    for (Page &page : pages) {
+        page.watched = false;
+        // The child's pages lead to its own devices.
+        if (page.device == &parent.ppu) {
+            page.device = &ppu;
+        } else if (page.device == &parent.io) {
+            page.device = &io;
+        }
+        updatePage(page);
+    }
+    // The child gets its own board, with the same banks.
+    if (parent.board) {
+        board = parent.board->clone(*this);
+    }
+    ppu.connect(board.get());
     cpu.ConnectBus(this);
+#if defined(NES_TRACE)
+    // The trace ring has one producer, the parent.
+    cpu.trace = nullptr;
+#endif
+    // Samples and frames go only where the parent's were going.
+    apu.connect(this);
+    apu.setOutput(nullptr);
+    ppu.setOutput(nullptr);
 }
 
 Bus::~Bus() {
 }
 
-void Bus::write(uint16_t addr, uint8_t data) {
-    if (addr >= 0x0000 && addr <= 0xFFFF) {
-        ram[addr] = data;
+unique_ptr<Bus> Bus::fork() {
+    shareRam();
+    return unique_ptr<Bus>(new Bus(*this, ForkTag()));
+}
+
+Bus::RamImage Bus::shareRam() {
+    for (int n = 0; n < 256; n++) {
+        if (!shared[n]) {
+            auto block = make_shared<PageBlock>();
+            memcpy(block->data(), &ram[n * 256], 256);
+            shared[n] = move(block);
+            remapRamPage(n);
+        }
+    }
+    return shared;
+}
+
+void Bus::restoreRam(const RamImage &image) {
+    for (int n = 0; n < 256; n++) {
+        if (shared[n] != image[n]) {
+            shared[n] = image[n];
+            remapRamPage(n);
+            ramPageChanged(n);
+        }
+    }
+}
+
+void Bus::loadRamPage(uint8_t n, const uint8_t *data) {
+    if (shared[n]) {
+        shared[n].reset();
+        remapRamPage(n);
+    }
+    memcpy(&ram[n * 256], data, 256);
+    ramPageChanged(n);
+}
+
+void Bus::remapRamPage(uint8_t n) {
+    for (Page &page : pages) {
+        if (page.ramPage == n) {
+            updatePage(page);
+        }
+    }
+}
+
+void Bus::updatePage(Page &page) {
+    if (page.ramPage != NOT_RAM && shared[page.ramPage]) {
+        page.read = shared[page.ramPage]->data();
+        page.write = nullptr;
+        return;
+    }
+
+    uint8_t *mem =
+        page.ramPage != NOT_RAM ? &ram[page.ramPage * 256] : page.mem;
+    page.read = mem;
+    page.write = page.writable && !page.watched ? mem : nullptr;
+}
+
+void Bus::unshare(uint8_t n) {
+    memcpy(&ram[n * 256], shared[n]->data(), 256);
+    shared[n].reset();
+    remapRamPage(n);
+}
+
+void Bus::saveState(SaveState &s) {
+    memcpy(s.magic, "NESS", 4);
+    s.version = SAVE_STATE_VERSION;
+    s.size = sizeof(SaveState);
+    s.reserved = 0;
+    cpu.saveState(s.cpu);
+    s.bus = BusState();
+    s.bus.cycles = cycles;
+    s.bus.dmaCycles = dmaCycles;
+    s.bus.dmaPending = dmaPending;
+    s.bus.dmaPage = dmaPage;
+    ppu.saveState(s.ppu);
+    apu.saveState(s.apu);
+    s.mapper = MapperState();
+    memset(s.chrRam, 0x00, sizeof(s.chrRam));
+    if (board) {
+        board->saveState(s.mapper);
+        if (board->chrRamData()) {
+            memcpy(s.chrRam, board->chrRamData(), sizeof(s.chrRam));
+        }
+    }
+    for (int n = 0; n < 256; n++) {
+        memcpy(&s.ram[n * 256], ramPage(n), 256);
+    }
+}
+
+bool Bus::loadState(const SaveState &s) {
+    // A state only goes back onto the board it was saved from.
+    uint16_t id = board ? board->cartridge().mapper : MapperState::NONE;
+    if (!s.valid() || s.mapper.id != id) {
+        return false;
+    }
+    cpu.loadState(s.cpu);
+    setCycles(s.bus.cycles);
+    dmaCycles = s.bus.dmaCycles;
+    dmaPending = s.bus.dmaPending;
+    dmaPage = s.bus.dmaPage;
+    ppu.loadState(s.ppu);
+    apu.loadState(s.apu);
+    if (board) {
+        board->loadState(s.mapper);
+        board->loadChrRam(s.chrRam);
+    }
+    loadRam(s.ram);
+    return true;
+}
+
+void Bus::clearRam() {
+    static const uint8_t zeros[64 * 1024] = {};
+    loadRam(zeros);
+}
+
+void Bus::loadRam(const uint8_t *data) {
+    memcpy(ram.data(), data, ram.size());
+    for (int n = 0; n < 256; n++) {
+        if (shared[n]) {
+            shared[n].reset();
+            remapRamPage(n);
+        }
+    }
+    // Every ram page changed, so one pass finds all the watched ones.
+    if (!watchers.empty()) {
+        for (int p = 0; p < 256; p++) {
+            if (pages[p].ramPage != NOT_RAM && pages[p].watched) {
+                for (BusWatcher *watcher : watchers) {
+                    watcher->busPageChanged(p);
+                }
+            }
+        }
+    }
+}
+
+void Bus::mapMemory(uint8_t firstPage, uint16_t nPages, uint8_t *mem,
+                    bool writable) {
+    for (uint16_t i = 0; i < nPages; i++) {
+        Page &page = pages[(firstPage + i) & 0xFF];
+        uint8_t *p = mem + i * 256;
+        page.mem = p;
+        page.writable = writable;
+        uint16_t ramPage = NOT_RAM;
+        if (p >= ram.data() && p < ram.data() + ram.size()) {
+            ramPage = (p - ram.data()) / 256;
+        }
+        setRamPage((firstPage + i) & 0xFF, ramPage);
+        // A new mirror of a watched ram page is watched along with it.
+        if (ramPage != NOT_RAM && !page.watched &&
+            !watchedMirrors[ramPage].empty()) {
+            setWatched((firstPage + i) & 0xFF);
+        }
+        updatePage(page);
+        pageChanged((firstPage + i) & 0xFF);
+    }
+}
+
+void Bus::mapRom(uint8_t firstPage, uint16_t nPages, const uint8_t *rom) {
+    // Never written through: read-only pages have no write pointer.
+    mapMemory(firstPage, nPages, const_cast<uint8_t *>(rom), false);
+}
+
+void Bus::mapDevice(uint8_t firstPage, uint16_t nPages, BusDevice *device) {
+    for (uint16_t i = 0; i < nPages; i++) {
+        Page &page = pages[(firstPage + i) & 0xFF];
+        page.read = nullptr;
+        page.write = nullptr;
+        page.device = device;
+        page.mem = nullptr;
+        setRamPage((firstPage + i) & 0xFF, NOT_RAM);
+        page.writable = false;
+        pageChanged((firstPage + i) & 0xFF);
+    }
+}
+
+bool Bus::canInsert(const Cartridge &cart) {
+    return Mapper::supports(cart);
+}
+
+bool Bus::insertCartridge(shared_ptr<const Cartridge> inserted) {
+    unique_ptr<Mapper> mapper = Mapper::create(*this, move(inserted));
+    if (!mapper) {
+        return false;
+    }
+    board = move(mapper);
+
+    // The 2 KiB of internal ram repeat up to $1FFF.
+    mapMemory(0x08, 8, &ram[0x0000]);
+    mapMemory(0x10, 8, &ram[0x0000]);
+    mapMemory(0x18, 8, &ram[0x0000]);
+    mapDevice(0x20, 32, &ppu);
+    mapDevice(0x40, 1, &io);
+    // Nothing on the supported boards decodes $4100-$5FFF: reads give 0
+    // and writes are dropped.
+    mapDevice(0x41, 31, nullptr);
+    ppu.reset();
+    ppu.connect(board.get());
+    apu.reset();
+    setCycles(0);
+    dmaPending = false;
+    dmaCycles = 0;
+    return true;
+}
+
+void Bus::ejectCartridge() {
+    if (board) {
+        mapMemory(0x08, 24, &ram[0x0800]);
+        mapDevice(0x20, 32, nullptr);
+        mapMemory(0x20, 32, &ram[0x2000]);
+        mapDevice(0x40, 32, nullptr);
+        mapMemory(0x40, 32, &ram[0x4000]);
+        mapDevice(0x80, 128, nullptr);
+        mapMemory(0x80, 128, &ram[0x8000]);
+        ppu.connect(nullptr);
+        board.reset();
+        // Nothing is left to acknowledge an interrupt the APU was holding.
+        apu.reset();
+        cpu.irqLine = false;
+    }
+}
+
+uint32_t Bus::run(uint32_t cycleBudget) {
+    uint64_t start = cycles;
+    if (!board) {
+        cycles += cpu.run(cycleBudget);
+        return cycles - start;
+    }
+
+    uint64_t end = start + cycleBudget;
+    if (lockstep) {
+        // DMA finishes with the instruction that started it.
+        while (cycles < end || !cpu.complete() || dmaPending || dmaCycles) {
+            clock();
+        }
+        return cycles - start;
+    }
+
+    // Each pass is an instruction boundary where something may be due, in
+    // the order clock() sees to it.
+    for (;;) {
+        catchUp(cycles);
+        if (dmaPending) {
+            cycles += oamDma();
+            continue;
+        }
+        if (cycles >= end) {
+            break;
+        }
+        if (ppu.nmi) {
+            ppu.nmi = false;
+            cpu.nmi();
+        } else if (irqDue()) {
+            cpu.irq();
+        }
+        runUntil = min(end, nextEvent());
+        cycles += cpu.runFor(runUntil - cycles);
+    }
+    runUntil = 0;
+    return cycles - start;
+}
+
+uint32_t Bus::step() {
+    uint64_t start = cycles;
+    if (!board) {
+        cycles += cpu.step();
+        return cycles - start;
+    }
+    // run(1) can be used up by the cycles the CPU still owes.
+    uint64_t done = cpu.instructions;
+    while (cpu.instructions == done) {
+        run(1);
+    }
+    return cycles - start;
+}
+
+void Bus::clock() {
+    if (dmaCycles > 0) {
+        dmaCycles--;
+    } else if (dmaPending && cpu.complete()) {
+        dmaCycles = oamDma() - 1;
+    } else {
+        if (ppu.nmi && cpu.complete()) {
+            ppu.nmi = false;
+            cpu.nmi();
+        } else if (irqDue() && cpu.complete()) {
+            cpu.irq();
+        }
+        cpu.clock();
+    }
+    cycles++;
+    catchUp(cycles);
+}
+
+void Bus::catchUpPpu(uint64_t t) {
+    if (t > ppuCycles) {
+        ppu.run(3 * (t - ppuCycles));
+        ppuCycles = t;
+    }
+}
+
+void Bus::catchUpApu(uint64_t t) {
+    if (t > apuCycles) {
+        apu.run(t - apuCycles);
+        apuCycles = t;
+    }
+    cpu.irqLine = apu.irq();
+}
+
+// The dots run by the end of cycle c are those before 3c, so vertical
+// blank is seen from the cycle after the one its dot falls in. A held IRQ
+// line needs no predicting.
+uint64_t Bus::nextEvent() const {
+    uint64_t next = ppuCycles + (ppu.untilVblank() + 3) / 3;
+    uint32_t irq = apu.irq() ? APU2A03::NEVER : apu.untilIrq();
+    if (irq != APU2A03::NEVER) {
+        next = min(next, apuCycles + irq);
+    }
+    return next;
+}
+
+void Bus::reschedule() {
+    cpu.irqLine = apu.irq();
+    if (dmaPending || ppu.nmi || nextEvent() < runUntil) {
+        cpu.yield();
+    }
+}
+
+// The whole page is copied on the first cycle, which the CPU cannot see.
+uint32_t Bus::oamDma() {
+    dmaPending = false;
+    for (int i = 0; i < 256; i++) {
+        ppu.writeOam(read((dmaPage << 8) | i));
+    }
+    return 513 + (cycles & 1);
+}
+
+uint8_t Bus::IoPorts::cpuRead(uint16_t addr, bool bReadOnly) {
+    if (addr == 0x4015) {
+        return bus.apu.cpuRead(addr, bReadOnly);
+    }
+    return 0x00;
+}
+
+void Bus::IoPorts::cpuWrite(uint16_t addr, uint8_t data) {
+    if (addr == 0x4014) {
+        bus.dmaPage = data;
+        bus.dmaPending = true;
+    } else if (addr <= 0x4013 || addr == 0x4015 || addr == 0x4017) {
+        bus.apu.cpuWrite(addr, data);
     }
 }
 
-uint8_t Bus::read(uint16_t addr, bool bReadOnly) {
-    if (addr >= 0x0000 && addr <= 0xFFFF) {
-        return ram[addr];
+uint8_t Bus::readSlow(uint16_t addr, bool bReadOnly) {
+    BusDevice *device = pages[addr >> 8].device;
+    if (device) {
+        if (!board) {
+            return device->cpuRead(addr, bReadOnly);
+        }
+        if (device == &ppu) {
+            catchUpPpu(now());
+            return device->cpuRead(addr, bReadOnly);
+        }
+        // Reading $4015 acknowledges the frame interrupt.
+        catchUp(now());
+        uint8_t data = device->cpuRead(addr, bReadOnly);
+        reschedule();
+        return data;
     }
 
     return 0x00;
 }
+
+void Bus::writeSlow(uint16_t addr, uint8_t data) {
+    const Page &page = pages[addr >> 8];
+
+    if (page.writable && page.ramPage != NOT_RAM) {
+        // First write to a page shared with a fork: take a private copy.
+        uint8_t n = page.ramPage;
+        if (shared[n]) {
+            unshare(n);
+        }
+        ram[n * 256 + (addr & 0x00FF)] = data;
+    } else if (page.writable) {
+        page.mem[addr & 0x00FF] = data;
+    } else if (page.device) {
+        if (board && page.device == &ppu) {
+            catchUpPpu(now());
+        } else if (board) {
+            catchUp(now());
+        }
+        page.device->cpuWrite(addr, data);
+        if (board) {
+            reschedule();
+        }
+    }
+
+    // Writes a device or ROM took did not change memory.
+    if (page.watched && page.writable) {
+        notifyWatchers(addr);
+    }
+}
+
+void Bus::addWatcher(BusWatcher *watcher) {
+    if (find(watchers.begin(), watchers.end(), watcher) == watchers.end()) {
+        watchers.push_back(watcher);
+    }
+}
+
+void Bus::removeWatcher(BusWatcher *watcher) {
+    watchers.erase(remove(watchers.begin(), watchers.end(), watcher),
+                   watchers.end());
+    if (watchers.empty()) {
+        for (Page &page : pages) {
+            page.watched = false;
+            updatePage(page);
+        }
+        for (vector<uint8_t> &mirrors : watchedMirrors) {
+            mirrors.clear();
+        }
+    }
+}
+
+void Bus::watchPage(uint8_t n) {
+    Page &page = pages[n];
+    if (page.watched) {
+        return;
+    }
+    if (page.ramPage == NOT_RAM) {
+        setWatched(n);
+        return;
+    }
+    for (int p = 0; p < 256; p++) {
+        if (pages[p].ramPage == page.ramPage && !pages[p].watched) {
+            setWatched(p);
+        }
+    }
+}
+
+void Bus::setWatched(uint8_t n) {
+    Page &page = pages[n];
+    page.watched = true;
+    if (page.ramPage != NOT_RAM) {
+        vector<uint8_t> &mirrors = watchedMirrors[page.ramPage];
+        mirrors.insert(lower_bound(mirrors.begin(), mirrors.end(), n), n);
+    }
+    updatePage(page);
+}
+
+void Bus::setRamPage(uint8_t n, uint16_t ramPage) {
+    Page &page = pages[n];
+    if (page.watched && page.ramPage != NOT_RAM) {
+        vector<uint8_t> &mirrors = watchedMirrors[page.ramPage];
+        mirrors.erase(find(mirrors.begin(), mirrors.end(), n));
+    }
+    page.ramPage = ramPage;
+    if (page.watched && ramPage != NOT_RAM) {
+        vector<uint8_t> &mirrors = watchedMirrors[ramPage];
+        mirrors.insert(lower_bound(mirrors.begin(), mirrors.end(), n), n);
+    }
+}
+
+void Bus::notifyWatchers(uint16_t addr) {
+    uint16_t ramPage = pages[addr >> 8].ramPage;
+    if (ramPage == NOT_RAM) {
+        for (BusWatcher *watcher : watchers) {
+            watcher->busWritten(addr);
+        }
+        return;
+    }
+    for (uint8_t n : watchedMirrors[ramPage]) {
+        uint16_t at = (n << 8) | (addr & 0x00FF);
+        for (BusWatcher *watcher : watchers) {
+            watcher->busWritten(at);
+        }
+    }
+}
+
+void Bus::pageChanged(uint8_t n) {
+    if (!pages[n].watched) {
+        return;
+    }
+    for (BusWatcher *watcher : watchers) {
+        watcher->busPageChanged(n);
+    }
+}
+
+void Bus::ramPageChanged(uint8_t n) {
+    if (watchers.empty()) {
+        return;
+    }
+    // Once per watched mirror, as notifyWatchers() reports a write.
+    for (uint8_t p : watchedMirrors[n]) {
+        for (BusWatcher *watcher : watchers) {
+            watcher->busPageChanged(p);
+        }
+    }
+}
@@ -1,144 +1,60 @@
 #include "CPU6502.h"
 
 #include <cstdint>
+#include <cstdlib>
 #include <map>
 
 #include "Bus.h"
+#include "CPU6502Fused.h"
+#include "CPU6502Jit.h"
+#include "CPU6502Opcodes.h"
+#include "Profile.h"
+#include "SaveState.h"
+#include "Trace.h"
 
 using namespace std;
 
+constexpr array<uint8_t (CPU6502::*)(void), 57> CPU6502::operations = {
+    &CPU6502::ADC, &CPU6502::AND, &CPU6502::ASL, &CPU6502::BCC, &CPU6502::BCS,
+    &CPU6502::BEQ, &CPU6502::BIT, &CPU6502::BMI, &CPU6502::BNE, &CPU6502::BPL,
+    &CPU6502::BRK, &CPU6502::BVC, &CPU6502::BVS, &CPU6502::CLC, &CPU6502::CLD,
+    &CPU6502::CLI, &CPU6502::CLV, &CPU6502::CMP, &CPU6502::CPX, &CPU6502::CPY,
+    &CPU6502::DEC, &CPU6502::DEX, &CPU6502::DEY, &CPU6502::EOR, &CPU6502::INC,
+    &CPU6502::INX, &CPU6502::INY, &CPU6502::JMP, &CPU6502::JSR, &CPU6502::LDA,
+    &CPU6502::LDX, &CPU6502::LDY, &CPU6502::LSR, &CPU6502::NOP, &CPU6502::ORA,
+    &CPU6502::PHA, &CPU6502::PHP, &CPU6502::PLA, &CPU6502::PLP, &CPU6502::ROL,
+    &CPU6502::ROR, &CPU6502::RTI, &CPU6502::RTS, &CPU6502::SBC, &CPU6502::SEC,
+    &CPU6502::SED, &CPU6502::SEI, &CPU6502::STA, &CPU6502::STX, &CPU6502::STY,
+    &CPU6502::TAX, &CPU6502::TAY, &CPU6502::TSX, &CPU6502::TXA, &CPU6502::TXS,
+    &CPU6502::TYA, &CPU6502::XXX,
+};
+
+constexpr array<uint8_t (CPU6502::*)(void), 12> CPU6502::addrmodes = {
+    &CPU6502::IMP, &CPU6502::IMM, &CPU6502::ZP0, &CPU6502::ZPX,
+    &CPU6502::ZPY, &CPU6502::REL, &CPU6502::ABS, &CPU6502::ABX,
+    &CPU6502::ABY, &CPU6502::IND, &CPU6502::IZX, &CPU6502::IZY,
+};
+
+#if defined(NES_PREDECODE)
+CPU6502::Decoded CPU6502::noneDecoded[64 * 1024];
+#endif
+
+#if defined(NES_PREDECODE) || defined(NES_JIT)
+constexpr array<uint8_t (*)(CPU6502 &, uint16_t), 256> CPU6502::handlers = {{
+#define CPU6502_HANDLER_ENTRY(code, name, op, mode, cyc) \
+    &CPU6502Fused::Op<CPU6502Fused::op, CPU6502Fused::mode>::run,
+    CPU6502_OPCODES(CPU6502_HANDLER_ENTRY)
+#undef CPU6502_HANDLER_ENTRY
+}};
+#endif
+
+const char CPU6502::names[256][4] = {
+#define CPU6502_NAME_ENTRY(code, name, op, mode, cyc) name,
+    CPU6502_OPCODES(CPU6502_NAME_ENTRY)
+#undef CPU6502_NAME_ENTRY
+};
+
 CPU6502::CPU6502() {
-    using a = CPU6502;
-    lookup = {
-        {"BRK", &a::BRK, &a::IMM, 7}, {"ORA", &a::ORA, &a::IZX, 6},
-        {"???", &a::XXX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 8},
-        {"???", &a::NOP, &a::IMP, 3}, {"ORA", &a::ORA, &a::ZP0, 3},
-        {"ASL", &a::ASL, &a::ZP0, 5}, {"???", &a::XXX, &a::IMP, 5},
-        {"PHP", &a::PHP, &a::IMP, 3}, {"ORA", &a::ORA, &a::IMM, 2},
-        {"ASL", &a::ASL, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 2},
-        {"???", &a::NOP, &a::IMP, 4}, {"ORA", &a::ORA, &a::ABS, 4},
-        {"ASL", &a::ASL, &a::ABS, 6}, {"???", &a::XXX, &a::IMP, 6},
-        {"BPL", &a::BPL, &a::REL, 2}, {"ORA", &a::ORA, &a::IZY, 5},
-        {"???", &a::XXX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 8},
-        {"???", &a::NOP, &a::IMP, 4}, {"ORA", &a::ORA, &a::ZPX, 4},
-        {"ASL", &a::ASL, &a::ZPX, 6}, {"???", &a::XXX, &a::IMP, 6},
-        {"CLC", &a::CLC, &a::IMP, 2}, {"ORA", &a::ORA, &a::ABY, 4},
-        {"???", &a::NOP, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 7},
-        {"???", &a::NOP, &a::IMP, 4}, {"ORA", &a::ORA, &a::ABX, 4},
-        {"ASL", &a::ASL, &a::ABX, 7}, {"???", &a::XXX, &a::IMP, 7},
-        {"JSR", &a::JSR, &a::ABS, 6}, {"AND", &a::AND, &a::IZX, 6},
-        {"???", &a::XXX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 8},
-        {"BIT", &a::BIT, &a::ZP0, 3}, {"AND", &a::AND, &a::ZP0, 3},
-        {"ROL", &a::ROL, &a::ZP0, 5}, {"???", &a::XXX, &a::IMP, 5},
-        {"PLP", &a::PLP, &a::IMP, 4}, {"AND", &a::AND, &a::IMM, 2},
-        {"ROL", &a::ROL, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 2},
-        {"BIT", &a::BIT, &a::ABS, 4}, {"AND", &a::AND, &a::ABS, 4},
-        {"ROL", &a::ROL, &a::ABS, 6}, {"???", &a::XXX, &a::IMP, 6},
-        {"BMI", &a::BMI, &a::REL, 2}, {"AND", &a::AND, &a::IZY, 5},
-        {"???", &a::XXX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 8},
-        {"???", &a::NOP, &a::IMP, 4}, {"AND", &a::AND, &a::ZPX, 4},
-        {"ROL", &a::ROL, &a::ZPX, 6}, {"???", &a::XXX, &a::IMP, 6},
-        {"SEC", &a::SEC, &a::IMP, 2}, {"AND", &a::AND, &a::ABY, 4},
-        {"???", &a::NOP, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 7},
-        {"???", &a::NOP, &a::IMP, 4}, {"AND", &a::AND, &a::ABX, 4},
-        {"ROL", &a::ROL, &a::ABX, 7}, {"???", &a::XXX, &a::IMP, 7},
-        {"RTI", &a::RTI, &a::IMP, 6}, {"EOR", &a::EOR, &a::IZX, 6},
-        {"???", &a::XXX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 8},
-        {"???", &a::NOP, &a::IMP, 3}, {"EOR", &a::EOR, &a::ZP0, 3},
-        {"LSR", &a::LSR, &a::ZP0, 5}, {"???", &a::XXX, &a::IMP, 5},
-        {"PHA", &a::PHA, &a::IMP, 3}, {"EOR", &a::EOR, &a::IMM, 2},
-        {"LSR", &a::LSR, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 2},
-        {"JMP", &a::JMP, &a::ABS, 3}, {"EOR", &a::EOR, &a::ABS, 4},
-        {"LSR", &a::LSR, &a::ABS, 6}, {"???", &a::XXX, &a::IMP, 6},
-        {"BVC", &a::BVC, &a::REL, 2}, {"EOR", &a::EOR, &a::IZY, 5},
-        {"???", &a::XXX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 8},
-        {"???", &a::NOP, &a::IMP, 4}, {"EOR", &a::EOR, &a::ZPX, 4},
-        {"LSR", &a::LSR, &a::ZPX, 6}, {"???", &a::XXX, &a::IMP, 6},
-        {"CLI", &a::CLI, &a::IMP, 2}, {"EOR", &a::EOR, &a::ABY, 4},
-        {"???", &a::NOP, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 7},
-        {"???", &a::NOP, &a::IMP, 4}, {"EOR", &a::EOR, &a::ABX, 4},
-        {"LSR", &a::LSR, &a::ABX, 7}, {"???", &a::XXX, &a::IMP, 7},
-        {"RTS", &a::RTS, &a::IMP, 6}, {"ADC", &a::ADC, &a::IZX, 6},
-        {"???", &a::XXX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 8},
-        {"???", &a::NOP, &a::IMP, 3}, {"ADC", &a::ADC, &a::ZP0, 3},
-        {"ROR", &a::ROR, &a::ZP0, 5}, {"???", &a::XXX, &a::IMP, 5},
-        {"PLA", &a::PLA, &a::IMP, 4}, {"ADC", &a::ADC, &a::IMM, 2},
-        {"ROR", &a::ROR, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 2},
-        {"JMP", &a::JMP, &a::IND, 5}, {"ADC", &a::ADC, &a::ABS, 4},
-        {"ROR", &a::ROR, &a::ABS, 6}, {"???", &a::XXX, &a::IMP, 6},
-        {"BVS", &a::BVS, &a::REL, 2}, {"ADC", &a::ADC, &a::IZY, 5},
-        {"???", &a::XXX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 8},
-        {"???", &a::NOP, &a::IMP, 4}, {"ADC", &a::ADC, &a::ZPX, 4},
-        {"ROR", &a::ROR, &a::ZPX, 6}, {"???", &a::XXX, &a::IMP, 6},
-        {"SEI", &a::SEI, &a::IMP, 2}, {"ADC", &a::ADC, &a::ABY, 4},
-        {"???", &a::NOP, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 7},
-        {"???", &a::NOP, &a::IMP, 4}, {"ADC", &a::ADC, &a::ABX, 4},
-        {"ROR", &a::ROR, &a::ABX, 7}, {"???", &a::XXX, &a::IMP, 7},
-        {"???", &a::NOP, &a::IMP, 2}, {"STA", &a::STA, &a::IZX, 6},
-        {"???", &a::NOP, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 6},
-        {"STY", &a::STY, &a::ZP0, 3}, {"STA", &a::STA, &a::ZP0, 3},
-        {"STX", &a::STX, &a::ZP0, 3}, {"???", &a::XXX, &a::IMP, 3},
-        {"DEY", &a::DEY, &a::IMP, 2}, {"???", &a::NOP, &a::IMP, 2},
-        {"TXA", &a::TXA, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 2},
-        {"STY", &a::STY, &a::ABS, 4}, {"STA", &a::STA, &a::ABS, 4},
-        {"STX", &a::STX, &a::ABS, 4}, {"???", &a::XXX, &a::IMP, 4},
-        {"BCC", &a::BCC, &a::REL, 2}, {"STA", &a::STA, &a::IZY, 6},
-        {"???", &a::XXX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 6},
-        {"STY", &a::STY, &a::ZPX, 4}, {"STA", &a::STA, &a::ZPX, 4},
-        {"STX", &a::STX, &a::ZPY, 4}, {"???", &a::XXX, &a::IMP, 4},
-        {"TYA", &a::TYA, &a::IMP, 2}, {"STA", &a::STA, &a::ABY, 5},
-        {"TXS", &a::TXS, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 5},
-        {"???", &a::NOP, &a::IMP, 5}, {"STA", &a::STA, &a::ABX, 5},
-        {"???", &a::XXX, &a::IMP, 5}, {"???", &a::XXX, &a::IMP, 5},
-        {"LDY", &a::LDY, &a::IMM, 2}, {"LDA", &a::LDA, &a::IZX, 6},
-        {"LDX", &a::LDX, &a::IMM, 2}, {"???", &a::XXX, &a::IMP, 6},
-        {"LDY", &a::LDY, &a::ZP0, 3}, {"LDA", &a::LDA, &a::ZP0, 3},
-        {"LDX", &a::LDX, &a::ZP0, 3}, {"???", &a::XXX, &a::IMP, 3},
-        {"TAY", &a::TAY, &a::IMP, 2}, {"LDA", &a::LDA, &a::IMM, 2},
-        {"TAX", &a::TAX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 2},
-        {"LDY", &a::LDY, &a::ABS, 4}, {"LDA", &a::LDA, &a::ABS, 4},
-        {"LDX", &a::LDX, &a::ABS, 4}, {"???", &a::XXX, &a::IMP, 4},
-        {"BCS", &a::BCS, &a::REL, 2}, {"LDA", &a::LDA, &a::IZY, 5},
-        {"???", &a::XXX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 5},
-        {"LDY", &a::LDY, &a::ZPX, 4}, {"LDA", &a::LDA, &a::ZPX, 4},
-        {"LDX", &a::LDX, &a::ZPY, 4}, {"???", &a::XXX, &a::IMP, 4},
-        {"CLV", &a::CLV, &a::IMP, 2}, {"LDA", &a::LDA, &a::ABY, 4},
-        {"TSX", &a::TSX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 4},
-        {"LDY", &a::LDY, &a::ABX, 4}, {"LDA", &a::LDA, &a::ABX, 4},
-        {"LDX", &a::LDX, &a::ABY, 4}, {"???", &a::XXX, &a::IMP, 4},
-        {"CPY", &a::CPY, &a::IMM, 2}, {"CMP", &a::CMP, &a::IZX, 6},
-        {"???", &a::NOP, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 8},
-        {"CPY", &a::CPY, &a::ZP0, 3}, {"CMP", &a::CMP, &a::ZP0, 3},
-        {"DEC", &a::DEC, &a::ZP0, 5}, {"???", &a::XXX, &a::IMP, 5},
-        {"INY", &a::INY, &a::IMP, 2}, {"CMP", &a::CMP, &a::IMM, 2},
-        {"DEX", &a::DEX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 2},
-        {"CPY", &a::CPY, &a::ABS, 4}, {"CMP", &a::CMP, &a::ABS, 4},
-        {"DEC", &a::DEC, &a::ABS, 6}, {"???", &a::XXX, &a::IMP, 6},
-        {"BNE", &a::BNE, &a::REL, 2}, {"CMP", &a::CMP, &a::IZY, 5},
-        {"???", &a::XXX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 8},
-        {"???", &a::NOP, &a::IMP, 4}, {"CMP", &a::CMP, &a::ZPX, 4},
-        {"DEC", &a::DEC, &a::ZPX, 6}, {"???", &a::XXX, &a::IMP, 6},
-        {"CLD", &a::CLD, &a::IMP, 2}, {"CMP", &a::CMP, &a::ABY, 4},
-        {"NOP", &a::NOP, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 7},
-        {"???", &a::NOP, &a::IMP, 4}, {"CMP", &a::CMP, &a::ABX, 4},
-        {"DEC", &a::DEC, &a::ABX, 7}, {"???", &a::XXX, &a::IMP, 7},
-        {"CPX", &a::CPX, &a::IMM, 2}, {"SBC", &a::SBC, &a::IZX, 6},
-        {"???", &a::NOP, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 8},
-        {"CPX", &a::CPX, &a::ZP0, 3}, {"SBC", &a::SBC, &a::ZP0, 3},
-        {"INC", &a::INC, &a::ZP0, 5}, {"???", &a::XXX, &a::IMP, 5},
-        {"INX", &a::INX, &a::IMP, 2}, {"SBC", &a::SBC, &a::IMM, 2},
-        {"NOP", &a::NOP, &a::IMP, 2}, {"???", &a::SBC, &a::IMP, 2},
-        {"CPX", &a::CPX, &a::ABS, 4}, {"SBC", &a::SBC, &a::ABS, 4},
-        {"INC", &a::INC, &a::ABS, 6}, {"???", &a::XXX, &a::IMP, 6},
-        {"BEQ", &a::BEQ, &a::REL, 2}, {"SBC", &a::SBC, &a::IZY, 5},
-        {"???", &a::XXX, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 8},
-        {"???", &a::NOP, &a::IMP, 4}, {"SBC", &a::SBC, &a::ZPX, 4},
-        {"INC", &a::INC, &a::ZPX, 6}, {"???", &a::XXX, &a::IMP, 6},
-        {"SED", &a::SED, &a::IMP, 2}, {"SBC", &a::SBC, &a::ABY, 4},
-        {"NOP", &a::NOP, &a::IMP, 2}, {"???", &a::XXX, &a::IMP, 7},
-        {"???", &a::NOP, &a::IMP, 4}, {"SBC", &a::SBC, &a::ABX, 4},
-        {"INC", &a::INC, &a::ABX, 7}, {"???", &a::XXX, &a::IMP, 7},
-    };
 }
 
 CPU6502::~CPU6502() {
@@ -152,42 +68,331 @@ uint8_t CPU6502::read(uint16_t a) {
     return bus->read(a, false);
 }
 
+uint16_t CPU6502::read16(uint16_t a) {
+    return bus->read16(a);
+}
+
 uint8_t CPU6502::GetFlag(FLAGS6502 f) {
+#if defined(NES_LAZY_FLAGS)
+    if (f == Z) {
+        return zResult == 0x00;
+    }
+    if (f == N) {
+        return nResult >> 7;
+    }
+#endif
     return ((status & f) > 0) ? 1 : 0;
 }
 
 void CPU6502::SetFlag(FLAGS6502 f, bool v) {
-    if (v) {
-        status |= f;
-    } else {
-        status &= ~f;
+#if defined(NES_LAZY_FLAGS)
+    if (f == Z) {
+        zResult = !v;
+        return;
     }
+    if (f == N) {
+        nResult = v ? 0x80 : 0x00;
+        return;
+    }
+#endif
+    status = (status & ~f) | (v ? f : 0);
+}
+
+void CPU6502::SetZN(uint8_t v) {
+#if defined(NES_LAZY_FLAGS)
+    zResult = v;
+    nResult = v;
+#else
+    SetFlag(Z, v == 0x00);
+    SetFlag(N, v & 0x80);
+#endif
+}
+
+uint8_t CPU6502::GetStatus() {
+#if defined(NES_LAZY_FLAGS)
+    return (status & ~(Z | N)) | (zResult == 0x00 ? Z : 0) | (nResult & N);
+#else
+    return status;
+#endif
+}
+
+void CPU6502::SetStatus(uint8_t v) {
+    status = v;
+#if defined(NES_LAZY_FLAGS)
+    zResult = ~v & Z;
+    nResult = v & N;
+#endif
+}
+
+void CPU6502::loadFlags() {
+#if defined(NES_LAZY_FLAGS)
+    SetStatus(status);
+#endif
+}
+
+void CPU6502::storeFlags() {
+#if defined(NES_LAZY_FLAGS)
+    status = GetStatus();
+#endif
 }
 
+#if !defined(NES_CYCLE_CORE)
 void CPU6502::clock() {
     if (cycles == 0) {
-        opcode = read(pc);
-        SetFlag(U, 1);
-        pc++;
-        cycles = lookup[opcode].cycles;
+        loadFlags();
+        execute();
+        storeFlags();
+    }
+    cycles--;
+}
 
-        uint8_t additional_cycle1 = (this->*lookup[opcode].addrmode)();
-        uint8_t additional_cycle2 = (this->*lookup[opcode].operate)();
+uint8_t CPU6502::step() {
+    uint8_t owed = cycles;
+    loadFlags();
+    execute();
+    storeFlags();
+    uint8_t elapsed = owed + cycles;
+    cycles = 0;
+    return elapsed;
+}
 
-        cycles += (additional_cycle1 & additional_cycle2);
+uint32_t CPU6502::run(uint32_t cycleBudget) {
+    // Cycles still owed from clock() or reset/irq/nmi count against the
+    // budget before any new instruction starts.
+    int64_t remaining = (int64_t)cycleBudget - overshoot - cycles;
+    ran = cycles;
+    cycles = 0;
+    yielded = false;
+
+#if defined(NES_JIT)
+    if (!jit) {
+        jit = make_shared<CPU6502Jit>(*this);
+    }
+#endif
+
+    loadFlags();
+    while (remaining > 0 && !yielded) {
+#if defined(NES_JIT)
+        if (jitEnabled && jit->run(remaining, ran)) {
+            continue;
+        }
+#endif
+        execute();
+        remaining -= cycles;
+        ran += cycles;
+    }
+    storeFlags();
+    cycles = 0;
+
+    // A yield leaves budget over, which is not carried.
+    overshoot = remaining < 0 ? (uint32_t)-remaining : 0;
+    uint32_t elapsed = ran;
+    ran = 0;
+    return elapsed;
+}
+#endif
+
+void CPU6502::execute() {
+#if defined(NES_TRACE)
+    if (trace) {
+        traceInstruction();
+    }
+#endif
+
+#if defined(NES_PREDECODE)
+    // Seen before: no opcode or operand fetch and no decode. The entry is
+    // copied out because the instruction may overwrite itself.
+    if (decoded[pc].run || predecode(pc)) {
+        Decoded d = decoded[pc];
+        opcode = d.opcode;
+        SetFlag(U, 1);
+        pc += d.length;
+        cycles = d.cycles + d.run(*this, d.operand);
         SetFlag(U, 1);
+        instructions++;
+#if defined(NES_PROFILE)
+        Profile::record(opcode, cycles);
+#endif
+#if defined(NES_TRACE)
+        if (trace) {
+            trace->cycle += cycles;
+        }
+#endif
+        return;
     }
-    cycles--;
+#endif
+
+    opcode = read(pc);
+    SetFlag(U, 1);
+    pc++;
+
+    dispatch();
+
+    SetFlag(U, 1);
+    instructions++;
+#if defined(NES_PROFILE)
+    Profile::record(opcode, cycles);
+#endif
+#if defined(NES_TRACE)
+    if (trace) {
+        trace->cycle += cycles;
+    }
+#endif
+}
+
+#if defined(NES_TRACE)
+void CPU6502::traceInstruction() {
+    TraceRecord r;
+    r.cycle = trace->cycle;
+    r.pc = pc;
+    // Peeked, so devices on the bus see nothing extra.
+    const Bus::Page &page = bus->pages[pc >> 8];
+    if (page.read && (pc & 0x00FF) <= 0xFD) {
+        const uint8_t *p = page.read + (pc & 0x00FF);
+        r.opcode = p[0];
+        r.lo = p[1];
+        r.hi = p[2];
+    } else {
+        r.opcode = bus->read(pc, true);
+        r.lo = bus->read(pc + 1, true);
+        r.hi = bus->read(pc + 2, true);
+    }
+    r.a = a;
+    r.x = x;
+    r.y = y;
+    r.p = GetStatus();
+    r.sp = stkp;
+    trace->push(r);
+}
+#endif
+
+#if defined(NES_SWITCH_CORE)
+// Switch core: one dense switch on the opcode, each case running the fused
+// handler for that row of the opcode table (see CPU6502Fused.h).
+void CPU6502::dispatch() {
+    using F = CPU6502Fused;
+    switch (opcode) {
+#define CPU6502_SWITCH_CASE(code, name, op, mode, cyc)      \
+    case code:                                              \
+        cycles = cyc + F::Op<F::op, F::mode>::exec(*this);  \
+        break;
+        CPU6502_OPCODES(CPU6502_SWITCH_CASE)
+#undef CPU6502_SWITCH_CASE
+    }
+}
+#else
+// Lookup core: dispatch through the member function pointers for the
+// addressing mode and operation named in lookup.
+void CPU6502::dispatch() {
+    const INSTRUCTION &inst = lookup[opcode];
+    cycles = inst.cycles;
+    implied = inst.addrmode == AddrMode::IMP;
+
+    uint8_t additional_cycle1 = (this->*addrmodes[(int)inst.addrmode])();
+    uint8_t additional_cycle2 = (this->*operations[(int)inst.operate])();
+
+    cycles += (additional_cycle1 & additional_cycle2);
+}
+#endif
+
+void CPU6502::ConnectBus(Bus *n) {
+    bus = n;
+#if defined(NES_PREDECODE)
+    decodedTable.reset();
+    decoded = noneDecoded;
+#endif
+#if defined(NES_JIT)
+    jit.reset();
+#endif
+#if defined(NES_PREDECODE) || defined(NES_JIT)
+    bus->addWatcher(this);
+#endif
+}
+
+void CPU6502::busWritten(uint16_t addr) {
+#if defined(NES_PREDECODE)
+    // Any instruction starting up to two bytes earlier may include addr.
+    if (decodedTable) {
+        for (uint16_t k = 0; k < 3; k++) {
+            decoded[(uint16_t)(addr - k)].run = nullptr;
+        }
+    }
+#endif
+#if defined(NES_JIT)
+    if (jit) {
+        jit->invalidate(addr);
+    }
+#endif
+}
+
+void CPU6502::busPageChanged(uint8_t n) {
+#if defined(NES_PREDECODE)
+    // Including instructions that start on the page before and run into it.
+    if (decodedTable) {
+        for (int i = -2; i < 256; i++) {
+            decoded[(uint16_t)((n << 8) + i)].run = nullptr;
+        }
+    }
+#endif
+#if defined(NES_JIT)
+    if (jit) {
+        jit->invalidatePage(n);
+    }
+#endif
 }
 
+#if defined(NES_PREDECODE)
+bool CPU6502::predecode(uint16_t addr) {
+    const Bus::Page &first = bus->pages[addr >> 8];
+    if (!first.read) {
+        return false;
+    }
+    uint8_t op = first.read[addr & 0x00FF];
+    const INSTRUCTION &inst = lookup[op];
+
+    // Operand bytes are read straight from their pages, which have no side
+    // effects; the handler does the fetch's work on them later.
+    uint8_t bytes[3] = {op, 0x00, 0x00};
+    for (uint8_t k = 1; k < inst.length; k++) {
+        uint16_t at = addr + k;
+        const Bus::Page &page = bus->pages[at >> 8];
+        if (!page.read) {
+            return false;
+        }
+        bytes[k] = page.read[at & 0x00FF];
+    }
+
+    if (!decodedTable) {
+        // calloc'd memory reads as nothing decoded, and the kernel only
+        // hands out the pages that get touched.
+        decodedTable.reset(
+            static_cast<Decoded *>(calloc(64 * 1024, sizeof(Decoded))), free);
+        decoded = decodedTable.get();
+    }
+
+    Decoded &d = decoded[addr];
+    d.opcode = op;
+    d.length = inst.length;
+    d.cycles = inst.cycles;
+    if (inst.addrmode == AddrMode::IMM) {
+        d.operand = (uint16_t)(addr + 1);
+    } else {
+        d.operand = bytes[1] | (bytes[2] << 8);
+    }
+
+    for (uint8_t k = 0; k < inst.length; k++) {
+        bus->watchPage((uint16_t)(addr + k) >> 8);
+    }
+    d.run = handlers[op];
+    return true;
+}
+#endif
+
 void CPU6502::reset() {
     // This is a hardcoded address which store where the
     // Program counter starts.
     addr_abs = 0xFFFC;
-    uint16_t lo = read(addr_abs);
-    uint16_t hi = read(addr_abs + 1);
-
-    pc = (hi << 8) | lo;
+    pc = read16(addr_abs);
 
     a = 0;
     x = 0;
@@ -201,12 +406,22 @@ void CPU6502::reset() {
     // https://www.pagetable.com/?p=410
     stkp = 0xFD;
 
-    status = 0x00 | U;
+    // With a cartridge in, interrupts come out of reset disabled, as on
+    // the 6502: its APU raises the frame interrupt from power-on until the
+    // program turns it off. Without one nothing raises IRQs, and programs
+    // and the stepper's irq() start with them enabled.
+    SetStatus(bus->mapper() ? U | I : U);
     addr_rel = 0x0000;
     addr_abs = 0x0000;
     fetched = 0x00;
 
     cycles = 8;
+    overshoot = 0;
+#if defined(NES_TRACE)
+    if (trace) {
+        trace->cycle += cycles;
+    }
+#endif
 }
 
 void CPU6502::irq() {
@@ -216,18 +431,22 @@ void CPU6502::irq() {
         write(0x0100 + stkp, pc & 0x00FF);
         stkp--;
 
+        loadFlags();
         SetFlag(B, 0);
         SetFlag(U, 1);
         SetFlag(I, 1);
-        write(0x0100 + stkp, status);
+        write(0x0100 + stkp, GetStatus());
         stkp--;
 
         addr_abs = 0xFFFE;
-        uint16_t lo = read(addr_abs);
-        uint16_t hi = read(addr_abs + 1);
-        pc = (hi << 8) | lo;
+        pc = read16(addr_abs);
 
         cycles = 7;
+#if defined(NES_TRACE)
+        if (trace) {
+            trace->cycle += cycles;
+        }
+#endif
     }
 }
 
@@ -237,18 +456,22 @@ void CPU6502::nmi() {
     write(0x0100 + stkp, pc & 0x00FF);
     stkp--;
 
+    loadFlags();
     SetFlag(B, 0);
     SetFlag(U, 1);
     SetFlag(I, 1);
-    write(0x0100 + stkp, status);
+    write(0x0100 + stkp, GetStatus());
     stkp--;
 
     addr_abs = 0xFFFA;
-    uint16_t lo = read(addr_abs);
-    uint16_t hi = read(addr_abs + 1);
-    pc = (hi << 8) | lo;
+    pc = read16(addr_abs);
 
     cycles = 8;
+#if defined(NES_TRACE)
+    if (trace) {
+        trace->cycle += cycles;
+    }
+#endif
 }
 
 // Addressing Modes
@@ -303,61 +526,47 @@ uint8_t CPU6502::REL() {
 }
 
 uint8_t CPU6502::ABS() {
-    uint16_t lo = read(pc);
-    pc++;
-    uint16_t hi = read(pc);
-    pc++;
-
-    addr_abs = (hi << 8) | lo;
+    addr_abs = read16(pc);
+    pc += 2;
     return 0;
 }
 
 uint8_t CPU6502::ABX() {
-    uint16_t lo = read(pc);
-    pc++;
-    uint16_t hi = read(pc);
-    pc++;
+    uint16_t base = read16(pc);
+    pc += 2;
 
-    addr_abs = (hi << 8) | lo;
-    addr_abs += x;
+    addr_abs = base + x;
 
-    if ((addr_abs & 0xFF00) != (hi << 8)) {
+    if ((addr_abs & 0xFF00) != (base & 0xFF00)) {
         return 1;
     }
     return 0;
 }
 
 uint8_t CPU6502::ABY() {
-    uint16_t lo = read(pc);
-    pc++;
-    uint16_t hi = read(pc);
-    pc++;
+    uint16_t base = read16(pc);
+    pc += 2;
 
-    addr_abs = (hi << 8) | lo;
-    addr_abs += y;
+    addr_abs = base + y;
 
-    if ((addr_abs & 0xFF00) != (hi << 8)) {
+    if ((addr_abs & 0xFF00) != (base & 0xFF00)) {
         return 1;
     }
     return 0;
 }
 
 uint8_t CPU6502::IND() {
-    uint16_t ptr_lo = read(pc);
-    pc++;
-    uint16_t ptr_hi = read(pc);
-    pc++;
-
-    uint16_t ptr = (ptr_hi << 8) | ptr_lo;
+    uint16_t ptr = read16(pc);
+    pc += 2;
 
     // If it is the end of the page we
     // go back to the start of the same page.
     // This is a bug in the original hardware
     // and we are emulating it.
-    if (ptr_lo == 0x00FF) {
+    if ((ptr & 0x00FF) == 0x00FF) {
         addr_abs = (read(ptr & 0xFF00) << 8) | read(ptr + 0);
     } else {
-        addr_abs = read(ptr + 1) << 8 | read(ptr + 0);
+        addr_abs = read16(ptr);
     }
     return 0;
 }
@@ -390,7 +599,11 @@ uint8_t CPU6502::IZY() {
 }
 
 uint8_t CPU6502::fetch() {
-    if (!(lookup[opcode].addrmode == &CPU6502::IMP)) {
+#if defined(NES_CYCLE_CORE)
+    if (!implied && !prefetched) {
+#else
+    if (!implied) {
+#endif
         fetched = read(addr_abs);
     }
 
@@ -403,8 +616,7 @@ uint8_t CPU6502::ADC() {
     fetch();
     uint16_t temp = (uint16_t)a + (uint16_t)fetched + (uint16_t)GetFlag(C);
     SetFlag(C, temp > 0xFF);
-    SetFlag(Z, (temp & 0x00FF) == 0x00);
-    SetFlag(N, temp & 0x80);
+    SetZN(temp & 0x00FF);
     SetFlag(V, (~((uint16_t)a ^ (uint16_t)fetched) & ((uint16_t)a ^ temp)) &
                    0x0080);
     a = temp & 0x00FF;
@@ -415,8 +627,7 @@ uint8_t CPU6502::AND() {
     fetch();
     a = a & fetched;
 
-    SetFlag(Z, a == 0x00);
-    SetFlag(N, a & 0x80);
+    SetZN(a);
 
     return 1;
 }
@@ -426,10 +637,9 @@ uint8_t CPU6502::ASL() {
     uint16_t temp = a << 1;
 
     SetFlag(C, (temp & 0xFF00));
-    SetFlag(Z, (temp & 0x00FF) == 0x00);
-    SetFlag(N, (temp & 0x80));
+    SetZN(temp & 0x00FF);
 
-    if (lookup[opcode].addrmode == &CPU6502::IMP) {
+    if (implied) {
         a = temp & 0x00FF;
     } else {
         write(addr_abs, temp & 0x00FF);
@@ -539,10 +749,10 @@ uint8_t CPU6502::BRK() {
     stkp--;
 
     SetFlag(B, 1);
-    write((0x0100 + stkp), status);
+    write((0x0100 + stkp), GetStatus());
     SetFlag(B, 0);
 
-    pc = ((uint16_t)read(0xFFFF) << 8) | (uint16_t)read(0xFFFE);
+    pc = read16(0xFFFE);
     return 0;
 }
 
@@ -584,6 +794,7 @@ uint8_t CPU6502::CLD() {
 
 uint8_t CPU6502::CLI() {
     SetFlag(I, 0);
+    checkIrq();
     return 0;
 }
 
@@ -597,8 +808,7 @@ uint8_t CPU6502::CMP() {
 
     uint16_t temp = (uint16_t)a - (uint16_t)fetched;
     SetFlag(C, a >= fetched);
-    SetFlag(Z, a == fetched);
-    SetFlag(N, temp & 0x0080);
+    SetZN(temp & 0x00FF);
 
     return 1;
 }
@@ -608,8 +818,7 @@ uint8_t CPU6502::CPX() {
 
     uint16_t temp = (uint16_t)x - (uint16_t)fetched;
     SetFlag(C, x >= fetched);
-    SetFlag(Z, x == fetched);
-    SetFlag(N, temp & 0x0080);
+    SetZN(temp & 0x00FF);
 
     return 0;
 }
@@ -630,31 +839,27 @@ uint8_t CPU6502::DEC() {
 
     uint16_t temp = (uint16_t)fetched - 1;
     write(addr_abs, temp & 0x00FF);
-    SetFlag(Z, (temp & 0x00FF) == 0x00);
-    SetFlag(N, (temp & 0x00FF) & 0x80);
+    SetZN(temp & 0x00FF);
 
     return 0;
 }
 
 uint8_t CPU6502::DEX() {
     x--;
-    SetFlag(Z, x == 0x00);
-    SetFlag(N, x & 0x80);
+    SetZN(x);
     return 0;
 }
 
 uint8_t CPU6502::DEY() {
     y--;
-    SetFlag(Z, y == 0x00);
-    SetFlag(N, y & 0x80);
+    SetZN(y);
     return 0;
 }
 
 uint8_t CPU6502::EOR() {
     fetch();
     a = a ^ fetched;
-    SetFlag(Z, a == 0x00);
-    SetFlag(N, a & 0x80);
+    SetZN(a);
 
     return 1;
 }
@@ -662,8 +867,7 @@ uint8_t CPU6502::EOR() {
 uint8_t CPU6502::INC() {
     fetch();
     uint16_t temp = (uint16_t)fetched + 1;
-    SetFlag(Z, (temp & 0x00FF) == 0x00);
-    SetFlag(N, temp & 0x0080);
+    SetZN(temp & 0x00FF);
     write(addr_abs, (temp & 0x00FF));
 
     return 0;
@@ -671,16 +875,14 @@ uint8_t CPU6502::INC() {
 
 uint8_t CPU6502::INX() {
     x++;
-    SetFlag(Z, x == 0x00);
-    SetFlag(N, x & 0x80);
+    SetZN(x);
 
     return 0;
 }
 
 uint8_t CPU6502::INY() {
     y++;
-    SetFlag(Z, y == 0x00);
-    SetFlag(N, y & 0x80);
+    SetZN(y);
 
     return 0;
 }
@@ -707,8 +909,7 @@ uint8_t CPU6502::JSR() {
 uint8_t CPU6502::LDA() {
     fetch();
     a = fetched;
-    SetFlag(Z, a == 0x00);
-    SetFlag(N, a & 0x80);
+    SetZN(a);
 
     return 1;
 }
@@ -716,8 +917,7 @@ uint8_t CPU6502::LDA() {
 uint8_t CPU6502::LDX() {
     fetch();
     x = fetched;
-    SetFlag(Z, x == 0x00);
-    SetFlag(N, x & 0x80);
+    SetZN(x);
 
     return 1;
 }
@@ -725,8 +925,7 @@ uint8_t CPU6502::LDX() {
 uint8_t CPU6502::LDY() {
     fetch();
     y = fetched;
-    SetFlag(Z, y == 0x00);
-    SetFlag(N, y & 0x80);
+    SetZN(y);
 
     return 1;
 }
@@ -736,7 +935,7 @@ uint8_t CPU6502::LSR() {
     SetFlag(C, fetched & 0x01);
     uint16_t temp = fetched >> 1;
     SetFlag(N, temp & 0x80);
-    if (lookup[opcode].addrmode == &CPU6502::IMP) {
+    if (implied) {
         a = temp & 0x00FF;
     } else {
         write(addr_abs, temp & 0x00FF);
@@ -775,7 +974,7 @@ uint8_t CPU6502::PHA() {
 
 uint8_t CPU6502::PHP() {
     // Note: find out why B and U are set.
-    write((0x0100 + stkp), status | B | U);
+    write((0x0100 + stkp), GetStatus() | B | U);
     SetFlag(B, 0);
     SetFlag(U, 0);
     stkp--;
@@ -785,15 +984,15 @@ uint8_t CPU6502::PHP() {
 uint8_t CPU6502::PLA() {
     stkp++;
     a = read((0x0100 + stkp));
-    SetFlag(Z, a == 0x00);
-    SetFlag(N, a & 0x80);
+    SetZN(a);
     return 0;
 }
 
 uint8_t CPU6502::PLP() {
     stkp++;
-    status = read((0x0100 + stkp));
+    SetStatus(read((0x0100 + stkp)));
     SetFlag(U, 1);
+    checkIrq();
     return 0;
 }
 
@@ -803,7 +1002,7 @@ uint8_t CPU6502::ROL() {
     SetFlag(C, temp & 0xFF00);
     SetFlag(Z, (temp & 0x00FF) == 0x0000);
     SetFlag(N, 0x0080);
-    if (lookup[opcode].addrmode == &CPU6502::IMP) {
+    if (implied) {
         a = temp & 0x00FF;
     } else {
         write(addr_abs, temp & 0x00FF);
@@ -816,9 +1015,8 @@ uint8_t CPU6502::ROR() {
     uint16_t temp = (uint16_t)fetched | GetFlag(C) << 8;
     SetFlag(C, fetched & 0x01);
     temp = temp >> 1;
-    SetFlag(Z, (temp & 0x00FF) == 0x0000);
-    SetFlag(N, temp & 0x80);
-    if (lookup[opcode].addrmode == &CPU6502::IMP) {
+    SetZN(temp & 0x00FF);
+    if (implied) {
         a = temp & 0x00FF;
     } else {
         write(addr_abs, temp & 0x00FF);
@@ -828,7 +1026,7 @@ uint8_t CPU6502::ROR() {
 
 uint8_t CPU6502::RTI() {
     stkp++;
-    status = read(0x0100 + stkp);
+    SetStatus(read(0x0100 + stkp));
     status &= ~B;
     status &= ~U;
 
@@ -836,6 +1034,7 @@ uint8_t CPU6502::RTI() {
     pc = (uint16_t)read(0x0100 + stkp);
     stkp++;
     pc |= (uint16_t)read(0x0100 + stkp) << 8;
+    checkIrq();
     return 0;
 }
 
@@ -854,10 +1053,9 @@ uint8_t CPU6502::SBC() {
     uint16_t temp = (int16_t)a + (int16_t)invertedVal + (uint16_t)GetFlag(C);
 
     SetFlag(C, temp & 0xFF00);
-    SetFlag(Z, ((temp & 0x00FF) == 0x00));
+    SetZN(temp & 0x00FF);
     // Note: this is not clear to me yet.
     SetFlag(V, (temp ^ (uint16_t)a) & (temp ^ invertedVal) & 0x0080);
-    SetFlag(N, temp & 0x80);
 
     a = temp & 0x00FF;
     return 1;
@@ -895,29 +1093,25 @@ uint8_t CPU6502::STY() {
 
 uint8_t CPU6502::TAX() {
     x = a;
-    SetFlag(Z, x == 0x00);
-    SetFlag(N, x & 0x80);
+    SetZN(x);
     return 0;
 }
 
 uint8_t CPU6502::TAY() {
     y = a;
-    SetFlag(Z, y == 0x00);
-    SetFlag(N, y & 0x80);
+    SetZN(y);
     return 0;
 }
 
 uint8_t CPU6502::TSX() {
     x = stkp;
-    SetFlag(Z, x == 0x00);
-    SetFlag(N, x & 0x80);
+    SetZN(x);
     return 0;
 }
 
 uint8_t CPU6502::TXA() {
     a = x;
-    SetFlag(Z, x == 0x00);
-    SetFlag(N, x & 0x80);
+    SetZN(x);
     return 0;
 }
 
@@ -935,16 +1129,113 @@ uint8_t CPU6502::XXX() {
     return 0;
 }
 
+void CPU6502::saveState(CPUState &s) {
+    s = CPUState();
+    s.a = a;
+    s.x = x;
+    s.y = y;
+    s.stkp = stkp;
+    s.status = status;
+    s.opcode = opcode;
+    s.cycles = cycles;
+    s.pc = pc;
+    s.overshoot = overshoot;
+    s.instructions = instructions;
+#if defined(NES_CYCLE_CORE)
+    // Only an instruction in flight has an operand worth keeping. Between
+    // instructions the fields stay zero, as the other cores never set them.
+    if (micro) {
+        s.microStep = 1 + (micro - microcode[opcode].data());
+        s.fetched = fetched;
+        s.addr_abs = addr_abs;
+        s.addr_rel = addr_rel;
+        s.microBase = microBase;
+        s.microFlags = (implied ? CPUState::MICRO_IMPLIED : 0) |
+                       (crossed ? CPUState::MICRO_CROSSED : 0) |
+                       (prefetched ? CPUState::MICRO_PREFETCHED : 0);
+        s.branchExtra = branchExtra;
+#if defined(NES_PROFILE) || defined(NES_TRACE)
+        s.microCycles = microCycles;
+#endif
+    }
+#endif
+}
+
+void CPU6502::loadState(const CPUState &s) {
+    a = s.a;
+    x = s.x;
+    y = s.y;
+    stkp = s.stkp;
+    status = s.status;
+    opcode = s.opcode;
+    cycles = s.cycles;
+    fetched = s.fetched;
+    pc = s.pc;
+    addr_abs = s.addr_abs;
+    addr_rel = s.addr_rel;
+    overshoot = s.overshoot;
+    instructions = s.instructions;
+    implied = s.microFlags & CPUState::MICRO_IMPLIED;
+#if defined(NES_CYCLE_CORE)
+    // Nothing from before the load may stay in flight.
+    micro = s.microStep ? microcode[opcode].data() + s.microStep - 1 : nullptr;
+    microBase = s.microBase;
+    crossed = s.microFlags & CPUState::MICRO_CROSSED;
+    prefetched = s.microFlags & CPUState::MICRO_PREFETCHED;
+    branchExtra = s.branchExtra;
+#if defined(NES_PROFILE) || defined(NES_TRACE)
+    microCycles = s.microCycles;
+#endif
+#endif
+}
+
+uint32_t CPU6502::runCycles() const {
+#if defined(NES_JIT)
+    // Translated code keeps its own count while it runs.
+    return ran + (jit ? jit->inFlight() : 0);
+#else
+    return ran;
+#endif
+}
+
+void CPU6502::yield() {
+    yielded = true;
+#if defined(NES_JIT)
+    if (jit) {
+        jit->yield();
+    }
+#endif
+}
+
 bool CPU6502::complete() {
+#if defined(NES_CYCLE_CORE)
+    return micro == nullptr && cycles == 0;
+#else
     return cycles == 0;
+#endif
 }
 
-map<uint16_t, string> CPU6502::disassemble(uint16_t nStart, uint16_t nStop) {
-    uint32_t addr = nStart;
-    uint8_t value = 0x00, lo = 0x00, hi = 0x00;
-    map<uint16_t, string> mapLines;
-    uint16_t line_addr = 0;
+const char *CPU6502::mnemonic(uint8_t opcode) {
+    return names[opcode];
+}
+
+uint8_t CPU6502::length(uint8_t opcode) {
+    return lookup[opcode].length;
+}
+
+CPU6502::AddrMode CPU6502::addrMode(uint8_t opcode) {
+    return lookup[opcode].addrmode;
+}
+
+const char *CPU6502::modeName(AddrMode mode) {
+    static const char *const names[] = {"IMP", "IMM", "ZP0", "ZPX",
+                                        "ZPY", "REL", "ABS", "ABX",
+                                        "ABY", "IND", "IZX", "IZY"};
+    return names[(int)mode];
+}
 
+string CPU6502::formatInstruction(uint16_t addr, uint8_t opcode, uint8_t lo,
+                                  uint8_t hi) {
     auto hex = [](uint32_t n, uint8_t d) {
         string s(d, '0');
         for (int i = d - 1; i >= 0; i--, n >>= 4)
@@ -952,78 +1243,62 @@ map<uint16_t, string> CPU6502::disassemble(uint16_t nStart, uint16_t nStop) {
         return s;
     };
 
-    while (addr <= (uint32_t)nStop) {
-        line_addr = addr;
-
-        string sInst = "$" + hex(addr, 4) + ": ";
-
-        uint8_t opcode = bus->read(addr, true);
-        addr++;
-        sInst += lookup[opcode].name + " ";
+    string sInst = "$" + hex(addr, 4) + ": " + string(names[opcode]) + " ";
+    uint16_t word = (uint16_t)(hi << 8) | lo;
 
-        if (lookup[opcode].addrmode == &CPU6502::IMP) {
+    switch (lookup[opcode].addrmode) {
+        case AddrMode::IMP:
             sInst += " {IMP}";
-        } else if (lookup[opcode].addrmode == &CPU6502::IMM) {
-            value = bus->read(addr, true);
-            addr++;
-            sInst += "#$" + hex(value, 2) + " {IMM}";
-        } else if (lookup[opcode].addrmode == &CPU6502::ZP0) {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = 0x00;
+            break;
+        case AddrMode::IMM:
+            sInst += "#$" + hex(lo, 2) + " {IMM}";
+            break;
+        case AddrMode::ZP0:
             sInst += "$" + hex(lo, 2) + " {ZP0}";
-        } else if (lookup[opcode].addrmode == &CPU6502::ZPX) {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = 0x00;
+            break;
+        case AddrMode::ZPX:
             sInst += "$" + hex(lo, 2) + ", X {ZPX}";
-        } else if (lookup[opcode].addrmode == &CPU6502::ZPY) {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = 0x00;
+            break;
+        case AddrMode::ZPY:
             sInst += "$" + hex(lo, 2) + ", Y {ZPY}";
-        } else if (lookup[opcode].addrmode == &CPU6502::IZX) {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = 0x00;
+            break;
+        case AddrMode::IZX:
             sInst += "($" + hex(lo, 2) + ", X) {IZX}";
-        } else if (lookup[opcode].addrmode == &CPU6502::IZY) {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = 0x00;
+            break;
+        case AddrMode::IZY:
             sInst += "($" + hex(lo, 2) + "), Y {IZY}";
-        } else if (lookup[opcode].addrmode == &CPU6502::ABS) {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = bus->read(addr, true);
-            addr++;
-            sInst += "$" + hex((uint16_t)(hi << 8) | lo, 4) + " {ABS}";
-        } else if (lookup[opcode].addrmode == &CPU6502::ABX) {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = bus->read(addr, true);
-            addr++;
-            sInst += "$" + hex((uint16_t)(hi << 8) | lo, 4) + ", X {ABX}";
-        } else if (lookup[opcode].addrmode == &CPU6502::ABY) {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = bus->read(addr, true);
-            addr++;
-            sInst += "$" + hex((uint16_t)(hi << 8) | lo, 4) + ", Y {ABY}";
-        } else if (lookup[opcode].addrmode == &CPU6502::IND) {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = bus->read(addr, true);
-            addr++;
-            sInst += "($" + hex((uint16_t)(hi << 8) | lo, 4) + ") {IND}";
-        } else if (lookup[opcode].addrmode == &CPU6502::REL) {
-            value = bus->read(addr, true);
-            addr++;
-            sInst +=
-                "$" + hex(value, 2) + " [$" + hex(addr + value, 4) + "] {REL}";
-        }
+            break;
+        case AddrMode::ABS:
+            sInst += "$" + hex(word, 4) + " {ABS}";
+            break;
+        case AddrMode::ABX:
+            sInst += "$" + hex(word, 4) + ", X {ABX}";
+            break;
+        case AddrMode::ABY:
+            sInst += "$" + hex(word, 4) + ", Y {ABY}";
+            break;
+        case AddrMode::IND:
+            sInst += "($" + hex(word, 4) + ") {IND}";
+            break;
+        case AddrMode::REL:
+            sInst += "$" + hex(lo, 2) + " [$" + hex(addr + 2 + lo, 4) +
+                     "] {REL}";
+            break;
+    }
+    return sInst;
+}
+
+map<uint16_t, string> CPU6502::disassemble(uint16_t nStart, uint16_t nStop) {
+    uint32_t addr = nStart;
+    map<uint16_t, string> mapLines;
 
-        mapLines[line_addr] = sInst;
+    while (addr <= (uint32_t)nStop) {
+        uint8_t opcode = bus->read(addr, true);
+        uint8_t len = lookup[opcode].length;
+        uint8_t lo = len > 1 ? bus->read(addr + 1, true) : 0x00;
+        uint8_t hi = len > 2 ? bus->read(addr + 2, true) : 0x00;
+        mapLines[addr] = formatInstruction(addr, opcode, lo, hi);
+        addr += len;
     }
 
     return mapLines;
@@ -0,0 +1,509 @@
+#include "CPU6502.h"
+
+#if defined(NES_CYCLE_CORE)
+
+#if defined(NES_SWITCH_CORE) || defined(NES_PREDECODE) || defined(NES_JIT)
+#error "ACCURACY=cycle replaces the CORE, PREDECODE and JIT options"
+#endif
+
+#include "Bus.h"
+#include "CPU6502Opcodes.h"
+#include "Profile.h"
+#include "Trace.h"
+
+namespace {
+
+// One cycle of an instruction program. Every entry but END is one bus
+// cycle, except for the conditional ones, which are skipped when their
+// condition does not hold. OPERATE is or'ed in to run the operation at the
+// end of that cycle; on a NONE cycle the access is the operation's own.
+enum Cycle : uint8_t {
+    END,
+    NONE,
+    IMPLIED,         // Dummy read of pc; the operand is a
+    IMMEDIATE,       // The operand is at pc++
+    ZP,              // addr_abs = read(pc++)
+    ZP_X,            // Dummy read of addr_abs, then add x within page 0
+    ZP_Y,
+    ABS_LO,          // addr_abs = read(pc++)
+    ABS_HI,          // addr_abs |= read(pc++) << 8
+    ABS_HI_X,        // ... then add x, noting a page crossing
+    ABS_HI_Y,
+    ZP_POINTER,      // microBase = read(pc++)
+    IZX_POINTER,     // Dummy read of the pointer, then add x
+    POINTER_LO,      // addr_abs = read(pointer)
+    POINTER_HI,      // addr_abs |= read(pointer + 1) << 8
+    POINTER_HI_Y,    // ... then add y, noting a page crossing
+    FIX,             // Dummy read before the high byte is fixed up
+    FIX_IF_CROSSED,  // The same, only when a page was crossed
+    RMW_READ,        // Read the operand
+    RMW_WRITE,       // Write it back unchanged
+    STACK,           // Dummy read of the stack
+    BRANCH,          // addr_rel = read(pc++)
+    BRANCH_TAKEN,    // Dummy read at the next instruction, when taken
+    BRANCH_CROSSED,  // Dummy read at the unfixed target, when it crosses
+    PUSH_PC_HI,
+    PUSH_PC_LO,
+    PULL_PC_LO,
+    PULL_PC_HI,
+    PULL_STATUS,     // As RTI: B and U cleared
+    RTS_INC,         // Dummy read of pc, then pc++
+    JSR_JUMP,        // pc = addr_abs | read(pc) << 8
+    JMP_HI,          // pc = addr_abs | read(pc++) << 8
+    IND_LO,          // Read the target through the pointer in addr_abs
+    IND_HI,          // ... with the pointer's high byte never carried
+    BRK_OPERAND,     // Dummy read of pc, which skips two bytes
+    BRK_PUSH_STATUS,
+    VECTOR_LO,
+    VECTOR_HI,
+    OPERATE = 0x80
+};
+
+}  // namespace
+
+// Each program follows the bus cycles of the 6502 for its addressing mode
+// and kind of operation, and leaves the operations themselves to the same
+// functions the lookup core calls. Programs are built from the same opcode
+// table as lookup, and their totals match it (plus the same page
+// crossing and branch penalties); opcodes with fewer bus cycles than that,
+// the unofficial ones, idle for the rest.
+constexpr array<array<uint8_t, 8>, 256> CPU6502::microcode = [] {
+    using Op = CPU6502::Operation;
+    using Mode = CPU6502::AddrMode;
+    struct Row {
+        Op operate;
+        Mode addrmode;
+    };
+    constexpr Row rows[256] = {
+#define CPU6502_MICROCODE_ROW(code, name, op, mode, cyc) {Op::op, Mode::mode},
+        CPU6502_OPCODES(CPU6502_MICROCODE_ROW)
+#undef CPU6502_MICROCODE_ROW
+    };
+    array<array<uint8_t, 8>, 256> programs{};
+
+    for (int code = 0; code < 256; code++) {
+        const Row &inst = rows[code];
+        uint8_t p[8] = {};
+        int n = 0;
+        auto add = [&](uint8_t entry) { p[n++] = entry; };
+
+        bool rmw = false, write = false, penalty = false;
+        switch (inst.operate) {
+            case Op::BCC: case Op::BCS: case Op::BEQ: case Op::BMI:
+            case Op::BNE: case Op::BPL: case Op::BVC: case Op::BVS:
+                add(BRANCH | OPERATE);
+                add(BRANCH_TAKEN);
+                add(BRANCH_CROSSED);
+                break;
+            case Op::BRK:
+                add(BRK_OPERAND);
+                add(PUSH_PC_HI);
+                add(PUSH_PC_LO);
+                add(BRK_PUSH_STATUS);
+                add(VECTOR_LO);
+                add(VECTOR_HI);
+                break;
+            case Op::JSR:
+                add(ABS_LO);
+                add(STACK);
+                add(PUSH_PC_HI);
+                add(PUSH_PC_LO);
+                add(JSR_JUMP);
+                break;
+            case Op::RTS:
+                add(IMPLIED);
+                add(STACK);
+                add(PULL_PC_LO);
+                add(PULL_PC_HI);
+                add(RTS_INC);
+                break;
+            case Op::RTI:
+                add(IMPLIED);
+                add(STACK);
+                add(PULL_STATUS);
+                add(PULL_PC_LO);
+                add(PULL_PC_HI);
+                break;
+            case Op::PHA: case Op::PHP:
+                add(IMPLIED);
+                add(NONE | OPERATE);
+                break;
+            case Op::PLA: case Op::PLP:
+                add(IMPLIED);
+                add(STACK);
+                add(NONE | OPERATE);
+                break;
+            case Op::JMP:
+                add(ABS_LO);
+                if (inst.addrmode == Mode::IND) {
+                    add(ABS_HI);
+                    add(IND_LO);
+                    add(IND_HI);
+                } else {
+                    add(JMP_HI);
+                }
+                break;
+            case Op::ASL: case Op::LSR: case Op::ROL: case Op::ROR:
+            case Op::INC: case Op::DEC:
+                rmw = true;
+                break;
+            case Op::STA: case Op::STX: case Op::STY:
+                write = true;
+                break;
+            // The operations whose page crossing costs a cycle.
+            case Op::ADC: case Op::AND: case Op::CMP: case Op::EOR:
+            case Op::LDA: case Op::LDX: case Op::LDY: case Op::SBC:
+                penalty = true;
+                break;
+            default:
+                break;
+        }
+
+        if (n == 0) {
+            bool indexed = false;
+            switch (inst.addrmode) {
+                case Mode::IMP:
+                    add(IMPLIED | OPERATE);
+                    break;
+                case Mode::IMM:
+                    add(IMMEDIATE | OPERATE);
+                    break;
+                case Mode::ZP0:
+                    add(ZP);
+                    break;
+                case Mode::ZPX:
+                    add(ZP);
+                    add(ZP_X);
+                    break;
+                case Mode::ZPY:
+                    add(ZP);
+                    add(ZP_Y);
+                    break;
+                case Mode::ABS:
+                    add(ABS_LO);
+                    add(ABS_HI);
+                    break;
+                case Mode::ABX:
+                    add(ABS_LO);
+                    add(ABS_HI_X);
+                    indexed = true;
+                    break;
+                case Mode::ABY:
+                    add(ABS_LO);
+                    add(ABS_HI_Y);
+                    indexed = true;
+                    break;
+                case Mode::IZX:
+                    add(ZP_POINTER);
+                    add(IZX_POINTER);
+                    add(POINTER_LO);
+                    add(POINTER_HI);
+                    break;
+                case Mode::IZY:
+                    add(ZP_POINTER);
+                    add(POINTER_LO);
+                    add(POINTER_HI_Y);
+                    indexed = true;
+                    break;
+                default:  // REL and IND only appear above
+                    break;
+            }
+
+            if (inst.addrmode != Mode::IMP && inst.addrmode != Mode::IMM) {
+                if (indexed && (rmw || write)) {
+                    add(FIX);
+                } else if (indexed && penalty) {
+                    add(FIX_IF_CROSSED);
+                }
+                if (rmw) {
+                    add(RMW_READ);
+                    add(RMW_WRITE);
+                }
+                add(NONE | OPERATE);
+            }
+        }
+
+        for (int k = 0; k < n; k++) programs[code][k] = p[k];
+    }
+    return programs;
+}();
+
+bool CPU6502::due(uint8_t entry) {
+    switch (entry & ~OPERATE) {
+        case FIX_IF_CROSSED:
+            return crossed;
+        case BRANCH_TAKEN:
+            return branchExtra >= 1;
+        case BRANCH_CROSSED:
+            return branchExtra >= 2;
+        default:
+            return true;
+    }
+}
+
+bool CPU6502::cycle(uint8_t entry) {
+    if (!due(entry)) {
+        return false;
+    }
+
+    switch (entry & ~OPERATE) {
+        case IMPLIED:
+            read(pc);
+            fetched = a;
+            break;
+        case IMMEDIATE:
+            addr_abs = pc;
+            pc++;
+            break;
+        case ZP:
+        case ABS_LO:
+            addr_abs = read(pc);
+            pc++;
+            break;
+        case ZP_X:
+        case ZP_Y:
+            read(addr_abs);
+            addr_abs = (addr_abs + ((entry & ~OPERATE) == ZP_X ? x : y)) &
+                       0x00FF;
+            break;
+        case ABS_HI:
+            addr_abs |= read(pc) << 8;
+            pc++;
+            break;
+        case ABS_HI_X:
+        case ABS_HI_Y:
+            microBase = addr_abs | (read(pc) << 8);
+            pc++;
+            addr_abs = microBase + ((entry & ~OPERATE) == ABS_HI_X ? x : y);
+            crossed = (addr_abs & 0xFF00) != (microBase & 0xFF00);
+            break;
+        case ZP_POINTER:
+            microBase = read(pc);
+            pc++;
+            break;
+        case IZX_POINTER:
+            read(microBase);
+            microBase = (microBase + x) & 0x00FF;
+            break;
+        case POINTER_LO:
+            addr_abs = read(microBase);
+            break;
+        case POINTER_HI:
+            addr_abs |= read((microBase + 1) & 0x00FF) << 8;
+            break;
+        case POINTER_HI_Y: {
+            uint16_t base = addr_abs | (read((microBase + 1) & 0x00FF) << 8);
+            microBase = base;
+            addr_abs = base + y;
+            crossed = (addr_abs & 0xFF00) != (base & 0xFF00);
+            break;
+        }
+        case FIX:
+        case FIX_IF_CROSSED:
+            read((microBase & 0xFF00) | (addr_abs & 0x00FF));
+            break;
+        case RMW_READ:
+            fetched = read(addr_abs);
+            prefetched = true;
+            break;
+        case RMW_WRITE:
+            write(addr_abs, fetched);
+            break;
+        case STACK:
+            read(0x0100 + stkp);
+            break;
+        case BRANCH:
+            addr_rel = read(pc);
+            pc++;
+            if (addr_rel & 0x80) {
+                addr_rel |= 0xFF00;
+            }
+            microBase = pc;
+            break;
+        case BRANCH_TAKEN:
+            read(microBase);
+            break;
+        case BRANCH_CROSSED:
+            read((microBase & 0xFF00) | (addr_abs & 0x00FF));
+            break;
+        case PUSH_PC_HI:
+            write(0x0100 + stkp, (pc >> 8) & 0x00FF);
+            stkp--;
+            break;
+        case PUSH_PC_LO:
+            write(0x0100 + stkp, pc & 0x00FF);
+            stkp--;
+            break;
+        case PULL_PC_LO:
+            stkp++;
+            pc = read(0x0100 + stkp);
+            break;
+        case PULL_PC_HI:
+            stkp++;
+            pc |= read(0x0100 + stkp) << 8;
+            break;
+        case PULL_STATUS:
+            stkp++;
+            SetStatus(read(0x0100 + stkp));
+            status &= ~B;
+            status &= ~U;
+            checkIrq();
+            break;
+        case RTS_INC:
+            read(pc);
+            pc++;
+            break;
+        case JSR_JUMP:
+            addr_abs |= read(pc) << 8;
+            pc = addr_abs;
+            break;
+        case JMP_HI:
+            addr_abs |= read(pc) << 8;
+            pc++;
+            pc = addr_abs;
+            break;
+        case IND_LO:
+            microBase = addr_abs;
+            addr_abs = read(microBase);
+            break;
+        case IND_HI:
+            addr_abs |= read((microBase & 0xFF00) | ((microBase + 1) & 0x00FF))
+                        << 8;
+            pc = addr_abs;
+            break;
+        // As BRK(): the pushed pc skips two bytes and the status is pushed
+        // with I already set and without moving the stack pointer.
+        case BRK_OPERAND:
+            read(pc);
+            addr_abs = pc;
+            pc += 2;
+            SetFlag(I, 1);
+            break;
+        case BRK_PUSH_STATUS:
+            SetFlag(B, 1);
+            write(0x0100 + stkp, GetStatus());
+            SetFlag(B, 0);
+            break;
+        case VECTOR_LO:
+            microBase = read(0xFFFE);
+            break;
+        case VECTOR_HI:
+            pc = microBase | (read(0xFFFF) << 8);
+            break;
+        default:  // NONE
+            break;
+    }
+
+    if (entry & OPERATE) {
+        operate();
+    }
+    return true;
+}
+
+void CPU6502::operate() {
+    uint8_t before = cycles;
+    uint8_t extra = (this->*operations[(int)lookup[opcode].operate])();
+    prefetched = false;
+    branchExtra = cycles - before;
+    cycles += crossed & extra;
+}
+
+void CPU6502::clock() {
+    loadFlags();
+    if (!micro) {
+        if (cycles > 0) {
+            // Owed by reset(), irq() or nmi().
+            cycles--;
+            storeFlags();
+            return;
+        }
+
+#if defined(NES_TRACE)
+        if (trace) {
+            traceInstruction();
+        }
+#endif
+        opcode = read(pc);
+        SetFlag(U, 1);
+        pc++;
+        const INSTRUCTION &inst = lookup[opcode];
+        cycles = inst.cycles;
+        implied = inst.addrmode == AddrMode::IMP;
+        crossed = false;
+        branchExtra = 0;
+        micro = microcode[opcode].data();
+#if defined(NES_PROFILE) || defined(NES_TRACE)
+        microCycles = 1;
+#endif
+    } else {
+        while (*micro != END && !cycle(*micro++)) {
+        }
+#if defined(NES_PROFILE) || defined(NES_TRACE)
+        microCycles++;
+#endif
+    }
+    if (cycles > 0) {
+        cycles--;
+    }
+
+    while (*micro != END && !due(*micro)) {
+        micro++;
+    }
+    if (*micro == END && cycles == 0) {
+        SetFlag(U, 1);
+        instructions++;
+        micro = nullptr;
+#if defined(NES_PROFILE)
+        Profile::record(opcode, microCycles);
+#endif
+#if defined(NES_TRACE)
+        if (trace) {
+            trace->cycle += microCycles;
+        }
+#endif
+    }
+    storeFlags();
+}
+
+uint8_t CPU6502::step() {
+    // Whatever is in flight or owed counts towards this step, as it does
+    // for the instruction-atomic step().
+    uint8_t elapsed = 0;
+    while (!complete()) {
+        clock();
+        elapsed++;
+    }
+    do {
+        clock();
+        elapsed++;
+    } while (!complete());
+    return elapsed;
+}
+
+// Clocked here rather than through step() so that ran always says which
+// cycle the access in progress is on.
+uint32_t CPU6502::run(uint32_t cycleBudget) {
+    ran = 0;
+    yielded = false;
+    while (!complete()) {
+        clock();
+        ran++;
+    }
+
+    int64_t remaining = (int64_t)cycleBudget - overshoot - ran;
+    while (remaining > 0 && !yielded) {
+        do {
+            clock();
+            ran++;
+            remaining--;
+        } while (!complete());
+    }
+
+    // A yield leaves budget over, which is not carried.
+    overshoot = remaining < 0 ? (uint32_t)-remaining : 0;
+    uint32_t elapsed = ran;
+    ran = 0;
+    return elapsed;
+}
+
+#endif
@@ -0,0 +1,1194 @@
+#include "CPU6502Jit.h"
+
+#if defined(NES_JIT)
+
+#if !defined(__x86_64__)
+#error "JIT=1 needs an x86-64 host"
+#endif
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "CPU6502Fused.h"
+#include "Hex.h"
+
+namespace {
+
+constexpr size_t BUFFER_SIZE = 16 << 20;
+
+// Slack past the end of the buffer, so patching a jump emitted into a full
+// buffer stays inside the mapping.
+constexpr size_t BUFFER_GUARD = 64;
+
+// Space left free for each translation; no block comes close.
+constexpr size_t MAX_BLOCK_BYTES = 32 * 1024;
+
+constexpr int MAX_INSTRUCTIONS = 64;
+
+// Interpreted visits to an address before the block there is translated.
+constexpr uint8_t HOT = 8;
+constexpr uint8_t COLD = 0xFF;  // Cannot be translated
+
+enum Reg : uint8_t {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum Cond : uint8_t {
+    CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+    CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE, CC_LE, CC_G
+};
+
+// ALU extensions for the 0x80/0x81 immediate forms.
+enum Alu : uint8_t { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5,
+                     ALU_XOR = 6, ALU_CMP = 7 };
+
+// Opcodes of the "op r/m, r" forms.
+enum : uint8_t { OP_ADD = 0x01, OP_OR = 0x09, OP_ADC8 = 0x10, OP_AND = 0x21,
+                 OP_SUB8 = 0x28, OP_SUB = 0x29, OP_XOR = 0x31, OP_TEST8 = 0x84,
+                 OP_TEST = 0x85, OP_MOV = 0x89 };
+
+// Just enough of an x86-64 assembler for the translator. Memory operands
+// are always [base + disp32]. Byte registers are limited to al, cl, dl and
+// r8b and up, which encode the same with or without a REX prefix.
+class Emitter {
+   public:
+    Emitter(uint8_t *p, uint8_t *end) : p(p), end(end) {
+    }
+
+    uint8_t *here() const {
+        return p;
+    }
+
+    bool overflowed() const {
+        return overflow;
+    }
+
+    void byte(uint8_t b) {
+        if (p < end) {
+            *p++ = b;
+        } else {
+            overflow = true;
+        }
+    }
+
+    void u16(uint16_t v) {
+        byte(v & 0xFF);
+        byte(v >> 8);
+    }
+
+    void u32(uint32_t v) {
+        for (int i = 0; i < 4; i++, v >>= 8) byte(v & 0xFF);
+    }
+
+    void u64(uint64_t v) {
+        for (int i = 0; i < 8; i++, v >>= 8) byte(v & 0xFF);
+    }
+
+    // movzx r32, byte/word [base + disp]
+    void movzx8(uint8_t dst, uint8_t base, int32_t disp) {
+        rex(false, dst, base);
+        byte(0x0F);
+        byte(0xB6);
+        mem(dst, base, disp);
+    }
+
+    void movzx16(uint8_t dst, uint8_t base, int32_t disp) {
+        rex(false, dst, base);
+        byte(0x0F);
+        byte(0xB7);
+        mem(dst, base, disp);
+    }
+
+    // mov r64, [base + disp] and back
+    void load64(uint8_t dst, uint8_t base, int32_t disp) {
+        rex(true, dst, base);
+        byte(0x8B);
+        mem(dst, base, disp);
+    }
+
+    void store64(uint8_t base, int32_t disp, uint8_t src) {
+        rex(true, src, base);
+        byte(0x89);
+        mem(src, base, disp);
+    }
+
+    // mov byte [base + disp], r8 / imm8 and mov word [base + disp], imm16
+    void store8(uint8_t base, int32_t disp, uint8_t src) {
+        rex(false, src, base);
+        byte(0x88);
+        mem(src, base, disp);
+    }
+
+    void store8i(uint8_t base, int32_t disp, uint8_t imm) {
+        rex(false, 0, base);
+        byte(0xC6);
+        mem(0, base, disp);
+        byte(imm);
+    }
+
+    void store16i(uint8_t base, int32_t disp, uint16_t imm) {
+        byte(0x66);
+        rex(false, 0, base);
+        byte(0xC7);
+        mem(0, base, disp);
+        u16(imm);
+    }
+
+    // alu byte [base + disp], imm8 and test byte [base + disp], imm8
+    void alu8mi(uint8_t alu, uint8_t base, int32_t disp, uint8_t imm) {
+        rex(false, 0, base);
+        byte(0x80);
+        mem(alu, base, disp);
+        byte(imm);
+    }
+
+    void test8mi(uint8_t base, int32_t disp, uint8_t imm) {
+        rex(false, 0, base);
+        byte(0xF6);
+        mem(0, base, disp);
+        byte(imm);
+    }
+
+    // add qword [base + disp], imm8
+    void add64mi(uint8_t base, int32_t disp, int8_t imm) {
+        rex(true, 0, base);
+        byte(0x83);
+        mem(0, base, disp);
+        byte(imm);
+    }
+
+    // op dst, src in 8, 32 or 64 bits
+    void rr8(uint8_t op, uint8_t dst, uint8_t src) {
+        rex(false, src, dst);
+        byte(op & ~1);
+        modrr(src, dst);
+    }
+
+    void rr32(uint8_t op, uint8_t dst, uint8_t src) {
+        rex(false, src, dst);
+        byte(op);
+        modrr(src, dst);
+    }
+
+    void rr64(uint8_t op, uint8_t dst, uint8_t src) {
+        rex(true, src, dst);
+        byte(op);
+        modrr(src, dst);
+    }
+
+    // alu r32/r64, imm32
+    void ri32(uint8_t alu, uint8_t dst, int32_t imm) {
+        rex(false, 0, dst);
+        byte(0x81);
+        modrr(alu, dst);
+        u32(imm);
+    }
+
+    void ri64(uint8_t alu, uint8_t dst, int32_t imm) {
+        rex(true, 0, dst);
+        byte(0x81);
+        modrr(alu, dst);
+        u32(imm);
+    }
+
+    void shl32(uint8_t dst, uint8_t n) {
+        rex(false, 0, dst);
+        byte(0xC1);
+        modrr(4, dst);
+        byte(n);
+    }
+
+    void bt32(uint8_t dst, uint8_t bit) {
+        rex(false, 0, dst);
+        byte(0x0F);
+        byte(0xBA);
+        modrr(4, dst);
+        byte(bit);
+    }
+
+    void setcc(uint8_t cc, uint8_t dst) {
+        rex(false, 0, dst);
+        byte(0x0F);
+        byte(0x90 + cc);
+        modrr(0, dst);
+    }
+
+    // movzx r32, r8
+    void movzx8r(uint8_t dst, uint8_t src) {
+        rex(false, dst, src);
+        byte(0x0F);
+        byte(0xB6);
+        modrr(dst, src);
+    }
+
+    void mov32i(uint8_t dst, uint32_t imm) {
+        rex(false, 0, dst);
+        byte(0xB8 + (dst & 7));
+        u32(imm);
+    }
+
+    void mov64i(uint8_t dst, uint64_t imm) {
+        rex(true, 0, dst);
+        byte(0xB8 + (dst & 7));
+        u64(imm);
+    }
+
+    void call(uint8_t reg) {
+        rex(false, 0, reg);
+        byte(0xFF);
+        modrr(2, reg);
+    }
+
+    void jmp(uint8_t reg) {
+        rex(false, 0, reg);
+        byte(0xFF);
+        modrr(4, reg);
+    }
+
+    void push(uint8_t reg) {
+        rex(false, 0, reg);
+        byte(0x50 + (reg & 7));
+    }
+
+    void pop(uint8_t reg) {
+        rex(false, 0, reg);
+        byte(0x58 + (reg & 7));
+    }
+
+    void ret() {
+        byte(0xC3);
+    }
+
+    // Forward jumps return their rel32 field, to be bound later.
+    uint8_t *jcc(uint8_t cc) {
+        byte(0x0F);
+        byte(0x80 + cc);
+        uint8_t *at = p;
+        u32(0);
+        return at;
+    }
+
+    uint8_t *jmp() {
+        byte(0xE9);
+        uint8_t *at = p;
+        u32(0);
+        return at;
+    }
+
+    void jcc(uint8_t cc, uint8_t *target) {
+        patch(jcc(cc), target);
+    }
+
+    void jmp(uint8_t *target) {
+        patch(jmp(), target);
+    }
+
+    void bind(uint8_t *at) {
+        patch(at, p);
+    }
+
+    static void patch(uint8_t *at, uint8_t *target) {
+        int32_t rel = target - (at + 4);
+        memcpy(at, &rel, 4);
+    }
+
+    static uint8_t *target(uint8_t *at) {
+        int32_t rel;
+        memcpy(&rel, at, 4);
+        return at + 4 + rel;
+    }
+
+   private:
+    uint8_t *p;
+    uint8_t *end;
+    bool overflow = false;
+
+    void rex(bool w, uint8_t reg, uint8_t rm) {
+        uint8_t r = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+        if (r != 0x40) {
+            byte(r);
+        }
+    }
+
+    void modrr(uint8_t reg, uint8_t rm) {
+        byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void mem(uint8_t reg, uint8_t base, int32_t disp) {
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP) {
+            byte(0x24);
+        }
+        u32(disp);
+    }
+};
+
+int32_t offset(const void *field, const void *object) {
+    return static_cast<const uint8_t *>(field) -
+           static_cast<const uint8_t *>(object);
+}
+
+}  // namespace
+
+// Register use in translated code: rbx holds the CPU, r12 the Context, r13
+// the cycles remaining, r14 the cycles elapsed and r15 the bus page table.
+// All five are callee-saved, so they survive calls into handlers. r14 is
+// stored to the Context before every call out, so that the devices the
+// call reaches can tell the time (CPU6502::runCycles()).
+struct CPU6502Jit::Translator {
+    using Op = CPU6502::Operation;
+    using Mode = CPU6502::AddrMode;
+
+    CPU6502Jit &jit;
+    Emitter e;
+
+    // Exits taken mid-block: store pc (after accounting for the instruction
+    // if cycles is set) and leave.
+    struct Stub {
+        uint8_t *at;
+        uint16_t pc;
+        uint8_t cycles;
+    };
+
+    // Jumps to the block at pc, leaving through a stub until linked.
+    struct Slot {
+        uint8_t *at;
+        uint16_t pc;
+    };
+
+    vector<Stub> stubs;
+    vector<Slot> slots;
+    bool chain;
+
+    Translator(CPU6502Jit &jit)
+        : jit(jit),
+          e(jit.cursor, jit.buffer + jit.bufferSize),
+          chain(!jit.crossChecking) {
+    }
+
+    // Per instruction bookkeeping: the opcode register, the instruction
+    // count and the cycle budget.
+    void opcode(uint8_t op) {
+        e.store8i(RBX, jit.offOpcode, op);
+    }
+
+    void account(uint8_t cycles, uint16_t next) {
+        e.add64mi(RBX, jit.offInstructions, 1);
+        e.ri64(ALU_ADD, R14, cycles);
+        e.ri64(ALU_SUB, R13, cycles);
+        stubs.push_back({e.jcc(CC_LE), next, 0});
+    }
+
+    void slot(uint16_t pc) {
+        slots.push_back({e.jmp(), pc});
+    }
+
+    // Z and N from al, as CPU6502::SetZN. Clobbers rcx and rdx.
+    void zn() {
+#if defined(NES_LAZY_FLAGS)
+        e.store8(RBX, jit.offZResult, RAX);
+        e.store8(RBX, jit.offNResult, RAX);
+#else
+        e.movzx8(RCX, RBX, jit.offStatus);
+        e.ri32(ALU_AND, RCX, (uint8_t) ~(CPU6502::Z | CPU6502::N));
+        e.rr8(OP_TEST8, RAX, RAX);
+        e.setcc(CC_E, RDX);
+        e.movzx8r(RDX, RDX);
+        e.rr32(OP_ADD, RDX, RDX);
+        e.rr32(OP_OR, RCX, RDX);
+        e.rr32(OP_MOV, RDX, RAX);
+        e.ri32(ALU_AND, RDX, CPU6502::N);
+        e.rr32(OP_OR, RCX, RDX);
+        e.store8(RBX, jit.offStatus, RCX);
+#endif
+    }
+
+    void znConst(uint8_t v) {
+#if defined(NES_LAZY_FLAGS)
+        e.store8i(RBX, jit.offZResult, v);
+        e.store8i(RBX, jit.offNResult, v);
+#else
+        uint8_t bits = (v == 0x00 ? CPU6502::Z : 0) | (v & CPU6502::N);
+        e.alu8mi(ALU_AND, RBX, jit.offStatus,
+                 (uint8_t) ~(CPU6502::Z | CPU6502::N));
+        if (bits) {
+            e.alu8mi(ALU_OR, RBX, jit.offStatus, bits);
+        }
+#endif
+    }
+
+    // Sets or clears a status bit that is never tracked lazily.
+    void flag(uint8_t bit, bool v) {
+        if (v) {
+            e.alu8mi(ALU_OR, RBX, jit.offStatus, bit);
+        } else {
+            e.alu8mi(ALU_AND, RBX, jit.offStatus, (uint8_t)~bit);
+        }
+    }
+
+    // Reads addr into eax: straight from the page when it has a read
+    // pointer, otherwise through CPU6502::read().
+    void read(uint16_t addr) {
+        int32_t page = (addr >> 8) * sizeof(Bus::Page);
+        e.load64(RAX, R15, page + offsetof(Bus::Page, read));
+        e.rr64(OP_TEST, RAX, RAX);
+        uint8_t *slow = e.jcc(CC_E);
+        e.movzx8(RAX, RAX, addr & 0x00FF);
+        uint8_t *done = e.jmp();
+        e.bind(slow);
+        e.store64(R12, offsetof(Context, elapsed), R14);
+        e.rr64(OP_MOV, RDI, RBX);
+        e.mov32i(RSI, addr);
+        e.mov64i(RAX, (uint64_t)&CPU6502Jit::readByte);
+        e.call(RAX);
+        e.movzx8r(RAX, RAX);
+        e.bind(done);
+    }
+
+    // After an instruction that read through read(): a read without a read
+    // pointer can yield (reading $4015 reschedules), and the block ends
+    // here if it did, as it does after write().
+    void yielded(uint16_t next) {
+        e.alu8mi(ALU_CMP, R12, offsetof(Context, dirty), 0);
+        stubs.push_back({e.jcc(CC_NE), next, 0});
+    }
+
+    // Writes the CPU field at field to addr. Writes without a write pointer
+    // may land in translated code; if one did, the block ends here.
+    void write(uint16_t addr, int32_t field, uint16_t next, uint8_t cycles) {
+        int32_t page = (addr >> 8) * sizeof(Bus::Page);
+        e.movzx8(RDX, RBX, field);
+        e.load64(RAX, R15, page + offsetof(Bus::Page, write));
+        e.rr64(OP_TEST, RAX, RAX);
+        uint8_t *slow = e.jcc(CC_E);
+        e.store8(RAX, addr & 0x00FF, RDX);
+        uint8_t *done = e.jmp();
+        e.bind(slow);
+        e.store64(R12, offsetof(Context, elapsed), R14);
+        e.rr64(OP_MOV, RDI, RBX);
+        e.mov32i(RSI, addr);
+        e.mov64i(RAX, (uint64_t)&CPU6502Jit::writeByte);
+        e.call(RAX);
+        e.alu8mi(ALU_CMP, R12, offsetof(Context, dirty), 0);
+        stubs.push_back({e.jcc(CC_NE), next, cycles});
+        e.bind(done);
+    }
+
+    // Anything without an inline translation: the fused handler, with pc
+    // already past the instruction as the handler expects.
+    void handler(uint8_t op, uint16_t operand, uint16_t next) {
+        opcode(op);
+        e.store16i(RBX, jit.offPc, next);
+        e.store64(R12, offsetof(Context, elapsed), R14);
+        e.rr64(OP_MOV, RDI, RBX);
+        e.mov32i(RSI, operand);
+        e.mov64i(RAX, (uint64_t)CPU6502::handlers[op]);
+        e.call(RAX);
+        e.movzx8r(RAX, RAX);
+        e.alu8mi(ALU_OR, RBX, jit.offStatus, CPU6502::U);
+        e.ri32(ALU_ADD, RAX, CPU6502::lookup[op].cycles);
+        e.add64mi(RBX, jit.offInstructions, 1);
+        e.rr64(OP_ADD, R14, RAX);
+        e.rr64(OP_SUB, R13, RAX);
+        e.jcc(CC_LE, jit.exitNoLink);
+        e.alu8mi(ALU_CMP, R12, offsetof(Context, dirty), 0);
+        e.jcc(CC_NE, jit.exitNoLink);
+    }
+
+    // After an instruction that left its target in pc: jump to the block
+    // there if there is one.
+    void dispatch() {
+        if (!chain) {
+            e.jmp(jit.exitNoLink);
+            return;
+        }
+        e.movzx16(RAX, RBX, jit.offPc);
+        e.mov64i(RCX, (uint64_t)jit.entries.data());
+        // mov rax, [rcx + rax * 8]
+        e.byte(0x48);
+        e.byte(0x8B);
+        e.byte(0x04);
+        e.byte(0xC1);
+        e.rr64(OP_TEST, RAX, RAX);
+        e.jcc(CC_E, jit.exitNoLink);
+        e.jmp(RAX);
+    }
+
+    // Tests the branch condition of op and returns the jump taken when the
+    // branch is.
+    uint8_t *branchTaken(Op op) {
+        uint8_t flag = 0;
+        bool whenSet = true;
+        switch (op) {
+            case Op::BCC: flag = CPU6502::C; whenSet = false; break;
+            case Op::BCS: flag = CPU6502::C; break;
+            case Op::BEQ: flag = CPU6502::Z; break;
+            case Op::BNE: flag = CPU6502::Z; whenSet = false; break;
+            case Op::BMI: flag = CPU6502::N; break;
+            case Op::BPL: flag = CPU6502::N; whenSet = false; break;
+            case Op::BVS: flag = CPU6502::V; break;
+            default: flag = CPU6502::V; whenSet = false; break;  // BVC
+        }
+#if defined(NES_LAZY_FLAGS)
+        if (flag == CPU6502::Z) {
+            e.alu8mi(ALU_CMP, RBX, jit.offZResult, 0);
+            return e.jcc(whenSet ? CC_E : CC_NE);
+        }
+        if (flag == CPU6502::N) {
+            e.test8mi(RBX, jit.offNResult, 0x80);
+            return e.jcc(whenSet ? CC_NE : CC_E);
+        }
+#endif
+        e.test8mi(RBX, jit.offStatus, flag);
+        return e.jcc(whenSet ? CC_NE : CC_E);
+    }
+
+    int32_t registerField(Op op) {
+        switch (op) {
+            case Op::LDX: case Op::STX: case Op::CPX: return jit.offX;
+            case Op::LDY: case Op::STY: return jit.offY;
+            default: return jit.offA;
+        }
+    }
+
+    // Emits one instruction. Returns false when it ended the block.
+    bool instruction(uint16_t addr, const uint8_t *bytes) {
+        uint8_t op = bytes[0];
+        const CPU6502::INSTRUCTION &inst = CPU6502::lookup[op];
+        uint16_t next = addr + inst.length;
+        uint8_t cycles = inst.cycles;
+        uint16_t word = bytes[1] | (bytes[2] << 8);
+        bool imm = inst.addrmode == Mode::IMM;
+        bool direct = inst.addrmode == Mode::ZP0 || inst.addrmode == Mode::ABS;
+        uint16_t target = inst.addrmode == Mode::ZP0 ? bytes[1] : word;
+
+        switch (inst.operate) {
+            case Op::BCC: case Op::BCS: case Op::BEQ: case Op::BNE:
+            case Op::BMI: case Op::BPL: case Op::BVS: case Op::BVC: {
+                uint16_t rel = bytes[1] & 0x80 ? bytes[1] | 0xFF00 : bytes[1];
+                uint16_t dest = next + rel;
+                uint8_t extra = 1 + ((dest & 0xFF00) != (next & 0xFF00));
+                // BVC takes the branch timing but not the jump.
+                if (inst.operate == Op::BVC) {
+                    dest = next;
+                }
+                opcode(op);
+                uint8_t *taken = branchTaken(inst.operate);
+                account(cycles, next);
+                slot(next);
+                e.bind(taken);
+                account(cycles + extra, dest);
+                slot(dest);
+                return false;
+            }
+
+            case Op::JMP:
+                if (inst.addrmode != Mode::ABS) {
+                    break;
+                }
+                opcode(op);
+                account(cycles, word);
+                slot(word);
+                return false;
+
+            case Op::JSR:
+                handler(op, word, next);
+                slot(word);
+                return false;
+
+            case Op::RTS: case Op::RTI: case Op::BRK:
+                handler(op, imm ? addr + 1 : word, next);
+                dispatch();
+                return false;
+
+            case Op::LDA: case Op::LDX: case Op::LDY:
+                if (!imm && !direct) {
+                    break;
+                }
+                opcode(op);
+                if (imm) {
+                    e.store8i(RBX, registerField(inst.operate), bytes[1]);
+                    znConst(bytes[1]);
+                } else {
+                    read(target);
+                    e.store8(RBX, registerField(inst.operate), RAX);
+                    zn();
+                }
+                account(cycles, next);
+                if (!imm) {
+                    yielded(next);
+                }
+                return true;
+
+            case Op::STA: case Op::STX: case Op::STY:
+                if (!direct) {
+                    break;
+                }
+                opcode(op);
+                write(target, registerField(inst.operate), next, cycles);
+                account(cycles, next);
+                return true;
+
+            case Op::ADC: case Op::SBC: case Op::AND: case Op::EOR:
+            case Op::CMP: case Op::CPX:
+                if (!imm && !direct) {
+                    break;
+                }
+                opcode(op);
+                if (imm) {
+                    e.mov32i(RDX, bytes[1]);
+                } else {
+                    read(target);
+                    e.rr32(OP_MOV, RDX, RAX);
+                }
+                alu(inst.operate);
+                account(cycles, next);
+                if (!imm) {
+                    yielded(next);
+                }
+                return true;
+
+            case Op::TAX: case Op::TAY: case Op::TSX: case Op::TXA:
+            case Op::TXS: case Op::TYA: case Op::INX: case Op::INY:
+            case Op::DEX: case Op::DEY:
+                opcode(op);
+                registers(inst.operate);
+                account(cycles, next);
+                return true;
+
+            // CLI goes to its handler, which can yield to a held IRQ.
+            case Op::CLC: case Op::SEC: case Op::SEI: case Op::CLD:
+            case Op::SED: case Op::CLV:
+                opcode(op);
+                flags(inst.operate);
+                account(cycles, next);
+                return true;
+
+            case Op::NOP:
+                if (inst.addrmode != Mode::IMP) {
+                    break;
+                }
+                opcode(op);
+                account(cycles, next);
+                return true;
+
+            default:
+                break;
+        }
+
+        // JMP (ind) leaves its target in pc like a return.
+        if (inst.operate == Op::JMP) {
+            handler(op, word, next);
+            dispatch();
+            return false;
+        }
+
+        handler(op, imm ? addr + 1 : word, next);
+        return true;
+    }
+
+    // The operand is in edx.
+    void alu(Op op) {
+        switch (op) {
+            case Op::ADC:
+            case Op::SBC:
+                if (op == Op::SBC) {
+                    e.ri32(ALU_XOR, RDX, 0xFF);
+                }
+                e.movzx8(RAX, RBX, jit.offA);
+                e.movzx8(RCX, RBX, jit.offStatus);
+                e.bt32(RCX, 0);
+                e.rr8(OP_ADC8, RAX, RDX);
+                e.setcc(CC_B, R8);
+                e.setcc(CC_O, R9);
+                e.store8(RBX, jit.offA, RAX);
+                e.ri32(ALU_AND, RCX, (uint8_t) ~(CPU6502::C | CPU6502::V));
+                e.movzx8r(R8, R8);
+                e.rr32(OP_OR, RCX, R8);
+                e.movzx8r(R9, R9);
+                e.shl32(R9, 6);
+                e.rr32(OP_OR, RCX, R9);
+                e.store8(RBX, jit.offStatus, RCX);
+                zn();
+                break;
+
+            case Op::CMP:
+            case Op::CPX:
+                e.movzx8(RAX, RBX, registerField(op));
+                e.rr8(OP_SUB8, RAX, RDX);
+                e.setcc(CC_AE, R8);
+                e.movzx8(RCX, RBX, jit.offStatus);
+                e.ri32(ALU_AND, RCX, (uint8_t)~CPU6502::C);
+                e.movzx8r(R8, R8);
+                e.rr32(OP_OR, RCX, R8);
+                e.store8(RBX, jit.offStatus, RCX);
+                zn();
+                break;
+
+            default:  // AND, EOR
+                e.movzx8(RAX, RBX, jit.offA);
+                e.rr32(op == Op::AND ? OP_AND : OP_XOR, RAX, RDX);
+                e.store8(RBX, jit.offA, RAX);
+                zn();
+                break;
+        }
+    }
+
+    void registers(Op op) {
+        int32_t from = jit.offA, to = jit.offX;
+        bool setZN = true;
+        int8_t delta = 0;
+        switch (op) {
+            case Op::TAY: to = jit.offY; break;
+            case Op::TSX: from = jit.offStkp; break;
+            case Op::TXA: from = jit.offX; to = jit.offA; break;
+            case Op::TXS: from = jit.offX; to = jit.offStkp; setZN = false;
+                break;
+            // Matches CPU6502::TYA, which loads the stack pointer.
+            case Op::TYA: from = jit.offY; to = jit.offStkp; setZN = false;
+                break;
+            case Op::INX: from = jit.offX; delta = 1; break;
+            case Op::INY: from = to = jit.offY; delta = 1; break;
+            case Op::DEX: from = jit.offX; delta = -1; break;
+            case Op::DEY: from = to = jit.offY; delta = -1; break;
+            default: break;  // TAX
+        }
+        e.movzx8(RAX, RBX, from);
+        if (delta) {
+            e.ri32(ALU_ADD, RAX, delta);
+        }
+        e.store8(RBX, to, RAX);
+        if (setZN) {
+            zn();
+        }
+    }
+
+    void flags(Op op) {
+        switch (op) {
+            case Op::CLC: flag(CPU6502::C, false); break;
+            case Op::SEC: flag(CPU6502::C, true); break;
+            case Op::SEI: flag(CPU6502::I, true); break;
+            case Op::CLD: flag(CPU6502::D, false); break;
+            case Op::SED: flag(CPU6502::D, true); break;
+            default: flag(CPU6502::V, false); break;  // CLV
+        }
+    }
+
+    // Emits the block at pc. Returns its size in 6502 bytes, or 0 if the
+    // first instruction is not in memory.
+    uint16_t block(uint16_t pc) {
+        const Bus::Page *pages = jit.cpu.bus->pages.data();
+        uint16_t addr = pc;
+        for (int n = 0; n < MAX_INSTRUCTIONS; n++) {
+            uint8_t bytes[3] = {0x00, 0x00, 0x00};
+            bool inMemory = fetch(pages, addr, bytes);
+            if (!inMemory) {
+                if (n == 0) {
+                    return 0;
+                }
+                e.store16i(RBX, jit.offPc, addr);
+                e.jmp(jit.exitNoLink);
+                break;
+            }
+
+            uint8_t length = CPU6502::lookup[bytes[0]].length;
+            bool more = instruction(addr, bytes);
+            addr += length;
+            if (!more) {
+                break;
+            }
+            if (n == MAX_INSTRUCTIONS - 1) {
+                slot(addr);
+            }
+        }
+
+        for (const Stub &s : stubs) {
+            e.bind(s.at);
+            if (s.cycles) {
+                e.add64mi(RBX, jit.offInstructions, 1);
+                e.ri64(ALU_ADD, R14, s.cycles);
+                e.ri64(ALU_SUB, R13, s.cycles);
+            }
+            e.store16i(RBX, jit.offPc, s.pc);
+            e.jmp(jit.exitNoLink);
+        }
+        for (const Slot &s : slots) {
+            e.bind(s.at);
+            e.store16i(RBX, jit.offPc, s.pc);
+            e.mov64i(RCX, (uint64_t)s.at);
+            e.jmp(jit.exitLink);
+        }
+        return addr - pc;
+    }
+
+    // The instruction bytes at addr, if they all come from memory pages.
+    static bool fetch(const Bus::Page *pages, uint16_t addr, uint8_t *bytes) {
+        const Bus::Page &first = pages[addr >> 8];
+        if (!first.read) {
+            return false;
+        }
+        bytes[0] = first.read[addr & 0x00FF];
+        uint8_t length = CPU6502::lookup[bytes[0]].length;
+        for (uint8_t k = 1; k < length; k++) {
+            uint16_t at = addr + k;
+            const Bus::Page &page = pages[at >> 8];
+            if (!page.read) {
+                return false;
+            }
+            bytes[k] = page.read[at & 0x00FF];
+        }
+        return true;
+    }
+};
+
+CPU6502Jit::CPU6502Jit(CPU6502 &cpu)
+    : cpu(cpu),
+      blockAt(64 * 1024, nullptr),
+      entries(64 * 1024, nullptr),
+      heat(64 * 1024, 0) {
+    offA = offset(&cpu.a, &cpu);
+    offX = offset(&cpu.x, &cpu);
+    offY = offset(&cpu.y, &cpu);
+    offStkp = offset(&cpu.stkp, &cpu);
+    offStatus = offset(&cpu.status, &cpu);
+    offPc = offset(&cpu.pc, &cpu);
+    offOpcode = offset(&cpu.opcode, &cpu);
+    offInstructions = offset(&cpu.instructions, &cpu);
+#if defined(NES_LAZY_FLAGS)
+    offZResult = offset(&cpu.zResult, &cpu);
+    offNResult = offset(&cpu.nResult, &cpu);
+#endif
+
+    void *p = mmap(nullptr, BUFFER_SIZE + BUFFER_GUARD,
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                   0);
+    if (p == MAP_FAILED) {
+        return;
+    }
+    buffer = static_cast<uint8_t *>(p);
+    bufferSize = BUFFER_SIZE;
+    bufferWritable = true;
+
+    // enter(cpu, context, code): save the callee-saved registers, load the
+    // fixed ones and jump into the block. The stack stays 16-byte aligned
+    // for calls made from blocks.
+    Emitter e(buffer, buffer + bufferSize);
+    enter = reinterpret_cast<Enter>(e.here());
+    for (uint8_t r : {RBX, RBP, R12, R13, R14, R15}) e.push(r);
+    e.ri64(ALU_SUB, RSP, 8);
+    e.rr64(OP_MOV, RBX, RDI);
+    e.rr64(OP_MOV, R12, RSI);
+    e.load64(R13, R12, offsetof(Context, remaining));
+    e.load64(R14, R12, offsetof(Context, elapsed));
+    e.load64(R15, R12, offsetof(Context, pages));
+    e.jmp(RDX);
+
+    // Leaving, with pc already stored and the chain slot (if any) in rcx.
+    exitNoLink = e.here();
+    e.rr32(OP_XOR, RCX, RCX);
+    exitLink = e.here();
+    e.store64(R12, offsetof(Context, link), RCX);
+    e.store64(R12, offsetof(Context, remaining), R13);
+    e.store64(R12, offsetof(Context, elapsed), R14);
+    e.ri64(ALU_ADD, RSP, 8);
+    for (uint8_t r : {R15, R14, R13, R12, RBP, RBX}) e.pop(r);
+    e.ret();
+
+    blocksStart = cursor = e.here();
+    if (!seal()) {
+        munmap(buffer, BUFFER_SIZE + BUFFER_GUARD);
+        buffer = nullptr;
+    }
+}
+
+CPU6502Jit::~CPU6502Jit() {
+    if (buffer) {
+        munmap(buffer, BUFFER_SIZE + BUFFER_GUARD);
+    }
+}
+
+uint8_t CPU6502Jit::readByte(CPU6502 *cpu, uint16_t addr) {
+    return cpu->read(addr);
+}
+
+void CPU6502Jit::writeByte(CPU6502 *cpu, uint16_t addr, uint8_t data) {
+    cpu->write(addr, data);
+}
+
+bool CPU6502Jit::run(int64_t &remaining, uint32_t &elapsed) {
+    if (!buffer) {
+        return false;
+    }
+    if (cpu.jitCrossCheck != crossChecking) {
+        flush();
+        crossChecking = cpu.jitCrossCheck;
+    }
+
+    Block *block = find(cpu.pc);
+    if (!block) {
+        return false;
+    }
+    cpu.SetFlag(CPU6502::U, 1);
+    if (crossChecking) {
+        return crossCheck(block, remaining, elapsed);
+    }
+
+    bool ran = false;
+    while (block && seal()) {
+        ran = true;
+        context.remaining = remaining;
+        context.elapsed = 0;
+        context.pages = cpu.bus->pages.data();
+        context.link = nullptr;
+        context.dirty = 0;
+        enter(&cpu, &context, block->code);
+        remaining = context.remaining;
+        elapsed += context.elapsed;
+        context.elapsed = 0;
+        if (remaining <= 0 || cpu.yielded) {
+            break;
+        }
+
+        uint32_t before = generation;
+        block = find(cpu.pc);
+        if (block && context.link && generation == before) {
+            link(context.link, block);
+        }
+    }
+    return ran;
+}
+
+CPU6502Jit::Block *CPU6502Jit::find(uint16_t pc) {
+    if (blockAt[pc]) {
+        return blockAt[pc];
+    }
+    if (heat[pc] == COLD || ++heat[pc] < HOT) {
+        return nullptr;
+    }
+    Block *block = translate(pc);
+    if (!block) {
+        heat[pc] = COLD;
+    }
+    return block;
+}
+
+CPU6502Jit::Block *CPU6502Jit::translate(uint16_t pc) {
+    if ((size_t)(buffer + bufferSize - cursor) < MAX_BLOCK_BYTES) {
+        flush();
+    }
+    if (!unseal()) {
+        return nullptr;
+    }
+
+    Translator t(*this);
+    uint8_t *code = cursor;
+    uint16_t size = t.block(pc);
+    if (size == 0 || t.e.overflowed()) {
+        return nullptr;
+    }
+    cursor = t.e.here();
+
+    auto block = make_unique<Block>();
+    block->start = pc;
+    block->size = size;
+    block->code = code;
+
+    // Watch every page the block was read from.
+    Bus &bus = *cpu.bus;
+    uint8_t first = pc >> 8;
+    uint8_t last = (uint16_t)(pc + size - 1) >> 8;
+    for (uint8_t page = first;; page++) {
+        byPage[page].push_back(block.get());
+        bus.watchPage(page);
+        if (page == last) {
+            break;
+        }
+    }
+
+    blockAt[pc] = block.get();
+    entries[pc] = code;
+    blocks.push_back(move(block));
+    return blocks.back().get();
+}
+
+void CPU6502Jit::link(uint8_t *slot, Block *target) {
+    if (!unseal()) {
+        return;
+    }
+    target->incoming.push_back({slot, Emitter::target(slot)});
+    Emitter::patch(slot, target->code);
+}
+
+void CPU6502Jit::invalidate(uint16_t addr) {
+    vector<Block *> &list = byPage[addr >> 8];
+    for (Block *block : list) {
+        if (block->live && (uint16_t)(addr - block->start) < block->size) {
+            kill(block);
+        }
+    }
+    list.erase(remove_if(list.begin(), list.end(),
+                         [](Block *block) { return !block->live; }),
+               list.end());
+}
+
+void CPU6502Jit::invalidatePage(uint8_t n) {
+    for (Block *block : byPage[n]) {
+        if (block->live) {
+            kill(block);
+        }
+    }
+    byPage[n].clear();
+}
+
+// The code stays where it is until the next flush(), so a block that is
+// running when it is killed can still finish its current instruction.
+// That block may be what called kill(), so its callers are unlinked by the
+// next seal(), once it has returned.
+void CPU6502Jit::kill(Block *block) {
+    block->live = false;
+    blockAt[block->start] = nullptr;
+    entries[block->start] = nullptr;
+    heat[block->start] = 0;
+    unlinks.insert(unlinks.end(), block->incoming.begin(),
+                   block->incoming.end());
+    block->incoming.clear();
+    context.dirty = 1;
+}
+
+void CPU6502Jit::flush() {
+    blocks.clear();
+    fill(blockAt.begin(), blockAt.end(), nullptr);
+    fill(entries.begin(), entries.end(), nullptr);
+    fill(heat.begin(), heat.end(), 0);
+    for (auto &list : byPage) {
+        list.clear();
+    }
+    unlinks.clear();
+    cursor = blocksStart;
+    generation++;
+}
+
+bool CPU6502Jit::unseal() {
+    if (!bufferWritable) {
+        if (mprotect(buffer, BUFFER_SIZE + BUFFER_GUARD,
+                     PROT_READ | PROT_WRITE) != 0) {
+            return false;
+        }
+        bufferWritable = true;
+    }
+    return true;
+}
+
+bool CPU6502Jit::seal() {
+    if (!unlinks.empty()) {
+        if (!unseal()) {
+            return false;
+        }
+        for (auto &in : unlinks) {
+            Emitter::patch(in.first, in.second);
+        }
+        unlinks.clear();
+    }
+    if (bufferWritable) {
+        if (mprotect(buffer, BUFFER_SIZE + BUFFER_GUARD,
+                     PROT_READ | PROT_EXEC) != 0) {
+            return false;
+        }
+        bufferWritable = false;
+    }
+    return true;
+}
+
+// Runs one block, then replays the same number of instructions on a fork
+// with the interpreter and compares registers, cycles and every ram page
+// either side has written.
+bool CPU6502Jit::crossCheck(Block *block, int64_t &remaining,
+                            uint32_t &elapsed) {
+    if (!seal()) {
+        return false;
+    }
+    Bus &bus = *cpu.bus;
+    cpu.storeFlags();
+    unique_ptr<Bus> shadow = bus.fork();
+    cpu.loadFlags();
+
+    uint16_t start = cpu.pc;
+    uint64_t before = cpu.instructions;
+    context.remaining = remaining;
+    context.elapsed = 0;
+    context.pages = bus.pages.data();
+    context.link = nullptr;
+    context.dirty = 0;
+    enter(&cpu, &context, block->code);
+    cpu.storeFlags();
+
+    // cycles is scratch inside run(); the replay owes nothing.
+    CPU6502 &ref = shadow->cpu;
+    ref.cycles = 0;
+    uint64_t cycles = 0;
+    for (uint64_t n = cpu.instructions - before; n > 0; n--) {
+        // The replay keeps time as run() would, for devices on the fork.
+        uint8_t took = ref.step();
+        cycles += took;
+        ref.ran += took;
+    }
+
+    string diff;
+    auto compare = [&](const char *name, uint32_t jit, uint32_t interp,
+                       uint8_t digits) {
+        if (jit != interp) {
+            diff += string(" ") + name + " $" + hex(jit, digits) + " != $" +
+                    hex(interp, digits);
+        }
+    };
+    compare("A", cpu.a, ref.a, 2);
+    compare("X", cpu.x, ref.x, 2);
+    compare("Y", cpu.y, ref.y, 2);
+    compare("SP", cpu.stkp, ref.stkp, 2);
+    compare("P", cpu.status, ref.status, 2);
+    compare("PC", cpu.pc, ref.pc, 4);
+    compare("opcode", cpu.opcode, ref.opcode, 2);
+    compare("cycles", context.elapsed, cycles, 4);
+
+    vector<uint8_t> pages;
+    for (int n = 0; n < 256; n++) {
+        if (bus.sharedPage(n) && bus.sharedPage(n) == shadow->sharedPage(n)) {
+            continue;
+        }
+        if (memcmp(bus.ramPage(n), shadow->ramPage(n), 256) != 0) {
+            pages.push_back(n);
+            diff += " ram $" + hex(n << 8, 4);
+        }
+    }
+
+    if (diff.empty()) {
+        remaining = context.remaining;
+        elapsed += context.elapsed;
+    } else {
+        if (++cpu.jitMismatches <= 10) {
+            cerr << "jit: block at $" << hex(start, 4) << " differs from "
+                 << "the interpreter:" << diff << "\n";
+        }
+
+        // Carry on from the interpreter's result.
+        CPUState s;
+        ref.saveState(s);
+        cpu.loadState(s);
+        for (uint8_t n : pages) {
+            bus.loadRamPage(n, shadow->ramPage(n));
+        }
+        remaining -= cycles;
+        elapsed += cycles;
+    }
+    context.elapsed = 0;
+    cpu.loadFlags();
+    return true;
+}
+
+#endif
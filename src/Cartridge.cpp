@@ -0,0 +1,115 @@
+#include "Cartridge.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+// Larger than any file; the size check turns it down.
+const uint64_t TOO_BIG = UINT64_MAX;
+
+// A NES 2.0 ROM size: units of unit bytes, or in exponent-multiplier form
+// when the top nibble is $F. Exponents up to 63 would overflow, so anything
+// past 2^40 (far beyond any real ROM) is TOO_BIG.
+uint64_t nes2Size(uint8_t lsb, uint8_t msb, uint64_t unit) {
+    if (msb == 0x0F) {
+        if ((lsb >> 2) > 40) {
+            return TOO_BIG;
+        }
+        return (uint64_t(1) << (lsb >> 2)) * ((lsb & 0x03) * 2 + 1);
+    }
+    return ((uint64_t)msb << 8 | lsb) * unit;
+}
+
+// A NES 2.0 RAM size: 64 << shift bytes, or none.
+size_t nes2RamSize(uint8_t shift) {
+    return shift ? (size_t)64 << shift : 0;
+}
+
+}  // namespace
+
+shared_ptr<const Cartridge> Cartridge::load(const string &path,
+                                            string &error) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "cannot open " + path;
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 16) {
+        ::close(fd);
+        error = path + " is too short for an iNES header";
+        return nullptr;
+    }
+    void *mapping =
+        mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        error = "cannot map " + path;
+        return nullptr;
+    }
+
+    // From here on the destructor unmaps the file.
+    shared_ptr<Cartridge> cart(new Cartridge());
+    cart->mapping = mapping;
+    cart->mappingSize = st.st_size;
+
+    const uint8_t *h = (const uint8_t *)mapping;
+    if (memcmp(h, "NES\x1A", 4) != 0) {
+        error = path + " is not an iNES image";
+        return nullptr;
+    }
+
+    uint64_t prg, chr;
+    cart->nes2 = (h[7] & 0x0C) == 0x08;
+    if (cart->nes2) {
+        prg = nes2Size(h[4], h[9] & 0x0F, 16 * 1024);
+        chr = nes2Size(h[5], h[9] >> 4, 8 * 1024);
+        cart->mapper = (h[6] >> 4) | (h[7] & 0xF0) | ((h[8] & 0x0F) << 8);
+        cart->submapper = h[8] >> 4;
+        cart->prgRamSize = nes2RamSize(h[10] & 0x0F) + nes2RamSize(h[10] >> 4);
+        cart->chrRamSize = nes2RamSize(h[11] & 0x0F) + nes2RamSize(h[11] >> 4);
+    } else {
+        prg = h[4] * 16 * 1024;
+        chr = h[5] * 8 * 1024;
+        // Old dumping tools left text in bytes 7-15; the high mapper nibble
+        // is only trusted if the padding is clean.
+        bool clean = h[12] == 0 && h[13] == 0 && h[14] == 0 && h[15] == 0;
+        cart->mapper = (h[6] >> 4) | (clean ? h[7] & 0xF0 : 0);
+        cart->prgRamSize = (h[8] ? h[8] : 1) * 8 * 1024;
+        cart->chrRamSize = chr ? 0 : 8 * 1024;
+    }
+    cart->mirroring = h[6] & 0x08   ? Mirroring::FOUR_SCREEN
+                      : h[6] & 0x01 ? Mirroring::VERTICAL
+                                    : Mirroring::HORIZONTAL;
+    cart->battery = h[6] & 0x02;
+
+    uint64_t offset = 16 + (h[6] & 0x04 ? 512 : 0);  // Trainer
+    if (prg == 0) {
+        error = path + " has no PRG ROM";
+        return nullptr;
+    }
+    // Each size on its own, so no sum can wrap around.
+    uint64_t left = offset < (uint64_t)st.st_size ? st.st_size - offset : 0;
+    if (prg > left || chr > left - prg) {
+        error = path + " is shorter than its header says";
+        return nullptr;
+    }
+    cart->prgData = h + offset;
+    cart->prgBytes = prg;
+    cart->chrData = h + offset + prg;
+    cart->chrBytes = chr;
+    return cart;
+}
+
+Cartridge::~Cartridge() {
+    if (mapping) {
+        munmap(mapping, mappingSize);
+    }
+}
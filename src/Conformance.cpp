@@ -0,0 +1,250 @@
+#include "Conformance.h"
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Bus.h"
+#include "Hex.h"
+#include "Program.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+namespace {
+
+// Cycles run between checks for a trap. A ROM that traps spends at most
+// this many cycles in the trap before it is noticed.
+const uint32_t SLICE = 16 * 1024;
+
+struct Rom {
+    string name;
+    const vector<uint8_t> *image = nullptr;
+    uint16_t load = 0x0000;
+    uint64_t cycles = 0;
+    bool hasEntry = false;
+    uint16_t entry = 0x0000;
+    bool hasPass = false;
+    uint16_t pass = 0x0000;
+    bool hasStatus = false;
+    uint16_t statusAddr = 0x0000;
+    uint8_t statusValue = 0x00;
+};
+
+enum class Verdict { PASS, FAIL, TIMEOUT, TRAP };
+
+// Written by exactly one worker; aligned so neighbours don't share a line.
+struct alignas(64) Result {
+    Verdict verdict;
+    bool trapped;
+    uint16_t pc;
+    uint8_t status;  // Byte at the status address
+    uint64_t cycles;
+    uint64_t instructions;
+    double seconds;
+};
+
+void runRom(Bus &bus, const Rom &rom, Result &r) {
+    bus.clearRam();
+
+    loadProgram(bus, *rom.image, rom.load, rom.hasEntry, rom.entry);
+
+    bus.cpu.reset();
+    uint64_t startInstructions = bus.cpu.instructions;
+
+    auto start = chrono::steady_clock::now();
+    r.cycles = 0;
+    r.trapped = false;
+    while (r.cycles < rom.cycles) {
+        // Whole slices while one cannot run past the budget, then one
+        // instruction at a time, so a trap is only seen if the program
+        // reached it within the budget.
+        if (rom.cycles - r.cycles > 2 * SLICE) {
+            r.cycles += bus.cpu.run(SLICE);
+        }
+
+        // A trap is an instruction that leaves pc where it was.
+        uint16_t at = bus.cpu.pc;
+        r.cycles += bus.cpu.step();
+        if (bus.cpu.pc == at) {
+            r.trapped = true;
+            break;
+        }
+    }
+    r.seconds = chrono::duration<double>(chrono::steady_clock::now() - start)
+                    .count();
+
+    r.instructions = bus.cpu.instructions - startInstructions;
+    r.pc = bus.cpu.pc;
+    r.status = bus.read(rom.statusAddr, true);
+
+    if (!r.trapped) {
+        r.verdict = Verdict::TIMEOUT;
+    } else if (!rom.hasPass && !rom.hasStatus) {
+        r.verdict = Verdict::TRAP;
+    } else if ((rom.hasPass && r.pc != rom.pass) ||
+               (rom.hasStatus && r.status != rom.statusValue)) {
+        r.verdict = Verdict::FAIL;
+    } else {
+        r.verdict = Verdict::PASS;
+    }
+}
+
+bool loadManifest(const string &path, vector<Rom> &roms, ImageCache &images) {
+    ifstream manifest(path);
+    if (!manifest) {
+        cerr << "test: cannot open manifest " << path << "\n";
+        return false;
+    }
+
+    string line;
+    int lineNo = 0;
+    while (getline(manifest, line)) {
+        lineNo++;
+        stringstream ss(line);
+        string file, load, cycles;
+        if (!(ss >> file) || file[0] == '#') {
+            continue;
+        }
+        ss >> load >> cycles;
+
+        Rom rom;
+        rom.name = file;
+        bool ok = parseHex(load, rom.load);
+        try {
+            rom.cycles = stoull(cycles);
+        } catch (...) {
+            ok = false;
+        }
+        string word;
+        while (ok && ss >> word) {
+            size_t eq = word.find('=');
+            string key = eq == string::npos ? "" : word.substr(0, eq);
+            string value = eq == string::npos ? word : word.substr(eq + 1);
+            if (key.empty() && !rom.hasEntry) {
+                rom.hasEntry = true;
+                ok = parseHex(value, rom.entry);
+            } else if (key == "pass") {
+                rom.hasPass = true;
+                ok = parseHex(value, rom.pass);
+            } else if (key == "status") {
+                size_t colon = value.find(':');
+                uint16_t expected = 0;
+                rom.hasStatus = true;
+                ok = colon != string::npos &&
+                     parseHex(value.substr(0, colon), rom.statusAddr) &&
+                     parseHex(value.substr(colon + 1), expected) &&
+                     expected <= 0xFF;
+                rom.statusValue = (uint8_t)expected;
+            } else {
+                ok = false;
+            }
+        }
+        if (!ok) {
+            cerr << "test: " << path << ":" << lineNo
+                 << ": expected <binary> <load> <cycles> [<entry>] "
+                    "[pass=<addr>] [status=<addr>:<value>]\n";
+            return false;
+        }
+
+        string error;
+        rom.image = images.load(file, error);
+        if (!rom.image) {
+            cerr << "test: " << error << "\n";
+            return false;
+        }
+        roms.push_back(rom);
+    }
+    return true;
+}
+
+}  // namespace
+
+int runConformance(int argc, char **argv) {
+    string manifest;
+    size_t nThreads = 0;
+    double minMHz = 0;
+    bool badArg = false;
+    for (int i = 0; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            badArg |= !parseCount(argv[++i], nThreads);
+        } else if (arg == "--min-mhz" && i + 1 < argc) {
+            string mhz = argv[++i];
+            try {
+                size_t used = 0;
+                minMHz = stod(mhz, &used);
+                badArg |= used != mhz.size();
+            } catch (...) {
+                badArg = true;
+            }
+        } else {
+            manifest = arg;
+        }
+    }
+    if (badArg || manifest.empty()) {
+        cerr << "usage: nes --test <manifest> [--threads N] "
+                "[--min-mhz MHZ]\n";
+        return 2;
+    }
+
+    vector<Rom> roms;
+    ImageCache images;
+    if (!loadManifest(manifest, roms, images)) {
+        return 1;
+    }
+
+    ThreadPool pool(nThreads);
+    vector<unique_ptr<Bus>> buses;
+    for (size_t i = 0; i < pool.size(); i++) {
+        buses.push_back(make_unique<Bus>());
+    }
+    vector<Result> results(roms.size());
+
+    auto start = chrono::steady_clock::now();
+    pool.run(roms.size(), [&](size_t rom, size_t worker) {
+        runRom(*buses[worker], roms[rom], results[rom]);
+    });
+    double wall =
+        chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    static const char *const verdicts[] = {"PASS", "FAIL", "TIMEOUT", "TRAP"};
+    size_t passed = 0, failed = 0;
+    uint64_t totalCycles = 0;
+    for (size_t i = 0; i < roms.size(); i++) {
+        const Result &r = results[i];
+        totalCycles += r.cycles;
+        double mhz = r.seconds > 0 ? r.cycles / r.seconds / 1e6 : 0;
+        bool slow = minMHz > 0 && mhz < minMHz;
+        bool failedRun =
+            r.verdict == Verdict::FAIL || r.verdict == Verdict::TIMEOUT;
+
+        cout << roms[i].name << "  "
+             << (slow && !failedRun ? "FAIL" : verdicts[(int)r.verdict]);
+        if (r.trapped) {
+            cout << " at $" << hex(r.pc, 4);
+        }
+        if (roms[i].hasStatus) {
+            cout << "  status: $" << hex(r.status, 2);
+        }
+        cout << "  instructions: " << r.instructions << "  cycles: "
+             << r.cycles << "  MHz: " << mhz << (slow ? " (too slow)" : "")
+             << "\n";
+
+        if (r.verdict == Verdict::PASS && !slow) {
+            passed++;
+        }
+        if (failedRun || slow) {
+            failed++;
+        }
+    }
+    cout << passed << " of " << roms.size() << " passed on " << pool.size()
+         << " threads in " << wall << " s ("
+         << (wall > 0 ? totalCycles / wall / 1e6 : 0) << " MHz)\n";
+    return failed ? 1 : 0;
+}
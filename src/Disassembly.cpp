@@ -0,0 +1,80 @@
+#include "Disassembly.h"
+
+Disassembly::Disassembly(Bus &bus) : bus(bus), records(64 * 1024) {
+    bus.addWatcher(this);
+}
+
+Disassembly::~Disassembly() {
+    bus.removeWatcher(this);
+}
+
+string Disassembly::line(uint16_t addr) {
+    const Record &r = decode(addr);
+    return CPU6502::formatInstruction(addr, r.opcode, r.lo, r.hi);
+}
+
+uint16_t Disassembly::back(uint16_t addr, int n) {
+    decode(addr);
+    if (records[addr].length) {
+        records[addr].known = 1;
+    }
+    if (n <= 0) {
+        return addr;
+    }
+
+    // Instructions are at most 3 bytes long; the slack lets a misaligned
+    // start fall back into step before it reaches the lines we keep.
+    int reach = 3 * n + 16;
+    uint16_t first = addr > reach ? addr - reach : 0;
+
+    vector<uint16_t> starts;
+    uint16_t best = addr;
+    int bestKnown = -1;
+    for (uint32_t start = first; start < addr; start++) {
+        starts.clear();
+        int known = 0;
+        uint32_t at = start;
+        while (at < addr) {
+            starts.push_back(at);
+            known += records[at].known;
+            at += decode(at).length;
+        }
+        if (at == addr && known > bestKnown) {
+            best = starts.size() > (size_t)n ? starts[starts.size() - n]
+                                             : starts.front();
+            bestKnown = known;
+        }
+    }
+    return best;
+}
+
+void Disassembly::busWritten(uint16_t addr) {
+    // Any record starting up to two bytes earlier may include addr.
+    for (uint16_t k = 0; k < 3; k++) {
+        records[(uint16_t)(addr - k)] = Record();
+    }
+}
+
+Disassembly::Record Disassembly::decode(uint16_t addr) {
+    Record &r = records[addr];
+    if (r.length) {
+        return r;
+    }
+
+    r.opcode = bus.read(addr, true);
+    r.length = CPU6502::length(r.opcode);
+    r.lo = r.length > 1 ? bus.read(addr + 1, true) : 0x00;
+    r.hi = r.length > 2 ? bus.read(addr + 2, true) : 0x00;
+
+    // Device bytes can change without a write: decode them every time.
+    Record decoded = r;
+    for (uint16_t k = 0; k < decoded.length; k++) {
+        uint8_t page = (uint16_t)(addr + k) >> 8;
+        if (bus.pages[page].read) {
+            bus.watchPage(page);
+        } else {
+            r.length = 0;
+        }
+    }
+    return decoded;
+}
@@ -0,0 +1,44 @@
+#include "Drain.h"
+
+#include <utility>
+
+using namespace std;
+
+Drain::~Drain() {
+    stop();
+}
+
+void Drain::start(Take t, function<void()> i) {
+    stop();
+    take = move(t);
+    idle = move(i);
+    failed = false;
+    count = 0;
+    stopping.store(false, memory_order_relaxed);
+    worker = thread(&Drain::loop, this);
+}
+
+bool Drain::stop() {
+    if (running()) {
+        stopping.store(true, memory_order_release);
+        worker.join();
+    }
+    return !failed;
+}
+
+void Drain::loop() {
+    for (;;) {
+        // Checked before draining, so items pushed before stop() are all
+        // taken.
+        bool last = stopping.load(memory_order_acquire);
+        size_t n = take(failed);
+        if (n > 0) {
+            count += n;
+            continue;
+        }
+        if (last) {
+            return;
+        }
+        idle();
+    }
+}
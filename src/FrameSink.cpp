@@ -0,0 +1,356 @@
+#include "FrameSink.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "ThreadPool.h"
+#include "WriteAll.h"
+
+using namespace std;
+
+namespace {
+
+const int WIDTH = 256;
+const int HEIGHT = 240;
+const size_t RGB_BYTES = WIDTH * HEIGHT * 3;
+const size_t PAGE = 4096;
+
+// The pipe size asked for: a few frames, so the reader can fall behind a
+// little without the sink waiting. Unprivileged processes get up to 1 MiB.
+const int PIPE_BYTES = 1 << 20;
+
+// How long the sink sleeps when it may have missed a push()'s wakeup.
+const chrono::microseconds SINK_POLL(1000);
+
+void toRgb(const uint8_t *pixels, uint8_t *rgb) {
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        const uint8_t *c = FrameSink::PALETTE[pixels[i] & 0x3F];
+        rgb[0] = c[0];
+        rgb[1] = c[1];
+        rgb[2] = c[2];
+        rgb += 3;
+    }
+}
+
+// Splices all size bytes at data into the pipe fd. Returns 0, or the errno
+// of the vmsplice() that failed.
+int spliceAll(int fd, const uint8_t *data, size_t size) {
+    iovec iov = {(void *)data, size};
+    while (iov.iov_len > 0) {
+        ssize_t n = vmsplice(fd, &iov, 1, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? errno : EIO;
+        }
+        iov.iov_base = (uint8_t *)iov.iov_base + n;
+        iov.iov_len -= n;
+    }
+    return 0;
+}
+
+void be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// A PNG chunk of type goes at the end of out: beginChunk() appends its
+// length and type, the caller its data, and endChunk() fills the length in
+// and appends the CRC.
+size_t beginChunk(vector<uint8_t> &out, const char *type) {
+    size_t start = out.size();
+    out.resize(start + 8);
+    memcpy(&out[start + 4], type, 4);
+    return start;
+}
+
+void endChunk(vector<uint8_t> &out, size_t start) {
+    size_t size = out.size() - start - 8;
+    be32(&out[start], (uint32_t)size);
+    uint8_t crc[4];
+    be32(crc, crc32(0, &out[start + 4], size + 4));
+    out.insert(out.end(), crc, crc + 4);
+}
+
+}  // namespace
+
+// The 2C02's colours as commonly measured, emphasis bits clear.
+const uint8_t FrameSink::PALETTE[64][3] = {
+    {84, 84, 84},    {0, 30, 116},    {8, 16, 144},    {48, 0, 136},
+    {68, 0, 100},    {92, 0, 48},     {84, 4, 0},      {60, 24, 0},
+    {32, 42, 0},     {8, 58, 0},      {0, 64, 0},      {0, 60, 0},
+    {0, 50, 60},     {0, 0, 0},       {0, 0, 0},       {0, 0, 0},
+    {152, 150, 152}, {8, 76, 196},    {48, 50, 236},   {92, 30, 228},
+    {136, 20, 176},  {160, 20, 100},  {152, 34, 32},   {120, 60, 0},
+    {84, 90, 0},     {40, 114, 0},    {8, 124, 0},     {0, 118, 40},
+    {0, 102, 120},   {0, 0, 0},       {0, 0, 0},       {0, 0, 0},
+    {236, 238, 236}, {76, 154, 236},  {120, 124, 236}, {176, 98, 236},
+    {228, 84, 236},  {236, 88, 180},  {236, 106, 100}, {212, 136, 32},
+    {160, 170, 0},   {116, 196, 0},   {76, 208, 32},   {56, 204, 108},
+    {56, 180, 204},  {60, 60, 60},    {0, 0, 0},       {0, 0, 0},
+    {236, 238, 236}, {168, 204, 236}, {188, 188, 236}, {212, 178, 236},
+    {236, 174, 236}, {236, 174, 212}, {236, 180, 176}, {228, 196, 144},
+    {204, 210, 120}, {180, 222, 120}, {168, 226, 144}, {152, 226, 180},
+    {160, 214, 228}, {160, 162, 160}, {0, 0, 0},       {0, 0, 0},
+};
+
+FrameRing::FrameRing(size_t frameBytes, size_t capacity)
+    : bytes(frameBytes), slots(max<size_t>(capacity, 1)) {
+    for (Slot &s : slots) {
+        s.pixels.assign(bytes, 0x00);
+    }
+}
+
+bool FrameRing::push(vector<uint8_t> &pixels, uint64_t number) {
+    uint64_t h = head.load(memory_order_relaxed);
+    if (h - tail.load(memory_order_acquire) >= slots.size()) {
+        lost++;
+        return false;
+    }
+    Slot &s = slots[h % slots.size()];
+    s.pixels.swap(pixels);
+    s.number = number;
+    head.store(h + 1, memory_order_release);
+    pushes.notify_one();
+    return true;
+}
+
+const uint8_t *FrameRing::last(uint64_t number) const {
+    uint64_t h = head.load(memory_order_relaxed);
+    if (h == 0) {
+        return nullptr;
+    }
+    const Slot &s = slots[(h - 1) % slots.size()];
+    return s.number == number ? s.pixels.data() : nullptr;
+}
+
+void FrameRing::release(size_t n) {
+    tail.store(tail.load(memory_order_relaxed) + n, memory_order_release);
+    releases.notify_one();
+}
+
+void FrameRing::waitForRoom() {
+    unique_lock<mutex> lock(m);
+    while (full()) {
+        releases.wait_for(lock, SINK_POLL);
+    }
+}
+
+void FrameRing::waitForFrames(chrono::microseconds timeout) {
+    unique_lock<mutex> lock(m);
+    if (ready() == 0) {
+        pushes.wait_for(lock, timeout);
+    }
+}
+
+FrameSink::FrameSink(FrameRing &ring) : ring(ring) {
+}
+
+FrameSink::~FrameSink() {
+    // Subclasses have closed already; their write() is gone by now.
+}
+
+void FrameSink::start() {
+    sink.start(
+        [this](bool &failed) {
+            size_t n = ring.ready();
+            if (n > 0) {
+                if (!failed && !write(n)) {
+                    failed = true;
+                }
+                ring.release(n);
+            }
+            return n;
+        },
+        [this] { ring.waitForFrames(SINK_POLL); });
+}
+
+bool FrameSink::close() {
+    if (!sink.running()) {
+        return sink.stop();
+    }
+    bool ok = sink.stop();
+    return finish() && ok;
+}
+
+RawVideoWriter::RawVideoWriter(FrameRing &ring) : FrameSink(ring) {
+}
+
+RawVideoWriter::~RawVideoWriter() {
+    close();
+}
+
+bool RawVideoWriter::open(const string &path) {
+    close();
+    if (path == "-") {
+        fd = STDOUT_FILENO;
+        ownFd = false;
+    } else {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ownFd = true;
+        if (fd < 0) {
+            return false;
+        }
+    }
+
+    // A pipe takes the buffers themselves, so each has to stay as it is
+    // until the reader is done with it: with the pipe full of the frames
+    // spliced after it, it has been read.
+    struct stat st;
+    zeroCopy = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    size_t pipeBytes = 0;
+    if (zeroCopy) {
+        fcntl(fd, F_SETPIPE_SZ, PIPE_BYTES);
+        int size = fcntl(fd, F_GETPIPE_SZ);
+        zeroCopy = size > 0;
+        pipeBytes = zeroCopy ? size : 0;
+    }
+    bufferBytes = (RGB_BYTES + PAGE - 1) / PAGE * PAGE;
+    nBuffers = (pipeBytes + RGB_BYTES - 1) / RGB_BYTES + 1;
+    void *p = nullptr;
+    if (posix_memalign(&p, PAGE, nBuffers * bufferBytes) != 0) {
+        finish();
+        return false;
+    }
+    buffers.reset((uint8_t *)p);
+    next = 0;
+
+    start();
+    return true;
+}
+
+bool RawVideoWriter::write(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint8_t *rgb = buffers.get() + next * bufferBytes;
+        next = (next + 1) % nBuffers;
+        toRgb(ring.pixels(i), rgb);
+        if (zeroCopy) {
+            int error = spliceAll(fd, rgb, RGB_BYTES);
+            if (error == 0) {
+                continue;
+            }
+            if (error != EINVAL && error != ENOSYS) {
+                return false;
+            }
+            // Not a pipe vmsplice() takes after all; this frame and the
+            // rest are written instead.
+            zeroCopy = false;
+        }
+        if (!writeAll(fd, rgb, RGB_BYTES)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool RawVideoWriter::finish() {
+    bool ok = true;
+    if (ownFd && fd >= 0) {
+        ok = ::close(fd) == 0;
+    }
+    fd = -1;
+    return ok;
+}
+
+ImageWriter::ImageWriter(FrameRing &ring, Format format, size_t workers)
+    : FrameSink(ring),
+      format(format),
+      pool(make_unique<ThreadPool>(max<size_t>(workers, 1))),
+      rows(pool->size()),
+      files(pool->size()) {
+}
+
+ImageWriter::~ImageWriter() {
+    close();
+}
+
+void ImageWriter::open(const string &path) {
+    close();
+    prefix = path;
+    start();
+}
+
+bool ImageWriter::write(size_t n) {
+    atomic<bool> ok{true};
+    pool->run(n, [&](size_t i, size_t worker) {
+        if (!writeImage(ring.pixels(i), ring.number(i), worker)) {
+            ok.store(false, memory_order_relaxed);
+        }
+    });
+    return ok.load(memory_order_relaxed);
+}
+
+bool ImageWriter::writeImage(const uint8_t *pixels, uint64_t number,
+                             size_t worker) {
+    vector<uint8_t> &out = files[worker];
+    out.clear();
+    string path = prefix + "." + to_string(number);
+
+    if (format == Format::PPM) {
+        path += ".ppm";
+        string header =
+            "P6\n" + to_string(WIDTH) + " " + to_string(HEIGHT) + "\n255\n";
+        out.assign(header.begin(), header.end());
+        out.resize(header.size() + RGB_BYTES);
+        toRgb(pixels, &out[header.size()]);
+    } else {
+        path += ".png";
+        static const uint8_t SIGNATURE[8] = {0x89, 'P',  'N',  'G',
+                                             '\r', '\n', 0x1A, '\n'};
+        out.assign(SIGNATURE, SIGNATURE + 8);
+
+        size_t chunk = beginChunk(out, "IHDR");
+        out.resize(chunk + 8 + 13);
+        uint8_t *ihdr = &out[chunk + 8];
+        be32(ihdr, WIDTH);
+        be32(ihdr + 4, HEIGHT);
+        ihdr[8] = 8;   // Bits per index
+        ihdr[9] = 3;   // Paletted
+        ihdr[10] = 0;  // Deflate
+        ihdr[11] = 0;  // Adaptive filtering
+        ihdr[12] = 0;  // Not interlaced
+        endChunk(out, chunk);
+
+        chunk = beginChunk(out, "PLTE");
+        out.insert(out.end(), &PALETTE[0][0], &PALETTE[0][0] + 64 * 3);
+        endChunk(out, chunk);
+
+        // Each row with filter type 0; the indices need no filtering to
+        // compress well.
+        vector<uint8_t> &raw = rows[worker];
+        raw.resize(HEIGHT * (WIDTH + 1));
+        for (int y = 0; y < HEIGHT; y++) {
+            raw[y * (WIDTH + 1)] = 0;
+            memcpy(&raw[y * (WIDTH + 1) + 1], pixels + y * WIDTH, WIDTH);
+        }
+        // Compressed straight into the chunk.
+        chunk = beginChunk(out, "IDAT");
+        uLongf size = compressBound(raw.size());
+        out.resize(chunk + 8 + size);
+        if (compress2(&out[chunk + 8], &size, raw.data(), raw.size(),
+                      Z_DEFAULT_COMPRESSION) != Z_OK) {
+            return false;
+        }
+        out.resize(chunk + 8 + size);
+        endChunk(out, chunk);
+
+        endChunk(out, beginChunk(out, "IEND"));
+    }
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = writeAll(fd, out.data(), out.size());
+    return ::close(fd) == 0 && ok;
+}
@@ -0,0 +1,356 @@
+#include "Mapper.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+const size_t PRG_BANK = 16 * 1024;
+const size_t CHR_BANK = 4 * 1024;
+const size_t NO_BANK = SIZE_MAX;
+
+// NROM: 16 or 32 KiB of PRG and 8 KiB of CHR, nothing switches.
+class Nrom : public Mapper {
+   public:
+    Nrom(Bus &bus, shared_ptr<const Cartridge> cart)
+        : Mapper(bus, move(cart)) {
+        reset();
+    }
+    Nrom(Bus &bus, const Nrom &other) : Mapper(bus, other) {
+        reset();
+    }
+
+    unique_ptr<Mapper> clone(Bus &bus) const override {
+        return make_unique<Nrom>(bus, *this);
+    }
+
+    void reset() override {
+        // A 16 KiB board shows its bank twice.
+        mapPrg16(0, 0);
+        mapPrg16(1, 1);
+        mapChr4(0, 0);
+        mapChr4(1, 1);
+    }
+
+    void cpuWrite(uint16_t addr, uint8_t data) override {
+    }
+
+    void saveRegs(uint8_t *regs) const override {
+    }
+    void loadRegs(const uint8_t *regs) override {
+    }
+};
+
+// UxROM: a switchable 16 KiB bank at $8000 and the last bank fixed at
+// $C000, selected by writing the bank number anywhere in $8000-$FFFF.
+class Uxrom : public Mapper {
+   public:
+    Uxrom(Bus &bus, shared_ptr<const Cartridge> cart)
+        : Mapper(bus, move(cart)) {
+        reset();
+    }
+    Uxrom(Bus &bus, const Uxrom &other) : Mapper(bus, other), bank(other.bank) {
+        remap();
+    }
+
+    unique_ptr<Mapper> clone(Bus &bus) const override {
+        return make_unique<Uxrom>(bus, *this);
+    }
+
+    void reset() override {
+        bank = 0;
+        remap();
+    }
+
+    void cpuWrite(uint16_t addr, uint8_t data) override {
+        bank = data;
+        mapPrg16(0, bank);
+    }
+
+    void saveRegs(uint8_t *regs) const override {
+        regs[0] = bank;
+    }
+    void loadRegs(const uint8_t *regs) override {
+        bank = regs[0];
+        remap();
+    }
+
+   private:
+    uint8_t bank = 0;
+
+    void remap() {
+        mapPrg16(0, bank);
+        mapPrg16(1, cart->prgSize() / PRG_BANK - 1);
+        mapChr4(0, 0);
+        mapChr4(1, 1);
+    }
+};
+
+// CNROM: PRG as NROM, and an 8 KiB CHR bank selected by writing anywhere in
+// $8000-$FFFF.
+class Cnrom : public Mapper {
+   public:
+    Cnrom(Bus &bus, shared_ptr<const Cartridge> cart)
+        : Mapper(bus, move(cart)) {
+        reset();
+    }
+    Cnrom(Bus &bus, const Cnrom &other) : Mapper(bus, other), bank(other.bank) {
+        remap();
+    }
+
+    unique_ptr<Mapper> clone(Bus &bus) const override {
+        return make_unique<Cnrom>(bus, *this);
+    }
+
+    void reset() override {
+        bank = 0;
+        remap();
+    }
+
+    void cpuWrite(uint16_t addr, uint8_t data) override {
+        bank = data;
+        mapChr4(0, bank * 2);
+        mapChr4(1, bank * 2 + 1);
+    }
+
+    void saveRegs(uint8_t *regs) const override {
+        regs[0] = bank;
+    }
+    void loadRegs(const uint8_t *regs) override {
+        bank = regs[0];
+        remap();
+    }
+
+   private:
+    uint8_t bank = 0;
+
+    void remap() {
+        mapPrg16(0, 0);
+        mapPrg16(1, 1);
+        mapChr4(0, bank * 2);
+        mapChr4(1, bank * 2 + 1);
+    }
+};
+
+// MMC1 (SxROM). Registers are loaded one bit per write through a 5-bit
+// shift register; the fifth write lands in the register picked by address
+// bits 13-14: control ($8000), CHR bank 0 ($A000), CHR bank 1 ($C000) and
+// PRG bank ($E000). A write with bit 7 set clears the shift register and
+// fixes the last PRG bank at $C000. On 512 KiB boards (SUROM) bit 4 of the
+// CHR bank 0 register picks the 256 KiB half of PRG.
+class Mmc1 : public Mapper {
+   public:
+    Mmc1(Bus &bus, shared_ptr<const Cartridge> cart)
+        : Mapper(bus, move(cart)) {
+        reset();
+    }
+    Mmc1(Bus &bus, const Mmc1 &other)
+        : Mapper(bus, other),
+          shift(other.shift),
+          control(other.control),
+          chr0(other.chr0),
+          chr1(other.chr1),
+          prg(other.prg) {
+        remap();
+    }
+
+    unique_ptr<Mapper> clone(Bus &bus) const override {
+        return make_unique<Mmc1>(bus, *this);
+    }
+
+    void reset() override {
+        shift = EMPTY;
+        control = 0x0C;
+        chr0 = chr1 = prg = 0;
+        remap();
+    }
+
+    void cpuWrite(uint16_t addr, uint8_t data) override {
+        if (data & 0x80) {
+            shift = EMPTY;
+            control |= 0x0C;
+            remap();
+            return;
+        }
+        // The marker bit reaching bit 0 means this is the fifth write.
+        bool full = shift & 0x01;
+        shift = (shift >> 1) | ((data & 0x01) << 4);
+        if (!full) {
+            return;
+        }
+        switch ((addr >> 13) & 0x03) {
+            case 0:
+                control = shift;
+                break;
+            case 1:
+                chr0 = shift;
+                break;
+            case 2:
+                chr1 = shift;
+                break;
+            case 3:
+                prg = shift;
+                break;
+        }
+        shift = EMPTY;
+        remap();
+    }
+
+    void saveRegs(uint8_t *regs) const override {
+        regs[0] = shift;
+        regs[1] = control;
+        regs[2] = chr0;
+        regs[3] = chr1;
+        regs[4] = prg;
+    }
+    void loadRegs(const uint8_t *regs) override {
+        shift = regs[0];
+        control = regs[1];
+        chr0 = regs[2];
+        chr1 = regs[3];
+        prg = regs[4];
+        remap();
+    }
+
+   private:
+    static const uint8_t EMPTY = 0x10;  // Shift register with no bits in
+
+    uint8_t shift = EMPTY;
+    uint8_t control = 0x0C;
+    uint8_t chr0 = 0, chr1 = 0, prg = 0;
+
+    void remap() {
+        static const Cartridge::Mirroring layouts[] = {
+            Cartridge::Mirroring::ONE_SCREEN_LO,
+            Cartridge::Mirroring::ONE_SCREEN_HI,
+            Cartridge::Mirroring::VERTICAL, Cartridge::Mirroring::HORIZONTAL};
+        mirroring = layouts[control & 0x03];
+
+        size_t banks = min<size_t>(cart->prgSize() / PRG_BANK, 16);
+        size_t outer = cart->prgSize() > 256 * 1024 ? (chr0 & 0x10) : 0;
+        switch ((control >> 2) & 0x03) {
+            case 0:
+            case 1:  // 32 KiB at $8000
+                mapPrg16(0, outer + (prg & 0x0E));
+                mapPrg16(1, outer + (prg & 0x0E) + 1);
+                break;
+            case 2:  // First bank fixed at $8000
+                mapPrg16(0, outer);
+                mapPrg16(1, outer + (prg & 0x0F));
+                break;
+            case 3:  // Last bank fixed at $C000
+                mapPrg16(0, outer + (prg & 0x0F));
+                mapPrg16(1, outer + banks - 1);
+                break;
+        }
+
+        if (control & 0x10) {  // Two 4 KiB banks
+            mapChr4(0, chr0);
+            mapChr4(1, chr1);
+        } else {  // One 8 KiB bank
+            mapChr4(0, chr0 & 0x1E);
+            mapChr4(1, (chr0 & 0x1E) + 1);
+        }
+    }
+};
+
+}  // namespace
+
+unique_ptr<Mapper> Mapper::create(Bus &bus,
+                                  shared_ptr<const Cartridge> cart) {
+    if (!supports(*cart)) {
+        return nullptr;
+    }
+    switch (cart->mapper) {
+        case 0:
+            return make_unique<Nrom>(bus, move(cart));
+        case 1:
+            return make_unique<Mmc1>(bus, move(cart));
+        case 2:
+            return make_unique<Uxrom>(bus, move(cart));
+        case 3:
+            return make_unique<Cnrom>(bus, move(cart));
+    }
+    return nullptr;
+}
+
+bool Mapper::supports(const Cartridge &cart) {
+    return cart.mapper <= 3 && cart.prgSize() % PRG_BANK == 0 &&
+           cart.chrSize() % CHR_BANK == 0 && cart.chrRamSize <= CHR_RAM_SIZE;
+}
+
+Mapper::Mapper(Bus &bus, shared_ptr<const Cartridge> c)
+    : bus(bus), cart(move(c)) {
+    if (!cart->chr()) {
+        chrRam.assign(CHR_RAM_SIZE, 0x00);
+    }
+    mirroring = cart->mirroring;
+    forgetBanks();
+    bus.mapDevice(0x80, 128, this);
+}
+
+Mapper::Mapper(Bus &bus, const Mapper &other)
+    : bus(bus), cart(other.cart), chrRam(other.chrRam) {
+    mirroring = other.mirroring;
+    forgetBanks();
+    bus.mapDevice(0x80, 128, this);
+}
+
+Mapper::~Mapper() {
+}
+
+void Mapper::saveState(MapperState &s) const {
+    s = MapperState();
+    s.id = cart->mapper;
+    saveRegs(s.regs);
+}
+
+bool Mapper::loadState(const MapperState &s) {
+    if (s.id != cart->mapper) {
+        return false;
+    }
+    loadRegs(s.regs);
+    return true;
+}
+
+void Mapper::loadChrRam(const uint8_t *data) {
+    copy(data, data + chrRam.size(), chrRam.begin());
+}
+
+uint8_t Mapper::cpuRead(uint16_t addr, bool bReadOnly) {
+    return 0x00;
+}
+
+void Mapper::mapPrg16(int slot, size_t n) {
+    n %= cart->prgSize() / PRG_BANK;
+    if (prgBank[slot] == n) {
+        return;
+    }
+    prgBank[slot] = n;
+    bus.mapRom(0x80 + slot * 0x40, PRG_BANK / 256, cart->prg() + n * PRG_BANK);
+}
+
+void Mapper::mapChr4(int slot, size_t n) {
+    size_t size = chrRam.empty() ? cart->chrSize() : chrRam.size();
+    n %= size / CHR_BANK;
+    if (chrBank[slot] == n) {
+        return;
+    }
+    chrBank[slot] = n;
+    for (int i = 0; i < 4; i++) {
+        size_t offset = n * CHR_BANK + i * 1024;
+        if (chrRam.empty()) {
+            chrRead[slot * 4 + i] = cart->chr() + offset;
+            chrWrite[slot * 4 + i] = nullptr;
+        } else {
+            chrRead[slot * 4 + i] = chrRam.data() + offset;
+            chrWrite[slot * 4 + i] = chrRam.data() + offset;
+        }
+    }
+}
+
+void Mapper::forgetBanks() {
+    prgBank.fill(NO_BANK);
+    chrBank.fill(NO_BANK);
+}
@@ -0,0 +1,705 @@
+#include "PPU2C02.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "FrameSink.h"
+#include "Mapper.h"
+
+using namespace std;
+
+namespace {
+
+// Pixels in the line buffers are palette RAM indices with flags on top:
+// bits 0-1 the colour within the palette, bits 2-3 the palette, bit 4 set
+// for sprite palettes, BEHIND for a sprite drawn behind the background and
+// SPRITE_ZERO for sprite 0. Transparent pixels are 0, flags and all.
+const uint8_t BEHIND = 0x40;
+const uint8_t SPRITE_ZERO = 0x80;
+
+// One tile row: its two bitplanes and the bits its opaque pixels get.
+struct Row {
+    uint8_t lo, hi, attr;
+};
+
+const int TILES = 33;  // Enough for a line at any fine X
+const int PAD = 32;    // Slack so vector loops need no tail
+
+uint8_t reverse(uint8_t b) {
+    return (uint8_t)(((b * 0x0202020202ULL) & 0x010884422010ULL) % 1023);
+}
+
+// $3F10/$3F14/$3F18/$3F1C are the same bytes as $3F00/$3F04/$3F08/$3F0C.
+uint8_t paletteIndex(uint16_t addr) {
+    uint8_t i = addr & 0x1F;
+    return (i & 0x13) == 0x10 ? i & 0x0F : i;
+}
+
+// Decodes n rows (a multiple of 4) into 8 pixels each, leftmost first.
+using Decode = void (*)(const Row *rows, int n, uint8_t *out);
+
+// Lays the sprite pixels spr over the background bg for one line, looks
+// every pixel up in table (32 colours, by palette RAM index) into out and
+// returns the first x where sprite 0 and the background are both opaque,
+// or -1.
+using Merge = int (*)(const uint8_t *bg, const uint8_t *spr,
+                      const uint8_t *table, uint8_t *out);
+
+#if !defined(__x86_64__)
+void decodeScalar(const Row *rows, int n, uint8_t *out) {
+    for (int i = 0; i < n; i++) {
+        for (int k = 0; k < 8; k++) {
+            uint8_t p = ((rows[i].lo >> (7 - k)) & 1) |
+                        (((rows[i].hi >> (7 - k)) & 1) << 1);
+            out[i * 8 + k] = p ? (rows[i].attr | p) : 0;
+        }
+    }
+}
+
+int mergeScalar(const uint8_t *bg, const uint8_t *spr, const uint8_t *table,
+                uint8_t *out) {
+    int hit = -1;
+    for (int x = 0; x < PPU2C02::WIDTH; x++) {
+        uint8_t b = bg[x], s = spr[x];
+        if ((s & SPRITE_ZERO) && b && hit < 0) {
+            hit = x;
+        }
+        bool sprite = s && (!(s & BEHIND) || !b);
+        out[x] = table[sprite ? (s & 0x1F) : b];
+    }
+    return hit;
+}
+#else
+const uint64_t BYTES = 0x0101010101010101ULL;  // Times a byte fills all 8
+const int64_t BITS = 0x0102040810204080LL;     // Bit 7 first
+
+void decodeSse2(const Row *rows, int n, uint8_t *out) {
+    const __m128i bits = _mm_set1_epi64x(BITS);
+    const __m128i one = _mm_set1_epi8(1), two = _mm_set1_epi8(2);
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < n; i += 2) {
+        const Row &a = rows[i], &b = rows[i + 1];
+        __m128i lo = _mm_set_epi64x(b.lo * BYTES, a.lo * BYTES);
+        __m128i hi = _mm_set_epi64x(b.hi * BYTES, a.hi * BYTES);
+        __m128i attr = _mm_set_epi64x(b.attr * BYTES, a.attr * BYTES);
+        // Each lane keeps its own bit of the plane, then becomes 0 or 1/2.
+        __m128i p = _mm_or_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(lo, bits), bits), one),
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(hi, bits), bits), two));
+        __m128i px = _mm_andnot_si128(_mm_cmpeq_epi8(p, zero),
+                                      _mm_or_si128(p, attr));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * 8), px);
+    }
+}
+
+// Without pshufb the palette is looked up one pixel at a time.
+int mergeSse2(const uint8_t *bg, const uint8_t *spr, const uint8_t *table,
+              uint8_t *out) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i behind = _mm_set1_epi8(BEHIND);
+    const __m128i index = _mm_set1_epi8(0x1F);
+    alignas(16) uint8_t pixels[PPU2C02::WIDTH];
+    int hit = -1;
+    for (int x = 0; x < PPU2C02::WIDTH; x += 16) {
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bg + x));
+        __m128i s =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(spr + x));
+        __m128i bClear = _mm_cmpeq_epi8(b, zero);
+        __m128i sClear = _mm_cmpeq_epi8(s, zero);
+        __m128i sBehind = _mm_cmpeq_epi8(_mm_and_si128(s, behind), behind);
+        __m128i useBg = _mm_or_si128(sClear, _mm_andnot_si128(bClear, sBehind));
+        __m128i px =
+            _mm_or_si128(_mm_and_si128(useBg, b),
+                         _mm_andnot_si128(useBg, _mm_and_si128(s, index)));
+        _mm_store_si128(reinterpret_cast<__m128i *>(pixels + x), px);
+        // Bit 7 is SPRITE_ZERO, which movemask picks out.
+        int zeroHits = _mm_movemask_epi8(_mm_andnot_si128(bClear, s));
+        if (zeroHits && hit < 0) {
+            hit = x + __builtin_ctz(zeroHits);
+        }
+    }
+    for (int x = 0; x < PPU2C02::WIDTH; x++) {
+        out[x] = table[pixels[x]];
+    }
+    return hit;
+}
+
+__attribute__((target("avx2"))) void decodeAvx2(const Row *rows, int n,
+                                                uint8_t *out) {
+    const __m256i bits = _mm256_set1_epi64x(BITS);
+    const __m256i one = _mm256_set1_epi8(1), two = _mm256_set1_epi8(2);
+    const __m256i zero = _mm256_setzero_si256();
+    for (int i = 0; i < n; i += 4) {
+        const Row *r = rows + i;
+        __m256i lo = _mm256_set_epi64x(r[3].lo * BYTES, r[2].lo * BYTES,
+                                       r[1].lo * BYTES, r[0].lo * BYTES);
+        __m256i hi = _mm256_set_epi64x(r[3].hi * BYTES, r[2].hi * BYTES,
+                                       r[1].hi * BYTES, r[0].hi * BYTES);
+        __m256i attr = _mm256_set_epi64x(r[3].attr * BYTES, r[2].attr * BYTES,
+                                         r[1].attr * BYTES, r[0].attr * BYTES);
+        __m256i p = _mm256_or_si256(
+            _mm256_and_si256(
+                _mm256_cmpeq_epi8(_mm256_and_si256(lo, bits), bits), one),
+            _mm256_and_si256(
+                _mm256_cmpeq_epi8(_mm256_and_si256(hi, bits), bits), two));
+        __m256i px = _mm256_andnot_si256(_mm256_cmpeq_epi8(p, zero),
+                                         _mm256_or_si256(p, attr));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i * 8), px);
+    }
+}
+
+// pshufb looks up 16 entries per 128-bit lane, so the 32 colours are two
+// lookups and a blend on bit 4.
+__attribute__((target("avx2"))) int mergeAvx2(const uint8_t *bg,
+                                              const uint8_t *spr,
+                                              const uint8_t *table,
+                                              uint8_t *out) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i behind = _mm256_set1_epi8(BEHIND);
+    const __m256i index = _mm256_set1_epi8(0x1F);
+    const __m256i upper = _mm256_set1_epi8(0x10);
+    const __m256i low16 = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(table)));
+    const __m256i high16 = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(table + 16)));
+    int hit = -1;
+    for (int x = 0; x < PPU2C02::WIDTH; x += 32) {
+        __m256i b =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bg + x));
+        __m256i s =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(spr + x));
+        __m256i bClear = _mm256_cmpeq_epi8(b, zero);
+        __m256i sClear = _mm256_cmpeq_epi8(s, zero);
+        __m256i sBehind =
+            _mm256_cmpeq_epi8(_mm256_and_si256(s, behind), behind);
+        __m256i useBg =
+            _mm256_or_si256(sClear, _mm256_andnot_si256(bClear, sBehind));
+        __m256i px = _mm256_blendv_epi8(_mm256_and_si256(s, index), b, useBg);
+        __m256i colour = _mm256_blendv_epi8(
+            _mm256_shuffle_epi8(low16, px), _mm256_shuffle_epi8(high16, px),
+            _mm256_cmpeq_epi8(_mm256_and_si256(px, upper), upper));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + x), colour);
+        uint32_t zeroHits =
+            _mm256_movemask_epi8(_mm256_andnot_si256(bClear, s));
+        if (zeroHits && hit < 0) {
+            hit = x + __builtin_ctz(zeroHits);
+        }
+    }
+    return hit;
+}
+#endif
+
+struct Kernels {
+    Decode decode;
+    Merge merge;
+};
+
+// Picked once, by what the host can run.
+const Kernels &kernels() {
+    static const Kernels k = [] {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return Kernels{decodeAvx2, mergeAvx2};
+        }
+        return Kernels{decodeSse2, mergeSse2};
+#else
+        return Kernels{decodeScalar, mergeScalar};
+#endif
+    }();
+    return k;
+}
+
+// Lays the 8 pixels at px over line wherever they are opaque.
+void place(uint8_t *line, const uint8_t *px) {
+#if defined(__x86_64__)
+    __m128i l = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(line));
+    __m128i p = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(px));
+    __m128i keep = _mm_cmpeq_epi8(p, _mm_setzero_si128());
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(line),
+                     _mm_or_si128(_mm_and_si128(keep, l), p));
+#else
+    for (int k = 0; k < 8; k++) {
+        if (px[k]) {
+            line[k] = px[k];
+        }
+    }
+#endif
+}
+
+// p's target for writing: p's alone, copied first if a copy of the PPU
+// still shares it.
+template <class T>
+T &own(shared_ptr<T> &p) {
+    if (p.use_count() > 1) {
+        p = make_shared<T>(*p);
+    } else {
+        // The copy that shared it last may have been reading it on another
+        // thread; see those reads finish first.
+        atomic_thread_fence(memory_order_acquire);
+    }
+    return *p;
+}
+
+}  // namespace
+
+PPU2C02::PPU2C02() {
+    reset();
+}
+
+void PPU2C02::connect(Mapper *m) {
+    mapper = m;
+}
+
+void PPU2C02::reset() {
+    ctrl = mask = status = oamAddr = 0x00;
+    v = t = 0x0000;
+    fineX = 0;
+    latch = false;
+    readBuffer = openBus = 0x00;
+    scanline = 0;
+    dot = 0;
+    oddFrame = false;
+    hitDot = 0;
+    spriteCount = 0;
+    nmi = false;
+    frames = 0;
+    palette.fill(0x00);
+    oam.fill(0x00);
+    vram = make_shared<Nametables>();
+    screen = make_shared<vector<uint8_t>>(WIDTH * HEIGHT, 0x00);
+}
+
+uint8_t PPU2C02::cpuRead(uint16_t addr, bool bReadOnly) {
+    uint8_t data = openBus;
+    switch (addr & 0x0007) {
+        case 2:  // PPUSTATUS; reading it ends vertical blank
+            data = (status & 0xE0) | (openBus & 0x1F);
+            if (!bReadOnly) {
+                status &= ~0x80;
+                latch = false;
+            }
+            break;
+        case 4:  // OAMDATA; attribute bits 2-4 do not exist
+            data = oam[oamAddr];
+            if ((oamAddr & 0x03) == 0x02) {
+                data &= 0xE3;
+            }
+            break;
+        case 7: {  // PPUDATA; palette reads skip the buffer
+            uint16_t at = v & 0x3FFF;
+            data = at >= 0x3F00 ? (ppuRead(at) | (openBus & 0xC0))
+                                : readBuffer;
+            if (!bReadOnly) {
+                // The buffer fills from the nametable under the palette.
+                readBuffer = ppuRead(at >= 0x3F00 ? at - 0x1000 : at);
+                v = (v + ((ctrl & 0x04) ? 32 : 1)) & 0x7FFF;
+            }
+            break;
+        }
+    }
+    if (!bReadOnly) {
+        openBus = data;
+    }
+    return data;
+}
+
+void PPU2C02::cpuWrite(uint16_t addr, uint8_t data) {
+    openBus = data;
+    switch (addr & 0x0007) {
+        case 0:  // PPUCTRL
+            // Enabling NMI during vertical blank raises one at once.
+            if (!(ctrl & 0x80) && (data & 0x80) && (status & 0x80)) {
+                nmi = true;
+            }
+            ctrl = data;
+            t = (t & 0xF3FF) | ((data & 0x03) << 10);
+            break;
+        case 1:  // PPUMASK
+            mask = data;
+            break;
+        case 3:  // OAMADDR
+            oamAddr = data;
+            break;
+        case 4:  // OAMDATA
+            oam[oamAddr++] = data;
+            break;
+        case 5:  // PPUSCROLL: x, then y
+            if (!latch) {
+                t = (t & 0xFFE0) | (data >> 3);
+                fineX = data & 0x07;
+            } else {
+                t = (t & 0x8C1F) | ((data & 0x07) << 12) |
+                    ((data & 0xF8) << 2);
+            }
+            latch = !latch;
+            break;
+        case 6:  // PPUADDR: high byte, then low
+            if (!latch) {
+                t = (t & 0x00FF) | ((data & 0x3F) << 8);
+            } else {
+                t = (t & 0xFF00) | data;
+                v = t;
+            }
+            latch = !latch;
+            break;
+        case 7:  // PPUDATA
+            ppuWrite(v & 0x3FFF, data);
+            v = (v + ((ctrl & 0x04) ? 32 : 1)) & 0x7FFF;
+            break;
+    }
+}
+
+void PPU2C02::run(uint64_t n) {
+    while (n > 0) {
+        uint16_t next = nextEvent();
+        if (dot < next) {
+            uint64_t skip = min<uint64_t>(n, next - dot);
+            dot += skip;
+            n -= skip;
+        } else if (dot >= lineLength()) {
+            dot = 0;
+            if (++scanline == LINES) {
+                scanline = 0;
+                oddFrame = !oddFrame;
+            }
+        } else {
+            event();
+            dot++;
+            n--;
+        }
+    }
+}
+
+uint32_t PPU2C02::untilVblank() const {
+    if (scanline < 241 || (scanline == 241 && dot <= 1)) {
+        return (241 - scanline) * DOTS + 1 - dot;
+    }
+    // To the end of the frame, then to dot 1 of line 241 in the next.
+    uint32_t rest = (LINES - scanline) * DOTS - dot;
+    if (oddFrame && rendering()) {
+        rest--;
+    }
+    return rest + 241 * DOTS + 1;
+}
+
+// The first dot at or after dot that does something, or the end of the
+// line.
+uint16_t PPU2C02::nextEvent() const {
+    uint16_t next = lineLength();
+    auto at = [&](uint16_t d) {
+        if (d >= dot && d < next) {
+            next = d;
+        }
+    };
+    if (scanline < HEIGHT) {
+        at(1);
+        if (hitDot) {
+            at(hitDot);
+        }
+        at(256);
+        at(257);
+    } else if (scanline == 241) {
+        at(1);
+    } else if (scanline == 261) {
+        at(1);
+        at(256);
+        at(257);
+        at(280);
+    }
+    return next;
+}
+
+// Everything that happens on the current dot. With rendering on, the
+// scroll follows the hardware: fine and coarse Y step on dot 256, the
+// horizontal bits reload from t on dot 257 and the vertical ones on the
+// pre-render line. Sprites for the next line are evaluated and fetched on
+// dot 257, where the hardware fetches them.
+void PPU2C02::event() {
+    if (scanline < HEIGHT) {
+        if (dot == 1) {
+            renderLine();
+        }
+        if (dot == hitDot) {
+            status |= 0x40;
+            hitDot = 0;
+        }
+        if (dot == 256 && rendering()) {
+            incrementY();
+        }
+        if (dot == 257) {
+            if (rendering()) {
+                v = (v & ~0x041F) | (t & 0x041F);
+                evaluateSprites();
+            } else {
+                spriteCount = 0;
+            }
+        }
+    } else if (scanline == 241) {
+        status |= 0x80;
+        if (ctrl & 0x80) {
+            nmi = true;
+        }
+        frames++;
+        if (output) {
+            output->push(own(screen), frames);
+        }
+    } else if (scanline == 261) {
+        if (dot == 1) {
+            status &= 0x1F;
+        }
+        if (rendering()) {
+            if (dot == 256) {
+                incrementY();
+            } else if (dot == 257) {
+                v = (v & ~0x041F) | (t & 0x041F);
+            } else if (dot == 280) {
+                v = (v & ~0x7BE0) | (t & 0x7BE0);
+            }
+        }
+        if (dot == 257) {
+            // Line 0 never has sprites.
+            spriteCount = 0;
+        }
+    }
+}
+
+uint8_t PPU2C02::chr(uint16_t addr) const {
+    return mapper ? mapper->chrRead[(addr >> 10) & 0x07][addr & 0x03FF]
+                  : 0x00;
+}
+
+uint16_t PPU2C02::nametable(uint16_t addr) const {
+    uint16_t table = (addr >> 10) & 0x03;
+    switch (mapper ? mapper->mirroring : Cartridge::Mirroring::HORIZONTAL) {
+        case Cartridge::Mirroring::HORIZONTAL:
+            table >>= 1;
+            break;
+        case Cartridge::Mirroring::VERTICAL:
+            table &= 1;
+            break;
+        case Cartridge::Mirroring::ONE_SCREEN_LO:
+            table = 0;
+            break;
+        case Cartridge::Mirroring::ONE_SCREEN_HI:
+            table = 1;
+            break;
+        case Cartridge::Mirroring::FOUR_SCREEN:
+            break;
+    }
+    return table * 0x0400 + (addr & 0x03FF);
+}
+
+uint8_t PPU2C02::ppuRead(uint16_t addr) const {
+    if (addr < 0x2000) {
+        return chr(addr);
+    }
+    if (addr < 0x3F00) {
+        return (*vram)[nametable(addr)];
+    }
+    return palette[paletteIndex(addr)];
+}
+
+void PPU2C02::ppuWrite(uint16_t addr, uint8_t data) {
+    if (addr < 0x2000) {
+        uint8_t *bank = mapper ? mapper->chrWrite[addr >> 10] : nullptr;
+        if (bank) {
+            bank[addr & 0x03FF] = data;
+        }
+    } else if (addr < 0x3F00) {
+        own(vram)[nametable(addr)] = data;
+    } else {
+        palette[paletteIndex(addr)] = data & 0x3F;
+    }
+}
+
+void PPU2C02::incrementY() {
+    if ((v & 0x7000) != 0x7000) {
+        v += 0x1000;
+        return;
+    }
+    v &= ~0x7000;
+    uint16_t y = (v & 0x03E0) >> 5;
+    if (y == 29) {
+        // The last row of a nametable; move down into the next one.
+        y = 0;
+        v ^= 0x0800;
+    } else if (y == 31) {
+        // Rows 30 and 31 are attribute data, and wrap without switching.
+        y = 0;
+    } else {
+        y++;
+    }
+    v = (v & ~0x03E0) | (y << 5);
+}
+
+// Picks the first eight sprites in OAM order that cover the next line and
+// fetches their pattern rows. Past the eighth the hardware goes on looking
+// for a ninth to set the overflow flag, but steps through the bytes of each
+// entry along with the entries, so it compares tile numbers, attributes and
+// x positions as if they were y.
+void PPU2C02::evaluateSprites() {
+    int height = (ctrl & 0x20) ? 16 : 8;
+    spriteCount = 0;
+    int n = 0;
+    for (; n < 64 && spriteCount < 8; n++) {
+        int row = scanline - oam[n * 4];
+        if (row < 0 || row >= height) {
+            continue;
+        }
+        uint8_t tile = oam[n * 4 + 1];
+        uint8_t attr = oam[n * 4 + 2];
+        if (attr & 0x80) {
+            row = height - 1 - row;
+        }
+        uint16_t addr;
+        if (height == 16) {
+            // 8x16 sprites take their pattern table from bit 0 of the tile.
+            addr = ((tile & 0x01) << 12) |
+                   (((tile & 0xFE) + (row >> 3)) << 4) | (row & 0x07);
+        } else {
+            addr = ((ctrl & 0x08) << 9) | (tile << 4) | row;
+        }
+        uint8_t lo = chr(addr), hi = chr(addr + 8);
+        if (attr & 0x40) {
+            lo = reverse(lo);
+            hi = reverse(hi);
+        }
+        uint8_t flags = 0x10 | ((attr & 0x03) << 2);
+        flags |= (attr & 0x20) ? BEHIND : 0;
+        flags |= n == 0 ? SPRITE_ZERO : 0;
+        sprites[spriteCount++] = {lo, hi, flags, oam[n * 4 + 3]};
+    }
+    for (int m = 0; n < 64; n++, m = (m + 1) & 0x03) {
+        int row = scanline - oam[n * 4 + m];
+        if (row >= 0 && row < height) {
+            status |= 0x20;
+            break;
+        }
+    }
+}
+
+void PPU2C02::renderLine() {
+    const Kernels &k = kernels();
+    alignas(32) uint8_t bg[(TILES + 3) * 8 + PAD];
+    alignas(32) uint8_t spr[WIDTH + PAD] = {};
+    alignas(32) uint8_t table[32];
+
+    if (mask & 0x08) {
+        // The tiles under the line, from the one fineX starts in.
+        Row rows[TILES + 3] = {};
+        const Nametables &nt = *vram;
+        uint16_t addr = v;
+        uint16_t base = ((ctrl & 0x10) << 8) | ((v >> 12) & 0x07);
+        for (int i = 0; i < TILES; i++) {
+            uint8_t tile = nt[nametable(0x2000 | (addr & 0x0FFF))];
+            uint8_t attr = nt[nametable(0x23C0 | (addr & 0x0C00) |
+                                        ((addr >> 4) & 0x38) |
+                                        ((addr >> 2) & 0x07))];
+            uint8_t shift = ((addr >> 4) & 0x04) | (addr & 0x02);
+            uint16_t pattern = base | (tile << 4);
+            rows[i] = {chr(pattern), chr(pattern + 8),
+                       (uint8_t)(((attr >> shift) & 0x03) << 2)};
+            // Coarse X wraps into the next nametable across.
+            addr = (addr & 0x001F) == 0x001F ? (addr & ~0x001F) ^ 0x0400
+                                             : addr + 1;
+        }
+        k.decode(rows, TILES + 3, bg);
+        if (!(mask & 0x02)) {
+            memset(bg + fineX, 0, 8);
+        }
+    } else {
+        memset(bg, 0, sizeof(bg));
+    }
+
+    if ((mask & 0x10) && spriteCount) {
+        Row rows[8] = {};
+        alignas(32) uint8_t px[8 * 8];
+        for (int i = 0; i < spriteCount; i++) {
+            rows[i] = {sprites[i].lo, sprites[i].hi, sprites[i].attr};
+        }
+        k.decode(rows, 8, px);
+        // Lower OAM entries are drawn last, so they end up in front.
+        for (int i = spriteCount - 1; i >= 0; i--) {
+            place(spr + sprites[i].x, px + i * 8);
+        }
+        if (!(mask & 0x04)) {
+            memset(spr, 0, 8);
+        }
+    }
+
+    uint8_t grey = (mask & 0x01) ? 0x30 : 0x3F;
+    for (int i = 0; i < 32; i++) {
+        table[i] = palette[(i & 0x03) ? i : 0] & grey;
+    }
+
+    hitDot = 0;
+    uint8_t *line = &own(screen)[scanline * WIDTH];
+    int hit = k.merge(bg + fineX, spr, table, line);
+    // No hit at x = 255, nor once the flag is already up.
+    if (hit >= 0 && hit < 255 && !(status & 0x40)) {
+        hitDot = hit + 1;
+    }
+}
+
+void PPU2C02::saveState(PPUState &s) const {
+    s = PPUState();
+    s.ctrl = ctrl;
+    s.mask = mask;
+    s.status = status;
+    s.oamAddr = oamAddr;
+    s.fineX = fineX;
+    s.latch = latch;
+    s.readBuffer = readBuffer;
+    s.openBus = openBus;
+    s.v = v;
+    s.t = t;
+    s.scanline = scanline;
+    s.dot = dot;
+    s.hitDot = hitDot;
+    s.oddFrame = oddFrame;
+    s.nmi = nmi;
+    s.spriteCount = spriteCount;
+    s.frames = frames;
+    for (int i = 0; i < 8; i++) {
+        s.sprites[i * 4] = sprites[i].lo;
+        s.sprites[i * 4 + 1] = sprites[i].hi;
+        s.sprites[i * 4 + 2] = sprites[i].attr;
+        s.sprites[i * 4 + 3] = sprites[i].x;
+    }
+    memcpy(s.palette, palette.data(), sizeof(s.palette));
+    memcpy(s.oam, oam.data(), sizeof(s.oam));
+    memcpy(s.vram, vram->data(), sizeof(s.vram));
+}
+
+void PPU2C02::loadState(const PPUState &s) {
+    ctrl = s.ctrl;
+    mask = s.mask;
+    status = s.status;
+    oamAddr = s.oamAddr;
+    fineX = s.fineX;
+    latch = s.latch;
+    readBuffer = s.readBuffer;
+    openBus = s.openBus;
+    v = s.v;
+    t = s.t;
+    scanline = s.scanline;
+    dot = s.dot;
+    hitDot = s.hitDot;
+    oddFrame = s.oddFrame;
+    nmi = s.nmi;
+    spriteCount = min<uint8_t>(s.spriteCount, 8);
+    frames = s.frames;
+    for (int i = 0; i < 8; i++) {
+        sprites[i] = {s.sprites[i * 4], s.sprites[i * 4 + 1],
+                      s.sprites[i * 4 + 2], s.sprites[i * 4 + 3]};
+    }
+    memcpy(palette.data(), s.palette, sizeof(s.palette));
+    memcpy(oam.data(), s.oam, sizeof(s.oam));
+    memcpy(own(vram).data(), s.vram, sizeof(s.vram));
+}
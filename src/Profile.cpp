@@ -0,0 +1,154 @@
+#include "Profile.h"
+
+#if defined(NES_PROFILE)
+
+#if defined(NES_JIT)
+#error "PROFILE=1 counts in the interpreter; build it without JIT=1"
+#endif
+
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "CPU6502Opcodes.h"
+
+namespace {
+
+// Every thread's counters. Blocks stay allocated after their thread exits
+// so its counts still show up in the totals.
+mutex registryLock;
+vector<unique_ptr<ProfileCounters>> registry;
+
+double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+}  // namespace
+
+thread_local ProfileCounters *Profile::current = nullptr;
+
+const array<uint8_t, 256> Profile::base = {{
+#define CPU6502_PROFILE_BASE(code, name, op, mode, cyc) cyc,
+    CPU6502_OPCODES(CPU6502_PROFILE_BASE)
+#undef CPU6502_PROFILE_BASE
+}};
+
+const array<bool, 256> Profile::branch = {{
+#define CPU6502_PROFILE_BRANCH(code, name, op, mode, cyc) \
+    CPU6502::AddrMode::mode == CPU6502::AddrMode::REL,
+    CPU6502_OPCODES(CPU6502_PROFILE_BRANCH)
+#undef CPU6502_PROFILE_BRANCH
+}};
+
+void ProfileCounters::add(const ProfileCounters &other) {
+    for (int op = 0; op < 256; op++) {
+        executed[op] += other.executed[op];
+        cycles[op] += other.cycles[op];
+        pageCrossed[op] += other.pageCrossed[op];
+        branchTaken[op] += other.branchTaken[op];
+    }
+}
+
+ProfileCounters *Profile::attach() {
+    lock_guard<mutex> lock(registryLock);
+    registry.push_back(make_unique<ProfileCounters>());
+    return registry.back().get();
+}
+
+ProfileCounters Profile::total() {
+    lock_guard<mutex> lock(registryLock);
+    ProfileCounters sum;
+    for (const auto &counters : registry) sum.add(*counters);
+    return sum;
+}
+
+void Profile::reset() {
+    lock_guard<mutex> lock(registryLock);
+    for (auto &counters : registry) *counters = ProfileCounters();
+}
+
+void Profile::dump(ostream &out) {
+    ProfileCounters t = total();
+    uint64_t instructions = 0, cycles = 0;
+    vector<int> ops;
+    for (int op = 0; op < 256; op++) {
+        instructions += t.executed[op];
+        cycles += t.cycles[op];
+        if (t.executed[op]) {
+            ops.push_back(op);
+        }
+    }
+    stable_sort(ops.begin(), ops.end(),
+                [&](int a, int b) { return t.executed[a] > t.executed[b]; });
+
+    out << instructions << " instructions, " << cycles << " cycles\n";
+    out << "op  name mode        executed       %        cycles       %"
+           "   penalty%\n";
+    out << fixed << setprecision(2);
+    for (int op : ops) {
+        CPU6502::AddrMode mode = CPU6502::addrMode(op);
+        out << uppercase << hex << setw(2) << setfill('0') << op << dec
+            << setfill(' ') << "  " << CPU6502::mnemonic(op) << "  "
+            << CPU6502::modeName(mode) << setw(16) << t.executed[op]
+            << setw(8) << percent(t.executed[op], instructions) << setw(14)
+            << t.cycles[op] << setw(8) << percent(t.cycles[op], cycles);
+        if (branch[op]) {
+            out << setw(10) << percent(t.branchTaken[op], t.executed[op])
+                << " taken";
+        } else if (mode == CPU6502::AddrMode::ABX ||
+                   mode == CPU6502::AddrMode::ABY ||
+                   mode == CPU6502::AddrMode::IZY) {
+            out << setw(10) << percent(t.pageCrossed[op], t.executed[op])
+                << " crossed";
+        }
+        out << "\n";
+    }
+
+    // By addressing mode.
+    array<uint64_t, 12> modeExecuted{}, modeCycles{};
+    for (int op = 0; op < 256; op++) {
+        int mode = (int)CPU6502::addrMode(op);
+        modeExecuted[mode] += t.executed[op];
+        modeCycles[mode] += t.cycles[op];
+    }
+    out << "mode        executed       %        cycles       %\n";
+    for (int mode = 0; mode < 12; mode++) {
+        if (modeExecuted[mode]) {
+            out << CPU6502::modeName((CPU6502::AddrMode)mode) << setw(17)
+                << modeExecuted[mode] << setw(8)
+                << percent(modeExecuted[mode], instructions) << setw(14)
+                << modeCycles[mode] << setw(8)
+                << percent(modeCycles[mode], cycles) << "\n";
+        }
+    }
+    out << defaultfloat;
+}
+
+void Profile::dumpJson(ostream &out) {
+    ProfileCounters t = total();
+    out << "{\n  \"opcodes\": [";
+    bool first = true;
+    for (int op = 0; op < 256; op++) {
+        if (!t.executed[op]) {
+            continue;
+        }
+        out << (first ? "\n" : ",\n") << "    {\"opcode\": " << op
+            << ", \"name\": \"" << CPU6502::mnemonic(op) << "\", \"mode\": \""
+            << CPU6502::modeName(CPU6502::addrMode(op))
+            << "\", \"executed\": " << t.executed[op]
+            << ", \"cycles\": " << t.cycles[op];
+        if (branch[op]) {
+            out << ", \"branch_taken\": " << t.branchTaken[op];
+        } else {
+            out << ", \"page_crossed\": " << t.pageCrossed[op];
+        }
+        out << "}";
+        first = false;
+    }
+    out << "\n  ]\n}\n";
+}
+
+#endif
@@ -0,0 +1,37 @@
+#include "Program.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+using namespace std;
+
+const vector<uint8_t> *ImageCache::load(const string &path, string &error) {
+    auto it = images.find(path);
+    if (it == images.end()) {
+        ifstream in(path, ios::binary);
+        if (!in) {
+            error = "cannot open " + path;
+            return nullptr;
+        }
+        vector<uint8_t> data((istreambuf_iterator<char>(in)),
+                             istreambuf_iterator<char>());
+        it = images.emplace(path, move(data)).first;
+    }
+    return &it->second;
+}
+
+void loadProgram(Bus &bus, const vector<uint8_t> &image, uint16_t load,
+                 bool hasEntry, uint16_t entry) {
+    size_t size = min(image.size(), (size_t)0x10000 - load);
+    for (size_t i = 0; i < size; i++) {
+        bus.write(load + i, image[i]);
+    }
+
+    bool imageHasVector = load + size > 0xFFFD;
+    if (hasEntry || !imageHasVector) {
+        uint16_t at = hasEntry ? entry : load;
+        bus.write(0xFFFC, at & 0x00FF);
+        bus.write(0xFFFD, at >> 8);
+    }
+}
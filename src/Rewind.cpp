@@ -0,0 +1,239 @@
+#include "Rewind.h"
+
+#include <cstddef>
+#include <cstring>
+
+#include "Mapper.h"
+
+namespace {
+
+// The bytes of a PPUState before its nametables.
+const size_t PPU_HEAD = offsetof(PPUState, vram);
+
+}  // namespace
+
+Rewind::Rewind(Bus &bus, uint32_t interval, size_t maxBytes,
+               uint32_t keyframeEvery)
+    : bus(bus),
+      interval(interval ? interval : 1),
+      maxBytes(maxBytes),
+      keyframeEvery(keyframeEvery ? keyframeEvery : 1) {
+}
+
+void Rewind::clear() {
+    snapshots.clear();
+    totalBytes = 0;
+    sinceKeyframe = 0;
+}
+
+void Rewind::capture() {
+    Snapshot s;
+    bus.cpu.saveState(s.cpu);
+    s.cycles = bus.now();
+    s.bytes = sizeof(Snapshot);
+
+    if (Mapper *mapper = bus.mapper()) {
+        mapper->saveState(s.mapper);
+        if (const uint8_t *chr = mapper->chrRamData()) {
+            const Snapshot *last =
+                snapshots.empty() ? nullptr : &snapshots.back();
+            if (last && last->chrRam &&
+                memcmp(last->chrRam->data(), chr, CHR_RAM_SIZE) == 0) {
+                s.chrRam = last->chrRam;
+            } else {
+                s.chrRam = make_shared<const vector<uint8_t>>(
+                    chr, chr + CHR_RAM_SIZE);
+                s.bytes += CHR_RAM_SIZE;
+            }
+        }
+
+        PPUState ppu;
+        bus.ppu.saveState(ppu);
+        const uint8_t *raw = reinterpret_cast<const uint8_t *>(&ppu);
+        s.ppu.assign(raw, raw + PPU_HEAD);
+        s.bytes += PPU_HEAD;
+        const Snapshot *last = snapshots.empty() ? nullptr : &snapshots.back();
+        if (last && last->vram &&
+            memcmp(last->vram->data(), ppu.vram, sizeof(ppu.vram)) == 0) {
+            s.vram = last->vram;
+        } else {
+            s.vram = make_shared<const vector<uint8_t>>(
+                ppu.vram, ppu.vram + sizeof(ppu.vram));
+            s.bytes += sizeof(ppu.vram);
+        }
+        bus.apu.saveState(s.apu);
+    }
+
+    if (snapshots.empty() || sinceKeyframe + 1 >= keyframeEvery) {
+        // Only blocks this keyframe does not share with the previous one
+        // are new memory.
+        const Bus::RamImage *previous =
+            snapshots.empty() ? nullptr : &keyframeOf(snapshots.size() - 1);
+        s.image = make_unique<Bus::RamImage>(bus.shareRam());
+        s.bytes += sizeof(Bus::RamImage);
+        for (int n = 0; n < 256; n++) {
+            if (!previous || (*previous)[n] != (*s.image)[n]) {
+                s.bytes += sizeof(Bus::PageBlock);
+            }
+        }
+        sinceKeyframe = 0;
+    } else {
+        encodeDelta(keyframeOf(snapshots.size() - 1), s.delta);
+        s.delta.shrink_to_fit();
+        s.bytes += s.delta.size();
+        sinceKeyframe++;
+    }
+
+    totalBytes += s.bytes;
+    snapshots.push_back(move(s));
+    lastCapture = bus.cpu.instructions;
+    trim();
+}
+
+bool Rewind::stepBack() {
+    if (snapshots.size() < 2) {
+        return false;
+    }
+
+    totalBytes -= snapshots.back().bytes;
+    snapshots.pop_back();
+    restore(snapshots.size() - 1);
+
+    // Count the snapshots since the keyframe again, so the next keyframe
+    // comes when it would have.
+    sinceKeyframe = 0;
+    for (size_t i = snapshots.size() - 1; !snapshots[i].image; i--) {
+        sinceKeyframe++;
+    }
+    lastCapture = bus.cpu.instructions;
+    return true;
+}
+
+const Bus::RamImage &Rewind::keyframeOf(size_t i) const {
+    while (!snapshots[i].image) {
+        i--;
+    }
+    return *snapshots[i].image;
+}
+
+// Each page that differs from the keyframe is stored as its XOR against the
+// keyframe's block: runs of (zero count, literal count, literals), so the
+// unchanged bytes in between cost one byte per run.
+void Rewind::encodeDelta(const Bus::RamImage &key, vector<uint8_t> &out) {
+    uint8_t diff[256];
+    for (int n = 0; n < 256; n++) {
+        if (bus.sharedPage(n) == key[n].get()) {
+            continue;
+        }
+
+        const uint8_t *now = bus.ramPage(n);
+        const uint8_t *then = key[n]->data();
+        bool changed = false;
+        for (int i = 0; i < 256; i++) {
+            diff[i] = now[i] ^ then[i];
+            changed |= diff[i] != 0;
+        }
+        if (!changed) {
+            continue;
+        }
+
+        size_t header = out.size();
+        out.push_back(n);
+        out.push_back(0);
+        out.push_back(0);
+
+        int i = 0;
+        while (i < 256) {
+            uint8_t zeros = 0;
+            while (i < 256 && diff[i] == 0 && zeros < 255) {
+                zeros++;
+                i++;
+            }
+            uint8_t literals = 0;
+            while (i + literals < 256 && diff[i + literals] != 0 &&
+                   literals < 255) {
+                literals++;
+            }
+            out.push_back(zeros);
+            out.push_back(literals);
+            out.insert(out.end(), diff + i, diff + i + literals);
+            i += literals;
+        }
+
+        uint16_t length = out.size() - header - 3;
+        out[header + 1] = length & 0x00FF;
+        out[header + 2] = length >> 8;
+    }
+}
+
+void Rewind::restore(size_t i) {
+    const Snapshot &s = snapshots[i];
+    bus.cpu.loadState(s.cpu);
+    bus.setCycles(s.cycles);
+    if (Mapper *mapper = bus.mapper()) {
+        mapper->loadState(s.mapper);
+        if (s.chrRam) {
+            mapper->loadChrRam(s.chrRam->data());
+        }
+        PPUState ppu;
+        memcpy(reinterpret_cast<uint8_t *>(&ppu), s.ppu.data(), PPU_HEAD);
+        memcpy(ppu.vram, s.vram->data(), sizeof(ppu.vram));
+        bus.ppu.loadState(ppu);
+        bus.apu.loadState(s.apu);
+    }
+
+    const Bus::RamImage &key = keyframeOf(i);
+    bus.restoreRam(key);
+
+    const uint8_t *p = s.delta.data();
+    const uint8_t *end = p + s.delta.size();
+    uint8_t page[256];
+    while (p < end) {
+        uint8_t n = p[0];
+        const uint8_t *next = p + 3 + (p[1] | (p[2] << 8));
+        p += 3;
+
+        memcpy(page, key[n]->data(), 256);
+        int at = 0;
+        while (p < next) {
+            at += p[0];
+            uint8_t literals = p[1];
+            p += 2;
+            for (uint8_t k = 0; k < literals; k++) {
+                page[at++] ^= *p++;
+            }
+        }
+        bus.loadRamPage(n, page);
+    }
+}
+
+// Drops whole keyframe groups from the front, always keeping the newest.
+void Rewind::trim() {
+    while (totalBytes > maxBytes) {
+        size_t next = 1;
+        while (next < snapshots.size() && !snapshots[next].image) {
+            next++;
+        }
+        if (next == snapshots.size()) {
+            return;
+        }
+
+        for (size_t i = 0; i < next; i++) {
+            totalBytes -= snapshots.front().bytes;
+            snapshots.pop_front();
+        }
+
+        // The new oldest keyframe now holds every block it shares alone.
+        Snapshot &front = snapshots.front();
+        size_t full = sizeof(Snapshot) + front.ppu.size() +
+                      sizeof(Bus::RamImage) + 256 * sizeof(Bus::PageBlock);
+        if (front.vram) {
+            full += sizeof(PPUState::vram);
+        }
+        if (front.chrRam) {
+            full += CHR_RAM_SIZE;
+        }
+        totalBytes += full - front.bytes;
+        front.bytes = full;
+    }
+}
@@ -0,0 +1,57 @@
+#include "SaveState.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "WriteAll.h"
+
+bool SaveState::valid() const {
+    return memcmp(magic, "NESS", 4) == 0 && version == SAVE_STATE_VERSION &&
+           size == sizeof(SaveState);
+}
+
+bool writeSaveState(const string &path, const SaveState &s) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    if (!writeAll(fd, &s, sizeof s)) {
+        close(fd);
+        return false;
+    }
+    return close(fd) == 0;
+}
+
+MappedSaveState::MappedSaveState(const string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size == sizeof(SaveState)) {
+        void *p = mmap(nullptr, sizeof(SaveState), PROT_READ, MAP_PRIVATE,
+                       fd, 0);
+        if (p != MAP_FAILED) {
+            mapped = static_cast<const SaveState *>(p);
+            length = sizeof(SaveState);
+        }
+    }
+    close(fd);
+
+    if (mapped && !mapped->valid()) {
+        munmap(const_cast<SaveState *>(mapped), length);
+        mapped = nullptr;
+    }
+}
+
+MappedSaveState::~MappedSaveState() {
+    if (mapped) {
+        munmap(const_cast<SaveState *>(mapped), length);
+    }
+}
@@ -0,0 +1,469 @@
+#include "SingleStep.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Bus.h"
+#include "Hex.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+namespace {
+
+// Pull parser over a file read in fixed-size chunks, just enough JSON for
+// the test vectors: every value can be skipped, and numbers are read as
+// unsigned integers.
+class JsonReader {
+   public:
+    explicit JsonReader(FILE *file) : file(file), buffer(1 << 20) {
+    }
+
+    bool failed() const {
+        return error;
+    }
+
+    // The next non-blank character, not consumed. EOF at the end.
+    int peek() {
+        for (;;) {
+            if (pos == end && !refill()) {
+                return EOF;
+            }
+            char c = buffer[pos];
+            if (c != ' ' && c != '\n' && c != '\r' && c != '\t') {
+                return c;
+            }
+            pos++;
+        }
+    }
+
+    bool expect(char c) {
+        if (peek() != c) {
+            return fail();
+        }
+        pos++;
+        return true;
+    }
+
+    // Consumes c if it is next.
+    bool accept(char c) {
+        if (peek() != c) {
+            return false;
+        }
+        pos++;
+        return true;
+    }
+
+    bool number(uint32_t &v) {
+        if (peek() < '0' || peek() > '9') {
+            return fail();
+        }
+        v = 0;
+        while ((pos < end || refill()) && buffer[pos] >= '0' &&
+               buffer[pos] <= '9') {
+            v = v * 10 + (buffer[pos++] - '0');
+        }
+        return true;
+    }
+
+    bool str(string &s) {
+        if (!expect('"')) {
+            return false;
+        }
+        s.clear();
+        for (;;) {
+            if (pos == end && !refill()) {
+                return fail();
+            }
+            char c = buffer[pos++];
+            if (c == '"') {
+                return true;
+            }
+            if (c == '\\') {
+                if (pos == end && !refill()) {
+                    return fail();
+                }
+                c = buffer[pos++];
+            }
+            s += c;
+        }
+    }
+
+    bool skip() {
+        int c = peek();
+        if (c == '"') {
+            return str(scratch);
+        }
+        if (c == '[' || c == '{') {
+            char close = c == '[' ? ']' : '}';
+            pos++;
+            if (accept(close)) {
+                return true;
+            }
+            do {
+                if (c == '{' && !(str(scratch) && expect(':'))) {
+                    return false;
+                }
+                if (!skip()) {
+                    return false;
+                }
+            } while (accept(','));
+            return expect(close);
+        }
+        // Numbers and literals.
+        size_t start = pos;
+        while ((pos < end || refill()) && buffer[pos] != '\0' &&
+               strchr("-+.eE0123456789truefalsn", buffer[pos])) {
+            pos++;
+        }
+        return pos != start || fail();
+    }
+
+   private:
+    FILE *file;
+    vector<char> buffer;
+    size_t pos = 0, end = 0;
+    bool error = false;
+    string scratch;
+
+    bool refill() {
+        if (error) {
+            return false;
+        }
+        end = fread(buffer.data(), 1, buffer.size(), file);
+        pos = 0;
+        return end > 0;
+    }
+
+    bool fail() {
+        error = true;
+        return false;
+    }
+};
+
+struct State {
+    uint32_t pc, s, a, x, y, p;
+    vector<pair<uint16_t, uint8_t>> ram;
+};
+
+struct Access {
+    uint16_t addr;
+    uint8_t data;
+    bool write;
+
+    bool operator!=(const Access &o) const {
+        return addr != o.addr || data != o.data || write != o.write;
+    }
+};
+
+struct Case {
+    string name;
+    State initial, final;
+    vector<Access> cycles;
+};
+
+bool parseState(JsonReader &in, State &s) {
+    string key;
+    s.ram.clear();
+    if (!in.expect('{')) {
+        return false;
+    }
+    do {
+        if (!in.str(key) || !in.expect(':')) {
+            return false;
+        }
+        uint32_t *reg = key == "pc"  ? &s.pc
+                        : key == "s" ? &s.s
+                        : key == "a" ? &s.a
+                        : key == "x" ? &s.x
+                        : key == "y" ? &s.y
+                        : key == "p" ? &s.p
+                                     : nullptr;
+        if (reg) {
+            if (!in.number(*reg)) {
+                return false;
+            }
+        } else if (key == "ram") {
+            if (!in.expect('[')) {
+                return false;
+            }
+            if (!in.accept(']')) {
+                do {
+                    uint32_t addr, value;
+                    if (!(in.expect('[') && in.number(addr) &&
+                          in.expect(',') && in.number(value) &&
+                          in.expect(']'))) {
+                        return false;
+                    }
+                    s.ram.emplace_back(addr, value);
+                } while (in.accept(','));
+                if (!in.expect(']')) {
+                    return false;
+                }
+            }
+        } else if (!in.skip()) {
+            return false;
+        }
+    } while (in.accept(','));
+    return in.expect('}');
+}
+
+bool parseCycles(JsonReader &in, vector<Access> &cycles) {
+    cycles.clear();
+    string kind;
+    if (!in.expect('[')) {
+        return false;
+    }
+    if (in.accept(']')) {
+        return true;
+    }
+    do {
+        uint32_t addr, value;
+        if (!(in.expect('[') && in.number(addr) && in.expect(',') &&
+              in.number(value) && in.expect(',') && in.str(kind) &&
+              in.expect(']'))) {
+            return false;
+        }
+        cycles.push_back({(uint16_t)addr, (uint8_t)value, kind == "write"});
+    } while (in.accept(','));
+    return in.expect(']');
+}
+
+// Reads the case starting at the next '{'.
+bool parseCase(JsonReader &in, Case &c) {
+    string key;
+    if (!in.expect('{')) {
+        return false;
+    }
+    do {
+        if (!in.str(key) || !in.expect(':')) {
+            return false;
+        }
+        bool ok = key == "name"      ? in.str(c.name)
+                  : key == "initial" ? parseState(in, c.initial)
+                  : key == "final"   ? parseState(in, c.final)
+                  : key == "cycles"  ? parseCycles(in, c.cycles)
+                                     : in.skip();
+        if (!ok) {
+            return false;
+        }
+    } while (in.accept(','));
+    return in.expect('}');
+}
+
+// The whole address space as flat memory that logs every access the CPU
+// makes. Peeks are not logged.
+class Recorder : public BusDevice {
+   public:
+    array<uint8_t, 64 * 1024> mem{};
+    vector<Access> log;
+
+    uint8_t cpuRead(uint16_t addr, bool bReadOnly) override {
+        uint8_t data = mem[addr];
+        if (!bReadOnly) {
+            log.push_back({addr, data, false});
+        }
+        return data;
+    }
+
+    void cpuWrite(uint16_t addr, uint8_t data) override {
+        mem[addr] = data;
+        log.push_back({addr, data, true});
+    }
+};
+
+struct Worker {
+    Bus bus;
+    Recorder recorder;
+
+    Worker() {
+        bus.mapDevice(0x00, 256, &recorder);
+    }
+};
+
+struct FileResult {
+    uint64_t cases = 0;
+    uint64_t failed = 0;
+    bool parsed = true;
+    string diffs;  // The first few mismatches, ready to print
+};
+
+#if defined(NES_CYCLE_CORE)
+string describe(const Access &a) {
+    return string(a.write ? "write" : "read") + " $" + hex(a.addr, 4) + " $" +
+           hex(a.data, 2);
+}
+#endif
+
+// Runs one case; returns the differences, empty if it passed.
+string runCase(Worker &w, const Case &c) {
+    CPU6502 &cpu = w.bus.cpu;
+    Recorder &r = w.recorder;
+
+    for (const auto &[addr, value] : c.initial.ram) r.mem[addr] = value;
+    cpu.pc = c.initial.pc;
+    cpu.stkp = c.initial.s;
+    cpu.a = c.initial.a;
+    cpu.x = c.initial.x;
+    cpu.y = c.initial.y;
+    cpu.status = c.initial.p;
+    r.log.clear();
+
+    uint8_t cycles = cpu.step();
+
+    string diff;
+    auto reg = [&](const char *name, uint32_t got, uint32_t want, int d) {
+        if (got != want) {
+            diff += string("  ") + name + " $" + hex(got, d) + " != $" +
+                    hex(want, d) + "\n";
+        }
+    };
+    reg("pc", cpu.pc, c.final.pc, 4);
+    reg("s", cpu.stkp, c.final.s, 2);
+    reg("a", cpu.a, c.final.a, 2);
+    reg("x", cpu.x, c.final.x, 2);
+    reg("y", cpu.y, c.final.y, 2);
+    reg("p", cpu.status, c.final.p, 2);
+    for (const auto &[addr, value] : c.final.ram) {
+        if (r.mem[addr] != value) {
+            diff += "  ram[$" + hex(addr, 4) + "] $" + hex(r.mem[addr], 2) +
+                    " != $" + hex(value, 2) + "\n";
+        }
+    }
+    if (cycles != c.cycles.size()) {
+        diff += "  cycles " + to_string(cycles) +
+                " != " + to_string(c.cycles.size()) + "\n";
+    }
+#if defined(NES_CYCLE_CORE)
+    for (size_t i = 0; i < max(r.log.size(), c.cycles.size()); i++) {
+        bool have = i < r.log.size(), want = i < c.cycles.size();
+        if (!have || !want || r.log[i] != c.cycles[i]) {
+            diff += "  cycle " + to_string(i + 1) + ": " +
+                    (have ? describe(r.log[i]) : "nothing") + " != " +
+                    (want ? describe(c.cycles[i]) : "nothing") + "\n";
+        }
+    }
+#endif
+
+    // Put everything back to zero for the next case.
+    for (const auto &entry : c.initial.ram) r.mem[entry.first] = 0x00;
+    for (const Access &a : r.log) r.mem[a.addr] = 0x00;
+    return diff;
+}
+
+void runFile(Worker &w, const string &path, size_t maxDiffs,
+             FileResult &result) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        result.parsed = false;
+        return;
+    }
+    JsonReader in(file);
+    Case c;
+    bool ok = in.expect('[');
+    if (ok && !in.accept(']')) {
+        do {
+            if (!parseCase(in, c)) {
+                ok = false;
+                break;
+            }
+            result.cases++;
+            string diff = runCase(w, c);
+            if (!diff.empty()) {
+                if (result.failed < maxDiffs) {
+                    result.diffs += path + ": " + c.name + "\n" + diff;
+                }
+                result.failed++;
+            }
+        } while (in.accept(','));
+        ok = ok && in.expect(']');
+    }
+    result.parsed = ok && !in.failed();
+    fclose(file);
+}
+
+}  // namespace
+
+int runSingleStep(int argc, char **argv) {
+    vector<string> paths;
+    size_t nThreads = 0, maxDiffs = 3;
+    bool badArg = false;
+    for (int i = 0; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            badArg |= !parseCount(argv[++i], nThreads);
+        } else if (arg == "--diffs" && i + 1 < argc) {
+            badArg |= !parseCount(argv[++i], maxDiffs);
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (badArg || paths.empty()) {
+        cerr << "usage: nes --single-step <file or directory>... "
+                "[--threads N] [--diffs N]\n";
+        return 2;
+    }
+
+    // Directories stand for the .json files in them.
+    vector<string> files;
+    for (const string &path : paths) {
+        error_code ec;
+        if (filesystem::is_directory(path, ec)) {
+            vector<string> inDir;
+            for (const auto &entry : filesystem::directory_iterator(path, ec)) {
+                if (entry.path().extension() == ".json") {
+                    inDir.push_back(entry.path().string());
+                }
+            }
+            sort(inDir.begin(), inDir.end());
+            files.insert(files.end(), inDir.begin(), inDir.end());
+        } else {
+            files.push_back(path);
+        }
+    }
+
+    ThreadPool pool(nThreads);
+    vector<unique_ptr<Worker>> workers;
+    for (size_t i = 0; i < pool.size(); i++) {
+        workers.push_back(make_unique<Worker>());
+    }
+    vector<FileResult> results(files.size());
+
+    auto start = chrono::steady_clock::now();
+    pool.run(files.size(), [&](size_t file, size_t worker) {
+        runFile(*workers[worker], files[file], maxDiffs, results[file]);
+    });
+    double wall =
+        chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    uint64_t cases = 0, failed = 0;
+    bool broken = false;
+    for (const FileResult &r : results) cout << r.diffs;
+    for (size_t i = 0; i < files.size(); i++) {
+        const FileResult &r = results[i];
+        cases += r.cases;
+        failed += r.failed;
+        if (!r.parsed) {
+            cerr << "single-step: cannot read " << files[i] << " after "
+                 << r.cases << " cases\n";
+            broken = true;
+        } else if (r.failed) {
+            cout << files[i] << "  " << r.cases - r.failed << " of "
+                 << r.cases << " passed\n";
+        }
+    }
+    cout << cases - failed << " of " << cases << " cases passed in "
+         << files.size() << " files on " << pool.size() << " threads in "
+         << wall << " s (" << (uint64_t)(wall > 0 ? cases / wall : 0)
+         << " cases/s)\n";
+    return failed || broken ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(size_t nThreads) {
+    if (nThreads == 0) {
+        nThreads = thread::hardware_concurrency();
+    }
+    if (nThreads == 0) {
+        nThreads = 1;
+    }
+
+    for (size_t i = 0; i < nThreads; i++) {
+        queues.push_back(make_unique<Queue>());
+    }
+    for (size_t i = 0; i < nThreads; i++) {
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lk(m);
+        stop = true;
+    }
+    wake.notify_all();
+    for (auto &w : workers) w.join();
+}
+
+void ThreadPool::run(size_t count,
+                     const function<void(size_t, size_t)> &fn) {
+    if (count == 0) {
+        return;
+    }
+
+    // The task and the count must be in place before the first item is
+    // queued: a worker still draining the previous run may pick it up.
+    unique_lock<mutex> lk(m);
+    task = &fn;
+    pending = count;
+
+    size_t n = queues.size();
+    for (size_t w = 0; w < n; w++) {
+        lock_guard<mutex> qlk(queues[w]->lock);
+        for (size_t i = count * w / n; i < count * (w + 1) / n; i++) {
+            queues[w]->items.push_back(i);
+        }
+    }
+
+    generation++;
+    wake.notify_all();
+    done.wait(lk, [this] { return pending == 0; });
+    task = nullptr;
+}
+
+void ThreadPool::workerLoop(size_t id) {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            unique_lock<mutex> lk(m);
+            wake.wait(lk, [&] { return stop || generation != seen; });
+            if (stop) {
+                return;
+            }
+            seen = generation;
+        }
+
+        size_t item;
+        while (next(id, item)) {
+            (*task)(item, id);
+            if (--pending == 0) {
+                lock_guard<mutex> lk(m);
+                done.notify_all();
+            }
+        }
+    }
+}
+
+bool ThreadPool::next(size_t id, size_t &item) {
+    {
+        Queue &own = *queues[id];
+        lock_guard<mutex> lk(own.lock);
+        if (!own.items.empty()) {
+            item = own.items.back();
+            own.items.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < queues.size(); i++) {
+        Queue &victim = *queues[(id + i) % queues.size()];
+        lock_guard<mutex> lk(victim.lock);
+        if (!victim.items.empty()) {
+            item = victim.items.front();
+            victim.items.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,230 @@
+#include "Trace.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include "CPU6502.h"
+#include "WriteAll.h"
+
+using namespace std;
+
+namespace {
+
+const char MAGIC[8] = {'N', 'E', 'S', '6', '5', '0', '2', 'T'};
+const uint32_t VERSION = 1;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+};
+
+// The operand as nestest.log writes it.
+void formatOperand(char *out, size_t size, const TraceRecord &r) {
+    using M = CPU6502::AddrMode;
+    uint16_t word = r.lo | (r.hi << 8);
+    switch (CPU6502::addrMode(r.opcode)) {
+        case M::IMP:
+            // The accumulator forms of the shifts and rotates.
+            if (r.opcode == 0x0A || r.opcode == 0x2A || r.opcode == 0x4A ||
+                r.opcode == 0x6A) {
+                snprintf(out, size, "A");
+            } else {
+                out[0] = '\0';
+            }
+            break;
+        case M::IMM:
+            snprintf(out, size, "#$%02X", r.lo);
+            break;
+        case M::ZP0:
+            snprintf(out, size, "$%02X", r.lo);
+            break;
+        case M::ZPX:
+            snprintf(out, size, "$%02X,X", r.lo);
+            break;
+        case M::ZPY:
+            snprintf(out, size, "$%02X,Y", r.lo);
+            break;
+        case M::REL:
+            snprintf(out, size, "$%04X",
+                     (uint16_t)(r.pc + 2 + (int8_t)r.lo));
+            break;
+        case M::ABS:
+            snprintf(out, size, "$%04X", word);
+            break;
+        case M::ABX:
+            snprintf(out, size, "$%04X,X", word);
+            break;
+        case M::ABY:
+            snprintf(out, size, "$%04X,Y", word);
+            break;
+        case M::IND:
+            snprintf(out, size, "($%04X)", word);
+            break;
+        case M::IZX:
+            snprintf(out, size, "($%02X,X)", r.lo);
+            break;
+        case M::IZY:
+            snprintf(out, size, "($%02X),Y", r.lo);
+            break;
+    }
+}
+
+}  // namespace
+
+Trace::Trace(size_t capacity, bool dropWhenFull) : dropWhenFull(dropWhenFull) {
+    size_t size = BATCH;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    ring.resize(size);
+    mask = size - 1;
+}
+
+Trace::~Trace() {
+    close();
+}
+
+bool Trace::open(const string &path) {
+    close();
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    Header h;
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = VERSION;
+    h.recordSize = sizeof(TraceRecord);
+    if (!writeAll(fd, &h, sizeof(h))) {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    head = tailCache = lost = 0;
+    cycle = 0;
+    done = 0;
+    published.store(0, memory_order_relaxed);
+    tail.store(0, memory_order_relaxed);
+    writer.start(
+        [this](bool &failed) {
+            uint64_t ready = published.load(memory_order_acquire);
+            // Up to the end of the ring; the rest goes in the next take.
+            size_t start = done & mask;
+            size_t count = min<uint64_t>(ready - done, ring.size() - start);
+            if (count > 0 && !failed &&
+                !writeAll(fd, &ring[start], count * sizeof(TraceRecord))) {
+                failed = true;
+            }
+            done += count;
+            tail.store(done, memory_order_release);
+            return count;
+        },
+        // Letting records pile up between wakeups keeps writes large.
+        [] { this_thread::sleep_for(chrono::microseconds(500)); });
+    return true;
+}
+
+bool Trace::close() {
+    if (fd < 0) {
+        return writer.stop();
+    }
+    published.store(head, memory_order_release);
+    bool ok = writer.stop();
+    ok = ::close(fd) == 0 && ok;
+    fd = -1;
+    return ok;
+}
+
+bool Trace::makeRoom() {
+    // The writer only sees what has been published, so hand everything over
+    // before waiting on it.
+    published.store(head, memory_order_release);
+    for (;;) {
+        tailCache = tail.load(memory_order_acquire);
+        if (head - tailCache < ring.size()) {
+            return true;
+        }
+        if (dropWhenFull) {
+            lost++;
+            return false;
+        }
+        this_thread::yield();
+    }
+}
+
+bool traceToText(const string &in, const string &out) {
+    FILE *src = fopen(in.c_str(), "rb");
+    if (!src) {
+        return false;
+    }
+    Header h;
+    if (fread(&h, sizeof(h), 1, src) != 1 ||
+        memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION ||
+        h.recordSize != sizeof(TraceRecord)) {
+        fclose(src);
+        return false;
+    }
+    FILE *dst = out.empty() ? stdout : fopen(out.c_str(), "w");
+    if (!dst) {
+        fclose(src);
+        return false;
+    }
+
+    vector<TraceRecord> records(64 * 1024);
+    string text;
+    size_t n;
+    while ((n = fread(records.data(), sizeof(TraceRecord), records.size(),
+                      src)) > 0) {
+        text.clear();
+        for (size_t i = 0; i < n; i++) {
+            const TraceRecord &r = records[i];
+            uint8_t length = CPU6502::length(r.opcode);
+            char bytes[9], operand[16], line[128];
+            snprintf(bytes, sizeof(bytes), length == 1   ? "%02X"
+                                           : length == 2 ? "%02X %02X"
+                                                         : "%02X %02X %02X",
+                     r.opcode, r.lo, r.hi);
+            formatOperand(operand, sizeof(operand), r);
+            char inst[40];
+            snprintf(inst, sizeof(inst), "%s %s", CPU6502::mnemonic(r.opcode),
+                     operand);
+            snprintf(line, sizeof(line),
+                     "%04X  %-8s  %-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X "
+                     "CYC:%llu\n",
+                     (unsigned)r.pc, bytes, inst, r.a, r.x, r.y, r.p, r.sp,
+                     (unsigned long long)r.cycle);
+            text += line;
+        }
+        fwrite(text.data(), 1, text.size(), dst);
+    }
+
+    bool ok = !ferror(src) && !ferror(dst);
+    fclose(src);
+    if (dst != stdout) {
+        ok = fclose(dst) == 0 && ok;
+    } else {
+        fflush(dst);
+    }
+    return ok;
+}
+
+int runTraceText(int argc, char **argv) {
+    if (argc < 1) {
+        cerr << "usage: nes --trace-text <trace> [<output>]\n";
+        return 2;
+    }
+    string out = argc > 1 ? argv[1] : "";
+    if (!traceToText(argv[0], out)) {
+        cerr << "trace: cannot convert " << argv[0] << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -1,9 +1,16 @@
-#include <algorithm>
 #include <iostream>
-#include <sstream>
+#include <memory>
 
+#include "Batch.h"
+#include "Bench.h"
 #include "Bus.h"
+#include "Cartridge.h"
+#include "Conformance.h"
 #include "CPU6502.h"
+#include "Disassembly.h"
+#include "Rewind.h"
+#include "SingleStep.h"
+#include "Trace.h"
 
 const string GREEN = "\033[32m";
 const string RED = "\033[31m";
@@ -14,7 +21,8 @@ using namespace std;
 class Emulation {
    public:
     Bus nes;
-    map<uint16_t, string> mapAsm;
+    Disassembly disasm{nes};
+    Rewind rewind{nes};
     Emulation() {
         // Load Program (assembled at
         // https://www.masswerk.at/6502/assembler.html)
@@ -37,24 +45,36 @@ class Emulation {
                 NOP
         */
 
-        // Convert hex string into bytes for RAM
-        stringstream ss;
-        ss << "A2 0A 8E 00 00 A2 03 8E 01 00 AC 00 00 A9 00 18 6D 01 00 88 D0 "
-              "FA 8D 02 00 EA EA EA";
+        const uint8_t program[] = {
+            0xA2, 0x0A, 0x8E, 0x00, 0x00, 0xA2, 0x03, 0x8E, 0x01, 0x00,
+            0xAC, 0x00, 0x00, 0xA9, 0x00, 0x18, 0x6D, 0x01, 0x00, 0x88,
+            0xD0, 0xFA, 0x8D, 0x02, 0x00, 0xEA, 0xEA, 0xEA};
         uint16_t nOffset = 0x8000;
-        while (!ss.eof()) {
-            string b;
-            ss >> b;
-            nes.ram[nOffset++] = (uint8_t)stoul(b, nullptr, 16);
+        for (uint8_t b : program) {
+            nes.ram[nOffset++] = b;
         }
 
         // Set Reset Vector
         nes.ram[0xFFFC] = 0x00;
         nes.ram[0xFFFD] = 0x80;
+        nes.cpu.reset();
+    }
 
-        // Extract dissassembly
-        mapAsm = nes.cpu.disassemble(0x0000, 0xFFFF);
+    // Replaces the demo program with the iNES image at path.
+    bool load(const string &path) {
+        string error;
+        shared_ptr<const Cartridge> cart = Cartridge::load(path, error);
+        if (!cart) {
+            cerr << "nes: " << error << "\n";
+            return false;
+        }
+        if (!nes.insertCartridge(cart)) {
+            cerr << "nes: " << path << ": mapper " << cart->mapper
+                 << " is not supported\n";
+            return false;
+        }
         nes.cpu.reset();
+        return true;
     }
 
     string hex(uint32_t n, uint8_t d) {
@@ -104,32 +124,20 @@ class Emulation {
 
     void printCode(int nLines) {
         cout << endl;
-        auto it_a = mapAsm.find(nes.cpu.pc);
-        int nLineY = nLines >> 1;
-        if (it_a != mapAsm.end()) {
-            vector<string> lines;
-            while (nLineY-- > 0) {
-                if (it_a != mapAsm.begin()) {
-                    lines.push_back((--it_a)->second);
-                } else {
-                    break;
-                }
-            }
-            // Reverse the collected lines to print them in the correct order
-            reverse(lines.begin(), lines.end());
-            for (const auto& line : lines) {
-                cout << line << endl;
-            }
+        uint16_t pc = nes.cpu.pc;
+        for (uint16_t addr = disasm.back(pc, nLines >> 1); addr != pc;
+             addr = disasm.next(addr)) {
+            cout << disasm.line(addr) << endl;
         }
-        it_a = mapAsm.find(nes.cpu.pc);
-        nLineY = nLines >> 1;
-        if (it_a != mapAsm.end()) {
-            cout << CYAN << (*it_a).second << ORIG_COLOR << endl;
-            while (nLineY++ < nLines) {
-                if (++it_a != mapAsm.end()) {
-                    cout << (*it_a).second << endl;
-                }
+        cout << CYAN << disasm.line(pc) << ORIG_COLOR << endl;
+        uint16_t addr = pc;
+        for (int nLineY = nLines >> 1; nLineY < nLines; nLineY++) {
+            uint16_t next = disasm.next(addr);
+            if (next <= addr) {
+                break;
             }
+            addr = next;
+            cout << disasm.line(addr) << endl;
         }
     }
 
@@ -142,15 +150,20 @@ class Emulation {
         char command = 'r';
         do {
             if (command == 's') {
-                do {
-                    nes.cpu.clock();
-                } while (!nes.cpu.complete());
+                // A cartridge brings the PPU, which steps along.
+                nes.step();
             } else if (command == 'r') {
                 nes.cpu.reset();
             } else if (command == 'i') {
                 nes.cpu.irq();
             } else if (command == 'n') {
                 nes.cpu.nmi();
+            } else if (command == 'b') {
+                rewind.stepBack();
+            }
+            if (command == 's' || command == 'r' || command == 'i' ||
+                command == 'n') {
+                rewind.capture();
             }
 
             printRam(0x0000, 16, 16);
@@ -158,7 +171,7 @@ class Emulation {
             printCpu();
             printCode(10);
 
-            cout << "[s]tep [r]eset [i]rq [n]mi [q]uit: ";
+            cout << "[s]tep [b]ack [r]eset [i]rq [n]mi [q]uit: ";
             cout << "Enter Command: ";
             cin >> command;
             ClearScreen();
@@ -166,7 +179,26 @@ class Emulation {
     }
 };
 
-int main() {
+int main(int argc, char **argv) {
+    if (argc > 1 && string(argv[1]) == "--batch") {
+        return runBatch(argc - 2, argv + 2);
+    }
+    if (argc > 1 && string(argv[1]) == "--bench") {
+        return runBench(argc - 2, argv + 2);
+    }
+    if (argc > 1 && string(argv[1]) == "--test") {
+        return runConformance(argc - 2, argv + 2);
+    }
+    if (argc > 1 && string(argv[1]) == "--single-step") {
+        return runSingleStep(argc - 2, argv + 2);
+    }
+    if (argc > 1 && string(argv[1]) == "--trace-text") {
+        return runTraceText(argc - 2, argv + 2);
+    }
+
     Emulation em;
+    if (argc > 1 && !em.load(argv[1])) {
+        return 1;
+    }
     em.runEmulation();
 }